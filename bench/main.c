@@ -0,0 +1,672 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "replay.h"
+#include "workloads.h"
+
+#include <purespice.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <time.h>
+#include <stdatomic.h>
+
+/* every allocation made through these is counted, the target is linked with
+ * --wrap for each so this includes those made by the library. The replay
+ * only allocates before a run starts */
+static atomic_ulong l_allocs;
+
+void * __real_malloc       (size_t size);
+void * __real_calloc       (size_t nmemb, size_t size);
+void * __real_realloc      (void * ptr, size_t size);
+void * __real_aligned_alloc(size_t alignment, size_t size);
+
+void * __wrap_malloc(size_t size)
+{
+  atomic_fetch_add_explicit(&l_allocs, 1, memory_order_relaxed);
+  return __real_malloc(size);
+}
+
+void * __wrap_calloc(size_t nmemb, size_t size)
+{
+  atomic_fetch_add_explicit(&l_allocs, 1, memory_order_relaxed);
+  return __real_calloc(nmemb, size);
+}
+
+void * __wrap_realloc(void * ptr, size_t size)
+{
+  atomic_fetch_add_explicit(&l_allocs, 1, memory_order_relaxed);
+  return __real_realloc(ptr, size);
+}
+
+void * __wrap_aligned_alloc(size_t alignment, size_t size)
+{
+  atomic_fetch_add_explicit(&l_allocs, 1, memory_order_relaxed);
+  return __real_aligned_alloc(alignment, size);
+}
+
+static struct
+{
+  unsigned int runs;
+  bool         threaded;
+  bool         ioUring;
+  bool         realtime;
+  bool         verbose;
+  bool         store;
+  bool         fills;
+  const char * capture;
+}
+l_opts =
+{
+  .runs = 3
+};
+
+typedef struct BenchResult
+{
+  uint64_t elapsedNS;
+  uint64_t allocs;
+  PSStats  stats;
+}
+BenchResult;
+
+static const char * l_channelNames[PS_CHANNEL_MAX] =
+{
+  [PS_CHANNEL_MAIN    ] = "main",
+  [PS_CHANNEL_INPUTS  ] = "inputs",
+  [PS_CHANNEL_PLAYBACK] = "playback",
+  [PS_CHANNEL_RECORD  ] = "record",
+  [PS_CHANNEL_DISPLAY ] = "display",
+  [PS_CHANNEL_CURSOR  ] = "cursor"
+};
+
+static uint64_t nowNS(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void logQuiet(const char * file, unsigned int line,
+    const char * function, const char * format, ...)
+{
+  (void)file;
+  (void)line;
+  (void)function;
+  (void)format;
+}
+
+static void logError(const char * file, unsigned int line,
+    const char * function, const char * format, ...)
+{
+  va_list va;
+  const char * f = strrchr(file, '/');
+  fprintf(stderr, "%s:%u (%s): ", f ? f + 1 : file, line, function);
+
+  va_start(va, format);
+  vfprintf(stderr, format, va);
+  va_end(va);
+  fputc('\n', stderr);
+}
+
+/* the consumers only look at the data so the results are the cost of the
+ * library, the sum keeps the reads from being optimised away */
+static volatile uint32_t l_sink;
+
+/* set for the first run of a workload whose bitmaps are checked, the later
+ * runs are timed without it. l_badImages counts those that failed */
+static bool        l_checkImages;
+static atomic_uint l_badImages;
+
+static void touch(const void * data, size_t size)
+{
+  if (size)
+    l_sink += ((const uint8_t *)data)[0] + ((const uint8_t *)data)[size - 1];
+}
+
+static void clipboardNotice(const PSDataType type)
+{
+  (void)type;
+}
+
+static void clipboardData(const PSDataType type, uint8_t * buffer,
+    uint32_t size)
+{
+  (void)type;
+  touch(buffer, size);
+}
+
+static void clipboardRelease(void)
+{
+}
+
+static void clipboardRequest(const PSDataType type)
+{
+  (void)type;
+}
+
+static void playbackStart(int channels, int sampleRate, PSAudioFormat format,
+    uint32_t time)
+{
+  (void)channels;
+  (void)sampleRate;
+  (void)format;
+  (void)time;
+}
+
+static void playbackStop(void)
+{
+}
+
+static void playbackData(uint8_t * data, size_t size)
+{
+  touch(data, size);
+}
+
+static void recordStart(int channels, int sampleRate, PSAudioFormat format)
+{
+  (void)channels;
+  (void)sampleRate;
+  (void)format;
+}
+
+static void recordStop(void)
+{
+}
+
+static void surfaceCreate(unsigned int surfaceId, PSSurfaceFormat format,
+    unsigned int width, unsigned int height)
+{
+  (void)surfaceId;
+  (void)format;
+  (void)width;
+  (void)height;
+}
+
+static void surfaceDestroy(unsigned int surfaceId)
+{
+  (void)surfaceId;
+}
+
+static void surfaceMapped(unsigned int surfaceId,
+    const PSSurfaceBuffer * buffer)
+{
+  (void)surfaceId;
+  touch(buffer->pixels, buffer->size);
+}
+
+static void surfaceDamage(unsigned int surfaceId, const PSSurfaceDirty * dirty)
+{
+  (void)surfaceId;
+  touch(dirty->bitmap, (dirty->tilesX * dirty->tilesY + 7) / 8);
+}
+
+static void drawBitmap(unsigned int surfaceId, PSBitmapFormat format,
+    bool topDown, int x, int y, int width, int height, int stride,
+    void * data)
+{
+  (void)surfaceId;
+  (void)x;
+  (void)y;
+  touch(data, (size_t)stride * height);
+
+  if (l_checkImages &&
+      !workload_checkImage(format, topDown, width, height, stride, data))
+    atomic_fetch_add(&l_badImages, 1);
+}
+
+static void drawFill(unsigned int surfaceId, int x, int y, int width,
+    int height, uint32_t color)
+{
+  (void)surfaceId;
+  (void)x;
+  (void)y;
+  (void)width;
+  (void)height;
+  l_sink += color;
+}
+
+static void drawFills(const PSFill * fills, unsigned int count)
+{
+  for(unsigned int i = 0; i < count; ++i)
+    l_sink += fills[i].color;
+}
+
+static void streamCreate(unsigned int streamId, unsigned int surfaceId,
+    PSVideoCodec codec, bool topDown, unsigned int width, unsigned int height,
+    int x, int y, int destWidth, int destHeight)
+{
+  (void)streamId;
+  (void)surfaceId;
+  (void)codec;
+  (void)topDown;
+  (void)width;
+  (void)height;
+  (void)x;
+  (void)y;
+  (void)destWidth;
+  (void)destHeight;
+}
+
+static void streamData(unsigned int streamId, uint32_t mmTime,
+    unsigned int width, unsigned int height, int x, int y, int destWidth,
+    int destHeight, const uint8_t * data, size_t size)
+{
+  (void)streamId;
+  (void)mmTime;
+  (void)width;
+  (void)height;
+  (void)x;
+  (void)y;
+  (void)destWidth;
+  (void)destHeight;
+  touch(data, size);
+}
+
+static void streamDestroy(unsigned int streamId)
+{
+  (void)streamId;
+}
+
+static void cursorRGBA(int width, int height, int hx, int hy,
+    const void * data)
+{
+  (void)hx;
+  (void)hy;
+  touch(data, (size_t)width * height * 4);
+}
+
+static void cursorMono(int width, int height, int hx, int hy,
+    const void * xorMask, const void * andMask)
+{
+  (void)width;
+  (void)height;
+  (void)hx;
+  (void)hy;
+  (void)xorMask;
+  (void)andMask;
+}
+
+static void cursorState(bool visible, int x, int y)
+{
+  l_sink += visible + x + y;
+}
+
+static bool runOnce(const uint8_t * capture, size_t size, const char * path,
+    const char * record, BenchResult * result)
+{
+  Replay * replay = replay_new(capture, size);
+  if (!replay)
+    return false;
+
+  bool ok = false;
+  if (!replay_start(replay, path, l_opts.realtime))
+    goto err_replay;
+
+  const PSConfig config =
+  {
+    .host     = path,
+    .port     = 0,
+    .password = "",
+    .threaded = l_opts.threaded,
+    .capture  = record,
+    .stats    =
+    {
+      .timing  = true,
+      .latency = true
+    },
+    .inputs =
+    {
+      .enable      = true,
+      .autoConnect = true
+    },
+    .clipboard =
+    {
+      .enable  = true,
+      .notice  = clipboardNotice,
+      .data    = clipboardData,
+      .release = clipboardRelease,
+      .request = clipboardRequest
+    },
+    .playback =
+    {
+      .enable      = true,
+      .autoConnect = true,
+      .start       = playbackStart,
+      .stop        = playbackStop,
+      .data        = playbackData
+    },
+    .record =
+    {
+      .enable      = true,
+      .autoConnect = true,
+      .start       = recordStart,
+      .stop        = recordStop
+    },
+    .display =
+    {
+      .enable         = true,
+      .autoConnect    = true,
+      .surfaceCreate  = surfaceCreate,
+      .surfaceDestroy = surfaceDestroy,
+      .surfaceMapped  = l_opts.store ? surfaceMapped : NULL,
+      .surfaceDamage  = surfaceDamage,
+      .drawBitmap     = drawBitmap,
+      .drawFill       = drawFill,
+      .drawFills      = l_opts.fills ? drawFills : NULL,
+      .streamCreate   = streamCreate,
+      .streamData     = streamData,
+      .streamDestroy  = streamDestroy
+    },
+    .cursor =
+    {
+      .enable       = true,
+      .autoConnect  = true,
+      .setRGBAImage = cursorRGBA,
+      .setMonoImage = cursorMono,
+      .setState     = cursorState
+    }
+  };
+
+  PSSession * session = purespice_newSession(NULL);
+  if (!session)
+    goto err_replay;
+
+  const unsigned long allocs = atomic_load(&l_allocs);
+  const uint64_t      start  = nowNS();
+
+  if (!purespice_connect(session, &config))
+  {
+    fprintf(stderr, "failed to connect to the replay\n");
+    goto err_session;
+  }
+
+  PSStatus status;
+  while((status = purespice_process(session, 100)) == PS_STATUS_RUN) {}
+
+  result->elapsedNS = nowNS() - start;
+  result->allocs    = atomic_load(&l_allocs) - allocs;
+  if (status != PS_STATUS_SHUTDOWN)
+    fprintf(stderr, "the session failed with status %d\n", status);
+  else
+    ok = purespice_getStats(session, &result->stats);
+
+  purespice_disconnect(session);
+
+err_session:
+  purespice_freeSession(session);
+err_replay:
+  replay_free(replay);
+  return ok;
+}
+
+static uint64_t totalMessages(const PSStats * stats)
+{
+  uint64_t messages = 0;
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    messages += stats->channels[i].messages;
+  return messages;
+}
+
+static void report(const char * name, const BenchResult * r)
+{
+  const PSStats * s       = &r->stats;
+  const double    seconds = r->elapsedNS / 1e9;
+
+  uint64_t bytes    = 0;
+  uint64_t handled  = 0;
+  uint64_t handlers = 0;
+  uint64_t maxNS    = 0;
+  PSStatsHistogram all  = { 0 };
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    const PSChannelStats * c = &s->channels[i];
+    bytes    += c->bytesIn;
+    handled  += c->handlers.count;
+    handlers += c->handlers.totalNS;
+    if (c->handlers.maxNS > maxNS)
+      maxNS = c->handlers.maxNS;
+
+    all.count += c->handlers.count;
+    for(int b = 0; b < PS_STATS_BUCKETS; ++b)
+      all.buckets[b] += c->handlers.buckets[b];
+  }
+
+  all.maxNS = maxNS;
+
+  const uint64_t messages = totalMessages(s);
+  printf("%-12s %9.0f msg/s %9.1f MB/s %8.3f s %8.2f allocs/msg"
+      "  handler avg %6.2f us p50 %llu us p99 %llu us max %.1f us\n",
+      name,
+      messages / seconds,
+      bytes / seconds / 1e6,
+      seconds,
+      messages ? (double)r->allocs / messages : 0.0,
+      handled ? handlers / 1e3 / handled : 0.0,
+      (unsigned long long)purespice_statsPercentile(&all, 50),
+      (unsigned long long)purespice_statsPercentile(&all, 99),
+      maxNS / 1e3);
+
+  if (!l_opts.verbose)
+    return;
+
+  if (s->streamDelay.count || s->streamLate)
+    printf("  stream   %10llu frames ahead p50 %llu us p99 %llu us,"
+        " %llu late\n",
+        (unsigned long long)s->streamDelay.count,
+        (unsigned long long)purespice_statsPercentile(&s->streamDelay, 50),
+        (unsigned long long)purespice_statsPercentile(&s->streamDelay, 99),
+        (unsigned long long)s->streamLate);
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    const PSChannelStats * c = &s->channels[i];
+    if (!c->messages)
+      continue;
+
+    printf("  %-8s %10llu msgs %12llu bytes %8llu acks %8llu writes\n",
+        l_channelNames[i],
+        (unsigned long long)c->messages, (unsigned long long)c->bytesIn,
+        (unsigned long long)c->acks    , (unsigned long long)c->writes);
+
+    for(int t = 0; t < PS_STATS_MESSAGE_TYPES; ++t)
+    {
+      if (!c->messagesByType[t])
+        continue;
+
+      printf("    type %3d %10llu msgs %9.2f us/msg\n", t,
+          (unsigned long long)c->messagesByType[t],
+          c->handlerNSByType[t] / 1e3 / c->messagesByType[t]);
+    }
+  }
+}
+
+// runs the capture the requested number of times and reports the fastest
+static bool bench(const char * name, const uint8_t * capture, size_t size,
+    bool checkImages)
+{
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/purespice-bench-%d.sock", (int)getpid());
+
+  BenchResult * best = calloc(2, sizeof(*best));
+  if (!best)
+    return false;
+
+  BenchResult * run = best + 1;
+  bool ok = true;
+  for(unsigned int i = 0; i < l_opts.runs; ++i)
+  {
+    const char * record = i == 0 ? l_opts.capture : NULL;
+    l_checkImages = checkImages && i == 0;
+    atomic_store(&l_badImages, 0);
+    if (!runOnce(capture, size, path, record, run))
+    {
+      fprintf(stderr, "%s: run %u failed\n", name, i + 1);
+      ok = false;
+      break;
+    }
+
+    const unsigned int bad = atomic_load(&l_badImages);
+    if (bad)
+    {
+      fprintf(stderr, "%s: run %u drew %u images that decoded wrong\n", name,
+          i + 1, bad);
+      ok = false;
+      break;
+    }
+
+    if (i == 0 || run->elapsedNS < best->elapsedNS)
+      memcpy(best, run, sizeof(*best));
+  }
+
+  if (ok)
+    report(name, best);
+
+  free(best);
+  return ok;
+}
+
+static bool benchWorkload(const Workload * workload)
+{
+  BenchBuffer capture = { 0 };
+  if (!workload->build(&capture))
+  {
+    fprintf(stderr, "%s: failed to build the workload\n", workload->name);
+    buffer_free(&capture);
+    return false;
+  }
+
+  const bool ok = bench(workload->name, capture.data, capture.size,
+      workload->checkImages);
+  buffer_free(&capture);
+  return ok;
+}
+
+static bool benchFile(const char * path)
+{
+  FILE * file = fopen(path, "rb");
+  if (!file)
+  {
+    fprintf(stderr, "%s: no such workload or capture file\n", path);
+    return false;
+  }
+
+  bool ok = false;
+  uint8_t * data = NULL;
+  if (fseek(file, 0, SEEK_END) != 0)
+    goto err_file;
+
+  const long size = ftell(file);
+  if (size <= 0 || fseek(file, 0, SEEK_SET) != 0)
+    goto err_file;
+
+  data = malloc(size);
+  if (!data || fread(data, size, 1, file) != 1)
+  {
+    fprintf(stderr, "%s: failed to read the capture\n", path);
+    goto err_file;
+  }
+
+  const char * name = strrchr(path, '/');
+  ok = bench(name ? name + 1 : path, data, size, false);
+
+err_file:
+  free(data);
+  fclose(file);
+  return ok;
+}
+
+static void usage(const char * argv0)
+{
+  fprintf(stderr,
+    "usage: %s [options] [workload | capture file]...\n"
+    "  -n RUNS  runs of each workload, the fastest is reported (default 3)\n"
+    "  -t       run the session in threaded mode\n"
+    "  -u       receive through io_uring\n"
+    "  -s       draw to the surface store instead of the callbacks\n"
+    "  -f       pass consecutive fills together to drawFills\n"
+    "  -r       replay at the recorded pace instead of as fast as possible\n"
+    "  -c FILE  capture the first run to FILE\n"
+    "  -v       report each channel and message type\n"
+    "  -l       list the workloads\n"
+    "with no workload or capture given all the workloads are run\n",
+    argv0);
+}
+
+int main(int argc, char * argv[])
+{
+  int opt;
+  while((opt = getopt(argc, argv, "n:tusfrc:vlh")) != -1)
+    switch(opt)
+    {
+      case 'n':
+        l_opts.runs = atoi(optarg);
+        if (!l_opts.runs)
+        {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+
+      case 't': l_opts.threaded = true  ; break;
+      case 'u': l_opts.ioUring  = true  ; break;
+      case 's': l_opts.store    = true  ; break;
+      case 'f': l_opts.fills    = true  ; break;
+      case 'r': l_opts.realtime = true  ; break;
+      case 'c': l_opts.capture  = optarg; break;
+      case 'v': l_opts.verbose  = true  ; break;
+
+      case 'l':
+        for(unsigned int i = 0; i < workloadCount; ++i)
+          printf("%-12s %s\n", workloads[i].name, workloads[i].description);
+        return 0;
+
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+
+  const PSInit init =
+  {
+    .log =
+    {
+      .info  = logQuiet,
+      .warn  = logError,
+      .error = logError
+    },
+    .ioUring = l_opts.ioUring
+  };
+  purespice_init(&init);
+
+  bool ok = true;
+  if (optind == argc)
+    for(unsigned int i = 0; i < workloadCount; ++i)
+      ok &= benchWorkload(&workloads[i]);
+
+  for(int i = optind; i < argc; ++i)
+  {
+    const Workload * workload = workload_find(argv[i]);
+    ok &= workload ? benchWorkload(workload) : benchFile(argv[i]);
+  }
+
+  return ok ? 0 : 1;
+}
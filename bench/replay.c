@@ -0,0 +1,507 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "replay.h"
+#include "capture.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <spice/protocol.h>
+
+// the most connections served at the same time
+#define REPLAY_CLIENTS 32
+
+// a connection's data are the records of its channel up to the next CONNECT
+typedef struct ReplayConnection
+{
+  uint8_t channel;
+  size_t  first;
+  bool    used;
+}
+ReplayConnection;
+
+typedef struct ReplayClient
+{
+  Replay    * replay;
+  int         socket;
+  atomic_bool busy;
+}
+ReplayClient;
+
+struct Replay
+{
+  const uint8_t    * data;
+  size_t             size;
+  ReplayConnection * conns;
+  unsigned int       numConns;
+  unsigned int       records;
+  uint64_t           bytes;
+
+  bool               realtime;
+  int                listenfd;
+  int                stopPipe[2];
+  char               path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+  bool               started;
+  pthread_t          thread;
+  atomic_bool        stop;
+
+  pthread_mutex_t    lock;
+  pthread_cond_t     idle;
+  unsigned int       active;
+  ReplayClient       clients[REPLAY_CLIENTS];
+};
+
+static uint64_t nowUS(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+Replay * replay_new(const uint8_t * capture, size_t size)
+{
+  PSCaptureHeader header;
+  if (size < sizeof(header))
+  {
+    fprintf(stderr, "replay: the capture is truncated\n");
+    return NULL;
+  }
+
+  memcpy(&header, capture, sizeof(header));
+  if (header.magic != PS_CAPTURE_MAGIC ||
+      header.version != PS_CAPTURE_VERSION)
+  {
+    fprintf(stderr, "replay: not a capture or an unsupported version\n");
+    return NULL;
+  }
+
+  Replay * replay = calloc(1, sizeof(*replay));
+  if (!replay)
+    return NULL;
+
+  replay->data        = capture;
+  replay->size        = size;
+  replay->listenfd    = -1;
+  replay->stopPipe[0] = -1;
+  replay->stopPipe[1] = -1;
+  pthread_mutex_init(&replay->lock, NULL);
+  pthread_cond_init (&replay->idle, NULL);
+
+  unsigned int alloc = 0;
+  bool connected[256] = { 0 };
+  for(size_t offset = sizeof(header); offset < size; )
+  {
+    if (size - offset < sizeof(PSCaptureRecord))
+      goto err_truncated;
+
+    PSCaptureRecord record;
+    memcpy(&record, capture + offset, sizeof(record));
+    if (size - offset - sizeof(record) < record.size)
+      goto err_truncated;
+
+    if (record.type == PS_CAPTURE_CONNECT)
+    {
+      if (replay->numConns == alloc)
+      {
+        alloc = alloc ? alloc * 2 : 16;
+        ReplayConnection * conns = realloc(replay->conns,
+            alloc * sizeof(*conns));
+        if (!conns)
+          goto err;
+        replay->conns = conns;
+      }
+
+      ReplayConnection * conn = &replay->conns[replay->numConns++];
+      conn->channel = record.channel;
+      conn->first   = offset + sizeof(record);
+      conn->used    = false;
+      connected[record.channel] = true;
+    }
+    else if (record.type == PS_CAPTURE_DATA && connected[record.channel])
+    {
+      ++replay->records;
+      replay->bytes += record.size;
+    }
+
+    offset += sizeof(record) + record.size;
+  }
+
+  return replay;
+
+err_truncated:
+  fprintf(stderr, "replay: the capture is truncated\n");
+err:
+  replay_free(replay);
+  return NULL;
+}
+
+unsigned int replay_records(const Replay * replay)
+{
+  return replay->records;
+}
+
+uint64_t replay_bytes(const Replay * replay)
+{
+  return replay->bytes;
+}
+
+static bool recvAll(int socket, void * data, size_t size)
+{
+  uint8_t * p = data;
+  while(size)
+  {
+    const ssize_t len = recv(socket, p, size, 0);
+    if (len <= 0)
+    {
+      if (len < 0 && errno == EINTR)
+        continue;
+      return false;
+    }
+    p    += len;
+    size -= len;
+  }
+  return true;
+}
+
+// reads whatever the client has sent, false once it has closed the socket
+static bool drain(int socket)
+{
+  uint8_t buffer[16384];
+  for(;;)
+  {
+    const ssize_t len = recv(socket, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (len > 0)
+      continue;
+
+    if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+
+    if (len < 0 && errno == EINTR)
+      continue;
+
+    return false;
+  }
+}
+
+/* waits for the socket to take more data, or until the deadline if no data
+ * is to be sent before then, reading from the client in the meantime */
+static bool waitSocket(Replay * replay, int socket, bool send,
+    uint64_t deadline)
+{
+  for(;;)
+  {
+    if (atomic_load(&replay->stop))
+      return false;
+
+    int timeout = 100;
+    if (!send)
+    {
+      const uint64_t now = nowUS();
+      if (now >= deadline)
+        return true;
+
+      if (deadline - now < 100000)
+        timeout = (deadline - now + 999) / 1000;
+    }
+
+    struct pollfd pfd =
+    {
+      .fd     = socket,
+      .events = POLLIN | (send ? POLLOUT : 0)
+    };
+
+    const int ret = poll(&pfd, 1, timeout);
+    if (ret < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+
+    if ((pfd.revents & (POLLIN | POLLHUP | POLLERR)) && !drain(socket))
+      return false;
+
+    if (send && (pfd.revents & POLLOUT))
+      return true;
+  }
+}
+
+static ReplayConnection * takeConnection(Replay * replay, uint8_t channel)
+{
+  ReplayConnection * conn = NULL;
+  pthread_mutex_lock(&replay->lock);
+  for(unsigned int i = 0; i < replay->numConns; ++i)
+    if (replay->conns[i].channel == channel && !replay->conns[i].used)
+    {
+      conn = &replay->conns[i];
+      conn->used = true;
+      break;
+    }
+  pthread_mutex_unlock(&replay->lock);
+  return conn;
+}
+
+static void serve(ReplayClient * client)
+{
+  Replay * replay = client->replay;
+  const int socket = client->socket;
+
+  SpiceLinkHeader header;
+  SpiceLinkMess   mess;
+  if (!recvAll(socket, &header, sizeof(header)) ||
+      header.magic != SPICE_MAGIC || header.size < sizeof(mess) ||
+      !recvAll(socket, &mess, sizeof(mess)))
+  {
+    fprintf(stderr, "replay: invalid link message\n");
+    return;
+  }
+
+  ReplayConnection * conn = takeConnection(replay, mess.channel_type);
+  if (!conn)
+  {
+    fprintf(stderr, "replay: no connection of channel type %u left\n",
+      mess.channel_type);
+    return;
+  }
+
+  const uint64_t start  = nowUS();
+  bool           first  = true;
+  uint64_t       base   = 0;
+  for(size_t offset = conn->first; offset < replay->size; )
+  {
+    PSCaptureRecord record;
+    memcpy(&record, replay->data + offset, sizeof(record));
+    const uint8_t * data = replay->data + offset + sizeof(record);
+    offset += sizeof(record) + record.size;
+
+    if (record.channel != conn->channel)
+      continue;
+
+    if (record.type == PS_CAPTURE_CONNECT)
+      break;
+
+    if (record.type != PS_CAPTURE_DATA)
+      continue;
+
+    if (first)
+    {
+      base  = record.timeUS;
+      first = false;
+    }
+
+    if (replay->realtime &&
+        !waitSocket(replay, socket, false, start + record.timeUS - base))
+      return;
+
+    for(size_t sent = 0; sent < record.size; )
+    {
+      const ssize_t len = send(socket, data + sent, record.size - sent,
+          MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (len > 0)
+      {
+        sent += len;
+        continue;
+      }
+
+      if (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+          errno != EINTR)
+        return;
+
+      if (!waitSocket(replay, socket, true, 0))
+        return;
+    }
+  }
+
+  // the client closes its side once it has read everything
+  shutdown(socket, SHUT_WR);
+  while(waitSocket(replay, socket, false, UINT64_MAX)) {}
+}
+
+static void * clientThread(void * opaque)
+{
+  ReplayClient * client = opaque;
+  Replay       * replay = client->replay;
+
+  serve(client);
+  close(client->socket);
+
+  pthread_mutex_lock(&replay->lock);
+  atomic_store(&client->busy, false);
+  if (--replay->active == 0)
+    pthread_cond_broadcast(&replay->idle);
+  pthread_mutex_unlock(&replay->lock);
+  return NULL;
+}
+
+static void * acceptThread(void * opaque)
+{
+  Replay * replay = opaque;
+  for(;;)
+  {
+    struct pollfd pfd[2] =
+    {
+      { .fd = replay->listenfd   , .events = POLLIN },
+      { .fd = replay->stopPipe[0], .events = POLLIN }
+    };
+
+    if (poll(pfd, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (pfd[1].revents)
+      break;
+
+    const int socket = accept(replay->listenfd, NULL, NULL);
+    if (socket < 0)
+      continue;
+
+    ReplayClient * client = NULL;
+    for(int i = 0; i < REPLAY_CLIENTS; ++i)
+      if (!atomic_load(&replay->clients[i].busy))
+      {
+        client = &replay->clients[i];
+        break;
+      }
+
+    if (!client)
+    {
+      fprintf(stderr, "replay: too many connections\n");
+      close(socket);
+      continue;
+    }
+
+    client->replay = replay;
+    client->socket = socket;
+    atomic_store(&client->busy, true);
+
+    pthread_mutex_lock(&replay->lock);
+    ++replay->active;
+    pthread_mutex_unlock(&replay->lock);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, clientThread, client) != 0)
+    {
+      fprintf(stderr, "replay: failed to create the client thread\n");
+      close(socket);
+      atomic_store(&client->busy, false);
+
+      pthread_mutex_lock(&replay->lock);
+      --replay->active;
+      pthread_mutex_unlock(&replay->lock);
+    }
+    pthread_attr_destroy(&attr);
+  }
+
+  return NULL;
+}
+
+bool replay_start(Replay * replay, const char * path, bool realtime)
+{
+  struct sockaddr_un addr = { .sun_family = AF_UNIX };
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "replay: the socket path is too long\n");
+    return false;
+  }
+
+  strcpy(addr.sun_path, path);
+  strcpy(replay->path , path);
+  replay->realtime = realtime;
+
+  replay->listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (replay->listenfd < 0)
+  {
+    fprintf(stderr, "replay: failed to create the socket\n");
+    return false;
+  }
+
+  unlink(path);
+  if (bind(replay->listenfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(replay->listenfd, REPLAY_CLIENTS) < 0)
+  {
+    fprintf(stderr, "replay: failed to listen on %s: %d\n", path, errno);
+    return false;
+  }
+
+  if (pipe(replay->stopPipe) < 0)
+  {
+    fprintf(stderr, "replay: failed to create the stop pipe\n");
+    return false;
+  }
+
+  if (pthread_create(&replay->thread, NULL, acceptThread, replay) != 0)
+  {
+    fprintf(stderr, "replay: failed to create the accept thread\n");
+    return false;
+  }
+
+  replay->started = true;
+  return true;
+}
+
+void replay_free(Replay * replay)
+{
+  if (!replay)
+    return;
+
+  if (replay->started)
+  {
+    atomic_store(&replay->stop, true);
+    if (write(replay->stopPipe[1], "", 1) < 0)
+      fprintf(stderr, "replay: failed to stop the accept thread\n");
+    pthread_join(replay->thread, NULL);
+
+    pthread_mutex_lock(&replay->lock);
+    while(replay->active)
+      pthread_cond_wait(&replay->idle, &replay->lock);
+    pthread_mutex_unlock(&replay->lock);
+  }
+
+  if (replay->listenfd >= 0)
+  {
+    close(replay->listenfd);
+    unlink(replay->path);
+  }
+
+  for(int i = 0; i < 2; ++i)
+    if (replay->stopPipe[i] >= 0)
+      close(replay->stopPipe[i]);
+
+  pthread_cond_destroy (&replay->idle);
+  pthread_mutex_destroy(&replay->lock);
+  free(replay->conns);
+  free(replay);
+}
@@ -0,0 +1,46 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_BENCH_REPLAY_
+#define _H_SPICE_BENCH_REPLAY_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a fake spice server that feeds a capture back to the client, each channel
+ * connection is answered with the data of the next unused connection of the
+ * same channel type in the capture, the link reply included. Whatever the
+ * client sends is read and dropped */
+typedef struct Replay Replay;
+
+// the capture must stay valid until the replay is freed
+Replay * replay_new(const uint8_t * capture, size_t size);
+void     replay_free(Replay * replay);
+
+/* listens on the unix socket at path, with realtime set each record is sent
+ * when it was received relative to the start of its connection, otherwise as
+ * fast as the client will take it */
+bool replay_start(Replay * replay, const char * path, bool realtime);
+
+// the number and payload of the data records in the capture
+unsigned int replay_records(const Replay * replay);
+uint64_t     replay_bytes  (const Replay * replay);
+
+#endif
@@ -0,0 +1,1155 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "workloads.h"
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <spice/protocol.h>
+#include <spice/enums.h>
+#include <spice/vd_agent.h>
+
+// records are cut at this size, about what a single receive returns
+#define WRITER_RECORD_SIZE (64 * 1024)
+
+// the frame interval of the display workloads in microseconds
+#define FRAME_US        16667
+#define STREAM_DELAY_US 100000
+
+/* compressed images all decode to a pattern that repeats every IMAGE_PERIOD
+ * pixels, so a match may reach back any multiple of it, also into an earlier
+ * image. GLZ images reference up to GLZ_REF_MAX images back and the window
+ * keeps GLZ_WINDOW of them */
+#define IMAGE_PERIOD 61
+#define GLZ_REF_MAX  3
+#define GLZ_WINDOW   4
+
+// the LZ formats, the distance up to which LZ needs no escape
+#define LZ_MAGIC        0x20205a4c
+#define LZ_VERSION      0x00010001
+#define LZ_TYPE_RGB32   8
+#define LZ_MAX_DISTANCE 8191
+
+/* the public key the link replies present, the client only encrypts the
+ * password with it so the private half is not needed. PUBKEY_MODULUS is the
+ * offset of the modulus, which is altered for a new key */
+#define PUBKEY_MODULUS 29
+
+static const uint8_t pubKey[SPICE_TICKET_PUBKEY_BYTES] =
+{
+   0x30, 0x81, 0x9f, 0x30, 0x0d, 0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7,
+   0x0d, 0x01, 0x01, 0x01, 0x05, 0x00, 0x03, 0x81, 0x8d, 0x00, 0x30, 0x81,
+   0x89, 0x02, 0x81, 0x81, 0x00, 0xdc, 0xa9, 0x37, 0x79, 0x53, 0x31, 0x83,
+   0xdd, 0xc5, 0x10, 0x04, 0xa7, 0x45, 0x70, 0xca, 0xfd, 0xed, 0xe6, 0x50,
+   0x31, 0x64, 0xf2, 0x53, 0xb3, 0xcf, 0x80, 0x69, 0x6e, 0xc2, 0x16, 0xaf,
+   0xa0, 0x06, 0x0f, 0x9d, 0x93, 0x94, 0x5c, 0x12, 0xff, 0x2c, 0xca, 0x04,
+   0x71, 0xf6, 0x8e, 0x53, 0xc6, 0xd4, 0xbb, 0xd6, 0xce, 0x97, 0x64, 0xb2,
+   0x17, 0x5b, 0x7f, 0x00, 0xab, 0x05, 0x6b, 0x8d, 0x46, 0x16, 0x94, 0x77,
+   0x9a, 0x51, 0x27, 0xec, 0x7f, 0x30, 0xfa, 0x67, 0xc3, 0x6a, 0x78, 0xad,
+   0x45, 0xf0, 0xcd, 0x45, 0x56, 0x7f, 0xb7, 0x6f, 0x39, 0x66, 0xa6, 0x4a,
+   0x3b, 0x08, 0x20, 0x67, 0xf1, 0x60, 0xd9, 0xbf, 0x16, 0x44, 0x70, 0x42,
+   0x14, 0xfc, 0x47, 0xf7, 0x47, 0x4d, 0x99, 0xa6, 0xd3, 0x3d, 0x7e, 0xdb,
+   0x76, 0x0a, 0x8d, 0xea, 0xd8, 0xba, 0xa9, 0xc5, 0xa1, 0x3d, 0xf8, 0xd1,
+   0x6f, 0x02, 0x03, 0x01, 0x00, 0x01
+};
+
+typedef struct Writer
+{
+  BenchBuffer * out;
+  bool          failed;
+  uint8_t       channel;
+  uint64_t      timeUS;
+
+  // every link presents a new key like spice-server, links counts them
+  bool          freshKeys;
+  unsigned int  links;
+
+  // the id of the next GLZ image and the pixels of those before it
+  uint64_t      glzId;
+  size_t        glzPixels[GLZ_WINDOW];
+
+  // offsets of the open record and message, 0 if there is none
+  size_t        record;
+  size_t        message;
+}
+Writer;
+
+static uint32_t l_seed;
+
+static uint32_t rnd(void)
+{
+  l_seed ^= l_seed << 13;
+  l_seed ^= l_seed >> 17;
+  l_seed ^= l_seed << 5;
+  return l_seed;
+}
+
+void buffer_free(BenchBuffer * buffer)
+{
+  free(buffer->data);
+  buffer->data  = NULL;
+  buffer->size  = 0;
+  buffer->alloc = 0;
+}
+
+static uint8_t * reserve(Writer * w, size_t size)
+{
+  BenchBuffer * b = w->out;
+  if (w->failed)
+    return NULL;
+
+  if (b->size + size > b->alloc)
+  {
+    size_t alloc = b->alloc ? b->alloc : 1024 * 1024;
+    while(alloc < b->size + size)
+      alloc *= 2;
+
+    uint8_t * data = realloc(b->data, alloc);
+    if (!data)
+    {
+      w->failed = true;
+      return NULL;
+    }
+
+    b->data  = data;
+    b->alloc = alloc;
+  }
+
+  uint8_t * p = b->data + b->size;
+  b->size += size;
+  return p;
+}
+
+static void closeRecord(Writer * w)
+{
+  if (!w->record || w->failed)
+    return;
+
+  PSCaptureRecord record;
+  memcpy(&record, w->out->data + w->record, sizeof(record));
+  record.size = w->out->size - w->record - sizeof(record);
+  memcpy(w->out->data + w->record, &record, sizeof(record));
+  w->record = 0;
+}
+
+static void openRecord(Writer * w, PSCaptureType type)
+{
+  const PSCaptureRecord record =
+  {
+    .timeUS  = w->timeUS,
+    .type    = type,
+    .channel = w->channel
+  };
+
+  const size_t offset = w->out->size;
+  uint8_t * p = reserve(w, sizeof(record));
+  if (!p)
+    return;
+
+  memcpy(p, &record, sizeof(record));
+  w->record = type == PS_CAPTURE_DATA ? offset : 0;
+}
+
+static void putRaw(Writer * w, const void * data, size_t size)
+{
+  if (!w->record)
+    openRecord(w, PS_CAPTURE_DATA);
+
+  uint8_t * p = reserve(w, size);
+  if (p)
+    memcpy(p, data, size);
+}
+
+static void put8 (Writer * w, uint8_t  v) { putRaw(w, &v, sizeof(v)); }
+static void put16(Writer * w, uint16_t v) { putRaw(w, &v, sizeof(v)); }
+static void put32(Writer * w, uint32_t v) { putRaw(w, &v, sizeof(v)); }
+static void put64(Writer * w, uint64_t v) { putRaw(w, &v, sizeof(v)); }
+
+// the LZ headers are big endian
+static void putBE32(Writer * w, uint32_t v)
+{
+  const uint8_t b[] = { v >> 24, v >> 16, v >> 8, v };
+  putRaw(w, b, sizeof(b));
+}
+
+// reserves a 32 bit size to be filled in by patch32 once it is known
+static size_t reserve32(Writer * w)
+{
+  put32(w, 0);
+  return w->out->size - sizeof(uint32_t);
+}
+
+static void patch32(Writer * w, size_t offset, uint32_t v, bool bigEndian)
+{
+  if (w->failed)
+    return;
+
+  if (bigEndian)
+    v = __builtin_bswap32(v);
+  memcpy(w->out->data + offset, &v, sizeof(v));
+}
+
+static void putRect(Writer * w, int top, int left, int bottom, int right)
+{
+  put32(w, top);
+  put32(w, left);
+  put32(w, bottom);
+  put32(w, right);
+}
+
+// fills size bytes with a pattern that does not compress to nothing
+static void putPattern(Writer * w, size_t size)
+{
+  if (!w->record)
+    openRecord(w, PS_CAPTURE_DATA);
+
+  uint8_t * p = reserve(w, size);
+  if (!p)
+    return;
+
+  size_t i = 0;
+  for(; i + 4 <= size; i += 4)
+  {
+    const uint32_t v = rnd();
+    memcpy(p + i, &v, 4);
+  }
+  for(; i < size; ++i)
+    p[i] = rnd();
+}
+
+static void beginCapture(Writer * w, BenchBuffer * capture)
+{
+  memset(w, 0, sizeof(*w));
+  w->out = capture;
+  l_seed = 0x2545f491;
+
+  const PSCaptureHeader header =
+  {
+    .magic   = PS_CAPTURE_MAGIC,
+    .version = PS_CAPTURE_VERSION
+  };
+
+  uint8_t * p = reserve(w, sizeof(header));
+  if (p)
+    memcpy(p, &header, sizeof(header));
+}
+
+// moves the clock forward, the data after it is a new record
+static void setTime(Writer * w, uint64_t timeUS)
+{
+  closeRecord(w);
+  w->timeUS = timeUS;
+}
+
+static void beginMessage(Writer * w, uint16_t type)
+{
+  if (!w->record)
+    openRecord(w, PS_CAPTURE_DATA);
+
+  w->message = w->out->size;
+  put16(w, type);
+  put32(w, 0);
+}
+
+static void endMessage(Writer * w)
+{
+  if (w->failed)
+    return;
+
+  const uint32_t size = w->out->size - w->message -
+    sizeof(SpiceMiniDataHeader);
+  memcpy(w->out->data + w->message + sizeof(uint16_t), &size, sizeof(size));
+
+  if (w->out->size - w->record >= WRITER_RECORD_SIZE)
+    closeRecord(w);
+}
+
+// starts a connection of the channel with the reply to its link
+static void beginChannel(Writer * w, uint8_t channel)
+{
+  closeRecord(w);
+  w->channel = channel;
+  w->timeUS  = 0;
+  openRecord(w, PS_CAPTURE_CONNECT);
+
+  const uint32_t commonCaps =
+    (1 << SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION) |
+    (1 << SPICE_COMMON_CAP_AUTH_SPICE             ) |
+    (1 << SPICE_COMMON_CAP_MINI_HEADER            );
+
+  SpiceLinkReply reply =
+  {
+    .error            = SPICE_LINK_ERR_OK,
+    .num_common_caps  = 1,
+    .num_channel_caps = 0,
+    .caps_offset      = sizeof(SpiceLinkReply)
+  };
+  memcpy(reply.pub_key, pubKey, sizeof(pubKey));
+  if (w->freshKeys)
+    reply.pub_key[PUBKEY_MODULUS + 1] ^= ++w->links;
+
+  const SpiceLinkHeader header =
+  {
+    .magic         = SPICE_MAGIC,
+    .major_version = SPICE_VERSION_MAJOR,
+    .minor_version = SPICE_VERSION_MINOR,
+    .size          = sizeof(reply) + sizeof(commonCaps)
+  };
+
+  putRaw(w, &header, sizeof(header));
+  putRaw(w, &reply , sizeof(reply));
+  put32(w, commonCaps);
+  put32(w, SPICE_LINK_ERR_OK);
+  closeRecord(w);
+}
+
+static void mainInit(Writer * w, bool agent, const uint8_t * channels,
+    unsigned int count)
+{
+  beginChannel(w, SPICE_CHANNEL_MAIN);
+
+  beginMessage(w, SPICE_MSG_MAIN_INIT);
+  put32(w, 1);                       // session_id
+  put32(w, 1);                       // display_channels_hint
+  put32(w, SPICE_MOUSE_MODE_SERVER | SPICE_MOUSE_MODE_CLIENT);
+  put32(w, SPICE_MOUSE_MODE_CLIENT);
+  put32(w, agent);                   // agent_connected
+  put32(w, 10);                      // agent_tokens
+  put32(w, 0);                       // multi_media_time
+  put32(w, 0);                       // ram_hint
+  endMessage(w);
+
+  beginMessage(w, SPICE_MSG_MAIN_CHANNELS_LIST);
+  put32(w, count);
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    put8(w, channels[i]);
+    put8(w, 0);
+  }
+  endMessage(w);
+}
+
+static void setAck(Writer * w, uint32_t window)
+{
+  beginMessage(w, SPICE_MSG_SET_ACK);
+  put32(w, 1);
+  put32(w, window);
+  endMessage(w);
+}
+
+static void ping(Writer * w, uint32_t id)
+{
+  beginMessage(w, SPICE_MSG_PING);
+  put32(w, id);
+  put64(w, w->timeUS);
+  endMessage(w);
+}
+
+static void surfaceCreate(Writer * w, unsigned int width, unsigned int height)
+{
+  beginMessage(w, SPICE_MSG_DISPLAY_SURFACE_CREATE);
+  put32(w, 0);
+  put32(w, width);
+  put32(w, height);
+  put32(w, SPICE_SURFACE_FMT_32_xRGB);
+  put32(w, SPICE_SURFACE_FLAGS_PRIMARY);
+  endMessage(w);
+}
+
+// the visible part of a window as top, left, bottom, right rects
+typedef struct Clip
+{
+  unsigned int count;
+  int          rects[4][4];
+}
+Clip;
+
+static void drawBase(Writer * w, int x, int y, int width, int height,
+    const Clip * clip)
+{
+  put32(w, 0);
+  putRect(w, y, x, y + height, x + width);
+  if (!clip)
+  {
+    put8(w, SPICE_CLIP_TYPE_NONE);
+    return;
+  }
+
+  put8 (w, SPICE_CLIP_TYPE_RECTS);
+  put32(w, clip->count);
+  for(unsigned int i = 0; i < clip->count; ++i)
+    putRect(w, clip->rects[i][0], clip->rects[i][1], clip->rects[i][2],
+        clip->rects[i][3]);
+}
+
+static void putNoMask(Writer * w)
+{
+  put8 (w, 0); // flags
+  put32(w, 0); // pos
+  put32(w, 0);
+  put32(w, 0); // bitmap
+}
+
+static void drawFill(Writer * w, int x, int y, int width, int height,
+    const Clip * clip)
+{
+  beginMessage(w, SPICE_MSG_DISPLAY_DRAW_FILL);
+  drawBase(w, x, y, width, height, clip);
+  put32(w, SPICE_BRUSH_TYPE_SOLID);
+  put32(w, rnd() & 0xffffff);
+  put16(w, SPICE_ROPD_OP_PUT);
+  putNoMask(w);
+  endMessage(w);
+}
+
+// a copy of the whole image up to its descriptor, the image data follows
+static void beginCopy(Writer * w, int x, int y, int width, int height,
+    uint64_t id, uint8_t type, const Clip * clip)
+{
+  beginMessage(w, SPICE_MSG_DISPLAY_DRAW_COPY);
+  const size_t start = w->out->size;
+  drawBase(w, x, y, width, height, clip);
+
+  // the image follows the copy, the offset is from the start of the message
+  const size_t copySize = 4 + 16 + 2 + 1 + 13;
+  put32(w, w->out->size - start + copySize);
+  putRect(w, 0, 0, height, width);
+  put16(w, SPICE_ROPD_OP_PUT);
+  put8 (w, SPICE_IMAGE_SCALE_MODE_NEAREST);
+  putNoMask(w);
+
+  put64(w, id);
+  put8 (w, type);
+  put8 (w, 0);
+  put32(w, width);
+  put32(w, height);
+}
+
+// an uncompressed top down 32bpp bitmap, as sent with compression disabled
+static void drawCopy(Writer * w, int x, int y, int width, int height,
+    uint64_t id, const Clip * clip)
+{
+  beginCopy(w, x, y, width, height, id, SPICE_IMAGE_TYPE_BITMAP, clip);
+  put8 (w, SPICE_BITMAP_FMT_32BIT);
+  put8 (w, SPICE_BITMAP_FLAGS_TOP_DOWN);
+  put32(w, width);
+  put32(w, height);
+  put32(w, width * 4);
+  put32(w, 0); // palette
+  putPattern(w, (size_t)width * height * 4);
+  endMessage(w);
+}
+
+static uint32_t imagePixel(size_t i)
+{
+  return ((i % IMAGE_PERIOD) * 0x030507) & 0xffffff;
+}
+
+bool workload_checkImage(PSBitmapFormat format, bool topDown,
+    unsigned int width, unsigned int height, unsigned int stride,
+    const void * data)
+{
+  if (format != PS_BITMAP_FMT_32BIT || !topDown)
+    return false;
+
+  for(unsigned int y = 0; y < height; ++y)
+  {
+    const uint32_t * row = (const uint32_t *)((const uint8_t *)data +
+        (size_t)y * stride);
+    for(unsigned int x = 0; x < width; ++x)
+      if ((row[x] & 0xffffff) != imagePixel((size_t)y * width + x))
+        return false;
+  }
+
+  return true;
+}
+
+// the length continuation the LZ formats share, runs of 255 until the rest
+static void putLength(Writer * w, size_t len)
+{
+  for(; len >= 255; len -= 255)
+    put8(w, 255);
+  put8(w, len);
+}
+
+// the pattern's pixels from i as literal runs of at most 32
+static void putLZLiterals(Writer * w, size_t i, size_t n)
+{
+  while(n)
+  {
+    const size_t run = n < 32 ? n : 32;
+    put8(w, run - 1);
+    for(const size_t end = i + run; i < end; ++i)
+    {
+      const uint32_t p = imagePixel(i);
+      put8(w, p      );
+      put8(w, p >> 8 );
+      put8(w, p >> 16);
+    }
+    n -= run;
+  }
+}
+
+// len pixels copied from dist back, farther than LZ_MAX_DISTANCE is escaped
+static void putLZMatch(Writer * w, size_t len, size_t dist)
+{
+  const size_t field = len < 7 ? len : 7;
+  const size_t ofs   = dist - 1;
+  const bool   far   = ofs >= LZ_MAX_DISTANCE;
+
+  put8(w, field << 5 | (far ? 31 : ofs >> 8));
+  if (field == 7)
+    putLength(w, len - 7);
+
+  if (!far)
+  {
+    put8(w, ofs);
+    return;
+  }
+
+  put8(w, 255);
+  put8(w, (ofs - LZ_MAX_DISTANCE) >> 8);
+  put8(w, (ofs - LZ_MAX_DISTANCE));
+}
+
+/* len pixels copied from pixel ofs of the image imageDist back, or from ofs
+ * pixels back in this one if imageDist is 0 (the caller removes the bias).
+ * The short form takes offsets under 4096 and distances under 64 */
+static void putGLZMatch(Writer * w, size_t len, size_t ofs,
+    unsigned int imageDist)
+{
+  const size_t field = len < 7 ? len : 7;
+  const bool   large = ofs >= 4096 || imageDist >= 64;
+
+  put8(w, field << 5 | large << 4 | (ofs & 0xf));
+  if (field == 7)
+    putLength(w, len - 7);
+
+  put8(w, ofs >> 4);
+  if (!large)
+  {
+    put8(w, imageDist);
+    return;
+  }
+
+  const bool huge = ofs >= (1 << 17);
+  put8(w, (imageDist ? 1 << 6 : 0) | huge << 5 | ((ofs >> 12) & 0x1f));
+  if (imageDist)
+    put8(w, imageDist);
+  if (huge)
+    put8(w, ofs >> 17);
+}
+
+// a length for the next match, mostly short with the odd long run
+static size_t matchLength(size_t left)
+{
+  const size_t len = 1 + (rnd() % 8 ? rnd() % 40 : rnd() % 2000);
+  return len < left ? len : left;
+}
+
+// the distance of a match at i, a multiple of the period that is within i
+static size_t matchDistance(size_t i, size_t max)
+{
+  size_t periods = i / IMAGE_PERIOD;
+  if (periods > max / IMAGE_PERIOD)
+    periods = max / IMAGE_PERIOD;
+  return IMAGE_PERIOD * (1 + rnd() % periods);
+}
+
+static void putLZ(Writer * w, unsigned int width, unsigned int height)
+{
+  const size_t count = (size_t)width * height;
+  putBE32(w, LZ_MAGIC);
+  putBE32(w, LZ_VERSION);
+  putBE32(w, LZ_TYPE_RGB32);
+  putBE32(w, width);
+  putBE32(w, height);
+  putBE32(w, width * 4);
+  putBE32(w, 1);
+
+  size_t i = count < IMAGE_PERIOD ? count : IMAGE_PERIOD;
+  putLZLiterals(w, 0, i);
+  while(i < count)
+  {
+    const size_t len = matchLength(count - i);
+    if (rnd() % 8 == 0)
+      putLZLiterals(w, i, len);
+    else
+      putLZMatch(w, len, matchDistance(i, rnd() % 4 ? 8000 : 65000));
+    i += len;
+  }
+}
+
+static void putGLZ(Writer * w, unsigned int width, unsigned int height)
+{
+  const size_t   count = (size_t)width * height;
+  const uint64_t id    = w->glzId++;
+  putBE32(w, LZ_MAGIC);
+  putBE32(w, LZ_VERSION);
+  put8   (w, LZ_TYPE_RGB32 | 1 << 4);
+  putBE32(w, width);
+  putBE32(w, height);
+  putBE32(w, width * 4);
+  putBE32(w, id >> 32);
+  putBE32(w, id);
+  putBE32(w, GLZ_WINDOW);
+
+  const unsigned int refs = id < GLZ_REF_MAX ? id : GLZ_REF_MAX;
+  size_t i = 0;
+  while(i < count)
+  {
+    size_t len = matchLength(count - i);
+
+    // an earlier image's pixels from the same place in the pattern
+    const unsigned int dist = refs ? 1 + rnd() % refs : 0;
+    const size_t       ref  = dist ? w->glzPixels[(id - dist) % GLZ_WINDOW] : 0;
+    const size_t       base = i % IMAGE_PERIOD;
+    if (dist && rnd() % 2 && ref > base)
+    {
+      if (len > ref - base)
+        len = ref - base;
+
+      const size_t periods = (ref - base - len) / IMAGE_PERIOD;
+      putGLZMatch(w, len, base + IMAGE_PERIOD * (rnd() % (periods + 1)),
+          dist);
+    }
+    else if (i >= IMAGE_PERIOD && rnd() % 8)
+      putGLZMatch(w, len, matchDistance(i, 200000) - 1, 0);
+    else
+    {
+      if (i < IMAGE_PERIOD && len > IMAGE_PERIOD - i)
+        len = IMAGE_PERIOD - i;
+      putLZLiterals(w, i, len);
+    }
+    i += len;
+  }
+
+  w->glzPixels[id % GLZ_WINDOW] = count;
+}
+
+// the pattern's bytes from i as LZ4 literals
+static void putLZ4Literals(Writer * w, size_t i, size_t n)
+{
+  for(const size_t end = i + n; i < end; ++i)
+    put8(w, imagePixel(i / 4) >> (8 * (i % 4)));
+}
+
+static void putLZ4Sequence(Writer * w, size_t i, size_t lit, size_t len,
+    size_t offset)
+{
+  const size_t mlen = len ? len - 4 : 0;
+  put8(w, (lit < 15 ? lit : 15) << 4 | (mlen < 15 ? mlen : 15));
+  if (lit >= 15)
+    putLength(w, lit - 15);
+  putLZ4Literals(w, i, lit);
+
+  if (!len)
+    return;
+
+  put8(w, offset     );
+  put8(w, offset >> 8);
+  if (mlen >= 15)
+    putLength(w, mlen - 15);
+}
+
+/* LZ4 images are split into blocks that each end with literals, matches
+ * reach back into the blocks before them */
+static void putLZ4(Writer * w, unsigned int width, unsigned int height)
+{
+  const size_t size   = (size_t)width * height * 4;
+  const size_t period = IMAGE_PERIOD * 4;
+  put8(w, 1);
+  put8(w, SPICE_BITMAP_FMT_32BIT);
+
+  for(size_t i = 0; i < size; )
+  {
+    const size_t sizeAt = w->out->size;
+    putBE32(w, 0);
+    const size_t start = w->out->size;
+
+    size_t end = i + 4096 + rnd() % 60000;
+    if (end > size)
+      end = size;
+
+    while(i < end)
+    {
+      size_t lit = i < period ? period - i : rnd() % 4 ? 0 : 1 + rnd() % 20;
+      if (lit > end - i)
+        lit = end - i;
+
+      // the last sequence of a block only carries literals
+      if (end - i - lit < 4)
+        lit = end - i;
+
+      if (i + lit == end)
+      {
+        putLZ4Sequence(w, i, lit, 0, 0);
+        i = end;
+        break;
+      }
+
+      size_t len = 4 + matchLength(end - i - lit - 4 + 1) - 1;
+      if (end - i - lit - len < 4 && end - i - lit - len)
+        len = end - i - lit;
+
+      // a distance in pixels that is a whole number of periods within 64KiB
+      putLZ4Sequence(w, i, lit, len, matchDistance((i + lit) / 4, 65535 / 4)
+          * 4);
+      i += lit + len;
+
+      if (i == end)
+        putLZ4Sequence(w, i, 0, 0, 0);
+    }
+
+    patch32(w, sizeAt, w->out->size - start, true);
+  }
+}
+
+/* a copy of a compressed image of the pattern, written by put as the image's
+ * data which is preceded by its size */
+static void drawCompressed(Writer * w, int x, int y, int width, int height,
+    uint64_t id, uint8_t type)
+{
+  beginCopy(w, x, y, width, height, id, type, NULL);
+  const size_t sizeAt = reserve32(w);
+  switch(type)
+  {
+    case SPICE_IMAGE_TYPE_LZ_RGB : putLZ (w, width, height); break;
+    case SPICE_IMAGE_TYPE_GLZ_RGB: putGLZ(w, width, height); break;
+    case SPICE_IMAGE_TYPE_LZ4    : putLZ4(w, width, height); break;
+  }
+  patch32(w, sizeAt, w->out->size - sizeAt - sizeof(uint32_t), false);
+  endMessage(w);
+}
+
+static void putCursor(Writer * w, uint64_t id)
+{
+  put16(w, 0);                       // flags
+  put64(w, id);
+  put8 (w, SPICE_CURSOR_TYPE_ALPHA);
+  put16(w, 32);
+  put16(w, 32);
+  put16(w, 0);
+  put16(w, 0);
+  putPattern(w, 32 * 32 * 4);
+}
+
+/* thirty seconds of desktop use: small fills and text sized bitmaps every frame
+ * with a larger bitmap now and then, and the pointer moving */
+static bool buildDesktop(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const uint8_t channels[] =
+    { SPICE_CHANNEL_DISPLAY, SPICE_CHANNEL_INPUTS, SPICE_CHANNEL_CURSOR };
+
+  const unsigned int frames = 1800;
+
+  mainInit(&w, false, channels, sizeof(channels));
+  for(unsigned int i = 0; i < frames / 60; ++i)
+  {
+    setTime(&w, (uint64_t)i * 60 * FRAME_US);
+    ping(&w, i);
+  }
+
+  beginChannel(&w, SPICE_CHANNEL_INPUTS);
+  beginMessage(&w, SPICE_MSG_INPUTS_INIT);
+  put16(&w, 0);
+  endMessage(&w);
+  for(unsigned int i = 0; i < frames; i += 60)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    beginMessage(&w, SPICE_MSG_INPUTS_KEY_MODIFIERS);
+    put16(&w, i & 1 ? SPICE_KEYBOARD_MODIFIER_FLAGS_NUM_LOCK : 0);
+    endMessage(&w);
+  }
+
+  beginChannel(&w, SPICE_CHANNEL_CURSOR);
+  beginMessage(&w, SPICE_MSG_CURSOR_INIT);
+  put16(&w, 100);
+  put16(&w, 100);
+  put16(&w, 0);
+  put16(&w, 0);
+  put8 (&w, 1);
+  putCursor(&w, 1);
+  endMessage(&w);
+  for(unsigned int i = 0; i < frames; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    if (i % 120 == 119)
+    {
+      beginMessage(&w, SPICE_MSG_CURSOR_SET);
+      put16(&w, i % 1920);
+      put16(&w, i % 1080);
+      put8 (&w, 1);
+      putCursor(&w, 2 + i);
+      endMessage(&w);
+    }
+
+    for(int m = 0; m < 2; ++m)
+    {
+      beginMessage(&w, SPICE_MSG_CURSOR_MOVE);
+      put16(&w, (i * 2 + m) % 1920);
+      put16(&w, i % 1080);
+      endMessage(&w);
+    }
+  }
+
+  uint64_t id = 1;
+  beginChannel(&w, SPICE_CHANNEL_DISPLAY);
+  setAck(&w, 20);
+  surfaceCreate(&w, 1920, 1080);
+  beginMessage(&w, SPICE_MSG_DISPLAY_MARK);
+  endMessage(&w);
+  for(unsigned int i = 0; i < frames; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    for(int n = 0; n < 6; ++n)
+      drawFill(&w, rnd() % 1800, rnd() % 1000, 8 + rnd() % 112,
+          8 + rnd() % 72, NULL);
+
+    for(int n = 0; n < 8; ++n)
+      drawCopy(&w, rnd() % 1856, rnd() % 1064, 64, 16, id++, NULL);
+
+    if (i % 10 == 0)
+      drawCopy(&w, rnd() % 1664, rnd() % 824, 256, 256, id++, NULL);
+  }
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+/* thirty seconds of a terminal partly covered by another window, every frame
+ * redraws a few lines cell by cell with a fill for the background of each and
+ * a bitmap for each glyph, all clipped to the terminal's visible part */
+static bool buildTerminal(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const uint8_t channels[] = { SPICE_CHANNEL_DISPLAY };
+  const unsigned int frames = 1800;
+
+  mainInit(&w, false, channels, sizeof(channels));
+
+  // the terminal is at (100, 100) to (1380, 868), covered from (1000, 0) to
+  // (1920, 500)
+  const Clip clip =
+  {
+    .count = 2,
+    .rects =
+    {
+      { 100, 100 , 500, 1000 },
+      { 500, 100 , 868, 1380 }
+    }
+  };
+
+  uint64_t id = 1;
+  beginChannel(&w, SPICE_CHANNEL_DISPLAY);
+  setAck(&w, 20);
+  surfaceCreate(&w, 1920, 1080);
+  beginMessage(&w, SPICE_MSG_DISPLAY_MARK);
+  endMessage(&w);
+  for(unsigned int i = 0; i < frames; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    for(int line = 0; line < 4; ++line)
+    {
+      const int y = 100 + (rnd() % 48) * 16;
+      for(int x = 100; x < 1380; x += 8)
+        drawFill(&w, x, y, 8, 16, &clip);
+
+      for(int n = 0; n < 20; ++n)
+        drawCopy(&w, 100 + (rnd() % 160) * 8, y, 8, 16, id++, &clip);
+    }
+  }
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+// a minute of 720p video playing as an MJPEG stream at 30 frames per second
+static bool buildVideo(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const uint8_t channels[] = { SPICE_CHANNEL_DISPLAY };
+  const unsigned int frames = 1800;
+
+  mainInit(&w, false, channels, sizeof(channels));
+
+  beginChannel(&w, SPICE_CHANNEL_DISPLAY);
+  setAck(&w, 20);
+  surfaceCreate(&w, 1920, 1080);
+
+  beginMessage(&w, SPICE_MSG_DISPLAY_STREAM_CREATE);
+  put32(&w, 0);                      // surface_id
+  put32(&w, 1);                      // id
+  put8 (&w, SPICE_STREAM_FLAGS_TOP_DOWN);
+  put8 (&w, SPICE_VIDEO_CODEC_TYPE_MJPEG);
+  put64(&w, 0);                      // stamp
+  put32(&w, 1280);
+  put32(&w, 720);
+  put32(&w, 1280);
+  put32(&w, 720);
+  putRect(&w, 180, 320, 900, 1600);
+  put8 (&w, SPICE_CLIP_TYPE_NONE);
+  endMessage(&w);
+
+  for(unsigned int i = 0; i < frames; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US * 2);
+
+    // key frames are larger
+    const uint32_t size = i % 30 == 0 ? 96 * 1024 : 16 * 1024 + rnd() % 16384;
+    beginMessage(&w, SPICE_MSG_DISPLAY_STREAM_DATA);
+    put32(&w, 1);
+    // stamped ahead of the send by the server's playback delay
+    put32(&w, (i * FRAME_US * 2 + STREAM_DELAY_US) / 1000);
+    put32(&w, size);
+    putPattern(&w, size);
+    endMessage(&w);
+  }
+
+  beginMessage(&w, SPICE_MSG_DISPLAY_STREAM_DESTROY);
+  put32(&w, 1);
+  endMessage(&w);
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+// five minutes of uncompressed 48kHz stereo playback in 10ms packets
+static bool buildAudio(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const uint8_t channels[] = { SPICE_CHANNEL_PLAYBACK };
+  const unsigned int packets = 30000;
+  const uint32_t     size    = 480 * 2 * sizeof(int16_t);
+
+  mainInit(&w, false, channels, sizeof(channels));
+
+  beginChannel(&w, SPICE_CHANNEL_PLAYBACK);
+  beginMessage(&w, SPICE_MSG_PLAYBACK_MODE);
+  put32(&w, 0);
+  put16(&w, SPICE_AUDIO_DATA_MODE_RAW);
+  endMessage(&w);
+
+  beginMessage(&w, SPICE_MSG_PLAYBACK_START);
+  put32(&w, 2);
+  put16(&w, SPICE_AUDIO_FMT_S16);
+  put32(&w, 48000);
+  put32(&w, 0);
+  endMessage(&w);
+
+  beginMessage(&w, SPICE_MSG_PLAYBACK_VOLUME);
+  put8 (&w, 2);
+  put16(&w, 0xffff);
+  put16(&w, 0xffff);
+  endMessage(&w);
+
+  for(unsigned int i = 0; i < packets; ++i)
+  {
+    setTime(&w, (uint64_t)i * 10000);
+    beginMessage(&w, SPICE_MSG_PLAYBACK_DATA);
+    put32(&w, i * 10);
+    putPattern(&w, size);
+    endMessage(&w);
+  }
+
+  beginMessage(&w, SPICE_MSG_PLAYBACK_STOP);
+  endMessage(&w);
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+static void agentMessage(Writer * w, uint32_t type, uint32_t size)
+{
+  beginMessage(w, SPICE_MSG_MAIN_AGENT_DATA);
+  put32(w, VD_AGENT_PROTOCOL);
+  put32(w, type);
+  put64(w, 0);
+  put32(w, size);
+}
+
+/* text copied in the guest, each grab followed by the data split over agent
+ * messages of VD_AGENT_MAX_DATA_SIZE as the server forwards them */
+static bool buildClipboard(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const unsigned int transfers = 200;
+  const uint32_t     size      = 256 * 1024;
+
+  mainInit(&w, true, NULL, 0);
+
+  agentMessage(&w, VD_AGENT_ANNOUNCE_CAPABILITIES, 8);
+  put32(&w, 0);
+  put32(&w, 1 << VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
+  endMessage(&w);
+
+  for(unsigned int i = 0; i < transfers; ++i)
+  {
+    setTime(&w, (uint64_t)i * 100000);
+    agentMessage(&w, VD_AGENT_CLIPBOARD_GRAB, 4);
+    put32(&w, VD_AGENT_CLIPBOARD_UTF8_TEXT);
+    endMessage(&w);
+
+    // the client requests the data on the grab, it arrives a little later
+    setTime(&w, (uint64_t)i * 100000 + 1000);
+    const uint32_t total = sizeof(uint32_t) + size;
+    agentMessage(&w, VD_AGENT_CLIPBOARD, total);
+    put32(&w, VD_AGENT_CLIPBOARD_UTF8_TEXT);
+
+    uint32_t chunk = VD_AGENT_MAX_DATA_SIZE - sizeof(VDAgentMessage) -
+      sizeof(uint32_t);
+    for(uint32_t sent = 0; sent < size; )
+    {
+      if (chunk > size - sent)
+        chunk = size - sent;
+
+      putPattern(&w, chunk);
+      endMessage(&w);
+      sent += chunk;
+
+      if (sent < size)
+      {
+        beginMessage(&w, SPICE_MSG_MAIN_AGENT_DATA);
+        chunk = VD_AGENT_MAX_DATA_SIZE;
+      }
+    }
+  }
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+/* the channels a session starts with linking to a server that makes a new
+ * key pair for every link, as spice-server does, with the default config */
+static bool buildRekey(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  w.freshKeys = true;
+
+  const uint8_t channels[] =
+    { SPICE_CHANNEL_DISPLAY, SPICE_CHANNEL_INPUTS, SPICE_CHANNEL_CURSOR };
+  mainInit(&w, false, channels, sizeof(channels));
+
+  beginChannel(&w, SPICE_CHANNEL_INPUTS);
+  beginMessage(&w, SPICE_MSG_INPUTS_INIT);
+  put16(&w, 0);
+  endMessage(&w);
+
+  beginChannel(&w, SPICE_CHANNEL_CURSOR);
+  beginMessage(&w, SPICE_MSG_CURSOR_INIT);
+  put16(&w, 100);
+  put16(&w, 100);
+  put16(&w, 0);
+  put16(&w, 0);
+  put8 (&w, 1);
+  putCursor(&w, 1);
+  endMessage(&w);
+
+  uint64_t id = 1;
+  beginChannel(&w, SPICE_CHANNEL_DISPLAY);
+  setAck(&w, 20);
+  surfaceCreate(&w, 1920, 1080);
+  beginMessage(&w, SPICE_MSG_DISPLAY_MARK);
+  endMessage(&w);
+  for(unsigned int i = 0; i < 60; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    drawCopy(&w, rnd() % 1856, rnd() % 1064, 64, 16, id++, NULL);
+  }
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+/* ten seconds of images in each of the compressed formats the client can
+ * decode at 60fps, with a larger GLZ image every second. Each is checked
+ * against the pattern it was made from */
+static bool buildCompressed(BenchBuffer * capture)
+{
+  Writer w;
+  beginCapture(&w, capture);
+  const uint8_t channels[] = { SPICE_CHANNEL_DISPLAY };
+  const unsigned int frames = 600;
+
+  mainInit(&w, false, channels, sizeof(channels));
+
+  uint64_t id = 1;
+  beginChannel(&w, SPICE_CHANNEL_DISPLAY);
+  setAck(&w, 20);
+  surfaceCreate(&w, 1920, 1080);
+  beginMessage(&w, SPICE_MSG_DISPLAY_MARK);
+  endMessage(&w);
+
+  static const uint8_t types[] =
+  {
+    SPICE_IMAGE_TYPE_LZ_RGB,
+    SPICE_IMAGE_TYPE_GLZ_RGB,
+    SPICE_IMAGE_TYPE_GLZ_RGB,
+    SPICE_IMAGE_TYPE_LZ4
+  };
+
+  for(unsigned int i = 0; i < frames; ++i)
+  {
+    setTime(&w, (uint64_t)i * FRAME_US);
+    for(unsigned int n = 0; n < sizeof(types); ++n)
+    {
+      const int width  = 1 + rnd() % 256;
+      const int height = 1 + rnd() % 128;
+      drawCompressed(&w, rnd() % (1920 - width), rnd() % (1080 - height),
+          width, height, id++, types[n]);
+    }
+
+    // offsets past 2^17 need the longest GLZ match form
+    if (i % 60 == 0)
+      drawCompressed(&w, 0, 0, 512, 300, id++, SPICE_IMAGE_TYPE_GLZ_RGB);
+  }
+
+  closeRecord(&w);
+  return !w.failed;
+}
+
+const Workload workloads[] =
+{
+  { "desktop"   , "fills, text and bitmaps at 60fps", buildDesktop   , false },
+  { "terminal"  , "clipped cell fills and glyphs"   , buildTerminal  , false },
+  { "video"     , "a 720p MJPEG stream at 30fps"    , buildVideo     , false },
+  { "audio"     , "48kHz stereo S16 playback"       , buildAudio     , false },
+  { "clipboard" , "256KiB text transfers"           , buildClipboard , false },
+  { "rekey"     , "linking with a new key per link" , buildRekey     , false },
+  { "compressed", "LZ, GLZ and LZ4 images at 60fps" , buildCompressed, true  }
+};
+
+const unsigned int workloadCount = sizeof(workloads) / sizeof(*workloads);
+
+const Workload * workload_find(const char * name)
+{
+  for(unsigned int i = 0; i < workloadCount; ++i)
+    if (strcmp(workloads[i].name, name) == 0)
+      return &workloads[i];
+  return NULL;
+}
@@ -0,0 +1,63 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_BENCH_WORKLOADS_
+#define _H_SPICE_BENCH_WORKLOADS_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <purespice.h>
+
+typedef struct BenchBuffer
+{
+  uint8_t * data;
+  size_t    size;
+  size_t    alloc;
+}
+BenchBuffer;
+
+/* a canned session, generated as a capture of what a server would send so it
+ * goes through the same replay as a recorded one */
+typedef struct Workload
+{
+  const char * name;
+  const char * description;
+  bool (*build)(BenchBuffer * capture);
+
+  // the bitmaps drawn are all checked with workload_checkImage
+  bool checkImages;
+}
+Workload;
+
+extern const Workload     workloads[];
+extern const unsigned int workloadCount;
+
+const Workload * workload_find(const char * name);
+
+void buffer_free(BenchBuffer * buffer);
+
+/* true if a bitmap drawn by a workload with checkImages set decoded to the
+ * pattern its compressed image was made from */
+bool workload_checkImage(PSBitmapFormat format, bool topDown,
+    unsigned int width, unsigned int height, unsigned int stride,
+    const void * data);
+
+#endif
@@ -29,7 +29,9 @@ typedef enum PSStatus
   PS_STATUS_SHUTDOWN,
   PS_STATUS_ERR_POLL,
   PS_STATUS_ERR_READ,
-  PS_STATUS_ERR_ACK
+  PS_STATUS_ERR_ACK,
+  PS_STATUS_ERR_WRITE,
+  PS_STATUS_ERR_CONNECT
 }
 PSStatus;
 
@@ -48,10 +50,21 @@ PSDataType;
 typedef enum PSAudioFormat
 {
   PS_AUDIO_FMT_INVALID,
-  PS_AUDIO_FMT_S16
+  PS_AUDIO_FMT_S16,
+
+  /* opus packets, only used when passthrough has been requested */
+  PS_AUDIO_FMT_OPUS
 }
 PSAudioFormat;
 
+/* a connection to a single SPICE server, every call that acts on a
+ * connection takes the session it is for */
+typedef struct PSSession PSSession;
+
+/* an epoll set that the sessions added to it share, a process can drive any
+ * number of sessions from one thread per loop */
+typedef struct PSLoop PSLoop;
+
 typedef struct PSServerInfo
 {
   char  * name;
@@ -72,6 +85,82 @@ typedef enum PSChannelType
 }
 PSChannelType;
 
+// bucket n of a PSStatsHistogram counts the durations under 2^n microseconds
+// that are not counted in a lower one, the last bucket takes the rest (8s+)
+#define PS_STATS_BUCKETS 24
+
+// message types at or above this are counted as type 0, which is unused
+#define PS_STATS_MESSAGE_TYPES 512
+
+typedef struct PSStatsHistogram
+{
+  uint64_t count;
+  uint64_t totalNS;
+  uint64_t maxNS;
+  uint64_t buckets[PS_STATS_BUCKETS];
+}
+PSStatsHistogram;
+
+typedef struct PSChannelStats
+{
+  bool     connected;
+
+  // socket traffic, including the mini headers, and the writes it took
+  uint64_t bytesIn;
+  uint64_t bytesOut;
+  uint64_t writes;
+
+  // received messages and the payload bytes of those that had no handler
+  uint64_t messages;
+  uint64_t messagesByType[PS_STATS_MESSAGE_TYPES];
+  uint64_t bytesDiscarded;
+
+  // the largest message received and the most data that waited to be sent
+  uint32_t messageMax;
+  uint64_t txQueueMax;
+
+  // acks and pongs sent to the server
+  uint64_t acks;
+  uint64_t pings;
+
+  /* the kernel's estimate of the TCP round trip time and its variation in
+   * microseconds, sampled when the statistics are read. Always 0 over a unix
+   * socket */
+  uint32_t rttUS;
+  uint32_t rttVarUS;
+
+  /* only with PSConfig.stats.timing set. The time spent handling each message,
+   * which includes the callbacks it made, and in the callbacks themselves */
+  uint64_t         handlerNSByType[PS_STATS_MESSAGE_TYPES];
+  PSStatsHistogram handlers;
+  PSStatsHistogram callbacks;
+}
+PSChannelStats;
+
+typedef struct PSStats
+{
+  // indexed by PSChannelType, counted since the session was connected
+  PSChannelStats channels[PS_CHANNEL_MAX];
+
+  // agent data waiting to be sent and the tokens the server has given us
+  size_t         agentQueued;
+  unsigned int   agentTokens;
+
+  /* only with PSConfig.stats.latency set. The time from an input event being
+   * queued until the first cursor update, and the first draw, frame or video
+   * frame passed to the callbacks after it. An update is matched to the
+   * oldest input still unmatched, so these are only meaningful while the
+   * guest is not also updating by itself */
+  PSStatsHistogram inputToCursor;
+  PSStatsHistogram inputToDisplay;
+
+  /* also only with PSConfig.stats.latency. How long before its mmTime each
+   * video frame arrived, and the frames that arrived after it */
+  PSStatsHistogram streamDelay;
+  uint64_t         streamLate;
+}
+PSStats;
+
 typedef enum PSSurfaceFormat
 {
   PS_SURFACE_FMT_1_A,
@@ -83,6 +172,33 @@ typedef enum PSSurfaceFormat
 }
 PSSurfaceFormat;
 
+typedef enum PSVideoCodec
+{
+  PS_VIDEO_CODEC_MJPEG,
+  PS_VIDEO_CODEC_VP8,
+  PS_VIDEO_CODEC_H264,
+  PS_VIDEO_CODEC_VP9,
+  PS_VIDEO_CODEC_H265
+}
+PSVideoCodec;
+
+typedef struct PSRect
+{
+  int x, y;
+  int width, height;
+}
+PSRect;
+
+typedef enum PSImageCompression
+{
+  PS_IMAGE_COMPRESSION_DEFAULT,
+  PS_IMAGE_COMPRESSION_OFF,
+  PS_IMAGE_COMPRESSION_LZ,
+  PS_IMAGE_COMPRESSION_GLZ,
+  PS_IMAGE_COMPRESSION_LZ4
+}
+PSImageCompression;
+
 typedef enum PSBitmapFormat
 {
   PS_BITMAP_FMT_1BIT_LE,
@@ -94,10 +210,126 @@ typedef enum PSBitmapFormat
   PS_BITMAP_FMT_24BIT,
   PS_BITMAP_FMT_32BIT,
   PS_BITMAP_FMT_RGBA,
-  PS_BITMAP_FMT_8BIT_A
+  PS_BITMAP_FMT_8BIT_A,
+
+  /* 32-bit R, G, B, A byte order, only produced by PS_OUTPUT_FMT_RGBA */
+  PS_BITMAP_FMT_ABGR
 }
 PSBitmapFormat;
 
+typedef enum PSDrawOpType
+{
+  PS_DRAW_OP_FILL,
+  PS_DRAW_OP_BITMAP
+}
+PSDrawOpType;
+
+typedef struct PSDrawOp
+{
+  PSDrawOpType type;
+  unsigned int surfaceId;
+  PSRect       rect;
+
+  union
+  {
+    /* PS_DRAW_OP_FILL */
+    uint32_t color;
+
+    /* PS_DRAW_OP_BITMAP, rect.width and rect.height are the size of the part
+     * of the image data points at, see drawBitmap for clipped draws */
+    struct
+    {
+      PSBitmapFormat format;
+      bool           topDown;
+      int            stride;
+      const void   * data;
+    }
+    bitmap;
+  }
+  u;
+}
+PSDrawOp;
+
+typedef struct PSFill
+{
+  unsigned int surfaceId;
+  PSRect       rect;
+  uint32_t     color;
+}
+PSFill;
+
+typedef struct PSSurfaceDamage
+{
+  unsigned int   surfaceId;
+  unsigned int   count;
+  const PSRect * rects;
+}
+PSSurfaceDamage;
+
+// the size in pixels of the square tiles PSSurfaceDirty tracks damage in
+#define PS_SURFACE_TILE_SIZE 64
+
+typedef struct PSSurfaceBuffer
+{
+  PSSurfaceFormat format;
+  unsigned int    width;
+  unsigned int    height;
+
+  // bytes per row, a multiple of 256 so the rows can be imported as they are
+  unsigned int    stride;
+
+  /* the memfd holding the pixels from offset 0, sealed against shrinking. It
+   * belongs to the library and is closed after surfaceDestroy, dup it to keep
+   * the memory any longer */
+  int             fd;
+  size_t          size;
+
+  // the library's own mapping of the fd
+  const void    * pixels;
+}
+PSSurfaceBuffer;
+
+typedef struct PSSurfaceDirty
+{
+  // the surface in tiles, those of the last row and column may be partial
+  unsigned int     tilesX;
+  unsigned int     tilesY;
+
+  // one bit per tile, tile (x, y) is bit (y * tilesX + x), and the bits set
+  const uint64_t * bitmap;
+  unsigned int     count;
+}
+PSSurfaceDirty;
+
+typedef struct PSGLScanout
+{
+  /* the dmabuf holding the guest's scanout, or -1 if the scanout has been
+   * disabled. It belongs to the library and is closed when the next scanout
+   * arrives or the session disconnects, dup it to keep it any longer */
+  int          fd;
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+
+  // the DRM fourcc of the buffer's format
+  uint32_t     fourcc;
+  bool         topDown;
+}
+PSGLScanout;
+
+typedef enum PSOutputFormat
+{
+  /* pass bitmaps through in the format the server sent them in */
+  PS_OUTPUT_FMT_NATIVE,
+
+  /* convert to 32-bit B, G, R, A byte order, reported as PS_BITMAP_FMT_RGBA */
+  PS_OUTPUT_FMT_BGRA,
+
+  /* convert to 32-bit R, G, B, A byte order, reported as PS_BITMAP_FMT_ABGR */
+  PS_OUTPUT_FMT_RGBA
+}
+PSOutputFormat;
+
 typedef enum PSRopd
 {
   PS_ROPD_INVERS_SRC,
@@ -126,8 +358,19 @@ typedef struct PSInit
 
     void (*error)(const char * file, unsigned int line, const char * function,
         const char * format, ...) __attribute__((format (printf, 4, 5)));
+
+    /* [optional] messages are queued and formatted on a logging thread, which
+     * calls the loggers above with the finished message as a "%s" argument.
+     * Set this to format and log them on the thread that raised them */
+    bool synchronous;
   }
   log;
+
+  /* [optional] receive on the channel sockets through io_uring rather than
+   * epoll. Only takes effect if the library was built with it and the kernel
+   * supports multishot receives, and only for loops created after this call.
+   * The channels run on an IO thread in threaded mode still use epoll */
+  bool ioUring;
 }
 PSInit;
 
@@ -137,9 +380,63 @@ typedef struct PSConfig
   unsigned     port;
   const char * password;
 
+  /* [optional] passed back by purespice_getOpaque, callbacks do not take the
+   * session so use purespice_currentSession to find out which one is
+   * calling */
+  void * opaque;
+
   /* [optional] called once the connection is ready (all channels connected) */
   void (*ready)(void);
 
+  /* [optional] run the cursor, inputs and playback channels on an IO thread
+   * of the session's own so large display messages don't delay them. The
+   * cursor and playback callbacks are then called from that thread, all the
+   * others are still called from the thread running purespice_process */
+  bool threaded;
+
+  struct
+  {
+    /* [optional] reconnect a channel other than main by itself if its
+     * connection is lost or its link fails on a network error, retrying with
+     * an increasing delay for as long as the main channel is up. The channels
+     * already reuse the session and the encrypted password of the main
+     * channel, the main channel itself can't be reconnected as the server
+     * ends the session with it */
+    bool automatic;
+
+    /* [optional] keep the surfaces over a reconnect of the display channel.
+     * Those the server creates again with the same format and size are not
+     * passed to surfaceCreate a second time, any it does not are destroyed
+     * once it has sent its first frame */
+    bool keepSurfaces;
+  }
+  reconnect;
+
+  struct
+  {
+    /* [optional] time the message handlers and the callbacks for the
+     * statistics, this costs two clock reads for each. The counters are
+     * always kept */
+    bool timing;
+
+    /* [optional] called with the session's statistics every intervalMS from
+     * the thread running purespice_process, the stats are only valid for
+     * the duration of the call */
+    void (*report)(const PSStats * stats);
+    unsigned int intervalMS;
+
+    /* [optional] measure the input to display latency, see PSStats, this
+     * costs a clock read for each input event and update */
+    bool latency;
+  }
+  stats;
+
+  /* [optional] record everything the server sends on each channel, and when
+   * it arrived, to this file so it can be fed back by purespice-bench. The
+   * file is truncated when the session connects, a write failure only stops
+   * the capture */
+  const char * capture;
+
   struct
   {
     /* enable input support if available */
@@ -147,6 +444,10 @@ typedef struct PSConfig
 
     /* automatically connect to the channel as soon as it's available */
     bool autoConnect;
+
+    /* coalesce mouse motion while the server is behind on acknowledging it,
+     * the accumulated motion is sent as soon as the server catches up */
+    bool coalesceMotion;
   }
   inputs;
 
@@ -161,6 +462,22 @@ typedef struct PSConfig
     /* called with the clipboard data */
     void (*data)(const PSDataType type, uint8_t * buffer, uint32_t size);
 
+    /* [optional] setting dataStart streams the clipboard data instead of
+     * collecting it for data. dataChunk is called with each part as it
+     * arrives, the buffer is only valid for the duration of the call, and
+     * dataEnd when the transfer is over or was cut short. dataChunk and
+     * dataEnd are then mandatory and data is not used */
+    void (*dataStart)(const PSDataType type, uint32_t size);
+    void (*dataChunk)(const PSDataType type, const uint8_t * buffer,
+        uint32_t size);
+    void (*dataEnd)(const PSDataType type, bool complete);
+
+    /* [optional] setting dataFd collects the clipboard data in a sealed
+     * memfd instead of on the heap, the callback takes ownership of the fd
+     * which is positioned at the start of the data. Takes precedence over
+     * dataStart and data */
+    void (*dataFd)(const PSDataType type, int fd, uint32_t size);
+
     /* called to notify that there is no longer any clipboard data available */
     void (*release)(void);
 
@@ -177,6 +494,21 @@ typedef struct PSConfig
     /* automatically connect to the channel as soon as it's available */
     bool autoConnect;
 
+    /* request opus compressed audio if the server supports it. Packets are
+     * decoded to S16 unless opusPassthrough is set, in which case start
+     * reports PS_AUDIO_FMT_OPUS and data is called with each packet as is.
+     * Decoding needs opus support to be built in, see purespice_hasOpus */
+    bool opus;
+    bool opusPassthrough;
+
+    /* [optional] keep S16 samples in a built in ring buffer that the audio
+     * device pulls from with purespice_readAudio instead of passing them to
+     * data. targetLatency is how much audio in milliseconds the ring keeps
+     * buffered, or zero for the default, the read rate is adjusted slightly
+     * to hold it there. Opus passthrough packets still go to data */
+    bool         pull;
+    unsigned int targetLatency;
+
     /* called with the details of the stream to open */
     void (*start)(int channels, int sampleRate, PSAudioFormat format,
         uint32_t time);
@@ -203,6 +535,21 @@ typedef struct PSConfig
     /* automatically connect to the channel as soon as it's available */
     bool autoConnect;
 
+    /* send opus compressed audio if the server supports it. The samples
+     * given to purespice_writeAudio are encoded unless opusPassthrough is
+     * set, in which case start reports PS_AUDIO_FMT_OPUS and each call to
+     * purespice_writeAudio must contain a single packet. Encoding needs
+     * opus support to be built in, see purespice_hasOpus */
+    bool opus;
+    bool opusPassthrough;
+
+    /* [optional] the record latency in milliseconds the application can
+     * accept, audio is collected and sent in a single write once this much
+     * is pending rather than one write per frame, anything left over is
+     * sent when the server stops recording. Zero sends every frame as soon
+     * as it is written */
+    unsigned int batchLatency;
+
     /* called with the details of the stream to open */
     void (*start)(int channels, int sampleRate, PSAudioFormat format);
 
@@ -225,6 +572,19 @@ typedef struct PSConfig
     /* automatically connect to the channel as soon as it's available */
     bool autoConnect;
 
+    /* the image compression to request from the server, images are decoded
+     * before they are passed to drawBitmap. The default is GLZ over TCP and
+     * off over a unix socket where it would only cost CPU time. QUIC is not
+     * supported and is never requested */
+    PSImageCompression compression;
+
+    /* the size of the image cache in bytes, or zero for the default */
+    size_t pixmapCacheSize;
+
+    /* the format bitmaps are converted to before they are passed to
+     * drawBitmap, converted bitmaps are always top down */
+    PSOutputFormat outputFormat;
+
     /* called to create a new surface */
     void (*surfaceCreate)(unsigned int surfaceId, PSSurfaceFormat format,
         unsigned int width, unsigned int height);
@@ -232,7 +592,46 @@ typedef struct PSConfig
     /* called to destroy a surface */
     void (*surfaceDestroy)(unsigned int surfaceId);
 
-    /* called to draw a bitmap to a surface */
+    /* [optional] setting frameComplete enables batched mode, draw operations
+     * are collected and delivered together once per purespice_process pass
+     * or when the server marks the end of a frame, along with the damaged
+     * area of each surface merged into a small list of rectangles. All
+     * pointers are only valid for the duration of the call. drawBitmap and
+     * drawFill are not used in this mode and may be NULL */
+    void (*frameComplete)(const PSDrawOp * ops, unsigned int numOps,
+        const PSSurfaceDamage * damage, unsigned int numSurfaces);
+
+    /* [optional] setting surfaceMapped enables the surface store, the library
+     * keeps each surface in a memfd of its own and applies the fills and
+     * copies to it itself, honoring their clip rects and rops. surfaceMapped
+     * is called in place of surfaceCreate and surfaceDamage at the same points
+     * frameComplete would be, with the tiles of each surface drawn to since.
+     * The pixels only change while the display channel is processed so read
+     * them during surfaceDamage or between calls to purespice_process. Only
+     * the 32-bit formats are drawn to, surfaceDestroy is called as usual and
+     * for every surface left when the session disconnects. surfaceCreate,
+     * frameComplete, drawBitmap and drawFill are not used in this mode and
+     * may be NULL, outputFormat is ignored */
+    void (*surfaceMapped)(unsigned int surfaceId,
+        const PSSurfaceBuffer * buffer);
+    void (*surfaceDamage)(unsigned int surfaceId,
+        const PSSurfaceDirty * dirty);
+
+    /* [optional] setting glScanout has a display channel connected over a
+     * UNIX socket ask the server for the guest's scanout as a dmabuf, where
+     * the guest renders with virgl or virtio-gpu the frames then never pass
+     * through the library. glDraw is called each time the area given of the
+     * current scanout has been updated, the server does not update it again
+     * until purespice_glDrawDone has been called. Both are mandatory if
+     * glScanout is set, the surfaces are still delivered as usual for guests
+     * that do not render this way */
+    void (*glScanout)(const PSGLScanout * scanout);
+    void (*glDraw)(int x, int y, int width, int height);
+
+    /* called to draw a bitmap to a surface. A draw the server clips is split
+     * into one call for each of its clip rects with data pointing at the part
+     * of the bitmap to draw, the stride is that of the whole bitmap. Formats
+     * of less than a byte per pixel are passed unclipped */
     void (*drawBitmap)(unsigned int surfaceId,
         PSBitmapFormat format,
         bool topDown,
@@ -241,11 +640,48 @@ typedef struct PSConfig
         int stride,
         void * data);
 
-    /* called to fill an area with a color */
+    /* called to fill an area with a color, a fill the server clips is split
+     * into one for each of its clip rects */
     void (*drawFill)(unsigned int surfaceId,
         int x    , int y,
         int width, int height,
         uint32_t color);
+
+    /* [optional] setting drawFills has the fills of consecutive DrawFill
+     * messages passed together in place of drawFill, so that they can be
+     * drawn with a single draw call. They are passed before anything else is
+     * drawn and at the end of each purespice_process pass, the array is only
+     * valid for the duration of the call. drawFill is not used then and may
+     * be NULL, drawFills is not used in batched mode or with the store */
+    void (*drawFills)(const PSFill * fills, unsigned int count);
+
+    /* [optional] setting streamCreate allows the server to send video regions
+     * as compressed streams, streamData and streamDestroy are then mandatory.
+     * streamCodecs is a mask of (1 << PSVideoCodec) for the codecs that can
+     * be decoded, MJPEG is always assumed */
+    unsigned int streamCodecs;
+
+    /* called when the server starts a new video stream */
+    void (*streamCreate)(unsigned int streamId, unsigned int surfaceId,
+        PSVideoCodec codec, bool topDown,
+        unsigned int width, unsigned int height,
+        int x, int y, int destWidth, int destHeight);
+
+    /* called with each compressed frame, the data points into the receive
+     * buffer and is only valid for the duration of the call. mmTime is when
+     * the frame should be presented, see purespice_getMMTime */
+    void (*streamData)(unsigned int streamId, uint32_t mmTime,
+        unsigned int width, unsigned int height,
+        int x, int y, int destWidth, int destHeight,
+        const uint8_t * data, size_t size);
+
+    /* [optional] called when the clip region of a stream changes, a count of
+     * zero removes the clipping */
+    void (*streamClip)(unsigned int streamId, unsigned int count,
+        const PSRect * rects);
+
+    /* called when the server ends a video stream */
+    void (*streamDestroy)(unsigned int streamId);
   }
   display;
 
@@ -282,43 +718,143 @@ extern "C" {
 #endif
 
 /*
- * Initialize the library for use, this may be called before any other methods
- * to setup the library. If not initialization will be automatically performed
- * by `purespice_connect` with default parameters.
+ * Sets up the logging shared by every session, this may be called before any
+ * other methods. If not the default loggers that write to stdout and stderr
+ * are used.
  *
  * `init` is optional and may be NULL
  */
 void purespice_init(const PSInit * init);
 
-bool purespice_connect(const PSConfig * config);
-void purespice_disconnect(void);
-PSStatus purespice_process(int timeout);
-
-bool purespice_getServerInfo(PSServerInfo * info);
+/* creates a loop that sessions can share, it must outlive them. The sessions
+ * on a loop must be connected, disconnected and freed by the thread that
+ * processes it, but never from within one of their callbacks */
+PSLoop * purespice_newLoop (void);
+void     purespice_freeLoop(PSLoop * loop);
+
+/* processes the events of every session on the loop, call from one thread.
+ * Returns PS_STATUS_RUN while they are running, otherwise the status of a
+ * session that stopped, which is stored in `session` if it is not NULL. The
+ * caller should disconnect that session, the others keep running */
+PSStatus purespice_processLoop(PSLoop * loop, int timeout,
+    PSSession ** session);
+
+/* for running the loop inside another event loop (GLib, libuv, ...). The fd
+ * becomes readable whenever the loop has work to do, watch it for POLLIN and
+ * call purespice_dispatch when it fires. Dispatch never blocks and returns
+ * like purespice_processLoop, if it stops early on a session the fd stays
+ * readable until the remaining events are handled. The fd belongs to the
+ * loop and must not be closed by the caller */
+int      purespice_getLoopFd(PSLoop * loop);
+PSStatus purespice_dispatch (PSLoop * loop, PSSession ** session);
+
+/* creates a session on `loop`, or on a loop of its own if it is NULL which
+ * is then driven with purespice_process */
+PSSession * purespice_newSession (PSLoop * loop);
+void        purespice_freeSession(PSSession * session);
+
+/* the session whose callback is running on this thread, or NULL outside of
+ * callbacks */
+PSSession * purespice_currentSession(void);
+void      * purespice_getOpaque(PSSession * session);
+
+// the loop the session is on, including one it created for itself
+PSLoop    * purespice_getLoop(PSSession * session);
+
+/* starts connecting, the channels then link from the session's loop with
+ * PSConfig.ready called once they all have. A link that fails disconnects the
+ * session and is reported by purespice_process as PS_STATUS_ERR_CONNECT */
+bool purespice_connect(PSSession * session, const PSConfig * config);
+void purespice_disconnect(PSSession * session);
+
+/* processes the session's events, for sessions on a shared loop this is the
+ * same as purespice_processLoop */
+PSStatus purespice_process(PSSession * session, int timeout);
+
+bool purespice_getServerInfo(PSSession * session, PSServerInfo * info);
 void purespice_freeServerInfo(PSServerInfo * info);
 
-bool purespice_hasChannel       (PSChannelType channel);
-bool purespice_channelConnected (PSChannelType channel);
-bool purespice_connectChannel   (PSChannelType channel);
-bool purespice_disconnectChannel(PSChannelType channel);
-
-bool purespice_keyDown      (uint32_t code);
-bool purespice_keyUp        (uint32_t code);
-bool purespice_keyModifiers (uint32_t modifiers);
-bool purespice_mouseMode    (bool     server);
-bool purespice_mousePosition(uint32_t x, uint32_t y);
-bool purespice_mouseMotion  ( int32_t x,  int32_t y);
-bool purespice_mousePress   (uint32_t button);
-bool purespice_mouseRelease (uint32_t button);
-
-bool purespice_clipboardRequest(PSDataType type);
-bool purespice_clipboardGrab(PSDataType types[], int count);
-bool purespice_clipboardRelease(void);
-
-bool purespice_clipboardDataStart(PSDataType type, size_t size);
-bool purespice_clipboardData(PSDataType type, uint8_t * data, size_t size);
-
-bool purespice_writeAudio(void * data, size_t size, uint32_t time);
+/* takes a snapshot of the session's statistics, this may be called from any
+ * thread while the session is connected. The counters are read one at a time
+ * so they may be a message or two apart */
+bool purespice_getStats(PSSession * session, PSStats * stats);
+
+/* the upper bound in microseconds of the histogram bucket that holds the
+ * given percentile, which is exact to within a factor of two */
+uint64_t purespice_statsPercentile(const PSStatsHistogram * histogram,
+    unsigned int percent);
+
+bool purespice_hasChannel       (PSSession * session, PSChannelType channel);
+bool purespice_channelConnected (PSSession * session, PSChannelType channel);
+/* connecting a channel only starts its link, purespice_channelConnected is
+ * true once it has completed */
+bool purespice_connectChannel   (PSSession * session, PSChannelType channel);
+bool purespice_disconnectChannel(PSSession * session, PSChannelType channel);
+
+/* tells the server the app is done reading the area passed to glDraw, this
+ * may be called from any thread */
+bool purespice_glDrawDone(PSSession * session);
+
+bool purespice_keyDown      (PSSession * session, uint32_t code);
+bool purespice_keyUp        (PSSession * session, uint32_t code);
+bool purespice_keyModifiers (PSSession * session, uint32_t modifiers);
+bool purespice_mouseMode    (PSSession * session, bool     server);
+bool purespice_mousePosition(PSSession * session, uint32_t x, uint32_t y);
+bool purespice_mouseMotion  (PSSession * session,  int32_t x,  int32_t y);
+bool purespice_mousePress   (PSSession * session, uint32_t button);
+bool purespice_mouseRelease (PSSession * session, uint32_t button);
+
+bool purespice_clipboardRequest(PSSession * session, PSDataType type);
+bool purespice_clipboardGrab(PSSession * session, PSDataType types[],
+    int count);
+bool purespice_clipboardRelease(PSSession * session);
+
+bool purespice_clipboardDataStart(PSSession * session, PSDataType type,
+    size_t size);
+bool purespice_clipboardData(PSSession * session, PSDataType type,
+    uint8_t * data, size_t size);
+
+typedef void (*PSReleaseFn)(void * opaque);
+
+/* as purespice_clipboardData but `data` is sent from in place instead of being
+ * copied, it must remain valid until `release` is called with `opaque`. The
+ * release function is always called exactly once, even on failure, and may
+ * be called from the thread running purespice_process */
+bool purespice_clipboardDataRef(PSSession * session, PSDataType type,
+    const uint8_t * data, size_t size, PSReleaseFn release, void * opaque);
+
+bool purespice_writeAudio(PSSession * session, void * data, size_t size,
+    uint32_t time);
+
+/* returns a library owned buffer of at least `size` bytes to fill with record
+ * audio in place, it is sent straight from there by purespice_commitAudio. Only
+ * one buffer can be borrowed at a time and it is invalid after disconnect */
+void * purespice_borrowAudio(PSSession * session, size_t size);
+bool purespice_commitAudio(PSSession * session, void * buffer, size_t size,
+    uint32_t time);
+
+/* fills `frames` frames of playback audio when playback.pull is set, padding
+ * with silence if not enough is buffered. time receives the server time of
+ * the first frame, or zero if it is unknown. Returns how many frames are
+ * audio, call from one thread at a time between playback start and stop */
+size_t purespice_readAudio(PSSession * session, void * data, size_t frames,
+    uint32_t * time);
+
+/* returns the server's multimedia clock in milliseconds, the time the server
+ * sends is advanced by half the main channel's round trip time */
+uint32_t purespice_getMMTime(PSSession * session);
+
+/* returns true if the library was built with opus support */
+bool purespice_hasOpus(void);
+
+/* takes a lease on `size` bytes at `*data`, a pointer given to a callback
+ * such as drawBitmap, so they stay valid after the callback returns. Library
+ * buffers are leased in place without a copy, anything else is copied into
+ * a new buffer and `*data` is updated to point at it. Returns the lease to
+ * give to purespice_releaseBuffer, which may be called from any thread, or
+ * NULL on failure */
+void * purespice_leaseBuffer(const void ** data, size_t size);
+void   purespice_releaseBuffer(void * lease);
 
 #ifdef __cplusplus
 }
@@ -17,72 +17,235 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#define _GNU_SOURCE
 #include "purespice.h"
 
 #include "ps.h"
+#include "agent.h"
 #include "log.h"
 #include "channel.h"
 #include "channel_main.h"
 
 #include "messages.h"
 #include "rsa.h"
-#include "queue.h"
+#include "stats.h"
 
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 
 #include <spice/vd_agent.h>
 
 typedef struct PSAgent PSAgent;
 
+/* a part of an outbound agent message, small parts are copied inline while
+ * large ones reference the caller's buffer until it has been sent */
+typedef struct AgentNode
+{
+  struct AgentNode * next;
+  bool               start;
+  const uint8_t    * data;
+  size_t             size;
+  size_t             offset;
+  PSReleaseFn        release;
+  void             * opaque;
+  uint8_t            inlineData[PS_AGENT_INLINE_SIZE];
+}
+AgentNode;
+
 struct PSAgent
 {
+  bool initDone;
   bool present;
-  struct Queue * queue;
   atomic_uint    serverTokens;
 
+  /* producers append under the lock, only the IO loop removes nodes so the
+   * head can be read without it */
+  atomic_flag    lock;
+  AgentNode    * head;
+  AgentNode    * tail;
+  AgentNode    * pool;
+  unsigned int   poolSize;
+  int            eventfd;
+  PSPollSource   poll;
+  atomic_bool    wakePending;
+
+  // bytes queued that have not been sent yet, for the statistics
+  atomic_size_t  queued;
+
   // clipboard variables
   bool               cbSupported;
   bool               cbSelection;
   bool               cbAgentGrabbed;
   bool               cbClientGrabbed;
   PSDataType         cbType;
+  bool               cbActive;
   uint8_t *          cbBuffer;
+  int                cbFd;
   uint32_t           cbRemain;
   uint32_t           cbSize;
 
   ssize_t msgSize;
 };
 
-static PSAgent agent = {0};
-
-static PS_STATUS agent_sendCaps(bool request);
-static void agent_onClipboard(void);
+static PS_STATUS agent_sendCaps(PS * ps, bool request);
+static bool agent_clipboardStart(PS * ps, uint32_t size);
+static bool agent_clipboardChunk(PS * ps, const uint8_t * data, uint32_t size);
+static void agent_clipboardEnd(PS * ps, bool complete);
 static uint32_t psTypeToAgentType(PSDataType type);
 static PSDataType agentTypeToPSType(uint32_t type);
 
-bool agent_present(void)
+bool agent_create(PS * ps)
 {
-  return agent.present;
+  ps->agent = calloc(1, sizeof(*ps->agent));
+  if (!ps->agent)
+  {
+    PS_LOG_ERROR("Failed to allocate the agent state");
+    return false;
+  }
+
+  ps->agent->eventfd   = -1;
+  ps->agent->cbFd      = -1;
+  ps->agent->poll.type = PS_POLL_AGENT;
+  ps->agent->poll.ps   = ps;
+  return true;
 }
 
-PS_STATUS agent_connect(void)
+void agent_destroy(PS * ps)
 {
-  if (!agent.queue)
-    agent.queue = queue_new();
-  else
+  free(ps->agent);
+  ps->agent = NULL;
+}
+
+bool agent_present(PS * ps)
+{
+  PSAgent * agent = ps->agent;
+  return agent->present;
+}
+
+static AgentNode * allocNode(PSAgent * agent)
+{
+  SPICE_LOCK(agent->lock);
+  AgentNode * node = agent->pool;
+  if (node)
+  {
+    agent->pool = node->next;
+    --agent->poolSize;
+  }
+  SPICE_UNLOCK(agent->lock);
+
+  if (!node)
+    node = malloc(sizeof(*node));
+
+  return node;
+}
+
+// call with the lock held
+static void recycleNodeNL(PSAgent * agent, AgentNode * node)
+{
+  if (agent->poolSize >= PS_AGENT_POOL_SIZE)
+  {
+    free(node);
+    return;
+  }
+
+  node->next = agent->pool;
+  agent->pool = node;
+  ++agent->poolSize;
+}
+
+static void releaseNode(PSAgent * agent, AgentNode * node)
+{
+  if (node->release)
+    node->release(node->opaque);
+
+  SPICE_LOCK(agent->lock);
+  recycleNodeNL(agent, node);
+  SPICE_UNLOCK(agent->lock);
+}
+
+static void discardQueue(PSAgent * agent)
+{
+  SPICE_LOCK(agent->lock);
+  AgentNode * node = agent->head;
+  agent->head = agent->tail = NULL;
+  SPICE_UNLOCK(agent->lock);
+
+  while(node)
+  {
+    AgentNode * next = node->next;
+    atomic_fetch_sub_explicit(&agent->queued, node->size - node->offset,
+        memory_order_relaxed);
+    releaseNode(agent, node);
+    node = next;
+  }
+}
+
+bool agent_init(PS * ps)
+{
+  PSAgent * agent = ps->agent;
+  SPICE_LOCK_INIT(agent->lock);
+  agent->head = agent->tail = NULL;
+  atomic_store(&agent->queued, 0);
+
+  agent->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (agent->eventfd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the agent eventfd");
+    return false;
+  }
+
+  atomic_store(&agent->wakePending, false);
+
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.ptr = &agent->poll
+  };
+  epoll_ctl(ps->epollfd, EPOLL_CTL_ADD, agent->eventfd, &ev);
+  agent->initDone = true;
+  return true;
+}
+
+void agent_deinit(PS * ps)
+{
+  PSAgent * agent = ps->agent;
+  if (!agent->initDone)
+    return;
+
+  agent_disconnect(ps);
+  agent->initDone = false;
+
+  if (agent->eventfd >= 0)
+  {
+    close(agent->eventfd);
+    agent->eventfd = -1;
+  }
+
+  while(agent->pool)
   {
-    void * msg;
-    while(queue_shift(agent.queue, &msg))
-      SPICE_RAW_PACKET_FREE(msg);
+    AgentNode * next = agent->pool->next;
+    free(agent->pool);
+    agent->pool = next;
   }
+  agent->poolSize = 0;
+}
 
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_MAIN];
+PS_STATUS agent_connect(PS * ps)
+{
+  PSAgent * agent = ps->agent;
+  discardQueue(agent);
+
+  PSChannel * channel = &ps->channels[PS_CHANNEL_MAIN];
   uint32_t * packet = SPICE_PACKET(SPICE_MSGC_MAIN_AGENT_START, uint32_t, 0);
   memcpy(packet, &(uint32_t){SPICE_AGENT_TOKENS_MAX}, sizeof(uint32_t));
   if (!SPICE_SEND_PACKET(channel, packet))
@@ -91,11 +254,11 @@ PS_STATUS agent_connect(void)
     return PS_STATUS_ERROR;
   }
 
-  agent.present = true;
-  PS_STATUS ret = agent_sendCaps(true);
+  agent->present      = true;
+  PS_STATUS ret = agent_sendCaps(ps, true);
   if (ret != PS_STATUS_OK)
   {
-    agent.present = false;
+    agent->present = false;
     PS_LOG_ERROR("Failed to send our capabillities to the spice guest agent");
     return ret;
   }
@@ -104,30 +267,19 @@ PS_STATUS agent_connect(void)
   return PS_STATUS_OK;
 }
 
-void agent_disconnect(void)
+void agent_disconnect(PS * ps)
 {
-  if (agent.queue)
-  {
-    void * msg;
-    while(queue_shift(agent.queue, &msg))
-      SPICE_RAW_PACKET_FREE(msg);
-    queue_free(agent.queue);
-    agent.queue = NULL;
-  }
+  PSAgent * agent = ps->agent;
+  if (agent->initDone)
+    discardQueue(agent);
 
-  if (agent.cbBuffer)
-  {
-    free(agent.cbBuffer);
-    agent.cbBuffer = NULL;
-  }
+  if (agent->cbActive)
+    agent_clipboardEnd(ps, false);
 
-  agent.cbRemain = 0;
-  agent.cbSize   = 0;
+  agent->cbAgentGrabbed  = false;
+  agent->cbClientGrabbed = false;
 
-  agent.cbAgentGrabbed  = false;
-  agent.cbClientGrabbed = false;
-
-  agent.present = false;
+  agent->present = false;
 }
 
 #pragma pack(push,1)
@@ -140,14 +292,25 @@ struct Selection
 
 PS_STATUS agent_process(PSChannel * channel)
 {
-  if (agent.cbRemain)
+  PS * ps = channel->ps;
+  PSAgent * agent = ps->agent;
+  if (agent->cbRemain)
   {
-    memcpy(agent.cbBuffer + agent.cbSize, channel->buffer, channel->header.size);
-    agent.cbRemain -= channel->header.size;
-    agent.cbSize   += channel->header.size;
+    if (channel->header.size > agent->cbRemain)
+    {
+      PS_LOG_ERROR("Agent sent more clipboard data than announced");
+      agent_clipboardEnd(ps, false);
+      return PS_STATUS_ERROR;
+    }
+
+    if (!agent_clipboardChunk(ps, channel->buffer, channel->header.size))
+    {
+      agent_clipboardEnd(ps, false);
+      return PS_STATUS_ERROR;
+    }
 
-    if (!agent.cbRemain)
-      agent_onClipboard();
+    if (!agent->cbRemain)
+      agent_clipboardEnd(ps, true);
 
     return PS_STATUS_OK;
   }
@@ -173,18 +336,18 @@ PS_STATUS agent_process(PSChannel * channel)
       VDAgentAnnounceCapabilities * caps = (VDAgentAnnounceCapabilities *)data;
       const int capsSize = VD_AGENT_CAPS_SIZE_FROM_MSG_SIZE(msg->size);
 
-      agent.cbSupported  =
+      agent->cbSupported  =
         VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize,
             VD_AGENT_CAP_CLIPBOARD_BY_DEMAND) ||
         VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize,
             VD_AGENT_CAP_CLIPBOARD_SELECTION);
 
-      agent.cbSelection  =
+      agent->cbSelection  =
         VD_AGENT_HAS_CAPABILITY(caps->caps, capsSize,
             VD_AGENT_CAP_CLIPBOARD_SELECTION);
 
       if (caps->request)
-        return agent_sendCaps(false);
+        return agent_sendCaps(ps, false);
 
       return PS_STATUS_OK;
     }
@@ -195,7 +358,7 @@ PS_STATUS agent_process(PSChannel * channel)
     case VD_AGENT_CLIPBOARD_RELEASE:
     {
       // all clipboard messages might have this
-      if (agent.cbSelection)
+      if (agent->cbSelection)
       {
         struct Selection * selection = (struct Selection *)data;
         data     += sizeof(*selection);
@@ -205,9 +368,9 @@ PS_STATUS agent_process(PSChannel * channel)
       switch(msg->type)
       {
         case VD_AGENT_CLIPBOARD_RELEASE:
-          agent.cbAgentGrabbed = false;
-          if (g_ps.config.clipboard.enable)
-            g_ps.config.clipboard.release();
+          agent->cbAgentGrabbed = false;
+          if (ps->config.clipboard.enable)
+            STATS_CALLBACK(ps, PS_CHANNEL_MAIN, ps->config.clipboard.release());
           return PS_STATUS_OK;
 
         case VD_AGENT_CLIPBOARD:
@@ -216,7 +379,7 @@ PS_STATUS agent_process(PSChannel * channel)
           data     += sizeof(*type);
           dataSize -= sizeof(*type);
 
-          if (agent.cbBuffer)
+          if (agent->cbActive)
           {
             PS_LOG_ERROR(
                 "Agent tried to send a new clipboard instead of remaining data");
@@ -224,19 +387,23 @@ PS_STATUS agent_process(PSChannel * channel)
           }
 
           const unsigned int totalData = msg->size - sizeof(*type);
-          agent.cbBuffer = (uint8_t *)malloc(totalData);
-          if (!agent.cbBuffer)
+          if (dataSize > totalData)
           {
-            PS_LOG_ERROR("Failed to allocate buffer for clipboard transfer");
+            PS_LOG_ERROR("Agent sent more clipboard data than announced");
             return PS_STATUS_ERROR;
           }
 
-          agent.cbSize   = dataSize;
-          agent.cbRemain = totalData - dataSize;
-          memcpy(agent.cbBuffer, data, dataSize);
+          if (!agent_clipboardStart(ps, totalData))
+            return PS_STATUS_ERROR;
+
+          if (!agent_clipboardChunk(ps, data, dataSize))
+          {
+            agent_clipboardEnd(ps, false);
+            return PS_STATUS_ERROR;
+          }
 
-          if (agent.cbRemain == 0)
-            agent_onClipboard();
+          if (agent->cbRemain == 0)
+            agent_clipboardEnd(ps, true);
 
           return PS_STATUS_OK;
         }
@@ -246,8 +413,9 @@ PS_STATUS agent_process(PSChannel * channel)
           uint32_t * type = (uint32_t *)data;
           data += sizeof(type);
 
-          if (g_ps.config.clipboard.enable)
-            g_ps.config.clipboard.request(agentTypeToPSType(*type));
+          if (ps->config.clipboard.enable)
+            STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+              ps->config.clipboard.request(agentTypeToPSType(*type)));
           return PS_STATUS_OK;
         }
 
@@ -259,18 +427,19 @@ PS_STATUS agent_process(PSChannel * channel)
           // there is zero documentation on the types field, it might be a
           // bitfield but for now we are going to assume it's not.
 
-          agent.cbType          = agentTypeToPSType(types[0]);
-          agent.cbAgentGrabbed  = true;
-          agent.cbClientGrabbed = false;
-          if (agent.cbSelection)
+          agent->cbType          = agentTypeToPSType(types[0]);
+          agent->cbAgentGrabbed  = true;
+          agent->cbClientGrabbed = false;
+          if (agent->cbSelection)
           {
             // Windows doesnt support this, so until it's needed there is no point
             // messing with it
             return PS_STATUS_OK;
           }
 
-          if (g_ps.config.clipboard.enable)
-            g_ps.config.clipboard.notice(agent.cbType);
+          if (ps->config.clipboard.enable)
+            STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+              ps->config.clipboard.notice(agent->cbType));
 
           return PS_STATUS_OK;
         }
@@ -281,25 +450,149 @@ PS_STATUS agent_process(PSChannel * channel)
   return PS_STATUS_OK;
 }
 
-static void agent_onClipboard(void)
+/* the clipboard data is either collected on the heap for data, written to a
+ * memfd for dataFd, or handed to dataChunk as it arrives */
+
+static bool agent_clipboardStart(PS * ps, uint32_t size)
+{
+  PSAgent * agent = ps->agent;
+  agent->cbActive = true;
+  agent->cbSize   = 0;
+  agent->cbRemain = size;
+  agent->cbBuffer = NULL;
+  agent->cbFd     = -1;
+
+  if (!ps->config.clipboard.enable)
+    return true;
+
+  if (ps->config.clipboard.dataFd)
+  {
+    agent->cbFd = memfd_create("purespice-clipboard",
+        MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (agent->cbFd < 0)
+    {
+      PS_LOG_ERROR("Failed to create the clipboard memfd: %d", errno);
+      agent->cbActive = false;
+      return false;
+    }
+    return true;
+  }
+
+  if (ps->config.clipboard.dataStart)
+  {
+    STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+      ps->config.clipboard.dataStart(agent->cbType, size));
+    return true;
+  }
+
+  agent->cbBuffer = (uint8_t *)malloc(size);
+  if (!agent->cbBuffer)
+  {
+    PS_LOG_ERROR("Failed to allocate buffer for clipboard transfer");
+    agent->cbActive = false;
+    return false;
+  }
+
+  return true;
+}
+
+static bool agent_clipboardChunk(PS * ps, const uint8_t * data, uint32_t size)
+{
+  PSAgent * agent = ps->agent;
+  agent->cbRemain -= size;
+
+  if (!ps->config.clipboard.enable || !size)
+  {
+    agent->cbSize += size;
+    return true;
+  }
+
+  if (agent->cbFd >= 0)
+  {
+    while(size)
+    {
+      const ssize_t wrote = write(agent->cbFd, data, size);
+      if (wrote < 0)
+      {
+        if (errno == EINTR)
+          continue;
+
+        PS_LOG_ERROR("Failed to write to the clipboard memfd: %d", errno);
+        return false;
+      }
+
+      data         += wrote;
+      size         -= wrote;
+      agent->cbSize += wrote;
+    }
+    return true;
+  }
+
+  if (ps->config.clipboard.dataStart)
+    STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+      ps->config.clipboard.dataChunk(agent->cbType, data, size));
+  else
+    memcpy(agent->cbBuffer + agent->cbSize, data, size);
+
+  agent->cbSize += size;
+  return true;
+}
+
+static void agent_clipboardEnd(PS * ps, bool complete)
 {
-  if (g_ps.config.clipboard.enable)
-    g_ps.config.clipboard.data(agent.cbType, agent.cbBuffer, agent.cbSize);
+  PSAgent * agent = ps->agent;
+  if (ps->config.clipboard.enable)
+  {
+    if (agent->cbFd >= 0)
+    {
+      if (complete)
+      {
+        fcntl(agent->cbFd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+        lseek(agent->cbFd, 0, SEEK_SET);
+
+        // the callback takes ownership of the fd
+        STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+          ps->config.clipboard.dataFd(agent->cbType, agent->cbFd,
+            agent->cbSize));
+      }
+      else
+        close(agent->cbFd);
+    }
+    else if (ps->config.clipboard.dataStart)
+      STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+        ps->config.clipboard.dataEnd(agent->cbType, complete));
+    else if (complete)
+      STATS_CALLBACK(ps, PS_CHANNEL_MAIN,
+        ps->config.clipboard.data(agent->cbType, agent->cbBuffer,
+          agent->cbSize));
+  }
 
-  free(agent.cbBuffer);
-  agent.cbBuffer = NULL;
-  agent.cbSize   = 0;
-  agent.cbRemain = 0;
+  free(agent->cbBuffer);
+  agent->cbBuffer = NULL;
+  agent->cbFd     = -1;
+  agent->cbSize   = 0;
+  agent->cbRemain = 0;
+  agent->cbActive = false;
+}
+
+void agent_setServerTokens(PS * ps, unsigned int tokens)
+{
+  PSAgent * agent = ps->agent;
+  atomic_store(&agent->serverTokens, tokens);
 }
 
-void agent_setServerTokens(unsigned int tokens)
+void agent_getQueue(PS * ps, size_t * queued, unsigned int * tokens)
 {
-  atomic_store(&agent.serverTokens, tokens);
+  PSAgent * agent = ps->agent;
+  *queued = atomic_load_explicit(&agent->queued, memory_order_relaxed);
+  *tokens = atomic_load_explicit(&agent->serverTokens, memory_order_relaxed);
 }
 
-static bool agent_takeServerToken(void)
+static bool agent_takeServerToken(PS * ps)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_MAIN];
+  PSAgent * agent = ps->agent;
+  PSChannel * channel = &ps->channels[PS_CHANNEL_MAIN];
 
   unsigned int tokens;
   do
@@ -307,82 +600,227 @@ static bool agent_takeServerToken(void)
     if (!channel->connected)
       return false;
 
-    tokens = atomic_load(&agent.serverTokens);
+    tokens = atomic_load(&agent->serverTokens);
     if (tokens == 0)
       return false;
   }
-  while(!atomic_compare_exchange_weak(&agent.serverTokens, &tokens, tokens - 1));
+  while(!atomic_compare_exchange_weak(&agent->serverTokens, &tokens, tokens - 1));
 
   return true;
 }
 
-void agent_returnServerTokens(unsigned int tokens)
+void agent_returnServerTokens(PS * ps, unsigned int tokens)
 {
-  atomic_fetch_add(&agent.serverTokens, tokens);
+  PSAgent * agent = ps->agent;
+  atomic_fetch_add(&agent->serverTokens, tokens);
 }
 
-bool agent_processQueue(void)
+bool agent_processQueue(PS * ps)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_MAIN];
+  PSAgent * agent = ps->agent;
+  PSChannel * channel = &ps->channels[PS_CHANNEL_MAIN];
 
-  SPICE_LOCK(channel->lock);
-  while (queue_peek(agent.queue, NULL) && agent_takeServerToken())
+  uint64_t value;
+  if (read(agent->eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
   {
-    void * msg;
-    queue_shift(agent.queue, &msg);
-    if (!SPICE_SEND_PACKET_NL(channel, msg))
+    PS_LOG_ERROR("Failed to read the agent eventfd");
+    return false;
+  }
+
+  // clear the flag before draining so that a push racing with us wakes us
+  // again instead of being left in the queue
+  atomic_store(&agent->wakePending, false);
+
+  /* send the queued data in packets of up to VD_AGENT_MAX_DATA_SIZE, each
+   * costs a server token. Stop if the socket is backed up, the flush on
+   * EPOLLOUT resumes us, and after a bunch of packets let the other channels
+   * have a turn */
+  for(int sent = 0; sent < PS_AGENT_DRAIN_MAX; ++sent)
+  {
+    SPICE_LOCK(agent->lock);
+    AgentNode * tail = agent->tail;
+    SPICE_UNLOCK(agent->lock);
+
+    if (!tail || channel->txWaiting || !agent_takeServerToken(ps))
+      return true;
+
+    struct iovec        iov[PS_SENDV_MAX];
+    SpiceMiniDataHeader header = { .type = SPICE_MSGC_MAIN_AGENT_DATA };
+    size_t              size   = 0;
+    int                 count  = 1;
+
+    /* the server expects each packet to hold data for only one agent message
+     * so stop at the start of the next. Nodes up to the tail we read are
+     * complete, a producer only ever touches the tail's next pointer */
+    iov[0] = (struct iovec){ .iov_base = &header, .iov_len = sizeof(header) };
+    for(AgentNode * node = agent->head; count < PS_SENDV_MAX;
+        node = node->next)
+    {
+      if (node->start && size)
+        break;
+
+      size_t len = node->size - node->offset;
+      if (len > VD_AGENT_MAX_DATA_SIZE - size)
+        len = VD_AGENT_MAX_DATA_SIZE - size;
+
+      iov[count++] = (struct iovec)
+      {
+        .iov_base = (void *)(node->data + node->offset),
+        .iov_len  = len
+      };
+
+      size += len;
+      if (size == VD_AGENT_MAX_DATA_SIZE || node == tail)
+        break;
+    }
+
+    header.size = size;
+    if (!channel_sendv(channel, iov, count))
     {
-      SPICE_RAW_PACKET_FREE(msg);
-      SPICE_UNLOCK(channel->lock);
-      PS_LOG_ERROR("Failed to send a queued packet");
+      PS_LOG_ERROR("Failed to send agent data");
       return false;
     }
-    SPICE_RAW_PACKET_FREE(msg);
+    atomic_fetch_sub_explicit(&agent->queued, size, memory_order_relaxed);
+
+    // account for what was sent, releasing buffers that are complete
+    while(size)
+    {
+      AgentNode * node = agent->head;
+      size_t len = node->size - node->offset;
+      if (len > size)
+      {
+        node->offset += size;
+        break;
+      }
+
+      SPICE_LOCK(agent->lock);
+      agent->head = node->next;
+      if (!agent->head)
+        agent->tail = NULL;
+      SPICE_UNLOCK(agent->lock);
+
+      size -= len;
+      releaseNode(agent, node);
+    }
   }
-  SPICE_UNLOCK(channel->lock);
+
+  // there is more to do, come back after the other channels had a turn
+  agent_wake(ps);
   return true;
 }
 
-static bool agent_startMsg(uint32_t type, ssize_t size)
+void agent_wake(PS * ps)
 {
-  VDAgentMessage * msg =
-    SPICE_PACKET_MALLOC(SPICE_MSGC_MAIN_AGENT_DATA, VDAgentMessage, 0);
+  PSAgent * agent = ps->agent;
+  if (!atomic_exchange(&agent->wakePending, true))
+  {
+    const uint64_t value = 1;
+    if (write(agent->eventfd, &value, sizeof(value)) != sizeof(value))
+      PS_LOG_ERROR("Failed to signal the agent eventfd");
+  }
+}
+
+static bool agent_pushData(PS * ps, const void * data, size_t size, bool start,
+    PSReleaseFn release, void * opaque)
+{
+  PSAgent * agent = ps->agent;
+  if (!size)
+  {
+    if (release)
+      release(opaque);
+    return true;
+  }
+
+  AgentNode * node = allocNode(agent);
+  if (!node)
+  {
+    PS_LOG_ERROR("Failed to allocate an agent queue node");
+    if (release)
+      release(opaque);
+    return false;
+  }
+
+  node->next   = NULL;
+  node->start  = start;
+  node->size   = size;
+  node->offset = 0;
+  if (size <= sizeof(node->inlineData))
+  {
+    memcpy(node->inlineData, data, size);
+    node->data    = node->inlineData;
+    node->release = NULL;
+    node->opaque  = NULL;
+
+    // the caller's buffer is no longer needed
+    if (release)
+      release(opaque);
+  }
+  else
+  {
+    node->data    = data;
+    node->release = release;
+    node->opaque  = opaque;
+  }
 
-  msg->protocol  = VD_AGENT_PROTOCOL;
-  msg->type      = type;
-  msg->opaque    = 0;
-  msg->size      = size;
-  agent.msgSize  = size;
-  queue_push(agent.queue, msg);
+  SPICE_LOCK(agent->lock);
+  if (agent->tail)
+    agent->tail->next = node;
+  else
+    agent->head = node;
+  agent->tail = node;
+  // before the sender can see the node so the count never goes negative
+  atomic_fetch_add_explicit(&agent->queued, size, memory_order_relaxed);
+  SPICE_UNLOCK(agent->lock);
 
-  return agent_processQueue();
+  agent_wake(ps);
+  return true;
 }
 
-static bool agent_writeMsg(const void * buffer_, ssize_t size)
+static bool agent_startMsg(PS * ps, uint32_t type, ssize_t size)
 {
-  assert(size <= agent.msgSize);
-
-  const char * buffer = buffer_;
-  while(size)
+  PSAgent * agent = ps->agent;
+  const VDAgentMessage msg =
   {
-    const ssize_t toWrite = size > VD_AGENT_MAX_DATA_SIZE ?
-      VD_AGENT_MAX_DATA_SIZE : size;
+    .protocol = VD_AGENT_PROTOCOL,
+    .type     = type,
+    .opaque   = 0,
+    .size     = size
+  };
+
+  agent->msgSize = size;
+  return agent_pushData(ps, &msg, sizeof(msg), true, NULL, NULL);
+}
+
+static bool agent_writeMsgRef(PS * ps, const void * buffer, ssize_t size,
+    PSReleaseFn release, void * opaque)
+{
+  PSAgent * agent = ps->agent;
+  assert(size <= agent->msgSize);
+  agent->msgSize -= size;
+  return agent_pushData(ps, buffer, size, false, release, opaque);
+}
 
-    void * msg = SPICE_RAW_PACKET_MALLOC(SPICE_MSGC_MAIN_AGENT_DATA, toWrite, 0);
-    memcpy(msg, buffer, toWrite);
-    queue_push(agent.queue, msg);
+static bool agent_writeMsg(PS * ps, const void * buffer, ssize_t size)
+{
+  // large buffers are copied once so the caller can reuse theirs
+  if ((size_t)size <= PS_AGENT_INLINE_SIZE)
+    return agent_writeMsgRef(ps, buffer, size, NULL, NULL);
 
-    size          -= toWrite;
-    buffer        += toWrite;
-    agent.msgSize -= toWrite;
+  void * copy = malloc(size);
+  if (!copy)
+  {
+    PS_LOG_ERROR("Failed to allocate a copy of the agent data");
+    return false;
   }
 
-  return agent_processQueue();
+  memcpy(copy, buffer, size);
+  return agent_writeMsgRef(ps, copy, size, free, copy);
 }
 
-static PS_STATUS agent_sendCaps(bool request)
+static PS_STATUS agent_sendCaps(PS * ps, bool request)
 {
-  if (!agent.present)
+  PSAgent * agent = ps->agent;
+  if (!agent->present)
     return PS_STATUS_ERROR;
 
   const ssize_t capsSize = sizeof(VDAgentAnnounceCapabilities) +
@@ -391,15 +829,15 @@ static PS_STATUS agent_sendCaps(bool request)
     (VDAgentAnnounceCapabilities *)alloca(capsSize);
   memset(caps, 0, capsSize);
 
-  if (g_ps.config.clipboard.enable)
+  if (ps->config.clipboard.enable)
   {
     caps->request = request ? 1 : 0;
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_BY_DEMAND);
     VD_AGENT_SET_CAPABILITY(caps->caps, VD_AGENT_CAP_CLIPBOARD_SELECTION);
   }
 
-  if (!agent_startMsg(VD_AGENT_ANNOUNCE_CAPABILITIES, capsSize) ||
-      !agent_writeMsg(caps, capsSize))
+  if (!agent_startMsg(ps, VD_AGENT_ANNOUNCE_CAPABILITIES, capsSize) ||
+      !agent_writeMsg(ps, caps, capsSize))
   {
     PS_LOG_ERROR("Failed to send our agent capabilities");
     return PS_STATUS_ERROR;
@@ -436,22 +874,23 @@ static PSDataType agentTypeToPSType(uint32_t type)
   }
 }
 
-bool purespice_clipboardRequest(PSDataType type)
+bool purespice_clipboardRequest(PSSession * ps, PSDataType type)
 {
-  if (!agent.present)
+  PSAgent * agent = ps->agent;
+  if (!agent->present)
     return false;
 
   VDAgentClipboardRequest req;
 
-  if (!agent.cbAgentGrabbed)
+  if (!agent->cbAgentGrabbed)
     return false;
 
-  if (type != agent.cbType)
+  if (type != agent->cbType)
     return false;
 
   req.type = psTypeToAgentType(type);
-  if (!agent_startMsg(VD_AGENT_CLIPBOARD_REQUEST, sizeof(req)) ||
-      !agent_writeMsg(&req, sizeof(req)))
+  if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD_REQUEST, sizeof(req)) ||
+      !agent_writeMsg(ps, &req, sizeof(req)))
   {
     PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD_REQUEST");
     return false;
@@ -460,15 +899,16 @@ bool purespice_clipboardRequest(PSDataType type)
   return true;
 }
 
-bool purespice_clipboardGrab(PSDataType types[], int count)
+bool purespice_clipboardGrab(PSSession * ps, PSDataType types[], int count)
 {
-  if (!agent.present)
+  PSAgent * agent = ps->agent;
+  if (!agent->present)
     return false;
 
   if (count == 0)
     return false;
 
-  if (agent.cbSelection)
+  if (agent->cbSelection)
   {
     struct Msg
     {
@@ -484,14 +924,14 @@ bool purespice_clipboardGrab(PSDataType types[], int count)
     for(int i = 0; i < count; ++i)
       msg->types[i] = psTypeToAgentType(types[i]);
 
-    if (!agent_startMsg(VD_AGENT_CLIPBOARD_GRAB, size) ||
-        !agent_writeMsg(msg, size))
+    if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD_GRAB, size) ||
+        !agent_writeMsg(ps, msg, size))
     {
       PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD_GRAB");
       return false;
     }
 
-    agent.cbClientGrabbed = true;
+    agent->cbClientGrabbed = true;
     return true;
   }
 
@@ -499,59 +939,61 @@ bool purespice_clipboardGrab(PSDataType types[], int count)
   for(int i = 0; i < count; ++i)
     msg[i] = psTypeToAgentType(types[i]);
 
-  if (!agent_startMsg(VD_AGENT_CLIPBOARD_GRAB, sizeof(msg)) ||
-      !agent_writeMsg(&msg, sizeof(msg)))
+  if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD_GRAB, sizeof(msg)) ||
+      !agent_writeMsg(ps, &msg, sizeof(msg)))
   {
     PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD_GRAB");
     return false;
   }
 
-  agent.cbClientGrabbed = true;
+  agent->cbClientGrabbed = true;
   return true;
 }
 
-bool purespice_clipboardRelease(void)
+bool purespice_clipboardRelease(PSSession * ps)
 {
-  if (!agent.present)
+  PSAgent * agent = ps->agent;
+  if (!agent->present)
     return false;
 
   // check if if there is anything to release first
-  if (!agent.cbClientGrabbed)
+  if (!agent->cbClientGrabbed)
     return true;
 
-  if (agent.cbSelection)
+  if (agent->cbSelection)
   {
     uint8_t req[4] = { VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD };
-    if (!agent_startMsg(VD_AGENT_CLIPBOARD_RELEASE, sizeof(req)) ||
-        !agent_writeMsg(req, sizeof(req)))
+    if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD_RELEASE, sizeof(req)) ||
+        !agent_writeMsg(ps, req, sizeof(req)))
     {
       PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD");
       return false;
     }
 
-    agent.cbClientGrabbed = false;
+    agent->cbClientGrabbed = false;
     return true;
   }
 
-   if (!agent_startMsg(VD_AGENT_CLIPBOARD_RELEASE, 0))
+   if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD_RELEASE, 0))
    {
      PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD_RELEASE");
      return false;
    }
 
-   agent.cbClientGrabbed = false;
+   agent->cbClientGrabbed = false;
    return true;
 }
 
-bool purespice_clipboardDataStart(PSDataType type, size_t size)
+bool purespice_clipboardDataStart(PSSession * ps, PSDataType type, size_t size)
 {
-  if (!agent.present)
+  PSAgent * agent = ps->agent;
+  if (!agent->present)
     return false;
 
   uint8_t buffer[8];
   size_t  bufSize;
 
-  if (agent.cbSelection)
+  if (agent->cbSelection)
   {
     bufSize                = 8;
     buffer[0]              = VD_AGENT_CLIPBOARD_SELECTION_CLIPBOARD;
@@ -564,13 +1006,13 @@ bool purespice_clipboardDataStart(PSDataType type, size_t size)
     ((uint32_t*)buffer)[0] = psTypeToAgentType(type);
   }
 
-  if (!agent_startMsg(VD_AGENT_CLIPBOARD, bufSize + size))
+  if (!agent_startMsg(ps, VD_AGENT_CLIPBOARD, bufSize + size))
   {
     PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD start");
     return false;
   }
 
-  if (!agent_writeMsg(buffer, bufSize))
+  if (!agent_writeMsg(ps, buffer, bufSize))
   {
     PS_LOG_ERROR("Failed to write VD_AGENT_CLIPBOARD data");
     return false;
@@ -579,12 +1021,29 @@ bool purespice_clipboardDataStart(PSDataType type, size_t size)
   return true;
 }
 
-bool purespice_clipboardData(PSDataType type, uint8_t * data, size_t size)
+bool purespice_clipboardData(PSSession * ps, PSDataType type, uint8_t * data, size_t size)
 {
+  PSAgent * agent = ps->agent;
   (void) type;
 
-  if (!agent.present)
+  if (!agent->present)
     return false;
 
-  return agent_writeMsg(data, size);
+  return agent_writeMsg(ps, data, size);
+}
+
+bool purespice_clipboardDataRef(PSSession * ps, PSDataType type, const uint8_t * data,
+    size_t size, PSReleaseFn release, void * opaque)
+{
+  PSAgent * agent = ps->agent;
+  (void) type;
+
+  if (!agent->present)
+  {
+    if (release)
+      release(opaque);
+    return false;
+  }
+
+  return agent_writeMsgRef(ps, data, size, release, opaque);
 }
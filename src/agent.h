@@ -19,16 +19,29 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-bool agent_present(void);
+bool agent_create(PS * ps);
 
-PS_STATUS agent_connect(void);
+void agent_destroy(PS * ps);
 
-void agent_setServerTokens(unsigned int tokens);
+bool agent_init(PS * ps);
 
-void agent_returnServerTokens(unsigned int tokens);
+void agent_deinit(PS * ps);
 
-void agent_disconnect(void);
+bool agent_present(PS * ps);
+
+PS_STATUS agent_connect(PS * ps);
+
+void agent_setServerTokens(PS * ps, unsigned int tokens);
+
+void agent_returnServerTokens(PS * ps, unsigned int tokens);
+
+// the bytes waiting to be sent to the agent and the tokens left to send them
+void agent_getQueue(PS * ps, size_t * queued, unsigned int * tokens);
+
+void agent_disconnect(PS * ps);
 
 PS_STATUS agent_process(PSChannel * channel);
 
-bool agent_processQueue(void);
+bool agent_processQueue(PS * ps);
+
+void agent_wake(PS * ps);
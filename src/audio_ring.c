@@ -0,0 +1,273 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "audio_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// number of packet timestamps that are tracked
+#define AUDIO_RING_TIMES 256
+
+typedef struct AudioTime
+{
+  uint64_t pos;
+  uint32_t time;
+}
+AudioTime;
+
+struct AudioRing
+{
+  uint8_t * data;
+  size_t    size;
+
+  // byte offsets that only ever increase, the ring index is offset % size
+  _Atomic(uint64_t) head;
+  _Atomic(uint64_t) tail;
+
+  AudioTime         times[AUDIO_RING_TIMES];
+  _Atomic(uint64_t) timeHead;
+  _Atomic(uint64_t) timeTail;
+
+  // the stream format, published to the consumer by bumping `generation`
+  int               channels;
+  int               rate;
+  unsigned int      targetLatency;
+  uint64_t          startPos;
+  atomic_uint       generation;
+
+  // consumer state
+  unsigned int      readGeneration;
+  int               readFrameSize;
+  int               readRate;
+  size_t            readTarget;
+  bool              prebuffer;
+
+  // the amount buffered smoothed over several reads, packets arrive in bursts
+  // so a single sample says little about the drift
+  float             avgFill;
+};
+
+struct AudioRing * audioRing_new(size_t size)
+{
+  struct AudioRing * ring = calloc(1, sizeof(*ring));
+  if (!ring)
+    return NULL;
+
+  ring->data = malloc(size);
+  if (!ring->data)
+  {
+    free(ring);
+    return NULL;
+  }
+
+  ring->size = size;
+  atomic_init(&ring->head      , 0);
+  atomic_init(&ring->tail      , 0);
+  atomic_init(&ring->timeHead  , 0);
+  atomic_init(&ring->timeTail  , 0);
+  atomic_init(&ring->generation, 0);
+  return ring;
+}
+
+void audioRing_free(struct AudioRing * ring)
+{
+  if (!ring)
+    return;
+
+  free(ring->data);
+  free(ring);
+}
+
+void audioRing_start(struct AudioRing * ring, int channels, int rate,
+    unsigned int targetLatency)
+{
+  ring->channels      = channels;
+  ring->rate          = rate;
+  ring->targetLatency = targetLatency;
+  ring->startPos      = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  atomic_fetch_add_explicit(&ring->generation, 1, memory_order_release);
+}
+
+bool audioRing_write(struct AudioRing * ring, const void * data, size_t size,
+    uint32_t time)
+{
+  const uint64_t head = atomic_load_explicit(&ring->head,
+      memory_order_relaxed);
+  const uint64_t tail = atomic_load_explicit(&ring->tail,
+      memory_order_acquire);
+
+  if (size > ring->size - (head - tail))
+    return false;
+
+  const size_t offset = head % ring->size;
+  const size_t first  = size < ring->size - offset ? size : ring->size - offset;
+  memcpy(ring->data + offset, data, first);
+  memcpy(ring->data, (const uint8_t *)data + first, size - first);
+
+  // the timestamp is optional, if there is no room the reader extrapolates
+  // from the previous packet
+  const uint64_t timeHead = atomic_load_explicit(&ring->timeHead,
+      memory_order_relaxed);
+  if (timeHead - atomic_load_explicit(&ring->timeTail, memory_order_acquire) <
+      AUDIO_RING_TIMES)
+  {
+    ring->times[timeHead % AUDIO_RING_TIMES] =
+      (AudioTime){ .pos = head, .time = time };
+    atomic_store_explicit(&ring->timeHead, timeHead + 1, memory_order_release);
+  }
+
+  atomic_store_explicit(&ring->head, head + size, memory_order_release);
+  return true;
+}
+
+static void readBytes(const struct AudioRing * ring, uint64_t pos, void * dst,
+    size_t size)
+{
+  const size_t offset = pos % ring->size;
+  const size_t first  = size < ring->size - offset ? size : ring->size - offset;
+  memcpy(dst, ring->data + offset, first);
+  memcpy((uint8_t *)dst + first, ring->data, size - first);
+}
+
+static bool timeAt(struct AudioRing * ring, uint64_t pos, uint32_t * time)
+{
+  const uint64_t timeHead = atomic_load_explicit(&ring->timeHead,
+      memory_order_acquire);
+  uint64_t timeTail = atomic_load_explicit(&ring->timeTail,
+      memory_order_relaxed);
+
+  // drop the timestamps of packets that have been fully consumed
+  while(timeTail + 1 < timeHead &&
+      ring->times[(timeTail + 1) % AUDIO_RING_TIMES].pos <= pos)
+    ++timeTail;
+
+  atomic_store_explicit(&ring->timeTail, timeTail, memory_order_release);
+
+  if (timeTail == timeHead)
+    return false;
+
+  const AudioTime * t = &ring->times[timeTail % AUDIO_RING_TIMES];
+  if (t->pos > pos)
+    return false;
+
+  *time = t->time +
+    (uint32_t)((pos - t->pos) / ring->readFrameSize * 1000 / ring->readRate);
+  return true;
+}
+
+size_t audioRing_read(struct AudioRing * ring, void * data, size_t frames,
+    uint32_t * time)
+{
+  const unsigned int generation = atomic_load_explicit(&ring->generation,
+      memory_order_acquire);
+
+  uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+  if (generation != ring->readGeneration)
+  {
+    ring->readGeneration = generation;
+    ring->readFrameSize  = ring->channels * sizeof(int16_t);
+    ring->readRate       = ring->rate;
+    ring->readTarget     = (size_t)ring->rate * ring->targetLatency / 1000;
+    ring->prebuffer      = true;
+
+    // leave room for the producer to keep writing while at the target
+    if (ring->readFrameSize &&
+        ring->readTarget > ring->size / ring->readFrameSize / 2)
+      ring->readTarget = ring->size / ring->readFrameSize / 2;
+
+    if (ring->startPos > tail)
+      tail = ring->startPos;
+  }
+
+  // no stream has been started yet
+  if (!ring->readFrameSize || !ring->readRate)
+    return 0;
+
+  const size_t   frameSize = ring->readFrameSize;
+  const uint64_t head      = atomic_load_explicit(&ring->head,
+      memory_order_acquire);
+  size_t         avail     = (head - tail) / frameSize;
+  const size_t   target    = ring->readTarget > frames ?
+    ring->readTarget : frames;
+
+  // hold off after a start or an underrun until the target is buffered
+  if (ring->prebuffer)
+  {
+    if (avail < target)
+    {
+      atomic_store_explicit(&ring->tail, tail, memory_order_release);
+      memset(data, 0, frames * frameSize);
+      return 0;
+    }
+    ring->prebuffer = false;
+    ring->avgFill   = avail;
+  }
+
+  // far too much buffered (the device stalled), skip straight to the target
+  if (avail > target * 2 + frames)
+  {
+    tail += (uint64_t)(avail - target) * frameSize;
+    avail = target;
+  }
+
+  if (time && !timeAt(ring, tail, time))
+    *time = 0;
+
+  if (avail < frames)
+  {
+    readBytes(ring, tail, data, avail * frameSize);
+    memset((uint8_t *)data + avail * frameSize, 0,
+        (frames - avail) * frameSize);
+
+    atomic_store_explicit(&ring->tail, tail + avail * frameSize,
+        memory_order_release);
+    ring->prebuffer = true;
+    return avail;
+  }
+
+  /* correct drift between the server and the audio device clocks by
+   * consuming up to 0.5% more or fewer frames than were asked for once the
+   * average strays from the target by more than a millisecond */
+  ring->avgFill += ((float)avail - ring->avgFill) / 32.0f;
+
+  const float  slack = ring->readRate / 1000.0f;
+  const size_t step  = frames / 200 + 1;
+  size_t consume = frames;
+  if (ring->avgFill > target + slack)
+    consume = frames + step < avail ? frames + step : avail;
+  else if (ring->avgFill + slack < target && frames > step)
+    consume = frames - step;
+
+  if (consume == frames)
+    readBytes(ring, tail, data, frames * frameSize);
+  else
+  {
+    // nearest neighbour resample, the error is inaudible at these ratios
+    uint8_t * dst = data;
+    for(size_t i = 0; i < frames; ++i, dst += frameSize)
+      readBytes(ring, tail + (uint64_t)(i * consume / frames) * frameSize,
+          dst, frameSize);
+  }
+
+  atomic_store_explicit(&ring->tail, tail + consume * frameSize,
+      memory_order_release);
+  return frames;
+}
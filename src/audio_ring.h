@@ -0,0 +1,50 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_AUDIO_RING_
+#define _H_SPICE_AUDIO_RING_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a single producer, single consumer ring of S16 audio. The IO thread writes
+ * whole packets along with their server timestamps and the audio device
+ * thread reads from it, adjusting how fast it consumes the samples to keep
+ * the amount buffered near the target latency */
+
+struct AudioRing;
+
+struct AudioRing * audioRing_new(size_t size);
+void audioRing_free(struct AudioRing * ring);
+
+// producer: begins a new stream, anything still buffered is discarded
+void audioRing_start(struct AudioRing * ring, int channels, int rate,
+    unsigned int targetLatency);
+
+// producer: returns false if the packet was dropped as the ring is full
+bool audioRing_write(struct AudioRing * ring, const void * data, size_t size,
+    uint32_t time);
+
+// consumer: fills `frames` padding with silence, returns how many of them
+// are audio. The buffer is untouched if no stream has been started
+size_t audioRing_read(struct AudioRing * ring, void * data, size_t frames,
+    uint32_t * time);
+
+#endif
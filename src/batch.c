@@ -0,0 +1,360 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "batch.h"
+#include "ps.h"
+#include "log.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+typedef struct BatchSurface
+{
+  unsigned int surfaceId;
+  unsigned int count;
+  PSRect       rects[PS_DAMAGE_RECTS_MAX];
+}
+BatchSurface;
+
+typedef struct PSBatch
+{
+  PSDrawOp        * ops;
+  unsigned int      numOps, maxOps;
+
+  // bitmap data is stored here, ops hold offsets until the flush as the buffer
+  // may move when it grows
+  uint8_t         * data;
+  size_t            dataUsed, dataSize;
+
+  BatchSurface    * surfaces;
+  PSSurfaceDamage * damage;
+  unsigned int      numSurfaces, maxSurfaces;
+
+  // the consecutive fills gathered for drawFills
+  PSFill          * fills;
+  unsigned int      numFills, maxFills;
+}
+PSBatch;
+
+static inline int64_t rectArea(const PSRect * r)
+{
+  return (int64_t)r->width * r->height;
+}
+
+static inline bool rectsTouch(const PSRect * a, const PSRect * b)
+{
+  return
+    a->x <= b->x + b->width  && b->x <= a->x + a->width &&
+    a->y <= b->y + b->height && b->y <= a->y + a->height;
+}
+
+static inline PSRect rectUnion(const PSRect * a, const PSRect * b)
+{
+  const int x1 = a->x < b->x ? a->x : b->x;
+  const int y1 = a->y < b->y ? a->y : b->y;
+  const int ax = a->x + a->width , bx = b->x + b->width;
+  const int ay = a->y + a->height, by = b->y + b->height;
+
+  return (PSRect)
+  {
+    .x      = x1,
+    .y      = y1,
+    .width  = (ax > bx ? ax : bx) - x1,
+    .height = (ay > by ? ay : by) - y1
+  };
+}
+
+static BatchSurface * getSurface(PSBatch * b, unsigned int surfaceId)
+{
+  for(unsigned int i = 0; i < b->numSurfaces; ++i)
+    if (b->surfaces[i].surfaceId == surfaceId)
+      return &b->surfaces[i];
+
+  if (b->numSurfaces == b->maxSurfaces)
+  {
+    const unsigned int max = b->maxSurfaces ? b->maxSurfaces * 2 : 4;
+    BatchSurface * surfaces = realloc(b->surfaces,
+        max * sizeof(*surfaces));
+    if (!surfaces)
+      return NULL;
+    b->surfaces = surfaces;
+
+    PSSurfaceDamage * damage = realloc(b->damage, max * sizeof(*damage));
+    if (!damage)
+      return NULL;
+    b->damage = damage;
+
+    b->maxSurfaces = max;
+  }
+
+  BatchSurface * s = &b->surfaces[b->numSurfaces++];
+  s->surfaceId = surfaceId;
+  s->count     = 0;
+  return s;
+}
+
+// absorb every rect that overlaps or borders the new one, the union can then
+// touch others so keep going until nothing changes
+static void absorbTouching(BatchSurface * s, PSRect * rect)
+{
+  for(unsigned int i = 0; i < s->count;)
+  {
+    if (!rectsTouch(rect, &s->rects[i]))
+    {
+      ++i;
+      continue;
+    }
+
+    *rect = rectUnion(rect, &s->rects[i]);
+    s->rects[i] = s->rects[--s->count];
+    i = 0;
+  }
+}
+
+static bool addDamage(PSBatch * b, unsigned int surfaceId, PSRect rect)
+{
+  if (rect.width <= 0 || rect.height <= 0)
+    return true;
+
+  BatchSurface * s = getSurface(b, surfaceId);
+  if (!s)
+    return false;
+
+  absorbTouching(s, &rect);
+
+  // out of space, merge with the rect that grows the least
+  while(s->count == PS_DAMAGE_RECTS_MAX)
+  {
+    unsigned int best     = 0;
+    int64_t      bestCost = INT64_MAX;
+    for(unsigned int i = 0; i < s->count; ++i)
+    {
+      const PSRect  u    = rectUnion(&rect, &s->rects[i]);
+      const int64_t cost = rectArea(&u) - rectArea(&s->rects[i]);
+      if (cost < bestCost)
+      {
+        best     = i;
+        bestCost = cost;
+      }
+    }
+
+    rect = rectUnion(&rect, &s->rects[best]);
+    s->rects[best] = s->rects[--s->count];
+
+    // the grown rect may now cover others
+    absorbTouching(s, &rect);
+  }
+
+  s->rects[s->count++] = rect;
+  return true;
+}
+
+bool batch_create(PS * ps)
+{
+  ps->batch = calloc(1, sizeof(*ps->batch));
+  if (!ps->batch)
+  {
+    PS_LOG_ERROR("Failed to allocate the draw batch");
+    return false;
+  }
+
+  return true;
+}
+
+void batch_destroy(PS * ps)
+{
+  if (!ps->batch)
+    return;
+
+  batch_free(ps);
+  free(ps->batch);
+  ps->batch = NULL;
+}
+
+static PSDrawOp * addOp(PSBatch * b)
+{
+  if (b->numOps == b->maxOps)
+  {
+    const unsigned int max = b->maxOps ? b->maxOps * 2 : 64;
+    PSDrawOp * ops = realloc(b->ops, max * sizeof(*ops));
+    if (!ops)
+    {
+      PS_LOG_ERROR("Failed to grow the draw batch");
+      return NULL;
+    }
+
+    b->ops    = ops;
+    b->maxOps = max;
+  }
+
+  return &b->ops[b->numOps++];
+}
+
+bool batch_fill(PS * ps, unsigned int surfaceId, int x, int y, int width,
+    int height, uint32_t color)
+{
+  PSBatch * b = ps->batch;
+
+  const PSRect rect = { x, y, width, height };
+  if (!addDamage(b, surfaceId, rect))
+    return false;
+
+  PSDrawOp * op = addOp(b);
+  if (!op)
+    return false;
+
+  op->type      = PS_DRAW_OP_FILL;
+  op->surfaceId = surfaceId;
+  op->rect      = rect;
+  op->u.color   = color;
+  return true;
+}
+
+bool batch_bitmap(PS * ps, unsigned int surfaceId, PSBitmapFormat format,
+    bool topDown, int x, int y, int width, int height, int stride,
+    const void * data, size_t size)
+{
+  PSBatch * b = ps->batch;
+
+  if (b->dataSize - b->dataUsed < size)
+  {
+    size_t newSize = b->dataSize ? b->dataSize : 1024 * 1024;
+    while(newSize - b->dataUsed < size)
+      newSize *= 2;
+
+    uint8_t * buffer = realloc(b->data, newSize);
+    if (!buffer)
+    {
+      PS_LOG_ERROR("Failed to grow the draw batch data");
+      return false;
+    }
+
+    b->data     = buffer;
+    b->dataSize = newSize;
+  }
+
+  const PSRect rect = { x, y, width, height };
+  if (!addDamage(b, surfaceId, rect))
+    return false;
+
+  PSDrawOp * op = addOp(b);
+  if (!op)
+    return false;
+
+  op->type             = PS_DRAW_OP_BITMAP;
+  op->surfaceId        = surfaceId;
+  op->rect             = rect;
+  op->u.bitmap.format  = format;
+  op->u.bitmap.topDown = topDown;
+  op->u.bitmap.stride  = stride;
+  op->u.bitmap.data    = (const void *)(uintptr_t)b->dataUsed;
+
+  memcpy(b->data + b->dataUsed, data, size);
+  b->dataUsed += size;
+  return true;
+}
+
+bool batch_queueFill(PS * ps, unsigned int surfaceId, int x, int y,
+    int width, int height, uint32_t color)
+{
+  PSBatch * b = ps->batch;
+
+  if (b->numFills == b->maxFills)
+  {
+    const unsigned int max = b->maxFills ? b->maxFills * 2 : 64;
+    PSFill * fills = realloc(b->fills, max * sizeof(*fills));
+    if (!fills)
+    {
+      PS_LOG_ERROR("Failed to grow the fill queue");
+      return false;
+    }
+
+    b->fills    = fills;
+    b->maxFills = max;
+  }
+
+  b->fills[b->numFills++] = (PSFill)
+  {
+    .surfaceId = surfaceId,
+    .rect      = { x, y, width, height },
+    .color     = color
+  };
+  return true;
+}
+
+void batch_flushFills(PS * ps)
+{
+  PSBatch * b = ps->batch;
+
+  if (!b->numFills)
+    return;
+
+  stats_displayUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.drawFills(b->fills, b->numFills));
+
+  b->numFills = 0;
+}
+
+void batch_flush(PS * ps)
+{
+  PSBatch * b = ps->batch;
+
+  batch_flushFills(ps);
+  if (!b->numOps)
+    return;
+
+  for(unsigned int i = 0; i < b->numOps; ++i)
+  {
+    PSDrawOp * op = &b->ops[i];
+    if (op->type == PS_DRAW_OP_BITMAP)
+      op->u.bitmap.data = b->data + (uintptr_t)op->u.bitmap.data;
+  }
+
+  for(unsigned int i = 0; i < b->numSurfaces; ++i)
+    b->damage[i] = (PSSurfaceDamage)
+    {
+      .surfaceId = b->surfaces[i].surfaceId,
+      .count     = b->surfaces[i].count,
+      .rects     = b->surfaces[i].rects
+    };
+
+  stats_displayUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.frameComplete(b->ops, b->numOps,
+        b->damage, b->numSurfaces));
+
+  b->numOps      = 0;
+  b->dataUsed    = 0;
+  b->numSurfaces = 0;
+}
+
+void batch_free(PS * ps)
+{
+  PSBatch * b = ps->batch;
+
+  free(b->ops);
+  free(b->data);
+  free(b->surfaces);
+  free(b->damage);
+  free(b->fills);
+  memset(b, 0, sizeof(*b));
+}
@@ -0,0 +1,57 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_BATCH_
+#define _H_SPICE_BATCH_
+
+#include "purespice.h"
+#include "ps.h"
+
+#include <stdbool.h>
+
+/* allocates and frees the per session batch state */
+bool batch_create(PS * ps);
+void batch_destroy(PS * ps);
+
+/* collects draw operations for PSConfig.display.frameComplete, the size bytes
+ * of bitmap data from data are copied as the source buffers do not outlive
+ * the message */
+
+bool batch_fill(PS * ps, unsigned int surfaceId, int x, int y, int width,
+    int height, uint32_t color);
+
+bool batch_bitmap(PS * ps, unsigned int surfaceId, PSBitmapFormat format,
+    bool topDown, int x, int y, int width, int height, int stride,
+    const void * data, size_t size);
+
+/* collects consecutive fills for PSConfig.display.drawFills, they must be
+ * flushed before anything else is drawn */
+bool batch_queueFill(PS * ps, unsigned int surfaceId, int x, int y,
+    int width, int height, uint32_t color);
+
+void batch_flushFills(PS * ps);
+
+/* delivers everything collected so far, including any queued fills, does
+ * nothing if there is nothing */
+void batch_flush(PS * ps);
+
+/* discards anything pending and releases the buffers */
+void batch_free(PS * ps);
+
+#endif
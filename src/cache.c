@@ -0,0 +1,230 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "cache.h"
+
+#include <stdlib.h>
+
+typedef struct CacheEntry
+{
+  uint64_t            id;
+  void              * value;
+  size_t              cost;
+
+  struct CacheEntry * hashNext;
+  struct CacheEntry * lruPrev;
+  struct CacheEntry * lruNext;
+}
+CacheEntry;
+
+struct Cache
+{
+  CacheFreeFn   freeFn;
+  size_t        budget;
+  size_t        cost;
+
+  CacheEntry ** buckets;
+  size_t        mask;
+  size_t        count;
+
+  // head is the most recently used entry
+  CacheEntry  * lruHead;
+  CacheEntry  * lruTail;
+};
+
+#define CACHE_INITIAL_BUCKETS 256
+
+static inline size_t hashId(uint64_t id)
+{
+  // the ids are often sequential, mix them so they spread over the buckets
+  id ^= id >> 33;
+  id *= 0xff51afd7ed558ccdULL;
+  id ^= id >> 33;
+  return (size_t)id;
+}
+
+struct Cache * cache_new(size_t budget, CacheFreeFn freeFn)
+{
+  struct Cache * cache = calloc(1, sizeof(*cache));
+  if (!cache)
+    return NULL;
+
+  cache->buckets = calloc(CACHE_INITIAL_BUCKETS, sizeof(*cache->buckets));
+  if (!cache->buckets)
+  {
+    free(cache);
+    return NULL;
+  }
+
+  cache->freeFn = freeFn;
+  cache->budget = budget;
+  cache->mask   = CACHE_INITIAL_BUCKETS - 1;
+  return cache;
+}
+
+void cache_free(struct Cache * cache)
+{
+  if (!cache)
+    return;
+
+  cache_clear(cache);
+  free(cache->buckets);
+  free(cache);
+}
+
+static void lruUnlink(struct Cache * cache, CacheEntry * entry)
+{
+  if (entry->lruPrev)
+    entry->lruPrev->lruNext = entry->lruNext;
+  else
+    cache->lruHead = entry->lruNext;
+
+  if (entry->lruNext)
+    entry->lruNext->lruPrev = entry->lruPrev;
+  else
+    cache->lruTail = entry->lruPrev;
+
+  entry->lruPrev = NULL;
+  entry->lruNext = NULL;
+}
+
+static void lruPushHead(struct Cache * cache, CacheEntry * entry)
+{
+  entry->lruPrev = NULL;
+  entry->lruNext = cache->lruHead;
+
+  if (cache->lruHead)
+    cache->lruHead->lruPrev = entry;
+  else
+    cache->lruTail = entry;
+
+  cache->lruHead = entry;
+}
+
+static CacheEntry ** findSlot(struct Cache * cache, uint64_t id)
+{
+  CacheEntry ** slot = &cache->buckets[hashId(id) & cache->mask];
+  while(*slot && (*slot)->id != id)
+    slot = &(*slot)->hashNext;
+  return slot;
+}
+
+static void removeEntry(struct Cache * cache, CacheEntry ** slot)
+{
+  CacheEntry * entry = *slot;
+  *slot = entry->hashNext;
+
+  lruUnlink(cache, entry);
+  cache->cost -= entry->cost;
+  --cache->count;
+
+  if (cache->freeFn)
+    cache->freeFn(entry->value);
+  free(entry);
+}
+
+static void grow(struct Cache * cache)
+{
+  const size_t size = (cache->mask + 1) * 2;
+  CacheEntry ** buckets = calloc(size, sizeof(*buckets));
+
+  // without a larger table the chains just get longer, which is not fatal
+  if (!buckets)
+    return;
+
+  for(size_t i = 0; i <= cache->mask; ++i)
+    for(CacheEntry * entry = cache->buckets[i], * next; entry; entry = next)
+    {
+      next = entry->hashNext;
+      CacheEntry ** slot = &buckets[hashId(entry->id) & (size - 1)];
+      entry->hashNext = *slot;
+      *slot = entry;
+    }
+
+  free(cache->buckets);
+  cache->buckets = buckets;
+  cache->mask    = size - 1;
+}
+
+bool cache_insert(struct Cache * cache, uint64_t id, void * value,
+    size_t cost)
+{
+  CacheEntry ** slot = findSlot(cache, id);
+  if (*slot)
+    removeEntry(cache, slot);
+
+  CacheEntry * entry = malloc(sizeof(*entry));
+  if (!entry)
+  {
+    if (cache->freeFn)
+      cache->freeFn(value);
+    return false;
+  }
+
+  entry->id    = id;
+  entry->value = value;
+  entry->cost  = cost;
+
+  // evict from the tail until the new entry fits
+  while(cache->lruTail && cache->cost + cost > cache->budget)
+    removeEntry(cache, findSlot(cache, cache->lruTail->id));
+
+  if (cache->count >= (cache->mask + 1) - (cache->mask + 1) / 4)
+    grow(cache);
+
+  slot = &cache->buckets[hashId(id) & cache->mask];
+  entry->hashNext = *slot;
+  *slot = entry;
+
+  lruPushHead(cache, entry);
+  cache->cost += cost;
+  ++cache->count;
+  return true;
+}
+
+void * cache_get(struct Cache * cache, uint64_t id)
+{
+  CacheEntry * entry = *findSlot(cache, id);
+  if (!entry)
+    return NULL;
+
+  if (entry != cache->lruHead)
+  {
+    lruUnlink  (cache, entry);
+    lruPushHead(cache, entry);
+  }
+
+  return entry->value;
+}
+
+bool cache_remove(struct Cache * cache, uint64_t id)
+{
+  CacheEntry ** slot = findSlot(cache, id);
+  if (!*slot)
+    return false;
+
+  removeEntry(cache, slot);
+  return true;
+}
+
+void cache_clear(struct Cache * cache)
+{
+  while(cache->lruHead)
+    removeEntry(cache, findSlot(cache, cache->lruHead->id));
+}
@@ -0,0 +1,48 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_CACHE_
+#define _H_SPICE_CACHE_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a hash table keyed by the 64-bit ids the server assigns to cached
+ * resources. Entries are kept in least recently used order and the oldest
+ * are evicted once the total cost of all entries exceeds the budget */
+
+struct Cache;
+
+typedef void (*CacheFreeFn)(void * value);
+
+struct Cache * cache_new(size_t budget, CacheFreeFn freeFn);
+void cache_free(struct Cache * cache);
+
+// inserts or replaces the value for `id`, takes ownership of `value`
+bool cache_insert(struct Cache * cache, uint64_t id, void * value,
+    size_t cost);
+
+// returns the value for `id` and marks it as the most recently used
+void * cache_get(struct Cache * cache, uint64_t id);
+
+bool cache_remove(struct Cache * cache, uint64_t id);
+void cache_clear(struct Cache * cache);
+
+#endif
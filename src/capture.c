@@ -0,0 +1,123 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "capture.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+struct PSCapture
+{
+  FILE   * file;
+  uint64_t startUS;
+  bool     failed;
+};
+
+static uint64_t nowUS(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+bool capture_init(PS * ps)
+{
+  if (!ps->config.capture)
+    return true;
+
+  struct PSCapture * cap = calloc(1, sizeof(*cap));
+  if (!cap)
+  {
+    PS_LOG_ERROR("Failed to allocate the capture");
+    return false;
+  }
+
+  cap->file = fopen(ps->config.capture, "wb");
+  if (!cap->file)
+  {
+    PS_LOG_ERROR("Failed to open the capture file %s: %d",
+        ps->config.capture, errno);
+    free(cap);
+    return false;
+  }
+
+  const PSCaptureHeader header =
+  {
+    .magic   = PS_CAPTURE_MAGIC,
+    .version = PS_CAPTURE_VERSION
+  };
+
+  if (fwrite(&header, sizeof(header), 1, cap->file) != 1)
+  {
+    PS_LOG_ERROR("Failed to write the capture header");
+    fclose(cap->file);
+    free(cap);
+    return false;
+  }
+
+  cap->startUS = nowUS();
+  ps->capture  = cap;
+  PS_LOG_INFO("Capturing to %s", ps->config.capture);
+  return true;
+}
+
+void capture_deinit(PS * ps)
+{
+  struct PSCapture * cap = ps->capture;
+  if (!cap)
+    return;
+
+  ps->capture = NULL;
+  if (fclose(cap->file) != 0 && !cap->failed)
+    PS_LOG_ERROR("Failed to close the capture file: %d", errno);
+
+  free(cap);
+}
+
+/* the loop and the IO thread both record, the stream lock keeps each record
+ * in one piece. A failed write stops the capture rather than the session */
+void capture_write(PSChannel * channel, PSCaptureType type,
+    const void * data, size_t size)
+{
+  struct PSCapture * cap = channel->ps->capture;
+
+  const PSCaptureRecord record =
+  {
+    .timeUS  = nowUS() - cap->startUS,
+    .size    = size,
+    .type    = type,
+    .channel = channel->spiceType
+  };
+
+  flockfile(cap->file);
+  if (!cap->failed)
+  {
+    if (fwrite(&record, sizeof(record), 1, cap->file) != 1 ||
+        (size && fwrite(data, size, 1, cap->file) != 1))
+    {
+      PS_LOG_ERROR("Failed to write to the capture file, capture stopped");
+      cap->failed = true;
+    }
+  }
+  funlockfile(cap->file);
+}
@@ -0,0 +1,85 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_CAPTURE_
+#define _H_SPICE_CAPTURE_
+
+#include "ps.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* a capture file is a PSCaptureHeader followed by a record for every receive
+ * of every channel, in the order they arrived and in host byte order. Each
+ * connection of a channel starts with a CONNECT record that has no data, the
+ * DATA records after it are the bytes read from that connection, starting
+ * with the link reply, so the n-th connection of a channel type can be fed
+ * back as it was recorded */
+#define PS_CAPTURE_MAGIC   0x50435350 // "PSCP"
+#define PS_CAPTURE_VERSION 1
+
+typedef struct PSCaptureHeader
+{
+  uint32_t magic;
+  uint32_t version;
+}
+PSCaptureHeader;
+
+typedef enum
+{
+  PS_CAPTURE_CONNECT,
+  PS_CAPTURE_DATA
+}
+PSCaptureType;
+
+typedef struct PSCaptureRecord
+{
+  // since the session connected
+  uint64_t timeUS;
+  uint32_t size;
+  uint8_t  type;
+
+  // the SpiceChannel type of the channel
+  uint8_t  channel;
+  uint16_t reserved;
+}
+PSCaptureRecord;
+
+// opens PSConfig.capture if it is set
+bool capture_init  (PS * ps);
+void capture_deinit(PS * ps);
+
+void capture_write(PSChannel * channel, PSCaptureType type,
+    const void * data, size_t size);
+
+static inline void capture_connect(PSChannel * channel)
+{
+  if (channel->ps->capture)
+    capture_write(channel, PS_CAPTURE_CONNECT, NULL, 0);
+}
+
+static inline void capture_data(PSChannel * channel, const void * data,
+    size_t size)
+{
+  if (channel->ps->capture)
+    capture_write(channel, PS_CAPTURE_DATA, data, size);
+}
+
+#endif
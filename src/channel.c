@@ -24,17 +24,25 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "messages.h"
 #include "rsa.h"
 #include "queue.h"
+#include "scratch.h"
+#include "uring.h"
+#include "reconnect.h"
+#include "stats.h"
+#include "capture.h"
 
 #include <alloca.h>
 #include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <errno.h>
 
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 
-static uint64_t get_timestamp(void)
+uint64_t get_timestamp(void)
 {
   struct timespec time;
   const int result = clock_gettime(CLOCK_MONOTONIC, &time);
@@ -43,33 +51,37 @@ static uint64_t get_timestamp(void)
   return (uint64_t)time.tv_sec * 1000LL + time.tv_nsec / 1000000LL;
 }
 
+// channels receiving through io_uring are only in the epoll set to flush
+static inline uint32_t rxEvents(const PSChannel * channel)
+{
+  return channel->uringSlot < 0 ? EPOLLIN : 0;
+}
+
 PS_STATUS channel_connect(PSChannel * channel)
 {
-  PS_STATUS status;
+  PS * ps = channel->ps;
 
   channel->doDisconnect = false;
   channel->initDone     = false;
   channel->ackFrequency = 0;
   channel->ackCount     = 0;
-
-  if (channel->spiceType == SPICE_CHANNEL_INPUTS)
-    SPICE_LOCK_INIT(g_ps.mouse.lock);
+  channel->txDeferred   = false;
 
   SPICE_LOCK_INIT(channel->lock);
 
   size_t addrSize;
-  switch(g_ps.family)
+  switch(ps->family)
   {
     case AF_UNIX:
-      addrSize = sizeof(g_ps.addr.un);
+      addrSize = sizeof(ps->addr.un);
       break;
 
     case AF_INET:
-      addrSize = sizeof(g_ps.addr.in);
+      addrSize = sizeof(ps->addr.in);
       break;
 
     case AF_INET6:
-      addrSize = sizeof(g_ps.addr.in6);
+      addrSize = sizeof(ps->addr.in6);
       break;
 
     default:
@@ -77,14 +89,18 @@ PS_STATUS channel_connect(PSChannel * channel)
       return PS_STATUS_ERROR;
   }
 
-  channel->socket = socket(g_ps.family, SOCK_STREAM, 0);
+  // the socket of the previous connection is only shut down by a disconnect
+  if (channel->socket >= 0)
+    close(channel->socket);
+
+  channel->socket = socket(ps->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
   if (channel->socket == -1)
   {
     PS_LOG_ERROR("Socket creation failed");
     return PS_STATUS_ERROR;
   }
 
-  if (g_ps.family != AF_UNIX)
+  if (ps->family != AF_UNIX)
   {
     const int flag = 1;
     (void)setsockopt(channel->socket, IPPROTO_TCP,
@@ -93,137 +109,403 @@ PS_STATUS channel_connect(PSChannel * channel)
         TCP_QUICKACK, &flag, sizeof(int));
   }
 
-  if (connect(channel->socket, &g_ps.addr.addr, addrSize) == -1)
+  if (connect(channel->socket, &ps->addr.addr, addrSize) == -1 &&
+      errno != EINPROGRESS)
   {
     close(channel->socket);
+    channel->socket = -1;
     PS_LOG_ERROR("Socket connect failed");
     return PS_STATUS_ERROR;
   }
 
-  channel->connected = true;
-
-  const SpiceLinkHeader * p = channel->getConnectPacket();
-  if ((size_t)channel_writeNL(channel, p, p->size + sizeof(*p)) != p->size + sizeof(*p))
+  /* the link is always run by the session's loop, even for channels that are
+   * processed by the IO thread once they are linked */
+  struct epoll_event ev =
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Failed to write the connect packet");
-    return PS_STATUS_ERROR;
-  }
+    .events   = EPOLLOUT,
+    .data.ptr = &channel->poll
+  };
+  epoll_ctl(ps->epollfd, EPOLL_CTL_ADD, channel->socket, &ev);
 
-  SpiceLinkHeader header;
-  if ((status = channel_readNL(channel, &header, sizeof(header),
-          NULL)) != PS_STATUS_OK)
+  capture_connect(channel);
+  channel->link = PS_LINK_CONNECT;
+  return PS_STATUS_OK;
+}
+
+static void setLinkState(PSChannel * channel, PSLinkState state,
+    unsigned int size)
+{
+  channel->link     = state;
+  channel->linkSize = size;
+  channel->linkRead = 0;
+}
+
+/* the link messages are tiny and the socket is fresh, so a short write is
+ * treated as a failure rather than queued. Returns PS_STATUS_NODATA if the
+ * connection was lost */
+static PS_STATUS linkWrite(PSChannel * channel, const struct iovec * iov,
+    int count)
+{
+  size_t size = 0;
+  for(int i = 0; i < count; ++i)
+    size += iov[i].iov_len;
+
+  struct msghdr msg =
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Failed to read the reply to the connect packet");
-    return status;
-  }
+    .msg_iov    = (struct iovec *)iov,
+    .msg_iovlen = count
+  };
 
-  if (header.magic         != SPICE_MAGIC ||
-      header.major_version != SPICE_VERSION_MAJOR)
+  ssize_t wrote;
+  do
+    wrote = sendmsg(channel->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  while(wrote < 0 && errno == EINTR);
+
+  if (wrote < 0 || (size_t)wrote != size)
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Invalid spice magic and or version");
-    return PS_STATUS_ERROR;
+    const int error = wrote < 0 ? errno : 0;
+    PS_LOG_ERROR("%s: Failed to write the link data: %d", channel->name,
+        error);
+    return reconnect_isTransient(error) ? PS_STATUS_NODATA : PS_STATUS_ERROR;
   }
 
-  if (header.size < sizeof(SpiceLinkReply))
+  return PS_STATUS_OK;
+}
+
+// returns PS_STATUS_HANDLED until all of the current link message has arrived
+static PS_STATUS linkRead(PSChannel * channel)
+{
+  while(channel->linkRead < channel->linkSize)
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("First message < sizeof(SpiceLinkReply)");
-    return PS_STATUS_ERROR;
+    const ssize_t len = recv(channel->socket,
+        channel->linkBuffer + channel->linkRead,
+        channel->linkSize   - channel->linkRead, MSG_DONTWAIT);
+
+    if (len == 0)
+    {
+      PS_LOG_ERROR("%s: The server closed the connection", channel->name);
+      return PS_STATUS_NODATA;
+    }
+
+    if (len < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return PS_STATUS_HANDLED;
+
+      PS_LOG_ERROR("%s: Failed to read from the socket: %d",
+          channel->name, errno);
+      return reconnect_isTransient(errno) ?
+        PS_STATUS_NODATA : PS_STATUS_ERROR;
+    }
+
+    capture_data(channel, channel->linkBuffer + channel->linkRead, len);
+    channel->linkRead += len;
   }
 
-  // in practice I have not seen this exceed 186, but it might depending on
-  // future protocol changes, so put a reaonable upper bound on it
-  if (header.size > 200)
+  return PS_STATUS_OK;
+}
+
+/* every channel is sent the same ticket, so the password only has to be
+ * encrypted once for each public key the server presents. spice-server makes
+ * a new key pair for every link, so this only saves anything with servers
+ * that keep a fixed key */
+static const PSPassword * getTicket(PS * ps, const uint8_t * pubKey)
+{
+  if (ps->ticket.valid &&
+      memcmp(ps->ticket.pubKey, pubKey, sizeof(ps->ticket.pubKey)) == 0)
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("SpiceLinkReply header size seems too large");
-    return PS_STATUS_ERROR;
+    ps->ticket.keyReused = true;
+    return &ps->ticket.pass;
   }
 
-  SpiceLinkReply * reply = alloca(header.size);
-  if ((status = channel_readNL(channel, reply, header.size,
-          NULL)) != PS_STATUS_OK)
-  {
-    channel_internal_disconnect(channel);
+  channel_freeTicket(ps);
+  memcpy(ps->ticket.pubKey, pubKey, sizeof(ps->ticket.pubKey));
+  if (!rsa_encryptPassword(ps->ticket.pubKey, ps->config.password,
+        &ps->ticket.pass))
+    return NULL;
+
+  ps->ticket.valid = true;
+  return &ps->ticket.pass;
+}
+
+void channel_freeTicket(PS * ps)
+{
+  if (!ps->ticket.valid)
+    return;
+
+  rsa_freePassword(&ps->ticket.pass);
+  ps->ticket.valid     = false;
+  ps->ticket.keyReused = false;
+}
+
+/* the server already has the ticket that was sent ahead, so the link is
+ * started over on a new connection that waits for the reply. This does not
+ * depend on reconnect.automatic, it is part of the same link */
+static PS_STATUS relink(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  channel_freeTicket(ps);
+
+  PS_LOG_INFO("%s: Linking again without sending the ticket ahead",
+      channel->name);
+
+  epoll_ctl(ps->epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+
+  PS_STATUS status;
+  if ((status = channel_connect(channel)) != PS_STATUS_OK)
     return status;
-  }
+
+  return PS_STATUS_HANDLED;
+}
+
+// sends the auth mechanism followed by the ticket
+static PS_STATUS sendTicket(PSChannel * channel, const PSPassword * pass)
+{
+  SpiceLinkAuthMechanism auth;
+  auth.auth_mechanism = SPICE_COMMON_CAP_AUTH_SPICE;
+
+  const struct iovec iov[] =
+  {
+    { .iov_base = &auth     , .iov_len = sizeof(auth) },
+    { .iov_base = pass->data, .iov_len = pass->size   }
+  };
+
+  PS_STATUS status;
+  if ((status = linkWrite(channel, iov, 2)) != PS_STATUS_OK)
+    PS_LOG_ERROR("Failed to write the encrypted password");
+
+  return status;
+}
+
+static PS_STATUS onLinkReply(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceLinkReply * reply = (SpiceLinkReply *)channel->linkBuffer;
 
   if (reply->error != SPICE_LINK_ERR_OK)
   {
-    channel_internal_disconnect(channel);
     PS_LOG_ERROR("Server reported link error: %d", reply->error);
     return PS_STATUS_ERROR;
   }
 
+  /* the ticket sent ahead is only any good if the server still has the key
+   * it was encrypted with */
+  if (channel->linkPipelined &&
+      memcmp(ps->ticket.pubKey, reply->pub_key, sizeof(ps->ticket.pubKey)))
+  {
+    PS_LOG_WARN("%s: The server's public key has changed", channel->name);
+    return relink(channel);
+  }
+
   const uint32_t * capsCommon =
     (uint32_t *)((uint8_t *)reply + reply->caps_offset);
   const uint32_t * capsChannel =
     capsCommon + reply->num_common_caps;
 
   if (channel->setCaps)
-    channel->setCaps(
+    channel->setCaps(ps,
       capsCommon , reply->num_common_caps,
       capsChannel, reply->num_channel_caps);
 
-  SpiceLinkAuthMechanism auth;
-  auth.auth_mechanism = SPICE_COMMON_CAP_AUTH_SPICE;
-  if (channel_writeNL(channel, &auth, sizeof(auth)) != sizeof(auth))
-  {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Failed to write the auth mechanisim packet");
-    return PS_STATUS_ERROR;
-  }
+  if (channel->linkPipelined)
+    return PS_STATUS_OK;
 
-  PSPassword pass;
-  if (!rsa_encryptPassword(reply->pub_key, g_ps.config.password, &pass))
+  const PSPassword * pass = getTicket(ps, reply->pub_key);
+  if (!pass)
   {
-    channel_internal_disconnect(channel);
     PS_LOG_ERROR("Failed to encrypt the password");
     return PS_STATUS_ERROR;
   }
 
-  if (channel_writeNL(channel, pass.data, pass.size) != pass.size)
+  return sendTicket(channel, pass);
+}
+
+PS_STATUS channel_link(PSChannel * channel)
+{
+  PS_STATUS status;
+  switch(channel->link)
   {
-    rsa_freePassword(&pass);
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Failed to write the encrypted password");
-    return PS_STATUS_ERROR;
-  }
+    case PS_LINK_NONE:
+      PS_LOG_ERROR("BUG: the channel is not linking");
+      return PS_STATUS_ERROR;
 
-  rsa_freePassword(&pass);
+    case PS_LINK_CONNECT:
+    {
+      int       error = 0;
+      socklen_t size  = sizeof(error);
+      if (getsockopt(channel->socket, SOL_SOCKET, SO_ERROR, &error,
+            &size) < 0 || error)
+      {
+        PS_LOG_ERROR("Socket connect failed: %d", error);
+        return reconnect_isTransient(error) ?
+          PS_STATUS_NODATA : PS_STATUS_ERROR;
+      }
+
+      const SpiceLinkHeader * p = channel->getConnectPacket(channel->ps);
+      const struct iovec iov =
+      {
+        .iov_base = (void *)p,
+        .iov_len  = p->size + sizeof(*p)
+      };
+
+      if ((status = linkWrite(channel, &iov, 1)) != PS_STATUS_OK)
+      {
+        PS_LOG_ERROR("Failed to write the connect packet");
+        return status;
+      }
+
+      /* the server reads the ticket once it has replied, so if it has shown
+       * that it keeps its key the cached one is sent right away to save
+       * waiting on the reply first */
+      PS * ps = channel->ps;
+      channel->linkPipelined = ps->ticket.valid && ps->ticket.keyReused;
+      if (channel->linkPipelined &&
+          (status = sendTicket(channel, &ps->ticket.pass)) != PS_STATUS_OK)
+        return status;
+
+      struct epoll_event ev =
+      {
+        .events   = EPOLLIN,
+        .data.ptr = &channel->poll
+      };
+      epoll_ctl(channel->ps->epollfd, EPOLL_CTL_MOD, channel->socket, &ev);
+
+      setLinkState(channel, PS_LINK_HEADER, sizeof(SpiceLinkHeader));
+      return PS_STATUS_HANDLED;
+    }
 
-  uint32_t linkResult;
-  if ((status = channel_readNL(channel, &linkResult, sizeof(linkResult),
-          NULL)) != PS_STATUS_OK)
-  {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Failed to read the authentication response");
-    return status;
+    case PS_LINK_HEADER:
+    {
+      if ((status = linkRead(channel)) != PS_STATUS_OK)
+        return status;
+
+      SpiceLinkHeader header;
+      memcpy(&header, channel->linkBuffer, sizeof(header));
+
+      if (header.magic         != SPICE_MAGIC ||
+          header.major_version != SPICE_VERSION_MAJOR)
+      {
+        PS_LOG_ERROR("Invalid spice magic and or version");
+        return PS_STATUS_ERROR;
+      }
+
+      if (header.size < sizeof(SpiceLinkReply))
+      {
+        PS_LOG_ERROR("First message < sizeof(SpiceLinkReply)");
+        return PS_STATUS_ERROR;
+      }
+
+      // in practice I have not seen this exceed 186, but it might depending on
+      // future protocol changes, so put a reaonable upper bound on it
+      if (header.size > PS_LINK_REPLY_MAX)
+      {
+        PS_LOG_ERROR("SpiceLinkReply header size seems too large");
+        return PS_STATUS_ERROR;
+      }
+
+      // the reply usually arrives with the header
+      setLinkState(channel, PS_LINK_REPLY, header.size);
+    }
+    // fall through
+
+    case PS_LINK_REPLY:
+      if ((status = linkRead(channel)) != PS_STATUS_OK)
+        return status;
+
+      if ((status = onLinkReply(channel)) != PS_STATUS_OK)
+        return status;
+
+      setLinkState(channel, PS_LINK_RESULT, sizeof(uint32_t));
+      return PS_STATUS_HANDLED;
+
+    case PS_LINK_RESULT:
+    {
+      if ((status = linkRead(channel)) != PS_STATUS_OK)
+        return status;
+
+      uint32_t linkResult;
+      memcpy(&linkResult, channel->linkBuffer, sizeof(linkResult));
+      if (linkResult != SPICE_LINK_ERR_OK)
+      {
+        PS_LOG_ERROR("Server reported link error: %u", linkResult);
+
+        // a ticket sent ahead that was refused gets one more try without it
+        if (channel->linkPipelined &&
+            linkResult == SPICE_LINK_ERR_PERMISSION_DENIED)
+          return relink(channel);
+
+        return PS_STATUS_ERROR;
+      }
+
+      setLinkState(channel, PS_LINK_NONE, 0);
+      return PS_STATUS_OK;
+    }
   }
 
-  if (linkResult != SPICE_LINK_ERR_OK)
+  __builtin_unreachable();
+}
+
+PS_STATUS channel_linked(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+
+  channel->rxRing = scratch_getPrivate(PS_RX_RING_SIZE);
+  if (!channel->rxRing)
   {
-    channel_internal_disconnect(channel);
-    PS_LOG_ERROR("Server reported link error: %u", linkResult);
+    PS_LOG_ERROR("Failed to allocate the receive ring");
     return PS_STATUS_ERROR;
   }
 
+  channel->rxStart      = 0;
+  channel->rxEnd        = 0;
+  channel->headerRead   = false;
+  channel->discardSize  = 0;
+  channel->largePending = false;
+
+  // the channels polled by the loop receive through its io_uring if it has
+  // one, falling back to epoll if the receive can't be started
+  channel->uringSlot = -1;
+  if (ps->uring && channel->epollfd == ps->epollfd && !channel->passFds)
+    uring_arm(ps->uring, channel);
+
   struct epoll_event ev =
   {
-    .events   = EPOLLIN,
-    .data.ptr = channel
+    .events   = rxEvents(channel),
+    .data.ptr = &channel->poll
   };
-  epoll_ctl(g_ps.epollfd, EPOLL_CTL_ADD, channel->socket, &ev);
 
-  channel->ready = true;
+  // hand the channel over to the IO thread if it runs there
+  if (channel->epollfd != ps->epollfd)
+  {
+    epoll_ctl(ps->epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+    epoll_ctl(channel->epollfd, EPOLL_CTL_ADD, channel->socket, &ev);
+  }
+  else
+    epoll_ctl(channel->epollfd, EPOLL_CTL_MOD, channel->socket, &ev);
+
+  channel->connected = true;
+  channel->ready     = true;
   return PS_STATUS_OK;
 }
 
 void channel_internal_disconnect(PSChannel * channel)
 {
+  PS * ps = channel->ps;
+
+  // a channel that has not finished linking only has its socket to drop
+  if (channel->link != PS_LINK_NONE)
+  {
+    epoll_ctl(ps->epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+    close(channel->socket);
+    channel->socket = -1;
+    channel->link   = PS_LINK_NONE;
+    PS_LOG_INFO("%s channel link aborted", channel->name);
+    return;
+  }
+
   if (!channel->connected)
     return;
 
@@ -233,7 +515,7 @@ void channel_internal_disconnect(PSChannel * channel)
 
     /* disable nodelay so we can trigger a flush after this message */
     int flag;
-    if (g_ps.family != AF_UNIX)
+    if (ps->family != AF_UNIX)
     {
       flag = 0;
       (void)setsockopt(channel->socket, IPPROTO_TCP,
@@ -244,10 +526,12 @@ void channel_internal_disconnect(PSChannel * channel)
         SpiceMsgcDisconnecting, 0);
     packet->time_stamp = get_timestamp();
     packet->reason     = SPICE_LINK_ERR_OK;
+
+    // this is a best effort, anything still pending in the queue is dropped
     SPICE_SEND_PACKET(channel, packet);
 
     /* re-enable nodelay as this triggers a flush according to the man page */
-    if (g_ps.family != AF_UNIX)
+    if (ps->family != AF_UNIX)
     {
       flag = 1;
       (void)setsockopt(channel->socket, IPPROTO_TCP,
@@ -255,14 +539,38 @@ void channel_internal_disconnect(PSChannel * channel)
     }
   }
 
-  epoll_ctl(g_ps.epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+  epoll_ctl(channel->epollfd, EPOLL_CTL_DEL, channel->socket, NULL);
+  uring_disarm(ps->uring, channel);
   shutdown(channel->socket, SHUT_WR);
 
-  channel->bufferRead = 0;
-  channel->headerRead = 0;
-  channel->bufferSize = 0;
-  free(channel->buffer);
-  channel->buffer = NULL;
+  channel->headerRead   = false;
+  channel->discardSize  = 0;
+  channel->buffer       = NULL;
+  channel->rxStart      = 0;
+  channel->rxEnd        = 0;
+  scratch_put(channel->rxRing);
+  channel->rxRing       = NULL;
+  channel->largePending = false;
+  channel->largeSize    = 0;
+  channel->largeHigh    = 0;
+  channel->largeIdle    = 0;
+  scratch_put(channel->largeBuffer);
+  channel->largeBuffer  = NULL;
+  if (channel->rxFd >= 0)
+  {
+    close(channel->rxFd);
+    channel->rxFd = -1;
+  }
+
+  SPICE_LOCK(channel->lock);
+  free(channel->txBuffer);
+  channel->txBuffer     = NULL;
+  channel->txSize       = 0;
+  channel->txStart      = 0;
+  channel->txEnd        = 0;
+  channel->txWaiting    = false;
+  SPICE_UNLOCK(channel->lock);
+  channel->txDeferred   = false;
   channel->connected = false;
   channel->doDisconnect = false;
 
@@ -300,15 +608,31 @@ static PS_STATUS onMessage_ping(PSChannel * channel)
 
   out->id        = msg->id;
   out->timestamp = msg->timestamp;
-  if (!SPICE_SEND_PACKET(channel, out))
+  if (!SPICE_QUEUE_PACKET(channel, out))
   {
     PS_LOG_ERROR("Failed to send SpiceMsgcPong");
     return PS_STATUS_ERROR;
   }
 
+  stats_add(&channel->stats->pings, 1);
   return PS_STATUS_OK;
 }
 
+bool channel_getRTT(PSChannel * channel, uint32_t * rttUS, uint32_t * rttVarUS)
+{
+  /* the ping's timestamp is in the server's clock and units, so use the
+   * kernel's own estimate of the round trip instead */
+  struct tcp_info info;
+  socklen_t       size = sizeof(info);
+  if (!channel->connected || channel->ps->family == AF_UNIX ||
+      getsockopt(channel->socket, IPPROTO_TCP, TCP_INFO, &info, &size) != 0)
+    return false;
+
+  *rttUS    = info.tcpi_rtt;
+  *rttVarUS = info.tcpi_rttvar;
+  return true;
+}
+
 static PS_STATUS onMessage_disconnecting(PSChannel * channel)
 {
   shutdown(channel->socket, SHUT_WR);
@@ -363,89 +687,305 @@ bool channel_ack(PSChannel * channel)
 
   char * ack = SPICE_PACKET(SPICE_MSGC_ACK, char, 0);
   *ack = 0;
-  if (!SPICE_SEND_PACKET(channel, ack))
+  if (!SPICE_QUEUE_PACKET(channel, ack))
   {
-    PS_LOG_ERROR("Failed to write ack packet");
+    PS_LOG_ERROR("Failed to queue ack packet");
     return false;
   }
 
+  stats_add(&channel->stats->acks, 1);
   return true;
 }
 
-ssize_t channel_writeNL(const PSChannel * channel,
-    const void * buffer, size_t size)
+ssize_t channel_recv(PSChannel * channel, void * data, size_t size)
 {
-  if (!channel->connected)
-    return -1;
+  if (!channel->passFds)
+    return recv(channel->socket, data, size, MSG_DONTWAIT);
 
-  if (!buffer)
-    return -1;
+  union
+  {
+    struct cmsghdr header;
+    uint8_t        buffer[CMSG_SPACE(sizeof(int))];
+  }
+  control;
+
+  struct iovec iov =
+  {
+    .iov_base = data,
+    .iov_len  = size
+  };
 
-  return send(channel->socket, buffer, size, 0);
+  struct msghdr msg =
+  {
+    .msg_iov        = &iov,
+    .msg_iovlen     = 1,
+    .msg_control    = control.buffer,
+    .msg_controllen = sizeof(control.buffer)
+  };
+
+  /* the kernel ends the read at the byte that carries an fd so there is
+   * never more than one per call */
+  const ssize_t len = recvmsg(channel->socket, &msg,
+      MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  if (len <= 0)
+    return len;
+
+  if (msg.msg_flags & MSG_CTRUNC)
+    PS_LOG_WARN("%s: The server passed more fds than expected",
+        channel->name);
+
+  for(struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+      cmsg = CMSG_NXTHDR(&msg, cmsg))
+  {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+    if (channel->rxFd >= 0)
+    {
+      PS_LOG_WARN("%s: Dropping an fd that was not used", channel->name);
+      close(channel->rxFd);
+    }
+    channel->rxFd = fd;
+  }
+
+  return len;
 }
 
-PS_STATUS channel_readNL(PSChannel * channel, void * buffer,
-    size_t size, int * dataAvailable)
+bool channel_reserveNL(PSChannel * channel, size_t size)
 {
   if (!channel->connected)
+    return false;
+
+  if (channel->txEnd + size > channel->txSize)
   {
-    PS_LOG_ERROR("BUG: attempted to read from a closed channel");
-    return PS_STATUS_ERROR;
+    // reclaim the space used by data that has already been sent
+    if (channel->txStart)
+    {
+      channel->txEnd -= channel->txStart;
+      memmove(channel->txBuffer, channel->txBuffer + channel->txStart,
+          channel->txEnd);
+      channel->txStart = 0;
+    }
+
+    if (channel->txEnd + size > channel->txSize)
+    {
+      const size_t needed = channel->txEnd + size;
+      if (needed > PS_TX_QUEUE_MAX)
+      {
+        PS_LOG_ERROR("%s: The send queue is full", channel->name);
+        return false;
+      }
+
+      size_t newSize = channel->txSize ? channel->txSize * 2 : 4096;
+      while(newSize < needed)
+        newSize *= 2;
+
+      uint8_t * buffer = realloc(channel->txBuffer, newSize);
+      if (!buffer)
+      {
+        PS_LOG_ERROR("out of memory");
+        return false;
+      }
+
+      channel->txBuffer = buffer;
+      channel->txSize   = newSize;
+    }
   }
 
-  if (!buffer)
+  return true;
+}
+
+bool channel_queueNL(PSChannel * channel, const void * data, size_t size)
+{
+  if (!channel_reserveNL(channel, size))
+    return false;
+
+  memcpy(channel->txBuffer + channel->txEnd, data, size);
+  channel->txEnd += size;
+  stats_max(&channel->stats->txQueueMax, channel->txEnd - channel->txStart);
+  return true;
+}
+
+bool channel_queue(PSChannel * channel, const void * data, size_t size)
+{
+  SPICE_LOCK(channel->lock);
+  const bool queued = channel_queueNL(channel, data, size);
+  SPICE_UNLOCK(channel->lock);
+
+  channel->txDeferred |= queued;
+  return queued;
+}
+
+bool channel_flushDeferred(PSChannel * channel)
+{
+  if (!channel->txDeferred)
+    return true;
+
+  channel->txDeferred = false;
+  return channel_flush(channel);
+}
+
+bool channel_send(PSChannel * channel, const void * data, size_t size)
+{
+  SPICE_LOCK(channel->lock);
+  const bool queued = channel_queueNL(channel, data, size);
+  SPICE_UNLOCK(channel->lock);
+
+  if (!queued)
+    return false;
+
+  return channel_flush(channel);
+}
+
+static void updateWaitingNL(PSChannel * channel)
+{
+  const bool pending = channel->txStart < channel->txEnd;
+  if (!pending)
+    channel->txStart = channel->txEnd = 0;
+
+  // if the kernel buffer is full let the IO loop finish the flush once the
+  // socket becomes writable again
+  if (pending != channel->txWaiting)
   {
-    PS_LOG_ERROR("BUG: attempted to read into a NULL buffer");
-    return PS_STATUS_ERROR;
+    struct epoll_event ev =
+    {
+      .events   = (pending ? EPOLLOUT : 0) | rxEvents(channel),
+      .data.ptr = &channel->poll
+    };
+    epoll_ctl(channel->epollfd, EPOLL_CTL_MOD, channel->socket, &ev);
+    channel->txWaiting = pending;
   }
+}
 
-  size_t    left = size;
-  uint8_t * buf  = (uint8_t *)buffer;
-  while(left)
+bool channel_flush(PSChannel * channel)
+{
+  SPICE_LOCK(channel->lock);
+  while(channel->txStart < channel->txEnd)
   {
-    ssize_t len = read(channel->socket, buf, left);
-    if (len == 0)
-      return PS_STATUS_NODATA;
+    const ssize_t wrote = send(channel->socket,
+        channel->txBuffer + channel->txStart,
+        channel->txEnd    - channel->txStart,
+        MSG_DONTWAIT | MSG_NOSIGNAL);
 
-    if (len < 0)
+    if (wrote < 0)
     {
-      channel->connected = false;
-      PS_LOG_ERROR("Failed to read from the socket: %ld", len);
-      return PS_STATUS_ERROR;
+      if (errno == EINTR)
+        continue;
+
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+
+      SPICE_UNLOCK(channel->lock);
+      PS_LOG_ERROR("%s: Failed to write to the socket: %d",
+          channel->name, errno);
+      return false;
     }
-    left -= len;
-    buf  += len;
 
-    if (dataAvailable)
-      *dataAvailable -= len;
+    channel->txStart += wrote;
+    stats_add(&channel->stats->bytesOut, wrote);
+    stats_add(&channel->stats->writes  , 1    );
   }
 
-  return PS_STATUS_OK;
+  updateWaitingNL(channel);
+  SPICE_UNLOCK(channel->lock);
+
+  return true;
 }
 
-PS_STATUS channel_discardNL(PSChannel * channel,
-    size_t size, int * dataAvailable)
+bool channel_sendv(PSChannel * channel, const struct iovec * iov, int count)
 {
-  uint8_t c[1024];
-  size_t left = size;
-  while(left)
+  if (count > PS_SENDV_MAX)
+    return false;
+
+  /* whatever the kernel does not take has to fit in the queue, so the room
+   * for all of it is made before anything is sent. A packet that was only
+   * partly queued would leave the server reading the next one inside it */
+  size_t total = 0;
+  for(int i = 0; i < count; ++i)
+    total += iov[i].iov_len;
+
+  SPICE_LOCK(channel->lock);
+  if (!channel_reserveNL(channel, total))
   {
-    ssize_t len = read(channel->socket, c, left > sizeof(c) ? sizeof(c) : left);
-    if (len == 0)
-      return PS_STATUS_NODATA;
+    SPICE_UNLOCK(channel->lock);
+    return false;
+  }
 
-    if (len < 0)
+  // anything already queued has to go first, send it in the same call
+  struct iovec vec[PS_SENDV_MAX + 1];
+  int n = 0;
+  if (channel->txStart < channel->txEnd)
+    vec[n++] = (struct iovec)
     {
-      channel->connected = false;
-      PS_LOG_ERROR("Failed to read from the socket: %ld", len);
-      return PS_STATUS_ERROR;
+      .iov_base = channel->txBuffer + channel->txStart,
+      .iov_len  = channel->txEnd    - channel->txStart
+    };
+
+  for(int i = 0; i < count; ++i)
+    vec[n++] = iov[i];
+
+  struct msghdr msg = { .msg_iov = vec, .msg_iovlen = n };
+  ssize_t wrote;
+  do
+    wrote = sendmsg(channel->socket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+  while(wrote < 0 && errno == EINTR);
+
+  if (wrote < 0)
+  {
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+    {
+      SPICE_UNLOCK(channel->lock);
+      PS_LOG_ERROR("%s: Failed to write to the socket: %d",
+          channel->name, errno);
+      return false;
     }
+    wrote = 0;
+  }
+  else
+    stats_add(&channel->stats->writes, 1);
 
-    left -= len;
+  stats_add(&channel->stats->bytesOut, wrote);
 
-    if (dataAvailable)
-      *dataAvailable -= len;
+  // account for what was sent and queue the remainder
+  size_t sent = wrote;
+  int    i    = 0;
+  if (channel->txStart < channel->txEnd)
+  {
+    const size_t queued = channel->txEnd - channel->txStart;
+    const size_t used   = sent < queued ? sent : queued;
+    channel->txStart += used;
+    sent             -= used;
+    i = 1;
   }
 
-  return PS_STATUS_OK;
+  bool ok = true;
+  for(; i < n && ok; ++i)
+  {
+    if (sent >= vec[i].iov_len)
+    {
+      sent -= vec[i].iov_len;
+      continue;
+    }
+
+    ok = channel_queueNL(channel, (uint8_t *)vec[i].iov_base + sent,
+        vec[i].iov_len - sent);
+    sent = 0;
+  }
+
+  /* the room was made above so this can't happen, but if it does part of the
+   * packet may already be on the wire. The stream can't be recovered, so the
+   * socket is shut down and the loop disconnects the channel on the hangup */
+  if (!ok)
+  {
+    PS_LOG_ERROR("BUG: %s: Failed to queue the rest of a packet",
+        channel->name);
+    shutdown(channel->socket, SHUT_RDWR);
+  }
+
+  updateWaitingNL(channel);
+  SPICE_UNLOCK(channel->lock);
+
+  return ok;
 }
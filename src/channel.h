@@ -19,8 +19,25 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
+#include <sys/uio.h>
+
+// returns the monotonic clock in milliseconds
+uint64_t get_timestamp(void);
+
+/* starts connecting the channel, the link handshake is then advanced by
+ * channel_link each time its socket is ready */
 PS_STATUS channel_connect(PSChannel * channel);
 
+/* returns PS_STATUS_HANDLED while the link is in progress and PS_STATUS_OK
+ * once it is done, after which channel_linked must be called to start the
+ * channel. On failure the channel is left to channel_internal_disconnect,
+ * PS_STATUS_NODATA means the connection was lost and may be retried */
+PS_STATUS channel_link  (PSChannel * channel);
+PS_STATUS channel_linked(PSChannel * channel);
+
+// drops the session's cached encrypted password
+void channel_freeTicket(PS * ps);
+
 void channel_internal_disconnect(PSChannel * channel);
 
 void channel_disconnect(PSChannel * channel);
@@ -29,11 +46,28 @@ PSHandlerFn channel_onMessage(PSChannel * channel);
 
 bool channel_ack(PSChannel * channel);
 
-ssize_t channel_writeNL(const PSChannel * channel,
-    const void * buffer, size_t size);
+/* the kernel's estimate of the channel's TCP round trip in microseconds,
+ * false if the channel is not connected over TCP */
+bool channel_getRTT(PSChannel * channel, uint32_t * rttUS, uint32_t * rttVarUS);
+
+/* receives from the channel's socket without blocking, any fd passed with
+ * the data is kept in rxFd for the handler of the message it belongs to */
+ssize_t channel_recv(PSChannel * channel, void * data, size_t size);
+
+/* makes room for `size` more bytes in the send queue without queuing
+ * anything, after which queuing up to that much can't fail */
+bool channel_reserveNL(PSChannel * channel, size_t size);
+bool channel_queueNL  (PSChannel * channel, const void * data, size_t size);
+
+/* queues data without flushing it, channel_flushDeferred then sends all that
+ * has been queued with one write once the channel's receive is done */
+bool channel_queue(PSChannel * channel, const void * data, size_t size);
+bool channel_flushDeferred(PSChannel * channel);
+
+bool channel_send(PSChannel * channel, const void * data, size_t size);
 
-PS_STATUS channel_readNL(PSChannel * channel, void * buffer,
-    size_t size, int * dataAvailable);
+bool channel_flush(PSChannel * channel);
 
-PS_STATUS channel_discardNL(PSChannel * channel,
-    size_t size, int * dataAvailable);
+/* sends what is queued followed by `iov` with a single sendmsg, whatever the
+ * kernel does not take is copied into the queue */
+bool channel_sendv(PSChannel * channel, const struct iovec * iov, int count);
@@ -23,12 +23,15 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "log.h"
 #include "channel.h"
 #include "channel_cursor.h"
+#include "cache.h"
 
 #include <stdlib.h>
+#include <inttypes.h>
 
 #include "messages.h"
+#include "stats.h"
 
-const SpiceLinkHeader * channelCursor_getConnectPacket(void)
+const SpiceLinkHeader * channelCursor_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -39,7 +42,7 @@ const SpiceLinkHeader * channelCursor_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -55,8 +58,8 @@ const SpiceLinkHeader * channelCursor_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -105,22 +108,116 @@ static size_t cursorBufferSize(SpiceCursorHeader * header)
   return 0;
 }
 
-static struct PSCursorImage * loadCursor(uint64_t id)
+static void freeCursor(void * value)
 {
-  for (struct PSCursorImage * node = g_ps.cursor.cache; node; node = node->next)
-    if (node->header.unique == id)
-      return node;
+  struct PSCursorImage * node = value;
 
-  return NULL;
+  // the cursor being shown outlives its cache entry and is freed once it is
+  // replaced instead
+  if (node->current)
+  {
+    node->cached = false;
+    return;
+  }
+
+  free(node);
+}
+
+static inline uint32_t cursorMask(const uint8_t * mask, unsigned stride,
+    unsigned x, unsigned y)
+{
+  return mask[y * stride + x / 8] & (0x80 >> (x % 8));
+}
+
+/* converts the color cursor types to ARGB, pixels with the AND mask bit set
+ * are transparent unless they are non-zero, these would invert the screen
+ * which can not be expressed so they are shown opaque */
+static void convertColorCursor(const SpiceCursorHeader * header,
+    const uint8_t * src, uint32_t * dst)
+{
+  const unsigned width  = header->width;
+  const unsigned height = header->height;
+  const unsigned mstride = (width + 7) / 8;
+
+  unsigned        stride;
+  const uint32_t * palette = NULL;
+  switch(header->type)
+  {
+    case SPICE_CURSOR_TYPE_COLOR4 : stride = (width + 1) / 2; break;
+    case SPICE_CURSOR_TYPE_COLOR8 : stride = width          ; break;
+    case SPICE_CURSOR_TYPE_COLOR16: stride = width * 2      ; break;
+    case SPICE_CURSOR_TYPE_COLOR24: stride = width * 3      ; break;
+    default                       : stride = width * 4      ; break;
+  }
+
+  const uint8_t * mask = src + stride * height;
+  if (header->type == SPICE_CURSOR_TYPE_COLOR4 ||
+      header->type == SPICE_CURSOR_TYPE_COLOR8)
+  {
+    palette = (const uint32_t *)mask;
+    mask   += (header->type == SPICE_CURSOR_TYPE_COLOR4 ? 16 : 256) *
+      sizeof(uint32_t);
+  }
+
+  for(unsigned y = 0; y < height; ++y)
+  {
+    const uint8_t * row = src + y * stride;
+    for(unsigned x = 0; x < width; ++x)
+    {
+      uint32_t px;
+      switch(header->type)
+      {
+        case SPICE_CURSOR_TYPE_COLOR4:
+          px = palette[(x & 1) ? row[x / 2] & 0xf : row[x / 2] >> 4];
+          break;
+
+        case SPICE_CURSOR_TYPE_COLOR8:
+          px = palette[row[x]];
+          break;
+
+        case SPICE_CURSOR_TYPE_COLOR16:
+        {
+          const uint16_t v = row[x * 2] | row[x * 2 + 1] << 8;
+          const uint32_t r = (v >> 10) & 0x1f;
+          const uint32_t g = (v >>  5) & 0x1f;
+          const uint32_t b =  v        & 0x1f;
+          px = (r << 3 | r >> 2) << 16 | (g << 3 | g >> 2) << 8 |
+            (b << 3 | b >> 2);
+          break;
+        }
+
+        case SPICE_CURSOR_TYPE_COLOR24:
+          px = row[x * 3] | row[x * 3 + 1] << 8 | row[x * 3 + 2] << 16;
+          break;
+
+        default:
+          memcpy(&px, row + x * 4, sizeof(px));
+          break;
+      }
+
+      px &= 0x00ffffff;
+      if (!cursorMask(mask, mstride, x, y) || px)
+        px |= 0xff000000;
+
+      *dst++ = px;
+    }
+  }
 }
 
-static struct PSCursorImage * convertCursor(SpiceCursor * cursor)
+static struct PSCursorImage * convertCursor(PS * ps, SpiceCursor * cursor)
 {
   if (cursor->flags & SPICE_CURSOR_FLAGS_NONE)
     return NULL;
 
   if (cursor->flags & SPICE_CURSOR_FLAGS_FROM_CACHE)
-    return loadCursor(cursor->header.unique);
+  {
+    struct PSCursorImage * node =
+      cache_get(ps->cursor.cache, cursor->header.unique);
+    if (!node)
+      PS_LOG_WARN("Cursor %" PRIu64 " is not in the cache",
+          cursor->header.unique);
+    return node;
+  }
 
   if (cursor->header.width > 512 || cursor->header.height > 512)
   {
@@ -129,218 +226,232 @@ static struct PSCursorImage * convertCursor(SpiceCursor * cursor)
     return NULL;
   }
 
-  size_t bufferSize = cursorBufferSize(&cursor->header);
-  struct PSCursorImage * node = malloc(sizeof(struct PSCursorImage) + bufferSize);
+  const size_t bufferSize = cursorBufferSize(&cursor->header);
+  const bool   isColor    =
+    cursor->header.type != SPICE_CURSOR_TYPE_ALPHA &&
+    cursor->header.type != SPICE_CURSOR_TYPE_MONO;
+  const size_t rgbaSize   = isColor ?
+    (size_t)cursor->header.width * cursor->header.height * 4 : 0;
+
+  // the converted image follows the raw data, rounded up for alignment
+  const size_t rgbaOffset = (bufferSize + 3) & ~(size_t)3;
+  const size_t size = sizeof(struct PSCursorImage) + rgbaOffset + rgbaSize;
 
-  node->cached = cursor->flags & SPICE_CURSOR_FLAGS_CACHE_ME;
+  struct PSCursorImage * node = malloc(size);
+  if (!node)
+  {
+    PS_LOG_ERROR("Failed to allocate the cursor");
+    return NULL;
+  }
+
+  node->cached  = cursor->flags & SPICE_CURSOR_FLAGS_CACHE_ME;
+  node->current = false;
   memcpy(&node->header, &cursor->header, sizeof(node->header));
   memcpy(node->buffer, cursor->data, bufferSize);
 
-  if (node->cached)
+  if (isColor)
   {
-    node->next             = NULL;
-    *g_ps.cursor.cacheLast = node;
-    g_ps.cursor.cacheLast  = &node->next;
+    convertColorCursor(&node->header, node->buffer,
+        (uint32_t *)(node->buffer + rgbaOffset));
+    node->rgba = node->buffer + rgbaOffset;
   }
+  else if (cursor->header.type == SPICE_CURSOR_TYPE_ALPHA)
+    node->rgba = node->buffer;
+  else
+    node->rgba = NULL;
+
+  // the cache frees the node if the insert fails
+  if (node->cached &&
+      !cache_insert(ps->cursor.cache, node->header.unique, node, size))
+    return NULL;
 
   return node;
 }
 
-static void clearCursorCache(void)
+static void setCurrent(PS * ps, struct PSCursorImage * node)
 {
-  struct PSCursorImage * node;
-  struct PSCursorImage * next;
-  for (node = g_ps.cursor.cache; node; node = next)
+  struct PSCursorImage * old = ps->cursor.current;
+  ps->cursor.current = node;
+
+  if (node)
+    node->current = true;
+
+  if (old && old != node)
   {
-    next = node->next;
-    free(node);
+    old->current = false;
+    if (!old->cached)
+      free(old);
   }
-
-  g_ps.cursor.cache     = NULL;
-  g_ps.cursor.cacheLast = &g_ps.cursor.cache;
 }
 
-static void updateCursorImage(void)
+static void updateCursorImage(PS * ps)
 {
-  if (!g_ps.cursor.current)
+  if (!ps->cursor.current)
     return;
 
-  switch (g_ps.cursor.current->header.type)
+  if (ps->cursor.current->rgba)
   {
-    case SPICE_CURSOR_TYPE_ALPHA:
-      g_ps.config.cursor.setRGBAImage(
-        g_ps.cursor.current->header.width,
-        g_ps.cursor.current->header.height,
-        g_ps.cursor.current->header.hot_spot_x,
-        g_ps.cursor.current->header.hot_spot_y,
-        g_ps.cursor.current->buffer
-      );
-      break;
+    STATS_CALLBACK(ps, PS_CHANNEL_CURSOR,
+      ps->config.cursor.setRGBAImage(
+        ps->cursor.current->header.width,
+        ps->cursor.current->header.height,
+        ps->cursor.current->header.hot_spot_x,
+        ps->cursor.current->header.hot_spot_y,
+        ps->cursor.current->rgba
+      ));
+    return;
+  }
 
+  switch (ps->cursor.current->header.type)
+  {
     case SPICE_CURSOR_TYPE_MONO:
     {
-      const unsigned width  = g_ps.cursor.current->header.width;
-      const unsigned height = g_ps.cursor.current->header.height;
+      const unsigned width  = ps->cursor.current->header.width;
+      const unsigned height = ps->cursor.current->header.height;
       const unsigned size   = (width + 7) / 8 * height;
 
-      const uint8_t * xorBuffer = g_ps.cursor.current->buffer;
+      const uint8_t * xorBuffer = ps->cursor.current->buffer;
       const uint8_t * andBuffer = xorBuffer + size;
 
-      g_ps.config.cursor.setMonoImage(
-        g_ps.cursor.current->header.width,
-        g_ps.cursor.current->header.height,
-        g_ps.cursor.current->header.hot_spot_x,
-        g_ps.cursor.current->header.hot_spot_y,
-        xorBuffer,
-        andBuffer
-      );
+      STATS_CALLBACK(ps, PS_CHANNEL_CURSOR,
+        ps->config.cursor.setMonoImage(
+          ps->cursor.current->header.width,
+          ps->cursor.current->header.height,
+          ps->cursor.current->header.hot_spot_x,
+          ps->cursor.current->header.hot_spot_y,
+          xorBuffer,
+          andBuffer
+        ));
       break;
     }
 
     default:
       PS_LOG_ERROR("Attempt to use unsupported cursor type: %d",
-        g_ps.cursor.current->header.type);
+        ps->cursor.current->header.type);
   }
 }
 
-static void updateCursorStatus(void)
+static void updateCursorStatus(PS * ps)
 {
-  g_ps.config.cursor.setState(g_ps.cursor.visible, g_ps.cursor.x, g_ps.cursor.y);
+  stats_cursorUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_CURSOR,
+    ps->config.cursor.setState(ps->cursor.visible, ps->cursor.x, ps->cursor.y));
 }
 
-static void updateCursorTrail(void)
+static void updateCursorTrail(PS * ps)
 {
-  if (g_ps.config.cursor.setTrail)
-    g_ps.config.cursor.setTrail(g_ps.cursor.trailLen, g_ps.cursor.trailFreq);
+  if (ps->config.cursor.setTrail)
+    STATS_CALLBACK(ps, PS_CHANNEL_CURSOR,
+      ps->config.cursor.setTrail(ps->cursor.trailLen, ps->cursor.trailFreq));
 }
 
 static PS_STATUS onMessage_cursorInit(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgCursorInit * msg = (SpiceMsgCursorInit *)channel->buffer;
 
-  g_ps.cursor.x         = msg->position.x;
-  g_ps.cursor.y         = msg->position.y;
-  g_ps.cursor.visible   = msg->visible;
-  g_ps.cursor.trailLen  = msg->trail_length;
-  g_ps.cursor.trailFreq = msg->trail_frequency;
+  ps->cursor.x         = msg->position.x;
+  ps->cursor.y         = msg->position.y;
+  ps->cursor.visible   = msg->visible;
+  ps->cursor.trailLen  = msg->trail_length;
+  ps->cursor.trailFreq = msg->trail_frequency;
 
-  g_ps.cursor.cache     = NULL;
-  g_ps.cursor.cacheLast = &g_ps.cursor.cache;
-  g_ps.cursor.current   = convertCursor(&msg->cursor);
+  setCurrent(ps, NULL);
+  cache_clear(ps->cursor.cache);
+  setCurrent(ps, convertCursor(ps, &msg->cursor));
 
-  if (!g_ps.cursor.current)
-    g_ps.cursor.visible = false;
+  if (!ps->cursor.current)
+    ps->cursor.visible = false;
 
-  updateCursorImage();
-  updateCursorStatus();
-  updateCursorTrail();
+  updateCursorImage(ps);
+  updateCursorStatus(ps);
+  updateCursorTrail(ps);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorReset(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   (void) channel;
 
-  g_ps.cursor.visible = false;
-  g_ps.cursor.current = NULL;
-
-  struct PSCursorImage * node;
-  struct PSCursorImage * next;
-  for (node = g_ps.cursor.cache; node; node = next)
-  {
-    next = node->next;
-    free(node);
-  }
-
-  clearCursorCache();
+  ps->cursor.visible = false;
+  setCurrent(ps, NULL);
+  cache_clear(ps->cursor.cache);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorSet(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgCursorSet * msg = (SpiceMsgCursorSet *)channel->buffer;
 
-  g_ps.cursor.x       = msg->position.x;
-  g_ps.cursor.y       = msg->position.y;
-  g_ps.cursor.visible = msg->visible;
-
-  if (g_ps.cursor.current && !g_ps.cursor.current->cached)
-    free(g_ps.cursor.current);
+  ps->cursor.x       = msg->position.x;
+  ps->cursor.y       = msg->position.y;
+  ps->cursor.visible = msg->visible;
 
-  g_ps.cursor.current = convertCursor(&msg->cursor);
+  setCurrent(ps, convertCursor(ps, &msg->cursor));
 
-  if (!g_ps.cursor.current)
-    g_ps.cursor.visible = false;
+  if (!ps->cursor.current)
+    ps->cursor.visible = false;
 
-  updateCursorStatus();
-  updateCursorImage();
+  updateCursorStatus(ps);
+  updateCursorImage(ps);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorMove(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgCursorMove * msg = (SpiceMsgCursorMove *)channel->buffer;
 
-  g_ps.cursor.x = msg->position.x;
-  g_ps.cursor.y = msg->position.y;
-  updateCursorStatus();
+  ps->cursor.x = msg->position.x;
+  ps->cursor.y = msg->position.y;
+  updateCursorStatus(ps);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorHide(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   (void) channel;
 
-  g_ps.cursor.visible = false;
-  updateCursorStatus();
+  ps->cursor.visible = false;
+  updateCursorStatus(ps);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorTrail(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgCursorTrail * msg = (SpiceMsgCursorTrail *)channel->buffer;
 
-  g_ps.cursor.trailLen  = msg->length;
-  g_ps.cursor.trailFreq = msg->frequency;
-  updateCursorTrail();
+  ps->cursor.trailLen  = msg->length;
+  ps->cursor.trailFreq = msg->frequency;
+  updateCursorTrail(ps);
 
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorInvalOne(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgCursorInvalOne * msg = (SpiceMsgCursorInvalOne *)channel->buffer;
 
-  struct PSCursorImage ** prev = &g_ps.cursor.cache;
-  struct PSCursorImage  * node = g_ps.cursor.cache;
-
-  while (node)
-  {
-    if (node->header.unique == msg->cursor_id)
-    {
-      *prev = node->next;
-      if (!node->next)
-        g_ps.cursor.cacheLast = prev;
-      break;
-    }
-
-    prev = &node->next;
-    node = node->next;
-  }
-
+  cache_remove(ps->cursor.cache, msg->cursor_id);
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_cursorInvalAll(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   (void) channel;
 
-  clearCursorCache();
+  cache_clear(ps->cursor.cache);
 
   return PS_STATUS_OK;
 }
@@ -377,3 +488,31 @@ PSHandlerFn channelCursor_onMessage(PSChannel * channel)
 
   return PS_HANDLER_DISCARD;
 }
+
+PS_STATUS channelCursor_onConnect(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+
+  setCurrent(ps, NULL);
+  if (ps->cursor.cache)
+  {
+    cache_clear(ps->cursor.cache);
+    return PS_STATUS_OK;
+  }
+
+  ps->cursor.cache = cache_new(PS_CURSOR_CACHE_SIZE, freeCursor);
+  if (!ps->cursor.cache)
+  {
+    PS_LOG_ERROR("Failed to create the cursor cache");
+    return PS_STATUS_ERROR;
+  }
+
+  return PS_STATUS_OK;
+}
+
+void channelCursor_deinit(PS * ps)
+{
+  setCurrent(ps, NULL);
+  cache_free(ps->cursor.cache);
+  ps->cursor.cache = NULL;
+}
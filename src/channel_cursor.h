@@ -19,6 +19,9 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelCursor_getConnectPacket(void);
+const SpiceLinkHeader * channelCursor_getConnectPacket(PS * ps);
+
+PS_STATUS channelCursor_onConnect(PSChannel * channel);
+void channelCursor_deinit(PS * ps);
 
 PSHandlerFn channelCursor_onMessage(PSChannel * channel);
@@ -19,15 +19,101 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "purespice.h"
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <unistd.h>
 
 #include "ps.h"
 #include "log.h"
 #include "channel.h"
 #include "channel_playback.h"
+#include "decode.h"
+#include "cache.h"
+#include "convert.h"
+#include "batch.h"
+#include "surface.h"
 
 #include "messages.h"
+#include "stats.h"
 
-const SpiceLinkHeader * channelDisplay_getConnectPacket(void)
+typedef struct PSStream
+{
+  bool         active;
+  unsigned int width;
+  unsigned int height;
+  SpiceRect    dest;
+
+  // stream report state, activated by the server
+  bool         report;
+  uint32_t     uniqueId;
+  uint32_t     maxWindow;
+  uint32_t     timeoutMS;
+  uint64_t     reportStart;
+  uint32_t     startMMTime;
+  uint32_t     numFrames;
+}
+PSStream;
+
+typedef struct PSSurface
+{
+  bool            created;
+
+  // created before the display channel was reconnected and not yet again
+  bool            stale;
+
+  PSSurfaceFormat format;
+  uint32_t        width, height;
+}
+PSSurface;
+
+struct PSDisplay
+{
+  PSStream  streams[PS_MAX_STREAMS];
+
+  // the surfaces passed to surfaceCreate if they are kept over a reconnect
+  PSSurface surfaces[PS_MAX_SURFACES];
+  bool      staleSurfaces;
+
+  // the dmabuf of the current GL scanout and if a draw of it awaits its done
+  int         glFd;
+  atomic_bool glDrawPending;
+};
+
+bool channelDisplay_create(PS * ps)
+{
+  ps->display = calloc(1, sizeof(*ps->display));
+  if (!ps->display)
+  {
+    PS_LOG_ERROR("Failed to allocate the display state");
+    return false;
+  }
+
+  ps->display->glFd = -1;
+  return true;
+}
+
+void channelDisplay_destroy(PS * ps)
+{
+  free(ps->display);
+  ps->display = NULL;
+}
+
+static void releaseScanout(PS * ps)
+{
+  if (ps->display->glFd >= 0)
+  {
+    close(ps->display->glFd);
+    ps->display->glFd = -1;
+  }
+}
+
+void channelDisplay_deinit(PS * ps)
+{
+  memset(ps->display->surfaces, 0, sizeof(ps->display->surfaces));
+  ps->display->staleSurfaces = false;
+  releaseScanout(ps);
+}
+
+const SpiceLinkHeader * channelDisplay_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -38,7 +124,7 @@ const SpiceLinkHeader * channelDisplay_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -54,8 +140,8 @@ const SpiceLinkHeader * channelDisplay_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -64,19 +150,105 @@ const SpiceLinkHeader * channelDisplay_getConnectPacket(void)
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_AUTH_SPICE             );
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_MINI_HEADER            );
 
-  DISPLAY_SET_CAPABILITY(p.supportCaps, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
+  DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_PREF_COMPRESSION);
+  DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_LZ4_COMPRESSION);
+
+  // the dmabufs can only be passed to a local client
+  PSChannel * channel = &ps->channels[PS_CHANNEL_DISPLAY];
+  channel->passFds = ps->config.display.glScanout && ps->family == AF_UNIX;
+  if (channel->passFds)
+    DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_GL_SCANOUT);
+
+  if (ps->config.display.streamCreate)
+  {
+    const unsigned int codecs = ps->config.display.streamCodecs;
+
+    DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_SIZED_STREAM );
+    DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_STREAM_REPORT);
+    DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_MULTI_CODEC  );
+    DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_CODEC_MJPEG  );
+
+    if (codecs & (1 << PS_VIDEO_CODEC_VP8))
+      DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_CODEC_VP8);
+    if (codecs & (1 << PS_VIDEO_CODEC_H264))
+      DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_CODEC_H264);
+    if (codecs & (1 << PS_VIDEO_CODEC_VP9))
+      DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_CODEC_VP9);
+    if (codecs & (1 << PS_VIDEO_CODEC_H265))
+      DISPLAY_SET_CAPABILITY(p.channelCaps, SPICE_DISPLAY_CAP_CODEC_H265);
+  }
 
   return &p.header;
 }
 
 PS_STATUS channelDisplay_onConnect(PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  // the server starts a new dictionary and cache for every connection
+  decode_glzReset(ps->glz);
+  memset(ps->display->streams, 0, sizeof(ps->display->streams));
+  atomic_store(&ps->display->glDrawPending, false);
+
+  /* the surfaces are kept until the server either creates them again or
+   * finishes its first frame without doing so */
+  if (ps->config.reconnect.keepSurfaces)
+    for(int i = 0; i < PS_MAX_SURFACES; ++i)
+    {
+      PSSurface * surface = &ps->display->surfaces[i];
+      surface->stale = surface->created;
+      ps->display->staleSurfaces |= surface->stale;
+    }
+
+  const size_t cacheSize = ps->config.display.pixmapCacheSize ?
+    ps->config.display.pixmapCacheSize : PS_PIXMAP_CACHE_DEFAULT;
+
+  if (ps->pixmapCache)
+    cache_clear(ps->pixmapCache);
+  else
+  {
+    /* the server does the eviction and accounts for 4 bytes per pixel,
+     * our budget is larger so that the LRU only acts as a safety net for
+     * images that decode to more then that */
+    ps->pixmapCache = cache_new(cacheSize * 2, free);
+    if (!ps->pixmapCache)
+    {
+      PS_LOG_ERROR("Failed to create the pixmap cache");
+      return PS_STATUS_ERROR;
+    }
+  }
+
+  if (ps->paletteCache)
+    cache_clear(ps->paletteCache);
+  else
+  {
+    ps->paletteCache = cache_new(PS_PALETTE_CACHE_SIZE, free);
+    if (!ps->paletteCache)
+    {
+      PS_LOG_ERROR("Failed to create the palette cache");
+      return PS_STATUS_ERROR;
+    }
+  }
+
+  PSImageCompression compression = ps->config.display.compression;
+  if (compression == PS_IMAGE_COMPRESSION_DEFAULT)
+    compression = ps->family == AF_UNIX ?
+      PS_IMAGE_COMPRESSION_OFF : PS_IMAGE_COMPRESSION_GLZ;
+
   {
     SpiceMsgcDisplayInit * msg =
       SPICE_PACKET(SPICE_MSGC_DISPLAY_INIT,
           SpiceMsgcDisplayInit, 0);
 
     memset(msg, 0, sizeof(*msg));
+    msg->pixmap_cache_id   = 1;
+    msg->pixmap_cache_size = cacheSize / 4;
+
+    if (compression == PS_IMAGE_COMPRESSION_GLZ)
+    {
+      msg->glz_dictionary_id          = 1;
+      msg->glz_dictionary_window_size = PS_GLZ_WINDOW_SIZE;
+    }
+
     if (!SPICE_SEND_PACKET(channel, msg))
     {
       PS_LOG_ERROR("Failed to send SpiceMsgcDisplayInit");
@@ -89,7 +261,25 @@ PS_STATUS channelDisplay_onConnect(PSChannel * channel)
       SPICE_PACKET(SPICE_MSGC_DISPLAY_PREFERRED_COMPRESSION,
           SpiceMsgcPreferredCompression, 0);
 
-    msg->image_compression = SPICE_IMAGE_COMPRESSION_OFF;
+    switch(compression)
+    {
+      case PS_IMAGE_COMPRESSION_LZ:
+        msg->image_compression = SPICE_IMAGE_COMPRESSION_LZ;
+        break;
+
+      case PS_IMAGE_COMPRESSION_GLZ:
+        msg->image_compression = SPICE_IMAGE_COMPRESSION_GLZ;
+        break;
+
+      case PS_IMAGE_COMPRESSION_LZ4:
+        msg->image_compression = SPICE_IMAGE_COMPRESSION_LZ4;
+        break;
+
+      default:
+        msg->image_compression = SPICE_IMAGE_COMPRESSION_OFF;
+        break;
+    }
+
     if (!SPICE_SEND_PACKET(channel, msg))
     {
       PS_LOG_ERROR("Failed to send SpiceMsgcPreferredCompression");
@@ -100,6 +290,21 @@ PS_STATUS channelDisplay_onConnect(PSChannel * channel)
   return PS_STATUS_OK;
 }
 
+static void resolveSpiceClip(uint8_t ** ptr, SpiceClip * clip)
+{
+  memcpy(&clip->type, *ptr, sizeof(clip->type));
+  *ptr += sizeof(clip->type);
+
+  if (clip->type == SPICE_CLIP_TYPE_RECTS)
+  {
+    clip->rects = (SpiceClipRects *)*ptr;
+    *ptr += sizeof(clip->rects->num_rects);
+    *ptr += clip->rects->num_rects * sizeof(SpiceRect);
+  }
+  else
+    clip->rects = NULL;
+}
+
 static void resolveDisplayBase(uint8_t ** ptr, SpiceMsgDisplayBase * base)
 {
   memcpy(&base->surface_id, *ptr, sizeof(base->surface_id));
@@ -108,15 +313,7 @@ static void resolveDisplayBase(uint8_t ** ptr, SpiceMsgDisplayBase * base)
   memcpy(&base->box, *ptr, sizeof(base->box));
   *ptr += sizeof(base->box);
 
-  memcpy(&base->clip.type, *ptr, sizeof(base->clip.type));
-  *ptr += sizeof(base->clip.type);
-
-  if (base->clip.type == SPICE_CLIP_TYPE_RECTS)
-  {
-    base->clip.rects = (SpiceClipRects *)*ptr;
-    *ptr += sizeof(base->clip.rects->num_rects);
-    *ptr += base->clip.rects->num_rects * sizeof(SpiceRect);
-  }
+  resolveSpiceClip(ptr, &base->clip);
 }
 
 static void resolveSpicePoint(uint8_t ** ptr, SpicePoint * dst)
@@ -126,17 +323,25 @@ static void resolveSpicePoint(uint8_t ** ptr, SpicePoint * dst)
 }
 
 static void resolveSpicePalette(const uint8_t * data, uint8_t ** ptr,
-    SpicePalette ** dst, uint64_t *dst_id)
+    uint8_t flags, SpicePalette ** dst, uint64_t *dst_id)
 {
+  // a cached palette is sent by id instead of by offset
+  if (flags & SPICE_BITMAP_FLAGS_PAL_FROM_CACHE)
+  {
+    memcpy(dst_id, *ptr, sizeof(*dst_id));
+    *ptr += sizeof(*dst_id);
+    *dst  = NULL;
+    return;
+  }
+
   uint32_t offset;
   memcpy(&offset, *ptr, sizeof(offset));
   *ptr += sizeof(offset);
 
   if (offset)
   {
-    *dst = (SpicePalette *)data + offset;
-    memcpy(dst_id, ptr, sizeof(*dst_id));
-    *ptr += sizeof(*dst_id);
+    *dst    = (SpicePalette *)(data + offset);
+    *dst_id = (*dst)->unique;
   }
   else
   {
@@ -233,7 +438,8 @@ static void readSpiceBitmap(const uint8_t * data, const SpiceImage * img,
   memcpy(dst, ptr, copy);
   ptr += copy;
 
-  resolveSpicePalette(data, &ptr, &dst->palette, &dst->palette_id);
+  resolveSpicePalette(data, &ptr, dst->flags, &dst->palette,
+      &dst->palette_id);
   dst->data = ptr;
 }
 
@@ -251,8 +457,81 @@ static void resolveDisplayDrawFill(uint8_t * data, SpiceMsgDisplayDrawFill * dst
   resolveSpiceFill  (data, &ptr, &dst->data);
 }
 
+static void destroySurface(PS * ps, unsigned int surfaceId)
+{
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.surfaceDestroy(surfaceId));
+
+  // the store unmaps it only once the app has let go of it
+  if (surface_enabled(ps))
+    surface_release(ps, surfaceId);
+}
+
+static PS_STATUS createSurface(PS * ps, unsigned int surfaceId,
+    PSSurfaceFormat format, unsigned int width, unsigned int height)
+{
+  if (!surface_enabled(ps))
+  {
+    STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+      ps->config.display.surfaceCreate(surfaceId, format, width, height));
+    return PS_STATUS_OK;
+  }
+
+  // created again without being destroyed, ie after a display reconnect
+  if (surface_isMapped(ps, surfaceId))
+    destroySurface(ps, surfaceId);
+
+  return surface_new(ps, surfaceId, format, width, height) ?
+    PS_STATUS_OK : PS_STATUS_ERROR;
+}
+
+// hands over what has been drawn so far in either batched or store mode
+static void flushDrawing(PS * ps)
+{
+  batch_flush(ps);
+  if (surface_enabled(ps))
+    surface_flush(ps);
+}
+
+/* returns the clip rects of a draw, or false if they run past the end of the
+ * message */
+static bool getClipRects(PSChannel * channel, const SpiceClip * clip,
+    const SpiceRect ** rects, unsigned int * count)
+{
+  *rects = NULL;
+  *count = 0;
+  if (clip->type != SPICE_CLIP_TYPE_RECTS)
+    return true;
+
+  const uint8_t * end = channel->buffer + channel->header.size;
+  const uint8_t * ptr = (const uint8_t *)clip->rects;
+  if (ptr > end || sizeof(clip->rects->num_rects) > (size_t)(end - ptr) ||
+      (size_t)clip->rects->num_rects * sizeof(SpiceRect) >
+        (size_t)(end - ptr) - sizeof(clip->rects->num_rects))
+  {
+    PS_LOG_ERROR("Clip rects are larger then the message");
+    return false;
+  }
+
+  *rects = clip->rects->rects;
+  *count = clip->rects->num_rects;
+  return true;
+}
+
+// the part of a box within a clip rect, false if there is none
+static bool clipBox(const SpiceRect * box, const SpiceRect * clip,
+    SpiceRect * out)
+{
+  out->left   = box->left   > clip->left   ? box->left   : clip->left;
+  out->top    = box->top    > clip->top    ? box->top    : clip->top;
+  out->right  = box->right  < clip->right  ? box->right  : clip->right;
+  out->bottom = box->bottom < clip->bottom ? box->bottom : clip->bottom;
+  return out->left < out->right && out->top < out->bottom;
+}
+
 static PS_STATUS onMessage_displaySurfaceCreate(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgSurfaceCreate * msg = (SpiceMsgSurfaceCreate *)channel->buffer;
 
   PSSurfaceFormat fmt;
@@ -270,22 +549,73 @@ static PS_STATUS onMessage_displaySurfaceCreate(PSChannel * channel)
       return PS_STATUS_ERROR;
   }
 
-  g_ps.config.display.surfaceCreate(msg->surface_id, fmt,
-      msg->width, msg->height);
+  // keep the batch ordered with respect to the surface lifetime
+  flushDrawing(ps);
 
-  return PS_STATUS_OK;
+  if (ps->config.reconnect.keepSurfaces && msg->surface_id < PS_MAX_SURFACES)
+  {
+    PSSurface * surface = &ps->display->surfaces[msg->surface_id];
+    if (surface->stale)
+    {
+      surface->stale = false;
+      if (surface->format == fmt        &&
+          surface->width  == msg->width &&
+          surface->height == msg->height)
+        return PS_STATUS_OK;
+
+      destroySurface(ps, msg->surface_id);
+    }
+
+    surface->created = true;
+    surface->format  = fmt;
+    surface->width   = msg->width;
+    surface->height  = msg->height;
+  }
+
+  return createSurface(ps, msg->surface_id, fmt, msg->width, msg->height);
 }
 
 static PS_STATUS onMessage_displaySurfaceDestroy(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgSurfaceDestroy * msg = (SpiceMsgSurfaceDestroy *)channel->buffer;
 
-  g_ps.config.display.surfaceDestroy(msg->surface_id);
+  flushDrawing(ps);
+
+  if (msg->surface_id < PS_MAX_SURFACES)
+  {
+    PSSurface * surface = &ps->display->surfaces[msg->surface_id];
+    surface->created = false;
+    surface->stale   = false;
+  }
+
+  destroySurface(ps, msg->surface_id);
   return PS_STATUS_OK;
 }
 
+static bool fillRect(PS * ps, unsigned int surfaceId, const SpiceRect * rect,
+    uint32_t color)
+{
+  const int x      = rect->left;
+  const int y      = rect->top;
+  const int width  = rect->right  - rect->left;
+  const int height = rect->bottom - rect->top;
+
+  if (ps->config.display.frameComplete)
+    return batch_fill(ps, surfaceId, x, y, width, height, color);
+
+  if (ps->config.display.drawFills)
+    return batch_queueFill(ps, surfaceId, x, y, width, height, color);
+
+  stats_displayUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.drawFill(surfaceId, x, y, width, height, color));
+  return true;
+}
+
 static PS_STATUS onMessage_displayDrawFill(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgDisplayDrawFill dst;
   resolveDisplayDrawFill(channel->buffer, &dst);
 
@@ -295,18 +625,291 @@ static PS_STATUS onMessage_displayDrawFill(PSChannel * channel)
     return PS_STATUS_OK;
   }
 
-  g_ps.config.display.drawFill(
-      dst.base.surface_id,
-      dst.base.box.left,
-      dst.base.box.top,
-      dst.base.box.right  - dst.base.box.left,
-      dst.base.box.bottom - dst.base.box.top,
-      dst.data.brush.u.color);
+  const SpiceRect * clip;
+  unsigned int      numClip;
+  if (!getClipRects(channel, &dst.base.clip, &clip, &numClip))
+    return PS_STATUS_ERROR;
+
+  if (surface_enabled(ps))
+  {
+    if (dst.data.mask.bitmap)
+      PS_LOG_WARN_ONCE("Masked draws are drawn unmasked");
+
+    surface_fill(ps, dst.base.surface_id, &dst.base.box, clip, numClip,
+        dst.data.brush.u.color, dst.data.rop_descriptor);
+    return PS_STATUS_OK;
+  }
+
+  if (!numClip)
+    return fillRect(ps, dst.base.surface_id, &dst.base.box,
+        dst.data.brush.u.color) ? PS_STATUS_OK : PS_STATUS_ERROR;
+
+  for(unsigned int i = 0; i < numClip; ++i)
+  {
+    SpiceRect rect;
+    if (clipBox(&dst.base.box, &clip[i], &rect) &&
+        !fillRect(ps, dst.base.surface_id, &rect, dst.data.brush.u.color))
+      return PS_STATUS_ERROR;
+  }
+
   return PS_STATUS_OK;
 }
 
+typedef struct PSPixmap
+{
+  PSBitmapFormat format;
+  bool           topDown;
+  unsigned int   width;
+  unsigned int   height;
+  unsigned int   stride;
+  uint8_t        data[];
+}
+PSPixmap;
+
+static void cachePixmap(PS * ps, uint64_t id, const PSDecodedImage * image)
+{
+  const size_t size = (size_t)image->stride * image->height;
+  PSPixmap * pixmap = malloc(sizeof(*pixmap) + size);
+  if (!pixmap)
+  {
+    PS_LOG_ERROR("Failed to allocate %lu bytes for a cached image",
+        (unsigned long)size);
+    return;
+  }
+
+  pixmap->format  = image->format;
+  pixmap->topDown = image->topDown;
+  pixmap->width   = image->width;
+  pixmap->height  = image->height;
+  pixmap->stride  = image->stride;
+  memcpy(pixmap->data, image->data, size);
+
+  cache_insert(ps->pixmapCache, id, pixmap, sizeof(*pixmap) + size);
+}
+
+static void cachePalette(PS * ps, const SpicePalette * palette)
+{
+  const size_t size = sizeof(*palette) + palette->num_ents * sizeof(uint32_t);
+  SpicePalette * copy = malloc(size);
+  if (!copy)
+  {
+    PS_LOG_ERROR("Failed to allocate %lu bytes for a cached palette",
+        (unsigned long)size);
+    return;
+  }
+
+  memcpy(copy, palette, size);
+  cache_insert(ps->paletteCache, palette->unique, copy, size);
+}
+
+/* resolves the image to pixels, returns false if there is nothing to draw and
+ * sets `status` if the failure is fatal */
+static bool readImage(PSChannel * channel, const SpiceImage * img,
+    PSDecodedImage * out, PS_STATUS * status)
+{
+  PS * ps = channel->ps;
+  *status = PS_STATUS_OK;
+  *out    = (PSDecodedImage){ 0 };
+  switch(img->descriptor.type)
+  {
+    case SPICE_IMAGE_TYPE_BITMAP:
+    {
+      SpiceBitmap bmp;
+      readSpiceBitmap(channel->buffer, img, &bmp);
+
+      PSBitmapFormat format;
+      switch(bmp.format)
+      {
+        case SPICE_BITMAP_FMT_1BIT_LE: format = PS_BITMAP_FMT_1BIT_LE; break;
+        case SPICE_BITMAP_FMT_1BIT_BE: format = PS_BITMAP_FMT_1BIT_BE; break;
+        case SPICE_BITMAP_FMT_4BIT_LE: format = PS_BITMAP_FMT_4BIT_LE; break;
+        case SPICE_BITMAP_FMT_4BIT_BE: format = PS_BITMAP_FMT_4BIT_BE; break;
+        case SPICE_BITMAP_FMT_8BIT   : format = PS_BITMAP_FMT_8BIT   ; break;
+        case SPICE_BITMAP_FMT_16BIT  : format = PS_BITMAP_FMT_16BIT  ; break;
+        case SPICE_BITMAP_FMT_24BIT  : format = PS_BITMAP_FMT_24BIT  ; break;
+        case SPICE_BITMAP_FMT_32BIT  : format = PS_BITMAP_FMT_32BIT  ; break;
+        case SPICE_BITMAP_FMT_RGBA   : format = PS_BITMAP_FMT_RGBA   ; break;
+        case SPICE_BITMAP_FMT_8BIT_A : format = PS_BITMAP_FMT_8BIT_A ; break;
+
+        default:
+          PS_LOG_ERROR("Unknown bitmap format: %u", bmp.format);
+          return false;
+      }
+
+      const uint8_t * end = channel->buffer + channel->header.size;
+      if (bmp.data > end ||
+          (size_t)bmp.stride * bmp.y > (size_t)(end - bmp.data))
+      {
+        PS_LOG_ERROR("Bitmap is larger then the message");
+        *status = PS_STATUS_ERROR;
+        return false;
+      }
+
+      const SpicePalette * palette = bmp.palette;
+      if (bmp.flags & SPICE_BITMAP_FLAGS_PAL_FROM_CACHE)
+      {
+        palette = cache_get(ps->paletteCache, bmp.palette_id);
+        if (!palette)
+          PS_LOG_ERROR("Palette %lu is not in the cache",
+              (unsigned long)bmp.palette_id);
+      }
+      else if (palette)
+      {
+        if ((const uint8_t *)palette->ents > end ||
+            palette->num_ents * sizeof(uint32_t) >
+              (size_t)(end - (const uint8_t *)palette->ents))
+        {
+          PS_LOG_ERROR("Palette is larger then the message");
+          *status = PS_STATUS_ERROR;
+          return false;
+        }
+
+        if (bmp.flags & SPICE_BITMAP_FLAGS_PAL_CACHE_ME)
+          cachePalette(ps, palette);
+      }
+
+      out->format         = format;
+      out->topDown        = bmp.flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
+      out->width          = bmp.x;
+      out->height         = bmp.y;
+      out->stride         = bmp.stride;
+      out->data           = bmp.data;
+      out->palette        = palette ? palette->ents     : NULL;
+      out->paletteEntries = palette ? palette->num_ents : 0;
+      out->owned          = false;
+      return true;
+    }
+
+    case SPICE_IMAGE_TYPE_FROM_CACHE:
+    case SPICE_IMAGE_TYPE_FROM_CACHE_LOSSLESS:
+    {
+      // we never cache lossy images so both types are served the same way
+      PSPixmap * pixmap = cache_get(ps->pixmapCache, img->descriptor.id);
+      if (!pixmap)
+      {
+        PS_LOG_ERROR("Image %lu is not in the cache",
+            (unsigned long)img->descriptor.id);
+        return false;
+      }
+
+      out->format  = pixmap->format;
+      out->topDown = pixmap->topDown;
+      out->width   = pixmap->width;
+      out->height  = pixmap->height;
+      out->stride  = pixmap->stride;
+      out->data    = pixmap->data;
+      out->owned   = false;
+      return true;
+    }
+
+    case SPICE_IMAGE_TYPE_LZ_RGB:
+    case SPICE_IMAGE_TYPE_GLZ_RGB:
+    case SPICE_IMAGE_TYPE_LZ4:
+    {
+      // lz_rgb and lz4 share the same layout
+      const SpiceLZRGBData * lz   = &img->u.lz_rgb;
+      const uint8_t        * end  = channel->buffer + channel->header.size;
+      if ((const uint8_t *)lz->data > end ||
+          lz->data_size > (size_t)(end - lz->data))
+      {
+        PS_LOG_ERROR("Compressed image is larger then the message");
+        *status = PS_STATUS_ERROR;
+        return false;
+      }
+
+      bool ok;
+      switch(img->descriptor.type)
+      {
+        case SPICE_IMAGE_TYPE_LZ_RGB:
+          ok = decode_lz(lz->data, lz->data_size,
+              img->descriptor.width, img->descriptor.height, out);
+          break;
+
+        case SPICE_IMAGE_TYPE_GLZ_RGB:
+          ok = decode_glz(ps->glz, lz->data, lz->data_size,
+              img->descriptor.width, img->descriptor.height, out);
+
+          // a GLZ failure leaves the dictionary out of step with the server
+          if (!ok)
+            *status = PS_STATUS_ERROR;
+          break;
+
+        default:
+          ok = decode_lz4(lz->data, lz->data_size,
+              img->descriptor.width, img->descriptor.height, out);
+          break;
+      }
+      return ok;
+    }
+
+    default:
+      PS_LOG_ERROR("PureSpice does not support image type %u",
+          img->descriptor.type);
+      return false;
+  }
+}
+
+// the bytes per pixel of a format, zero for those of less than a byte
+static unsigned int bitmapBytes(PSBitmapFormat format)
+{
+  switch(format)
+  {
+    case PS_BITMAP_FMT_8BIT:
+    case PS_BITMAP_FMT_8BIT_A:
+      return 1;
+
+    case PS_BITMAP_FMT_16BIT:
+      return 2;
+
+    case PS_BITMAP_FMT_24BIT:
+      return 3;
+
+    case PS_BITMAP_FMT_32BIT:
+    case PS_BITMAP_FMT_RGBA:
+    case PS_BITMAP_FMT_ABGR:
+      return 4;
+
+    default:
+      return 0;
+  }
+}
+
+/* draws the width x height part of the image at (srcX, srcY) to (x, y), for
+ * the formats bitmapBytes does not know it has to be the whole image */
+static bool drawImage(PS * ps, unsigned int surfaceId,
+    const PSDecodedImage * image, int x, int y, int srcX, int srcY,
+    int width, int height)
+{
+  const unsigned int bytes = bitmapBytes(image->format);
+  const int          row   = image->topDown ?
+    srcY : (int)image->height - srcY - height;
+
+  uint8_t * data = image->data +
+    (size_t)row * image->stride + (size_t)srcX * bytes;
+
+  if (ps->config.display.frameComplete)
+  {
+    // whole rows unless that would run past the end of the image
+    const size_t end  = (size_t)image->stride * image->height;
+    const size_t left = end - (size_t)(data - image->data);
+    size_t       size = (size_t)image->stride * height;
+    if (size > left)
+      size = left;
+
+    return batch_bitmap(ps, surfaceId, image->format, image->topDown,
+        x, y, width, height, image->stride, data, size);
+  }
+
+  stats_displayUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.drawBitmap(surfaceId, image->format, image->topDown,
+        x, y, width, height, image->stride, data));
+  return true;
+}
+
 static PS_STATUS onMessage_displayDrawCopy(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgDisplayDrawCopy dst;
   resolveDisplayDrawCopy(channel->buffer, &dst);
 
@@ -317,37 +920,507 @@ static PS_STATUS onMessage_displayDrawCopy(PSChannel * channel)
     return PS_STATUS_OK;
   }
 
-  switch(dst.data.src_bitmap->descriptor.type)
+  const SpiceImage * img = dst.data.src_bitmap;
+  PSDecodedImage     image;
+  PS_STATUS          status;
+  if (!readImage(channel, img, &image, &status))
+    return status;
+
+  const bool           store  = surface_enabled(ps);
+  const PSOutputFormat target = store ? PS_OUTPUT_FMT_BGRA :
+    ps->config.display.outputFormat;
+  const PSBitmapFormat targetFormat = target == PS_OUTPUT_FMT_RGBA ?
+    PS_BITMAP_FMT_ABGR : PS_BITMAP_FMT_RGBA;
+
+  // the store draws 32-bit images either way up as they are
+  const bool direct = store && (image.format == PS_BITMAP_FMT_RGBA ||
+      image.format == PS_BITMAP_FMT_32BIT);
+
+  // images from the cache have already been converted
+  if (!direct && target != PS_OUTPUT_FMT_NATIVE &&
+      (image.format != targetFormat || !image.topDown))
   {
-    case SPICE_IMAGE_TYPE_BITMAP:
+    PSDecodedImage converted;
+    const bool ok = convert_image(&image, target, &converted);
+
+    decode_release(&image);
+    if (!ok)
+      return PS_STATUS_OK;
+
+    image = converted;
+  }
+
+  const SpiceRect * clip;
+  unsigned int      numClip;
+  if (!getClipRects(channel, &dst.base.clip, &clip, &numClip))
+  {
+    decode_release(&image);
+    return PS_STATUS_ERROR;
+  }
+
+  const SpiceRect * box = &dst.base.box;
+  bool ok = true;
+  if (store)
+  {
+    if (dst.data.mask.bitmap)
+      PS_LOG_WARN_ONCE("Masked draws are drawn unmasked");
+
+    surface_copy(ps, dst.base.surface_id, box, clip, numClip,
+        &dst.data.meta.src_area, &image, dst.data.meta.rop_descriptor);
+  }
+  else if (!numClip || !bitmapBytes(image.format))
+    ok = drawImage(ps, dst.base.surface_id, &image, box->left, box->top,
+        0, 0, image.width, image.height);
+  else
+  {
+    // the image is drawn from the box's origin
+    const SpiceRect bounds =
     {
-      SpiceBitmap bmp;
-      readSpiceBitmap(channel->buffer, dst.data.src_bitmap, &bmp);
-      const bool topDown = bmp.flags & SPICE_BITMAP_FLAGS_TOP_DOWN;
-      g_ps.config.display.drawBitmap(
-          dst.base.surface_id,
-          PS_BITMAP_FMT_RGBA,
-          topDown,
-          dst.base.box.left,
-          dst.base.box.top,
-          bmp.x,
-          bmp.y,
-          bmp.stride,
-          bmp.data);
-      break;
+      .top    = box->top,
+      .left   = box->left,
+      .bottom = box->bottom < box->top  + (int)image.height ?
+        box->bottom : box->top  + (int)image.height,
+      .right  = box->right  < box->left + (int)image.width  ?
+        box->right  : box->left + (int)image.width
+    };
+
+    for(unsigned int i = 0; i < numClip && ok; ++i)
+    {
+      SpiceRect rect;
+      if (clipBox(&bounds, &clip[i], &rect))
+        ok = drawImage(ps, dst.base.surface_id, &image,
+            rect.left, rect.top,
+            rect.left - box->left, rect.top - box->top,
+            rect.right - rect.left, rect.bottom - rect.top);
+    }
+  }
+
+  if (!ok)
+  {
+    decode_release(&image);
+    return PS_STATUS_ERROR;
+  }
+
+  if (img->descriptor.flags &
+      (SPICE_IMAGE_FLAGS_CACHE_ME | SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME))
+    cachePixmap(ps, img->descriptor.id, &image);
+
+  decode_release(&image);
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayMark(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+
+  // the server has finished a frame, hand over what has been drawn so far
+  flushDrawing(ps);
+
+  // the first frame after a reconnect has everything the server still has
+  if (ps->display->staleSurfaces)
+  {
+    ps->display->staleSurfaces = false;
+    for(int i = 0; i < PS_MAX_SURFACES; ++i)
+    {
+      PSSurface * surface = &ps->display->surfaces[i];
+      if (!surface->stale)
+        continue;
+
+      surface->created = false;
+      surface->stale   = false;
+      destroySurface(ps, i);
     }
+  }
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayInvalList(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayInvalList * msg = (SpiceMsgDisplayInvalList *)channel->buffer;
+
+  if (sizeof(*msg) + msg->count * sizeof(SpiceResourceID) >
+      channel->header.size)
+  {
+    PS_LOG_ERROR("SpiceMsgDisplayInvalList is truncated");
+    return PS_STATUS_ERROR;
+  }
+
+  for(unsigned int i = 0; i < msg->count; ++i)
+    if (msg->resources[i].type == SPICE_RES_TYPE_PIXMAP)
+      cache_remove(ps->pixmapCache, msg->resources[i].id);
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayInvalPalette(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayInvalOne * msg = (SpiceMsgDisplayInvalOne *)channel->buffer;
+  cache_remove(ps->paletteCache, msg->id);
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayInvalAllPalettes(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  cache_clear(ps->paletteCache);
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayInvalAllPixmaps(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+
+  /* the message carries a list of channels to wait for, there is only ever
+   * one display channel so there is nothing to wait on */
+  cache_clear(ps->pixmapCache);
+  return PS_STATUS_OK;
+}
+
+static PSStream * getStream(PS * ps, uint32_t id)
+{
+  if (id >= PS_MAX_STREAMS || !ps->display->streams[id].active)
+  {
+    PS_LOG_ERROR("Invalid stream id: %u", id);
+    return NULL;
+  }
+
+  return &ps->display->streams[id];
+}
+
+static void streamClip(PS * ps, uint32_t id, const SpiceClip * clip)
+{
+  if (!ps->config.display.streamClip)
+    return;
+
+  if (clip->type != SPICE_CLIP_TYPE_RECTS || !clip->rects->num_rects)
+  {
+    STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+      ps->config.display.streamClip(id, 0, NULL));
+    return;
+  }
+
+  const unsigned int count = clip->rects->num_rects;
+  PSRect * rects = malloc(count * sizeof(*rects));
+  if (!rects)
+  {
+    PS_LOG_ERROR("Failed to allocate the stream clip rects");
+    return;
+  }
+
+  for(unsigned int i = 0; i < count; ++i)
+  {
+    const SpiceRect * r = &clip->rects->rects[i];
+    rects[i] = (PSRect)
+    {
+      .x      = r->left,
+      .y      = r->top,
+      .width  = r->right  - r->left,
+      .height = r->bottom - r->top
+    };
+  }
+
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.streamClip(id, count, rects));
+  free(rects);
+}
+
+static PS_STATUS onMessage_displayStreamCreate(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayStreamCreate * msg =
+    (SpiceMsgDisplayStreamCreate *)channel->buffer;
+
+  if (msg->id >= PS_MAX_STREAMS)
+  {
+    PS_LOG_ERROR("Stream id %u is out of range", msg->id);
+    return PS_STATUS_ERROR;
+  }
+
+  PSVideoCodec codec;
+  switch(msg->codec_type)
+  {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG: codec = PS_VIDEO_CODEC_MJPEG; break;
+    case SPICE_VIDEO_CODEC_TYPE_VP8  : codec = PS_VIDEO_CODEC_VP8  ; break;
+    case SPICE_VIDEO_CODEC_TYPE_H264 : codec = PS_VIDEO_CODEC_H264 ; break;
+    case SPICE_VIDEO_CODEC_TYPE_VP9  : codec = PS_VIDEO_CODEC_VP9  ; break;
+    case SPICE_VIDEO_CODEC_TYPE_H265 : codec = PS_VIDEO_CODEC_H265 ; break;
 
     default:
-      PS_LOG_ERROR("PureSpice does not support compressed formats yet");
-      break;
+      PS_LOG_ERROR("Unknown video codec: %u", msg->codec_type);
+      return PS_STATUS_ERROR;
+  }
+
+  PSStream * stream = &ps->display->streams[msg->id];
+  memset(stream, 0, sizeof(*stream));
+  stream->active = true;
+  stream->width  = msg->stream_width;
+  stream->height = msg->stream_height;
+  stream->dest   = msg->dest;
+
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.streamCreate(
+        msg->id,
+        msg->surface_id,
+        codec,
+        msg->flags & SPICE_STREAM_FLAGS_TOP_DOWN,
+        msg->stream_width,
+        msg->stream_height,
+        msg->dest.left,
+        msg->dest.top,
+        msg->dest.right  - msg->dest.left,
+        msg->dest.bottom - msg->dest.top));
+
+  SpiceClip clip;
+  uint8_t * ptr = (uint8_t *)(msg + 1);
+  resolveSpiceClip(&ptr, &clip);
+  if (clip.type == SPICE_CLIP_TYPE_RECTS)
+    streamClip(ps, msg->id, &clip);
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS streamReport(PSChannel * channel, uint32_t id,
+    PSStream * stream, uint32_t frameTime)
+{
+  PS * ps = channel->ps;
+  const uint32_t now = purespice_getMMTime(ps);
+
+  if (stream->numFrames++ == 0)
+  {
+    stream->reportStart = get_timestamp();
+    stream->startMMTime = frameTime;
+  }
+
+  if (stream->numFrames < stream->maxWindow &&
+      get_timestamp() - stream->reportStart < stream->timeoutMS)
+    return PS_STATUS_OK;
+
+  SpiceMsgcDisplayStreamReport * msg =
+    SPICE_PACKET(SPICE_MSGC_DISPLAY_STREAM_REPORT,
+        SpiceMsgcDisplayStreamReport, 0);
+
+  msg->stream_id           = id;
+  msg->unique_id           = stream->uniqueId;
+  msg->start_frame_mm_time = stream->startMMTime;
+  msg->end_frame_mm_time   = frameTime;
+  msg->num_frames          = stream->numFrames;
+  msg->num_drops           = 0;
+  msg->last_frame_delay    = (int32_t)(frameTime - now);
+  msg->audio_delay         = UINT32_MAX;
+
+  stream->numFrames = 0;
+
+  if (!SPICE_SEND_PACKET(channel, msg))
+  {
+    PS_LOG_ERROR("Failed to send SpiceMsgcDisplayStreamReport");
+    return PS_STATUS_ERROR;
+  }
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS streamFrame(PSChannel * channel, uint32_t id,
+    uint32_t mmTime, unsigned int width, unsigned int height,
+    const SpiceRect * dest, const uint8_t * data, uint32_t size)
+{
+  PS * ps = channel->ps;
+  PSStream * stream = getStream(ps, id);
+  if (!stream)
+    return PS_STATUS_ERROR;
+
+  const uint8_t * end = channel->buffer + channel->header.size;
+  if (data > end || size > (size_t)(end - data))
+  {
+    PS_LOG_ERROR("Stream frame is larger then the message");
+    return PS_STATUS_ERROR;
+  }
+
+  stats_streamFrame(ps, mmTime);
+  stats_displayUpdate(ps);
+
+  // passed straight out of the receive buffer for the decoder to consume
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.streamData(
+        id,
+        mmTime,
+        width,
+        height,
+        dest->left,
+        dest->top,
+        dest->right  - dest->left,
+        dest->bottom - dest->top,
+        data,
+        size));
+
+  if (stream->report)
+    return streamReport(channel, id, stream, mmTime);
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayStreamData(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayStreamData * msg =
+    (SpiceMsgDisplayStreamData *)channel->buffer;
+
+  if (msg->base.id >= PS_MAX_STREAMS)
+  {
+    PS_LOG_ERROR("Stream id %u is out of range", msg->base.id);
+    return PS_STATUS_ERROR;
   }
 
+  const PSStream * stream = &ps->display->streams[msg->base.id];
+  return streamFrame(channel, msg->base.id, msg->base.multi_media_time,
+      stream->width, stream->height, &stream->dest,
+      msg->data, msg->data_size);
+}
+
+static PS_STATUS onMessage_displayStreamDataSized(PSChannel * channel)
+{
+  SpiceMsgDisplayStreamDataSized * msg =
+    (SpiceMsgDisplayStreamDataSized *)channel->buffer;
+
+  return streamFrame(channel, msg->base.id, msg->base.multi_media_time,
+      msg->width, msg->height, &msg->dest,
+      msg->data, msg->data_size);
+}
+
+static PS_STATUS onMessage_displayStreamClip(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayStreamClip * msg =
+    (SpiceMsgDisplayStreamClip *)channel->buffer;
+
+  if (!getStream(ps, msg->id))
+    return PS_STATUS_ERROR;
+
+  SpiceClip clip;
+  uint8_t * ptr = (uint8_t *)(msg + 1);
+  resolveSpiceClip(&ptr, &clip);
+  streamClip(ps, msg->id, &clip);
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayStreamDestroy(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayStreamDestroy * msg =
+    (SpiceMsgDisplayStreamDestroy *)channel->buffer;
+
+  PSStream * stream = getStream(ps, msg->id);
+  if (!stream)
+    return PS_STATUS_ERROR;
+
+  stream->active = false;
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.streamDestroy(msg->id));
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayStreamDestroyAll(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+
+  for(unsigned int i = 0; i < PS_MAX_STREAMS; ++i)
+    if (ps->display->streams[i].active)
+    {
+      ps->display->streams[i].active = false;
+      STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+        ps->config.display.streamDestroy(i));
+    }
+
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayStreamActivateReport(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayStreamActivateReport * msg =
+    (SpiceMsgDisplayStreamActivateReport *)channel->buffer;
+
+  PSStream * stream = getStream(ps, msg->stream_id);
+  if (!stream)
+    return PS_STATUS_ERROR;
+
+  stream->report    = true;
+  stream->uniqueId  = msg->unique_id;
+  stream->maxWindow = msg->max_window_size;
+  stream->timeoutMS = msg->timeout_ms;
+  stream->numFrames = 0;
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayGLScanout(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayGlScanoutUnix * msg =
+    (SpiceMsgDisplayGlScanoutUnix *)channel->buffer;
+
+  // the previous scanout is replaced, no fd at all disables it
+  releaseScanout(ps);
+  ps->display->glFd = channel->rxFd;
+  channel->rxFd     = -1;
+
+  const PSGLScanout scanout =
+  {
+    .fd      = ps->display->glFd,
+    .width   = msg->width,
+    .height  = msg->height,
+    .stride  = msg->stride,
+    .fourcc  = msg->drm_fourcc_format,
+    .topDown = msg->flags & SPICE_GL_SCANOUT_FLAGS_Y0TOP
+  };
+
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.glScanout(&scanout));
+  return PS_STATUS_OK;
+}
+
+static PS_STATUS onMessage_displayGLDraw(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgDisplayGlDraw * msg = (SpiceMsgDisplayGlDraw *)channel->buffer;
+
+  atomic_store(&ps->display->glDrawPending, true);
+  stats_displayUpdate(ps);
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.glDraw(msg->x, msg->y, msg->w, msg->h));
   return PS_STATUS_OK;
 }
 
+bool purespice_glDrawDone(PSSession * ps)
+{
+  PSChannel * channel = &ps->channels[PS_CHANNEL_DISPLAY];
+  if (!channel->connected || !channel->ready)
+    return false;
+
+  // the server expects exactly one for each draw
+  if (!atomic_exchange(&ps->display->glDrawPending, false))
+    return true;
+
+  void * packet = SPICE_RAW_PACKET(SPICE_MSGC_DISPLAY_GL_DRAW_DONE, 0, 0);
+  if (!SPICE_SEND_PACKET(channel, packet))
+  {
+    PS_LOG_ERROR("Failed to write SPICE_MSGC_DISPLAY_GL_DRAW_DONE");
+    return false;
+  }
+
+  return true;
+}
+
 PSHandlerFn channelDisplay_onMessage(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   channel->initDone = true;
+
+  // the fills gathered for drawFills go before anything else is drawn
+  if (channel->header.type != SPICE_MSG_DISPLAY_DRAW_FILL)
+    batch_flushFills(ps);
+
   switch(channel->header.type)
   {
     case SPICE_MSG_DISPLAY_SURFACE_CREATE:
@@ -361,6 +1434,72 @@ PSHandlerFn channelDisplay_onMessage(PSChannel * channel)
 
     case SPICE_MSG_DISPLAY_DRAW_COPY:
       return onMessage_displayDrawCopy;
+
+    case SPICE_MSG_DISPLAY_MARK:
+      if (!ps->config.display.frameComplete &&
+          !ps->config.reconnect.keepSurfaces)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayMark;
+
+    case SPICE_MSG_DISPLAY_INVAL_LIST:
+      return onMessage_displayInvalList;
+
+    case SPICE_MSG_DISPLAY_STREAM_CREATE:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamCreate;
+
+    case SPICE_MSG_DISPLAY_STREAM_DATA:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamData;
+
+    case SPICE_MSG_DISPLAY_STREAM_DATA_SIZED:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamDataSized;
+
+    case SPICE_MSG_DISPLAY_STREAM_CLIP:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamClip;
+
+    case SPICE_MSG_DISPLAY_STREAM_DESTROY:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamDestroy;
+
+    case SPICE_MSG_DISPLAY_STREAM_DESTROY_ALL:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamDestroyAll;
+
+    case SPICE_MSG_DISPLAY_STREAM_ACTIVATE_REPORT:
+      if (!ps->config.display.streamCreate)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayStreamActivateReport;
+
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PIXMAPS:
+      return onMessage_displayInvalAllPixmaps;
+
+    case SPICE_MSG_DISPLAY_INVAL_PALETTE:
+      return onMessage_displayInvalPalette;
+
+    case SPICE_MSG_DISPLAY_INVAL_ALL_PALETTES:
+      return onMessage_displayInvalAllPalettes;
+
+    case SPICE_MSG_DISPLAY_GL_SCANOUT_UNIX:
+      // over a UNIX socket the fd follows with a byte of its own
+      if (ps->family == AF_UNIX)
+        channel->trailerSize = 1;
+      if (!channel->passFds)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayGLScanout;
+
+    case SPICE_MSG_DISPLAY_GL_DRAW:
+      if (!channel->passFds)
+        return PS_HANDLER_DISCARD;
+      return onMessage_displayGLDraw;
   }
 
   return PS_HANDLER_DISCARD;
@@ -19,7 +19,13 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelDisplay_getConnectPacket(void);
+bool channelDisplay_create (PS * ps);
+void channelDisplay_destroy(PS * ps);
+
+// forgets the surfaces of the session once it has been disconnected
+void channelDisplay_deinit(PS * ps);
+
+const SpiceLinkHeader * channelDisplay_getConnectPacket(PS * ps);
 
 PS_STATUS channelDisplay_onConnect(PSChannel * channel);
 
@@ -23,10 +23,17 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "log.h"
 #include "channel.h"
 #include "messages.h"
+#include "mpsc.h"
+#include "stats.h"
 
 #include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
 
-const SpiceLinkHeader * channelInputs_getConnectPacket(void)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+const SpiceLinkHeader * channelInputs_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -37,7 +44,7 @@ const SpiceLinkHeader * channelInputs_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -53,8 +60,8 @@ const SpiceLinkHeader * channelInputs_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -76,16 +83,19 @@ static PS_STATUS onMessage_inputsInit(PSChannel * channel)
 
 static PS_STATUS onMessage_inputsKeyModifiers(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgInputsInit * msg = (SpiceMsgInputsInit *)channel->buffer;
-  g_ps.kb.modifiers = msg->modifiers;
+  ps->kb.modifiers = msg->modifiers;
   return PS_STATUS_OK;
 }
 
+static bool queuePendingMotion(PSChannel * channel);
+static bool motionThrottled(PS * ps);
+
 static PS_STATUS onMessage_inputsMouseMotionAck(PSChannel * channel)
 {
-  (void)channel;
-
-  const int count = atomic_fetch_sub(&g_ps.mouse.sentCount,
+  PS * ps = channel->ps;
+  const int count = atomic_fetch_sub(&ps->mouse.sentCount,
       SPICE_INPUT_MOTION_ACK_BUNCH);
 
   if (count < SPICE_INPUT_MOTION_ACK_BUNCH)
@@ -94,17 +104,32 @@ static PS_STATUS onMessage_inputsMouseMotionAck(PSChannel * channel)
     return PS_STATUS_ERROR;
   }
 
+  if ((!ps->mouse.motionPending && !ps->mouse.positionPending) ||
+      motionThrottled(ps))
+    return PS_STATUS_OK;
+
+  SPICE_LOCK(channel->lock);
+  const bool queued = queuePendingMotion(channel);
+  SPICE_UNLOCK(channel->lock);
+
+  if (!queued || !channel_flush(channel))
+  {
+    PS_LOG_ERROR("Failed to send the coalesced mouse motion");
+    return PS_STATUS_ERROR;
+  }
+
   return PS_STATUS_OK;
 }
 
 PSHandlerFn channelInputs_onMessage(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   if (!channel->initDone)
   {
     if (channel->header.type == SPICE_MSG_INPUTS_INIT)
       return onMessage_inputsInit;
 
-    purespice_disconnect();
+    purespice_disconnect(ps);
     PS_LOG_ERROR("Expected  SPICE_MSG_INPUTS_INIT but got %d", channel->header.type);
     return PS_HANDLER_ERROR;
   }
@@ -112,7 +137,7 @@ PSHandlerFn channelInputs_onMessage(PSChannel * channel)
   switch(channel->header.type)
   {
     case SPICE_MSG_INPUTS_INIT:
-      purespice_disconnect();
+      purespice_disconnect(ps);
       PS_LOG_ERROR("Unexpected SPICE_MSG_INPUTS_INIT");
       return PS_HANDLER_ERROR;
 
@@ -126,277 +151,440 @@ PSHandlerFn channelInputs_onMessage(PSChannel * channel)
   return PS_HANDLER_DISCARD;
 }
 
-bool purespice_keyDown(uint32_t code)
+typedef enum
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
-  if (!channel->connected || !channel->ready)
-    return false;
+  INPUT_KEY_DOWN,
+  INPUT_KEY_UP,
+  INPUT_KEY_MODIFIERS,
+  INPUT_MOUSE_POSITION,
+  INPUT_MOUSE_MOTION,
+  INPUT_MOUSE_PRESS,
+  INPUT_MOUSE_RELEASE
+}
+InputEventType;
 
-  if (code > 0x100)
-    code = 0xe0 | ((code - 0x100) << 8);
+typedef struct InputEvent
+{
+  InputEventType type;
+  union
+  {
+    uint32_t code;
+    uint32_t modifiers;
+    uint32_t button;
+    struct { uint32_t x, y; } position;
+    struct { int32_t  x, y; } motion;
+  }
+  u;
+}
+InputEvent;
 
-  SpiceMsgcKeyDown * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_DOWN,
-        SpiceMsgcKeyDown, 0);
-  msg->code = code;
+/* the queue and the eventfd live as long as the session. The UI threads push
+ * to them without synchronising with the loop, so freeing them on disconnect
+ * could leave a push using freed memory or a closed fd */
+bool channelInputs_create(PS * ps)
+{
+  ps->inputs.queue = mpsc_new(sizeof(InputEvent), PS_INPUT_QUEUE_SIZE);
+  if (!ps->inputs.queue)
+  {
+    PS_LOG_ERROR("Failed to allocate the input queue");
+    return false;
+  }
 
-  if (!SPICE_SEND_PACKET(channel, msg))
+  ps->inputs.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (ps->inputs.eventfd < 0)
   {
-    PS_LOG_ERROR("Failed to send SpiceMsgcKeyDown");
+    mpsc_free(ps->inputs.queue);
+    ps->inputs.queue = NULL;
+    PS_LOG_ERROR("Failed to create the input eventfd");
     return false;
   }
 
   return true;
 }
 
-bool purespice_keyUp(uint32_t code)
+void channelInputs_destroy(PS * ps)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
-  if (!channel->connected || !channel->ready)
-    return false;
-
-  if (code < 0x100)
-    code |= 0x80;
-  else
-    code = 0x80e0 | ((code - 0x100) << 8);
+  if (!ps->inputs.queue)
+    return;
 
-  SpiceMsgcKeyUp * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_UP,
-        SpiceMsgcKeyUp, 0);
-  msg->code = code;
+  close(ps->inputs.eventfd);
+  mpsc_free(ps->inputs.queue);
+  ps->inputs.queue   = NULL;
+  ps->inputs.eventfd = -1;
+}
 
-  if (!SPICE_SEND_PACKET(channel, msg))
+bool channelInputs_init(PS * ps)
+{
+  /* the eventfd is identified by the session's inputs poll source, it is
+   * polled along with the inputs channel so the queue is drained by the same
+   * thread that sends on it */
+  struct epoll_event ev =
   {
-    PS_LOG_ERROR("Failed to send SpiceMsgcKeyUp");
-    return false;
-  }
-
+    .events   = EPOLLIN,
+    .data.ptr = &ps->inputs.poll
+  };
+  epoll_ctl(ps->channels[PS_CHANNEL_INPUTS].epollfd, EPOLL_CTL_ADD,
+      ps->inputs.eventfd, &ev);
   return true;
 }
 
-bool purespice_keyModifiers(uint32_t modifiers)
+void channelInputs_deinit(PS * ps)
+{
+  epoll_ctl(ps->channels[PS_CHANNEL_INPUTS].epollfd, EPOLL_CTL_DEL,
+      ps->inputs.eventfd, NULL);
+}
+
+/* every connection of the channel starts with nothing in flight, the server
+ * never acks the motion sent on the previous one. Runs on the thread that
+ * drains the queue, so the events left over from that connection are dropped
+ * along with the motion held back */
+PS_STATUS channelInputs_onConnect(PSChannel * channel)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
+  PS * ps = channel->ps;
+
+  ps->mouse.buttonState     = 0;
+  ps->mouse.motionPending   = false;
+  ps->mouse.positionPending = false;
+  atomic_store(&ps->mouse.sentCount, 0);
+
+  InputEvent event;
+  while(mpsc_pop(ps->inputs.queue, &event)) {}
+
+  return PS_STATUS_OK;
+}
+
+static bool pushEvent(PS * ps, const InputEvent * event)
+{
+  PSChannel * channel = &ps->channels[PS_CHANNEL_INPUTS];
   if (!channel->connected || !channel->ready)
     return false;
 
-  SpiceMsgcInputsKeyModifiers * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_MODIFIERS,
-        SpiceMsgcInputsKeyModifiers, 0);
-  msg->modifiers = modifiers;
-
-  if (!SPICE_SEND_PACKET(channel, msg))
+  if (!mpsc_push(ps->inputs.queue, event))
   {
-    PS_LOG_ERROR("Failed to send SpiceMsgcInputsKeyModifiers");
+    PS_LOG_WARN_ONCE("The input queue is full, events are being dropped");
     return false;
   }
 
+  stats_input(ps, event->type >= INPUT_MOUSE_POSITION);
+
+  // only wake the IO loop if it has not already been asked to drain the queue
+  if (!atomic_exchange(&ps->inputs.wakePending, true))
+  {
+    const uint64_t value = 1;
+    if (write(ps->inputs.eventfd, &value, sizeof(value)) != sizeof(value))
+      PS_LOG_ERROR("Failed to signal the input eventfd");
+  }
+
   return true;
 }
 
-bool purespice_mouseMode(bool server)
+static uint32_t buttonMask(uint32_t button)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_MAIN];
-  if (!channel->connected || !channel->ready)
-    return false;
-
-  SpiceMsgcMainMouseModeRequest * msg = SPICE_PACKET(
-    SPICE_MSGC_MAIN_MOUSE_MODE_REQUEST,
-    SpiceMsgcMainMouseModeRequest, 0);
+  switch(button)
+  {
+    case SPICE_MOUSE_BUTTON_LEFT   : return SPICE_MOUSE_BUTTON_MASK_LEFT  ;
+    case SPICE_MOUSE_BUTTON_MIDDLE : return SPICE_MOUSE_BUTTON_MASK_MIDDLE;
+    case SPICE_MOUSE_BUTTON_RIGHT  : return SPICE_MOUSE_BUTTON_MASK_RIGHT ;
+    case _SPICE_MOUSE_BUTTON_SIDE  : return _SPICE_MOUSE_BUTTON_MASK_SIDE ;
+    case _SPICE_MOUSE_BUTTON_EXTRA : return _SPICE_MOUSE_BUTTON_MASK_EXTRA;
+  }
 
-  msg->mouse_mode = server ? SPICE_MOUSE_MODE_SERVER : SPICE_MOUSE_MODE_CLIENT;
+  return 0;
+}
 
-  if (!SPICE_SEND_PACKET(channel, msg))
+static bool queueMotion(PSChannel * channel, int32_t x, int32_t y)
+{
+  PS * ps = channel->ps;
+  /* while the protocol supports movements greater then +-127 the QEMU
+   * virtio-mouse device does not, so we need to split this up into seperate
+   * messages */
+  do
   {
-    PS_LOG_ERROR("Failed to send SpiceMsgcMainMouseModeRequest");
-    return false;
+    SpiceMsgcMouseMotion * msg =
+      SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_MOTION, SpiceMsgcMouseMotion, 0);
+
+    msg->x            = x > 127 ? 127 : (x < -127 ? -127 : x);
+    msg->y            = y > 127 ? 127 : (y < -127 ? -127 : y);
+    msg->button_state = ps->mouse.buttonState;
+
+    x -= msg->x;
+    y -= msg->y;
+
+    if (!SPICE_SEND_PACKET_NL(channel, msg))
+      return false;
+
+    atomic_fetch_add(&ps->mouse.sentCount, 1);
   }
+  while(x != 0 || y != 0);
 
   return true;
 }
 
-bool purespice_mousePosition(uint32_t x, uint32_t y)
+static bool queuePosition(PSChannel * channel, uint32_t x, uint32_t y)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
-  if (!channel->connected || !channel->ready)
-    return false;
-
+  PS * ps = channel->ps;
   SpiceMsgcMousePosition * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_POSITION, SpiceMsgcMousePosition, 0);
+    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_POSITION,
+        SpiceMsgcMousePosition, 0);
 
-  SPICE_LOCK(g_ps.mouse.lock);
   msg->display_id   = 0;
-  msg->button_state = g_ps.mouse.buttonState;
+  msg->button_state = ps->mouse.buttonState;
   msg->x            = x;
   msg->y            = y;
-  SPICE_UNLOCK(g_ps.mouse.lock);
 
-  atomic_fetch_add(&g_ps.mouse.sentCount, 1);
-  if (!SPICE_SEND_PACKET(channel, msg))
-  {
-    PS_LOG_ERROR("Failed to send SpiceMsgcMousePosition");
+  if (!SPICE_SEND_PACKET_NL(channel, msg))
     return false;
-  }
 
+  atomic_fetch_add(&ps->mouse.sentCount, 1);
   return true;
 }
 
-bool purespice_mouseMotion(int32_t x, int32_t y)
+static bool motionThrottled(PS * ps)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
-  if (!channel->connected || !channel->ready)
-    return false;
+  return ps->config.inputs.coalesceMotion &&
+    atomic_load(&ps->mouse.sentCount) >= PS_MOTION_INFLIGHT_MAX;
+}
 
-  /* while the protocol supports movements greater then +-127 the QEMU
-   * virtio-mouse device does not, so we need to split this up into seperate
-   * messages. For performance we build this as a single buffer otherwise this
-   * will be split into multiple packets */
+static bool queuePendingMotion(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  if (ps->mouse.motionPending)
+  {
+    ps->mouse.motionPending = false;
+    if (!queueMotion(channel, ps->mouse.motionX, ps->mouse.motionY))
+      return false;
+  }
 
-  const unsigned delta = abs(x) > abs(y) ? abs(x) : abs(y);
-  const unsigned msgs  = (delta + 126) / 127;
+  if (ps->mouse.positionPending)
+  {
+    ps->mouse.positionPending = false;
+    if (!queuePosition(channel, ps->mouse.positionX, ps->mouse.positionY))
+      return false;
+  }
+
+  return true;
+}
 
-  // only one message, so just send it normally
-  if (msgs == 1)
+static bool queueEvent(PSChannel * channel, const InputEvent * event)
+{
+  PS * ps = channel->ps;
+  switch(event->type)
   {
-    SpiceMsgcMouseMotion * msg =
-      SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_MOTION, SpiceMsgcMouseMotion, 0);
+    case INPUT_KEY_DOWN:
+    {
+      SpiceMsgcKeyDown * msg =
+        SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_DOWN, SpiceMsgcKeyDown, 0);
+      msg->code = event->u.code;
+      return SPICE_SEND_PACKET_NL(channel, msg);
+    }
 
-    SPICE_LOCK(g_ps.mouse.lock);
-    msg->x            = x;
-    msg->y            = y;
-    msg->button_state = g_ps.mouse.buttonState;
-    SPICE_UNLOCK(g_ps.mouse.lock);
+    case INPUT_KEY_UP:
+    {
+      SpiceMsgcKeyUp * msg =
+        SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_UP, SpiceMsgcKeyUp, 0);
+      msg->code = event->u.code;
+      return SPICE_SEND_PACKET_NL(channel, msg);
+    }
 
-    atomic_fetch_add(&g_ps.mouse.sentCount, 1);
-    if (!SPICE_SEND_PACKET(channel, msg))
+    case INPUT_KEY_MODIFIERS:
     {
-      PS_LOG_ERROR("Failed to send SpiceMsgcMouseMotion");
-      return false;
+      SpiceMsgcInputsKeyModifiers * msg =
+        SPICE_PACKET(SPICE_MSGC_INPUTS_KEY_MODIFIERS,
+            SpiceMsgcInputsKeyModifiers, 0);
+      msg->modifiers = event->u.modifiers;
+      return SPICE_SEND_PACKET_NL(channel, msg);
     }
 
-    return true;
+    case INPUT_MOUSE_POSITION:
+      // only the latest position matters, hold it until the server catches up
+      if (motionThrottled(ps))
+      {
+        ps->mouse.positionPending = true;
+        ps->mouse.positionX       = event->u.position.x;
+        ps->mouse.positionY       = event->u.position.y;
+        return true;
+      }
+
+      return queuePendingMotion(channel) &&
+        queuePosition(channel, event->u.position.x, event->u.position.y);
+
+    case INPUT_MOUSE_MOTION:
+      // accumulate the deltas until the server catches up
+      if (motionThrottled(ps))
+      {
+        if (!ps->mouse.motionPending)
+        {
+          ps->mouse.motionPending = true;
+          ps->mouse.motionX       = 0;
+          ps->mouse.motionY       = 0;
+        }
+
+        ps->mouse.motionX += event->u.motion.x;
+        ps->mouse.motionY += event->u.motion.y;
+        return true;
+      }
+
+      return queuePendingMotion(channel) &&
+        queueMotion(channel, event->u.motion.x, event->u.motion.y);
+
+    case INPUT_MOUSE_PRESS:
+    case INPUT_MOUSE_RELEASE:
+    {
+      // the press must land where the pointer was moved to
+      if (!queuePendingMotion(channel))
+        return false;
+
+      if (event->type == INPUT_MOUSE_PRESS)
+        ps->mouse.buttonState |=  buttonMask(event->u.button);
+      else
+        ps->mouse.buttonState &= ~buttonMask(event->u.button);
+
+      // press and release share the same message layout
+      SpiceMsgcMousePress * msg =
+        SPICE_PACKET(event->type == INPUT_MOUSE_PRESS ?
+            SPICE_MSGC_INPUTS_MOUSE_PRESS : SPICE_MSGC_INPUTS_MOUSE_RELEASE,
+            SpiceMsgcMousePress, 0);
+      msg->button       = event->u.button;
+      msg->button_state = ps->mouse.buttonState;
+      return SPICE_SEND_PACKET_NL(channel, msg);
+    }
   }
 
-  const size_t bufferSize = (
-    sizeof(SpiceMiniDataHeader ) +
-    sizeof(SpiceMsgcMouseMotion)
-  ) * msgs;
+  return false;
+}
 
-  if (bufferSize > g_ps.motionBufferSize)
+bool channelInputs_processQueue(PS * ps)
+{
+  uint64_t value;
+  if (read(ps->inputs.eventfd, &value, sizeof(value)) < 0 &&
+      errno != EAGAIN)
   {
-    if (g_ps.motionBuffer)
-      free(g_ps.motionBuffer);
-    g_ps.motionBuffer     = malloc(bufferSize);
-    g_ps.motionBufferSize = bufferSize;
+    PS_LOG_ERROR("Failed to read the input eventfd");
+    return false;
   }
 
-  uint8_t * buffer = g_ps.motionBuffer;
-  uint8_t * msg    = buffer;
+  // clear the flag before draining so that a push racing with us wakes us
+  // again instead of being left in the queue
+  atomic_store(&ps->inputs.wakePending, false);
 
-  SPICE_LOCK(g_ps.mouse.lock);
-  while(x != 0 || y != 0)
-  {
-    SpiceMiniDataHeader  *h = (SpiceMiniDataHeader  *)msg;
-    SpiceMsgcMouseMotion *m = (SpiceMsgcMouseMotion *)(h + 1);
-    msg = (uint8_t*)(m + 1);
+  PSChannel * channel = &ps->channels[PS_CHANNEL_INPUTS];
+  InputEvent  event;
+  bool        queued = false;
 
-    h->size = sizeof(SpiceMsgcMouseMotion);
-    h->type = SPICE_MSGC_INPUTS_MOUSE_MOTION;
+  SPICE_LOCK(channel->lock);
+  while(mpsc_pop(ps->inputs.queue, &event))
+  {
+    if (!channel->connected)
+      continue;
 
-    m->x = x > 127 ? 127 : (x < -127 ? -127 : x);
-    m->y = y > 127 ? 127 : (y < -127 ? -127 : y);
-    m->button_state = g_ps.mouse.buttonState;
+    if (!queueEvent(channel, &event))
+    {
+      PS_LOG_ERROR("Failed to queue an input event");
+      continue;
+    }
 
-    x -= m->x;
-    y -= m->y;
+    queued = true;
   }
-  SPICE_UNLOCK(g_ps.mouse.lock);
-
-  atomic_fetch_add(&g_ps.mouse.sentCount, msgs);
-
-  SPICE_LOCK(channel->lock);
-  const ssize_t wrote = send(channel->socket, buffer, bufferSize, 0);
   SPICE_UNLOCK(channel->lock);
 
-  if ((size_t)wrote != bufferSize)
+  // send everything drained above in one write
+  if (queued && !channel_flush(channel))
   {
-    PS_LOG_ERROR("Only wrote %ld of the expected %ld bytes", wrote, bufferSize);
+    PS_LOG_ERROR("Failed to send the input events");
     return false;
   }
 
   return true;
 }
 
-bool purespice_mousePress(uint32_t button)
+bool purespice_keyDown(PSSession * ps, uint32_t code)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
-  if (!channel->connected || !channel->ready)
-    return false;
+  if (code > 0x100)
+    code = 0xe0 | ((code - 0x100) << 8);
 
-  SPICE_LOCK(g_ps.mouse.lock);
-  switch(button)
+  return pushEvent(ps, &(InputEvent)
   {
-    case SPICE_MOUSE_BUTTON_LEFT   :
-      g_ps.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_LEFT   ; break;
-    case SPICE_MOUSE_BUTTON_MIDDLE :
-      g_ps.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_MIDDLE ; break;
-    case SPICE_MOUSE_BUTTON_RIGHT  :
-      g_ps.mouse.buttonState |= SPICE_MOUSE_BUTTON_MASK_RIGHT  ; break;
-    case _SPICE_MOUSE_BUTTON_SIDE  :
-      g_ps.mouse.buttonState |= _SPICE_MOUSE_BUTTON_MASK_SIDE  ; break;
-    case _SPICE_MOUSE_BUTTON_EXTRA :
-      g_ps.mouse.buttonState |= _SPICE_MOUSE_BUTTON_MASK_EXTRA ; break;
-  }
-
-  SpiceMsgcMousePress * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_PRESS, SpiceMsgcMousePress, 0);
+    .type   = INPUT_KEY_DOWN,
+    .u.code = code
+  });
+}
 
-  msg->button       = button;
-  msg->button_state = g_ps.mouse.buttonState;
-  SPICE_UNLOCK(g_ps.mouse.lock);
+bool purespice_keyUp(PSSession * ps, uint32_t code)
+{
+  if (code < 0x100)
+    code |= 0x80;
+  else
+    code = 0x80e0 | ((code - 0x100) << 8);
 
-  if (!SPICE_SEND_PACKET(channel, msg))
+  return pushEvent(ps, &(InputEvent)
   {
-    PS_LOG_ERROR("Failed to write SpiceMsgcMousePress");
-    return false;
-  }
+    .type   = INPUT_KEY_UP,
+    .u.code = code
+  });
+}
 
-  return true;
+bool purespice_keyModifiers(PSSession * ps, uint32_t modifiers)
+{
+  return pushEvent(ps, &(InputEvent)
+  {
+    .type        = INPUT_KEY_MODIFIERS,
+    .u.modifiers = modifiers
+  });
 }
 
-bool purespice_mouseRelease(uint32_t button)
+bool purespice_mouseMode(PSSession * ps, bool server)
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_INPUTS];
+  PSChannel * channel = &ps->channels[PS_CHANNEL_MAIN];
   if (!channel->connected || !channel->ready)
     return false;
 
-  SPICE_LOCK(g_ps.mouse.lock);
-  switch(button)
-  {
-    case SPICE_MOUSE_BUTTON_LEFT   :
-      g_ps.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_LEFT   ; break;
-    case SPICE_MOUSE_BUTTON_MIDDLE :
-      g_ps.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_MIDDLE ; break;
-    case SPICE_MOUSE_BUTTON_RIGHT  :
-      g_ps.mouse.buttonState &= ~SPICE_MOUSE_BUTTON_MASK_RIGHT  ; break;
-    case _SPICE_MOUSE_BUTTON_SIDE  :
-      g_ps.mouse.buttonState &= ~_SPICE_MOUSE_BUTTON_MASK_SIDE  ; break;
-    case _SPICE_MOUSE_BUTTON_EXTRA :
-      g_ps.mouse.buttonState &= ~_SPICE_MOUSE_BUTTON_MASK_EXTRA ; break;
-  }
-
-  SpiceMsgcMouseRelease * msg =
-    SPICE_PACKET(SPICE_MSGC_INPUTS_MOUSE_RELEASE, SpiceMsgcMouseRelease, 0);
+  SpiceMsgcMainMouseModeRequest * msg = SPICE_PACKET(
+    SPICE_MSGC_MAIN_MOUSE_MODE_REQUEST,
+    SpiceMsgcMainMouseModeRequest, 0);
 
-  msg->button       = button;
-  msg->button_state = g_ps.mouse.buttonState;
-  SPICE_UNLOCK(g_ps.mouse.lock);
+  msg->mouse_mode = server ? SPICE_MOUSE_MODE_SERVER : SPICE_MOUSE_MODE_CLIENT;
 
   if (!SPICE_SEND_PACKET(channel, msg))
   {
-    PS_LOG_ERROR("Failed to write SpiceMsgcMouseRelease");
+    PS_LOG_ERROR("Failed to send SpiceMsgcMainMouseModeRequest");
     return false;
   }
 
   return true;
 }
+
+bool purespice_mousePosition(PSSession * ps, uint32_t x, uint32_t y)
+{
+  return pushEvent(ps, &(InputEvent)
+  {
+    .type       = INPUT_MOUSE_POSITION,
+    .u.position = { .x = x, .y = y }
+  });
+}
+
+bool purespice_mouseMotion(PSSession * ps, int32_t x, int32_t y)
+{
+  return pushEvent(ps, &(InputEvent)
+  {
+    .type     = INPUT_MOUSE_MOTION,
+    .u.motion = { .x = x, .y = y }
+  });
+}
+
+bool purespice_mousePress(PSSession * ps, uint32_t button)
+{
+  return pushEvent(ps, &(InputEvent)
+  {
+    .type     = INPUT_MOUSE_PRESS,
+    .u.button = button
+  });
+}
+
+bool purespice_mouseRelease(PSSession * ps, uint32_t button)
+{
+  return pushEvent(ps, &(InputEvent)
+  {
+    .type     = INPUT_MOUSE_RELEASE,
+    .u.button = button
+  });
+}
@@ -19,6 +19,17 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelInputs_getConnectPacket(void);
+const SpiceLinkHeader * channelInputs_getConnectPacket(PS * ps);
+
+PS_STATUS channelInputs_onConnect(PSChannel * channel);
 
 PSHandlerFn channelInputs_onMessage(PSChannel * channel);
+
+bool channelInputs_create (PS * ps);
+void channelInputs_destroy(PS * ps);
+
+bool channelInputs_init(PS * ps);
+
+void channelInputs_deinit(PS * ps);
+
+bool channelInputs_processQueue(PS * ps);
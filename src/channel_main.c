@@ -22,6 +22,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "channel.h"
 #include "agent.h"
 #include "messages.h"
+#include "stats.h"
 
 #include <stdlib.h>
 
@@ -36,9 +37,25 @@ struct ChannelMain
   bool hasList;
 };
 
-static struct ChannelMain cm = { 0 };
+bool channelMain_create(PS * ps)
+{
+  ps->main = calloc(1, sizeof(*ps->main));
+  if (!ps->main)
+  {
+    PS_LOG_ERROR("Failed to allocate the main channel state");
+    return false;
+  }
+
+  return true;
+}
+
+void channelMain_destroy(PS * ps)
+{
+  free(ps->main);
+  ps->main = NULL;
+}
 
-const SpiceLinkHeader * channelMain_getConnectPacket(void)
+const SpiceLinkHeader * channelMain_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -49,7 +66,7 @@ const SpiceLinkHeader * channelMain_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -65,8 +82,8 @@ const SpiceLinkHeader * channelMain_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -78,73 +95,99 @@ const SpiceLinkHeader * channelMain_getConnectPacket(void)
   MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_AGENT_CONNECTED_TOKENS);
   MAIN_SET_CAPABILITY(p.channelCaps, SPICE_MAIN_CAP_NAME_AND_UUID         );
 
-  memset(&cm, 0, sizeof(cm));
+  memset(ps->main, 0, sizeof(*ps->main));
 
   return &p.header;
 }
 
-void channelMain_setCaps(const uint32_t * common, int numCommon,
+void channelMain_setCaps(PS * ps, const uint32_t * common, int numCommon,
     const uint32_t * channel, int numChannel)
 {
+  struct ChannelMain * cm = ps->main;
   /* for whatever reason the spice server does not report that it supports these
    * capabilities so we are just going to assume it does until the below PR is
    * merged, or indefiniately if it's rejected.
    * https://gitlab.freedesktop.org/spice/spice/-/merge_requests/198
    */
 #if 0
-  cm.capAgentTokens = HAS_CAPABILITY(channel, numChannel,
+  cm->capAgentTokens = HAS_CAPABILITY(channel, numChannel,
       SPICE_MAIN_CAP_AGENT_CONNECTED_TOKENS);
-  cm.capNameAndUUID = HAS_CAPABILITY(channel, numChannel,
+  cm->capNameAndUUID = HAS_CAPABILITY(channel, numChannel,
       SPICE_MAIN_CAP_NAME_AND_UUID);
 #else
   (void) common;
   (void) numCommon;
   (void) channel;
   (void) numChannel;
-  cm.capAgentTokens = true;
-  cm.capNameAndUUID = true;
+  cm->capAgentTokens = true;
+  cm->capNameAndUUID = true;
 #endif
 }
 
-static void checkReady(void)
+void channelMain_checkReady(PS * ps)
 {
-  if (cm.ready)
+  struct ChannelMain * cm = ps->main;
+  if (cm->ready)
     return;
 
-  if (cm.capNameAndUUID)
+  if (cm->capNameAndUUID)
   {
-    if (!cm.hasName || !cm.hasUUID)
+    if (!cm->hasName || !cm->hasUUID)
       return;
   }
 
-  if (!cm.hasList)
+  if (!cm->hasList)
     return;
 
-  cm.ready = true;
-  if (g_ps.config.ready)
-    g_ps.config.ready();
+  // the channels from the list link in parallel, wait for all of them
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    if (ps->channels[i].link != PS_LINK_NONE)
+      return;
+
+  cm->ready = true;
+  if (ps->config.ready)
+    STATS_CALLBACK(ps, PS_CHANNEL_MAIN, ps->config.ready());
+}
+
+static void setMMTime(PS * ps, uint32_t time)
+{
+  /* the time was the server's when the message was sent, it has since moved
+   * on by the one way delay, taken as half the round trip */
+  uint32_t rttUS = 0, rttVarUS;
+  channel_getRTT(&ps->channels[PS_CHANNEL_MAIN], &rttUS, &rttVarUS);
+
+  atomic_store(&ps->mmTimeOffset,
+      (int64_t)time + rttUS / 2000 - (int64_t)get_timestamp());
+}
+
+uint32_t purespice_getMMTime(PSSession * ps)
+{
+  // the server's clock is 32-bit and wraps, so does ours
+  return (uint32_t)(get_timestamp() + atomic_load(&ps->mmTimeOffset));
 }
 
 static PS_STATUS onMessage_mainInit(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   channel->initDone = true;
 
   SpiceMsgMainInit * msg = (SpiceMsgMainInit *)channel->buffer;
-  g_ps.sessionID = msg->session_id;
-  agent_setServerTokens(msg->agent_tokens);
+  ps->sessionID = msg->session_id;
+  agent_setServerTokens(ps, msg->agent_tokens);
+  setMMTime(ps, msg->multi_media_time);
 
   if (msg->agent_connected)
   {
     PS_STATUS status;
-    if ((status = agent_connect()) != PS_STATUS_OK)
+    if ((status = agent_connect(ps)) != PS_STATUS_OK)
     {
-      purespice_disconnect();
+      purespice_disconnect(ps);
       return status;
     }
   }
 
   if (msg->current_mouse_mode != SPICE_MOUSE_MODE_CLIENT &&
-      !purespice_mouseMode(false))
+      !purespice_mouseMode(ps, false))
   {
     PS_LOG_ERROR("Failed to set the initial mouse mode");
     return PS_STATUS_ERROR;
@@ -153,7 +196,7 @@ static PS_STATUS onMessage_mainInit(struct PSChannel * channel)
   void * packet = SPICE_RAW_PACKET(SPICE_MSGC_MAIN_ATTACH_CHANNELS, 0, 0);
   if (!SPICE_SEND_PACKET(channel, packet))
   {
-    purespice_disconnect();
+    purespice_disconnect(ps);
     PS_LOG_ERROR("Failed to write SPICE_MSGC_MAIN_ATTACH_CHANNELS");
     return PS_STATUS_ERROR;
   }
@@ -161,23 +204,37 @@ static PS_STATUS onMessage_mainInit(struct PSChannel * channel)
   return PS_STATUS_OK;
 }
 
+static PS_STATUS onMessage_mainMultiMediaTime(struct PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  SpiceMsgMainMultiMediaTime * msg =
+    (SpiceMsgMainMultiMediaTime *)channel->buffer;
+
+  setMMTime(ps, msg->time);
+  return PS_STATUS_OK;
+}
+
 static PS_STATUS onMessage_mainName(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  struct ChannelMain * cm = ps->main;
   SpiceMsgMainName * msg = (SpiceMsgMainName *)channel->buffer;
   PS_LOG_INFO("Guest name: %s", msg->name);
 
-  if (g_ps.guestName)
-    free(g_ps.guestName);
+  if (ps->guestName)
+    free(ps->guestName);
 
-  g_ps.guestName = strdup((char *)msg->name);
-  cm.hasName = true;
+  ps->guestName = strdup((char *)msg->name);
+  cm->hasName = true;
 
-  checkReady();
+  channelMain_checkReady(ps);
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_mainUUID(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  struct ChannelMain * cm = ps->main;
   SpiceMsgMainUUID * msg = (SpiceMsgMainUUID *)channel->buffer;
 
   PS_LOG_INFO("Guest UUID: "
@@ -187,27 +244,29 @@ static PS_STATUS onMessage_mainUUID(struct PSChannel * channel)
       msg->uuid[10], msg->uuid[11], msg->uuid[12], msg->uuid[13], msg->uuid[14],
       msg->uuid[15]);
 
-  memcpy(g_ps.guestUUID, msg->uuid, sizeof(g_ps.guestUUID));
-  cm.hasUUID = true;
+  memcpy(ps->guestUUID, msg->uuid, sizeof(ps->guestUUID));
+  cm->hasUUID = true;
 
-  checkReady();
+  channelMain_checkReady(ps);
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_mainChannelsList(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  struct ChannelMain * cm = ps->main;
   SpiceMainChannelsList * msg = (SpiceMainChannelsList *)channel->buffer;
 
   for(int n = 0; n < PS_CHANNEL_MAX; ++n)
   {
-    struct PSChannel * ch = &g_ps.channels[n];
+    struct PSChannel * ch = &ps->channels[n];
     ch->available = false;
   }
 
   for(size_t i = 0; i < msg->num_of_channels; ++i)
     for(int n = 0; n < PS_CHANNEL_MAX; ++n)
     {
-      struct PSChannel * ch = &g_ps.channels[n];
+      struct PSChannel * ch = &ps->channels[n];
       if (ch->spiceType != msg->channels[i].type)
        continue;
 
@@ -215,9 +274,9 @@ static PS_STATUS onMessage_mainChannelsList(struct PSChannel * channel)
       if ((ch->enable && !*ch->enable) || (ch->autoConnect && !*ch->autoConnect))
         continue;
 
-      if (ch->connected)
+      if (ch->connected || ch->link != PS_LINK_NONE)
       {
-        purespice_disconnect();
+        purespice_disconnect(ps);
         PS_LOG_ERROR("Protocol error. The server asked us to reconnect an "
             "already connected channel (%s)", ch->name);
         return PS_STATUS_ERROR;
@@ -226,7 +285,7 @@ static PS_STATUS onMessage_mainChannelsList(struct PSChannel * channel)
       PS_STATUS status = ps_connectChannel(ch);
       if (status != PS_STATUS_OK)
       {
-        purespice_disconnect();
+        purespice_disconnect(ps);
         PS_LOG_ERROR("Failed to connect to the %s channel", ch->name);
         return status;
       }
@@ -234,19 +293,19 @@ static PS_STATUS onMessage_mainChannelsList(struct PSChannel * channel)
       break;
     }
 
-  cm.hasList = true;
-  checkReady();
+  cm->hasList = true;
+  channelMain_checkReady(ps);
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_mainAgentConnected(struct PSChannel * channel)
 {
-  (void)channel;
+  PS * ps = channel->ps;
 
   PS_STATUS status;
-  if ((status = agent_connect()) != PS_STATUS_OK)
+  if ((status = agent_connect(ps)) != PS_STATUS_OK)
   {
-    purespice_disconnect();
+    purespice_disconnect(ps);
     return status;
   }
 
@@ -255,28 +314,31 @@ static PS_STATUS onMessage_mainAgentConnected(struct PSChannel * channel)
 
 static PS_STATUS onMessage_mainAgentConnectedTokens(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   uint32_t num_tokens = *(uint32_t *)channel->buffer;
 
-  agent_setServerTokens(num_tokens);
+  agent_setServerTokens(ps, num_tokens);
   return onMessage_mainAgentConnected(channel);
 }
 
 static PS_STATUS onMessage_mainAgentDisconnected(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   uint32_t error = *(uint32_t *)channel->buffer;
 
-  agent_disconnect();
+  agent_disconnect(ps);
   PS_LOG_WARN("Disconnected from the spice guest agent: %u", error);
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_mainAgentData(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   PS_STATUS status;
   if ((status = agent_process(channel)) != PS_STATUS_OK)
   {
     PS_LOG_ERROR("Failed to process agent data");
-    purespice_disconnect();
+    purespice_disconnect(ps);
   }
 
   return status;
@@ -284,12 +346,13 @@ static PS_STATUS onMessage_mainAgentData(struct PSChannel * channel)
 
 static PS_STATUS onMessage_mainAgentToken(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   uint32_t num_tokens = *(uint32_t *)channel->buffer;
 
-  agent_returnServerTokens(num_tokens);
-  if (!agent_processQueue())
+  agent_returnServerTokens(ps, num_tokens);
+  if (!agent_processQueue(ps))
   {
-    purespice_disconnect();
+    purespice_disconnect(ps);
     PS_LOG_ERROR("Failed to process the agent queue");
     return PS_STATUS_ERROR;
   }
@@ -299,12 +362,13 @@ static PS_STATUS onMessage_mainAgentToken(struct PSChannel * channel)
 
 PSHandlerFn channelMain_onMessage(struct PSChannel * channel)
 {
+  PS * ps = channel->ps;
   if (!channel->initDone)
   {
     if (channel->header.type == SPICE_MSG_MAIN_INIT)
       return onMessage_mainInit;
 
-    purespice_disconnect();
+    purespice_disconnect(ps);
     PS_LOG_ERROR("Expected SPICE_MSG_MAIN_INIT but got %d", channel->header.type);
     return PS_HANDLER_ERROR;
   }
@@ -312,7 +376,7 @@ PSHandlerFn channelMain_onMessage(struct PSChannel * channel)
   switch(channel->header.type)
   {
     case SPICE_MSG_MAIN_INIT:
-      purespice_disconnect();
+      purespice_disconnect(ps);
       PS_LOG_ERROR("Unexpected SPICE_MSG_MAIN_INIT");
       return PS_HANDLER_ERROR;
 
@@ -329,7 +393,7 @@ PSHandlerFn channelMain_onMessage(struct PSChannel * channel)
       return PS_HANDLER_DISCARD;
 
     case SPICE_MSG_MAIN_MULTI_MEDIA_TIME:
-      return PS_HANDLER_DISCARD;
+      return onMessage_mainMultiMediaTime;
 
     case SPICE_MSG_MAIN_AGENT_CONNECTED:
       return onMessage_mainAgentConnected;
@@ -341,7 +405,7 @@ PSHandlerFn channelMain_onMessage(struct PSChannel * channel)
       return onMessage_mainAgentDisconnected;
 
     case SPICE_MSG_MAIN_AGENT_DATA:
-      if (!agent_present())
+      if (!agent_present(ps))
         return PS_HANDLER_DISCARD;
       return onMessage_mainAgentData;
 
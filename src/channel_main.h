@@ -19,7 +19,13 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelMain_getConnectPacket(void);
-void channelMain_setCaps(const uint32_t * common, int numCommon,
+bool channelMain_create(PS * ps);
+void channelMain_destroy(PS * ps);
+
+const SpiceLinkHeader * channelMain_getConnectPacket(PS * ps);
+void channelMain_setCaps(PS * ps, const uint32_t * common, int numCommon,
     const uint32_t * channel, int numChannel);
 PSHandlerFn channelMain_onMessage(struct PSChannel * channel);
+
+// calls PSConfig.ready once the session is set up and no channel is linking
+void channelMain_checkReady(PS * ps);
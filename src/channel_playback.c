@@ -23,10 +23,66 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "log.h"
 #include "channel.h"
 #include "channel_playback.h"
+#include "audio_ring.h"
 
 #include "messages.h"
+#include "stats.h"
 
-const SpiceLinkHeader * channelPlayback_getConnectPacket(void)
+#include <stdlib.h>
+
+#if defined(USE_OPUS)
+  #include <opus.h>
+
+  // the largest opus frame is 120ms
+  #define OPUS_MAX_FRAME (48000 * 120 / 1000)
+#endif
+
+typedef struct PSPlayback
+{
+  // the server is sending opus packets
+  bool opus;
+
+  // the ring for pull mode and whether the current stream is going into it
+  struct AudioRing * ring;
+  bool               useRing;
+  bool               ringFull;
+
+#if defined(USE_OPUS)
+  OpusDecoder * decoder;
+  int           channels;
+  int16_t       pcm[OPUS_MAX_FRAME * 2];
+#endif
+}
+PSPlayback;
+
+bool channelPlayback_create(PS * ps)
+{
+  ps->playback = calloc(1, sizeof(*ps->playback));
+  if (!ps->playback)
+  {
+    PS_LOG_ERROR("Failed to allocate the playback state");
+    return false;
+  }
+
+  return true;
+}
+
+void channelPlayback_destroy(PS * ps)
+{
+  free(ps->playback);
+  ps->playback = NULL;
+}
+
+bool purespice_hasOpus(void)
+{
+#if defined(USE_OPUS)
+  return true;
+#else
+  return false;
+#endif
+}
+
+const SpiceLinkHeader * channelPlayback_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -37,7 +93,7 @@ const SpiceLinkHeader * channelPlayback_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -53,8 +109,8 @@ const SpiceLinkHeader * channelPlayback_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -63,69 +119,231 @@ const SpiceLinkHeader * channelPlayback_getConnectPacket(void)
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_AUTH_SPICE             );
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_MINI_HEADER            );
 
-  if (g_ps.config.playback.volume || g_ps.config.playback.mute)
+  if (ps->config.playback.volume || ps->config.playback.mute)
     PLAYBACK_SET_CAPABILITY(p.channelCaps, SPICE_PLAYBACK_CAP_VOLUME);
 
+  if (ps->config.playback.opus &&
+      (ps->config.playback.opusPassthrough || purespice_hasOpus()))
+    PLAYBACK_SET_CAPABILITY(p.channelCaps, SPICE_PLAYBACK_CAP_OPUS);
+
   return &p.header;
 }
 
+static void closeDecoder(PSPlayback * pb)
+{
+#if defined(USE_OPUS)
+  if (pb->decoder)
+  {
+    opus_decoder_destroy(pb->decoder);
+    pb->decoder = NULL;
+  }
+#else
+  (void)pb;
+#endif
+}
+
+PS_STATUS channelPlayback_onConnect(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  PSPlayback * pb = ps->playback;
+
+  // don't carry the mode over from a previous connection
+  pb->opus    = false;
+  pb->useRing = false;
+  closeDecoder(pb);
+
+  if (ps->config.playback.pull && !pb->ring)
+  {
+    pb->ring = audioRing_new(PS_PLAYBACK_RING_SIZE);
+    if (!pb->ring)
+    {
+      PS_LOG_ERROR("Failed to allocate the playback ring");
+      return PS_STATUS_ERROR;
+    }
+  }
+
+  return PS_STATUS_OK;
+}
+
+void channelPlayback_deinit(PS * ps)
+{
+  PSPlayback * pb = ps->playback;
+  closeDecoder(pb);
+  audioRing_free(pb->ring);
+  pb->ring    = NULL;
+  pb->useRing = false;
+}
+
+size_t purespice_readAudio(PSSession * ps, void * data, size_t frames,
+    uint32_t * time)
+{
+  PSPlayback * pb = ps->playback;
+  if (!pb->ring)
+    return 0;
+
+  return audioRing_read(pb->ring, data, frames, time);
+}
+
+static PS_STATUS onMessage_playbackMode(PSChannel * channel)
+{
+  PSPlayback * pb = channel->ps->playback;
+  SpiceMsgPlaybackMode * msg = (SpiceMsgPlaybackMode *)channel->buffer;
+
+  switch(msg->mode)
+  {
+    case SPICE_AUDIO_DATA_MODE_RAW:
+      pb->opus = false;
+      break;
+
+    case SPICE_AUDIO_DATA_MODE_OPUS:
+      pb->opus = true;
+      break;
+
+    default:
+      PS_LOG_ERROR("Unsupported playback data mode: %u", msg->mode);
+      return PS_STATUS_ERROR;
+  }
+
+  return PS_STATUS_OK;
+}
+
 static PS_STATUS onMessage_playbackStart(PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  PSPlayback * pb = ps->playback;
   SpiceMsgPlaybackStart * msg = (SpiceMsgPlaybackStart *)channel->buffer;
 
   PSAudioFormat fmt = PS_AUDIO_FMT_INVALID;
   if (msg->format == SPICE_AUDIO_FMT_S16)
     fmt = PS_AUDIO_FMT_S16;
 
-  g_ps.config.playback.start(msg->channels, msg->frequency, fmt, msg->time);
+  closeDecoder(pb);
+  if (pb->opus)
+  {
+    if (ps->config.playback.opusPassthrough)
+      fmt = PS_AUDIO_FMT_OPUS;
+    else
+    {
+#if defined(USE_OPUS)
+      int error;
+      pb->channels = msg->channels;
+      pb->decoder  = pb->channels <= 2 ?
+        opus_decoder_create(msg->frequency, msg->channels, &error) : NULL;
+
+      if (!pb->decoder)
+      {
+        PS_LOG_ERROR("Failed to create the opus decoder");
+        fmt = PS_AUDIO_FMT_INVALID;
+      }
+#else
+      fmt = PS_AUDIO_FMT_INVALID;
+#endif
+    }
+  }
+
+  pb->useRing = pb->ring && fmt == PS_AUDIO_FMT_S16;
+  if (pb->useRing)
+    audioRing_start(pb->ring, msg->channels, msg->frequency,
+        ps->config.playback.targetLatency ?
+        ps->config.playback.targetLatency : PS_PLAYBACK_LATENCY_DEFAULT);
+
+  STATS_CALLBACK(ps, PS_CHANNEL_PLAYBACK,
+    ps->config.playback.start(msg->channels, msg->frequency, fmt, msg->time));
   return PS_STATUS_OK;
 }
 
+static void queueSamples(PS * ps, uint8_t * data, size_t size, uint32_t time)
+{
+  PSPlayback * pb = ps->playback;
+  if (!pb->useRing)
+  {
+    STATS_CALLBACK(ps, PS_CHANNEL_PLAYBACK,
+      ps->config.playback.data(data, size));
+    return;
+  }
+
+  // the reader is behind, its drift correction will catch up
+  const bool dropped = !audioRing_write(pb->ring, data, size, time);
+  if (dropped && !pb->ringFull)
+    PS_LOG_WARN("Playback ring is full, dropping audio");
+  pb->ringFull = dropped;
+}
+
 static PS_STATUS onMessage_playbackData(PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  PSPlayback * pb = ps->playback;
   SpiceMsgPlaybackPacket * msg = (SpiceMsgPlaybackPacket *)channel->buffer;
+  const size_t size = channel->header.size - sizeof(*msg);
+
+  if (!pb->opus || ps->config.playback.opusPassthrough)
+  {
+    queueSamples(ps, msg->data, size, msg->time);
+    return PS_STATUS_OK;
+  }
+
+#if defined(USE_OPUS)
+  if (!pb->decoder)
+    return PS_STATUS_OK;
+
+  const int samples = opus_decode(pb->decoder, msg->data, size, pb->pcm,
+      OPUS_MAX_FRAME, 0);
+  if (samples < 0)
+  {
+    PS_LOG_WARN("Failed to decode opus packet: %s", opus_strerror(samples));
+    return PS_STATUS_OK;
+  }
+
+  queueSamples(ps, (uint8_t *)pb->pcm,
+      samples * pb->channels * sizeof(*pb->pcm), msg->time);
+#endif
 
-  g_ps.config.playback.data(msg->data, channel->header.size - sizeof(*msg));
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_playbackStop(PSChannel * channel)
 {
-  (void)channel;
-  g_ps.config.playback.stop();
+  PS * ps = channel->ps;
+  PSPlayback * pb = ps->playback;
+  closeDecoder(pb);
+  pb->useRing = false;
+  STATS_CALLBACK(ps, PS_CHANNEL_PLAYBACK, ps->config.playback.stop());
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_playbackVolume(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgAudioVolume * msg = (SpiceMsgAudioVolume *)channel->buffer;
 
   uint16_t volume[msg->nchannels];
   memcpy(&volume, msg->volume, sizeof(volume));
 
-  g_ps.config.playback.volume(msg->nchannels, volume);
+  STATS_CALLBACK(ps, PS_CHANNEL_PLAYBACK,
+    ps->config.playback.volume(msg->nchannels, volume));
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_playbackMute(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgAudioMute * msg = (SpiceMsgAudioMute *)channel->buffer;
 
-  g_ps.config.playback.mute(msg->mute);
+  STATS_CALLBACK(ps, PS_CHANNEL_PLAYBACK, ps->config.playback.mute(msg->mute));
   return PS_STATUS_OK;
 }
 
 PSHandlerFn channelPlayback_onMessage(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   channel->initDone = true;
   switch(channel->header.type)
   {
     case SPICE_MSG_PLAYBACK_START:
       return onMessage_playbackStart;
 
-    //TODO: Lookup this message and see what it's for
     case SPICE_MSG_PLAYBACK_MODE:
-      return PS_HANDLER_DISCARD;
+      return onMessage_playbackMode;
 
     case SPICE_MSG_PLAYBACK_DATA:
       return onMessage_playbackData;
@@ -134,12 +352,12 @@ PSHandlerFn channelPlayback_onMessage(PSChannel * channel)
       return onMessage_playbackStop;
 
     case SPICE_MSG_PLAYBACK_VOLUME:
-      if (!g_ps.config.playback.volume)
+      if (!ps->config.playback.volume)
         return PS_HANDLER_DISCARD;
       return onMessage_playbackVolume;
 
     case SPICE_MSG_PLAYBACK_MUTE:
-      if (!g_ps.config.playback.mute)
+      if (!ps->config.playback.mute)
         return PS_HANDLER_DISCARD;
       return onMessage_playbackMute;
   }
@@ -19,6 +19,12 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelPlayback_getConnectPacket(void);
+bool channelPlayback_create (PS * ps);
+void channelPlayback_destroy(PS * ps);
+
+const SpiceLinkHeader * channelPlayback_getConnectPacket(PS * ps);
+
+PS_STATUS channelPlayback_onConnect(PSChannel * channel);
+void channelPlayback_deinit(PS * ps);
 
 PSHandlerFn channelPlayback_onMessage(PSChannel * channel);
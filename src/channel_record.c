@@ -25,8 +25,68 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "channel_record.h"
 
 #include "messages.h"
+#include "stats.h"
 
-const SpiceLinkHeader * channelRecord_getConnectPacket(void)
+#include <stdlib.h>
+
+#if defined(USE_OPUS)
+  #include <opus.h>
+
+  // the largest packet opus will produce for a single frame
+  #define OPUS_MAX_PACKET 1275
+#endif
+
+typedef struct PSRecord
+{
+  bool serverOpus;
+
+  // the server has been told to expect opus packets
+  bool opus;
+
+  // the format of the stream being recorded
+  int frameSize;
+  int frequency;
+
+  // ms of audio queued but not yet flushed when batching
+  unsigned int batched;
+
+  // the buffer handed out by purespice_borrowAudio
+  void * borrow;
+  size_t borrowSize;
+  bool   borrowed;
+
+#if defined(USE_OPUS)
+  OpusEncoder * encoder;
+  int           channels;
+
+  // 10ms frames are encoded, samples are held here until a frame is complete
+  int16_t     * pcm;
+  int           frameSamples;
+  int           pcmSamples;
+  uint32_t      pcmTime;
+#endif
+}
+PSRecord;
+
+bool channelRecord_create(PS * ps)
+{
+  ps->record = calloc(1, sizeof(*ps->record));
+  if (!ps->record)
+  {
+    PS_LOG_ERROR("Failed to allocate the record state");
+    return false;
+  }
+
+  return true;
+}
+
+void channelRecord_destroy(PS * ps)
+{
+  free(ps->record);
+  ps->record = NULL;
+}
+
+const SpiceLinkHeader * channelRecord_getConnectPacket(PS * ps)
 {
   typedef struct
   {
@@ -37,7 +97,7 @@ const SpiceLinkHeader * channelRecord_getConnectPacket(void)
   }
   __attribute__((packed)) ConnectPacket;
 
-  static ConnectPacket p =
+  static _Thread_local ConnectPacket p =
   {
     .header = {
       .magic         = SPICE_MAGIC        ,
@@ -53,8 +113,8 @@ const SpiceLinkHeader * channelRecord_getConnectPacket(void)
     }
   };
 
-  p.message.connection_id = g_ps.sessionID;
-  p.message.channel_id    = g_ps.channelID;
+  p.message.connection_id = ps->sessionID;
+  p.message.channel_id    = ps->channelID;
 
   memset(p.supportCaps, 0, sizeof(p.supportCaps));
   memset(p.channelCaps, 0, sizeof(p.channelCaps));
@@ -63,53 +123,185 @@ const SpiceLinkHeader * channelRecord_getConnectPacket(void)
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_AUTH_SPICE             );
   COMMON_SET_CAPABILITY(p.supportCaps, SPICE_COMMON_CAP_MINI_HEADER            );
 
-  if (g_ps.config.record.volume || g_ps.config.record.mute)
+  if (ps->config.record.volume || ps->config.record.mute)
     RECORD_SET_CAPABILITY(p.channelCaps, SPICE_RECORD_CAP_VOLUME);
 
+  if (ps->config.record.opus &&
+      (ps->config.record.opusPassthrough || purespice_hasOpus()))
+    RECORD_SET_CAPABILITY(p.channelCaps, SPICE_RECORD_CAP_OPUS);
+
   return &p.header;
 }
 
+void channelRecord_setCaps(PS * ps, const uint32_t * common, int numCommon,
+    const uint32_t * channel, int numChannel)
+{
+  (void)common;
+  (void)numCommon;
+
+  ps->record->serverOpus = HAS_CAPABILITY(channel, numChannel, SPICE_RECORD_CAP_OPUS);
+}
+
+static void closeEncoder(PSRecord * rec)
+{
+  rec->opus = false;
+
+#if defined(USE_OPUS)
+  if (rec->encoder)
+  {
+    opus_encoder_destroy(rec->encoder);
+    rec->encoder = NULL;
+  }
+
+  free(rec->pcm);
+  rec->pcm        = NULL;
+  rec->pcmSamples = 0;
+#endif
+}
+
+PS_STATUS channelRecord_onConnect(PSChannel * channel)
+{
+  PSRecord * rec = channel->ps->record;
+
+  closeEncoder(rec);
+  rec->frameSize = 0;
+  return PS_STATUS_OK;
+}
+
+void channelRecord_deinit(PS * ps)
+{
+  PSRecord * rec = ps->record;
+  closeEncoder(rec);
+
+  free(rec->borrow);
+  rec->borrow     = NULL;
+  rec->borrowSize = 0;
+  rec->borrowed   = false;
+}
+
+#if defined(USE_OPUS)
+static bool openEncoder(PSRecord * rec, int channels, int frequency)
+{
+  int error;
+  rec->encoder = channels <= 2 ?
+    opus_encoder_create(frequency, channels, OPUS_APPLICATION_AUDIO, &error) :
+    NULL;
+
+  if (!rec->encoder)
+  {
+    PS_LOG_ERROR("Failed to create the opus encoder");
+    return false;
+  }
+
+  rec->channels     = channels;
+  rec->frameSamples = frequency / 100;
+  rec->pcmSamples   = 0;
+  rec->pcm          = malloc(rec->frameSamples * channels * sizeof(*rec->pcm));
+  if (!rec->pcm)
+  {
+    PS_LOG_ERROR("Failed to allocate the opus frame buffer");
+    closeEncoder(rec);
+    return false;
+  }
+
+  return true;
+}
+#endif
+
+static bool sendMode(PSChannel * channel, SpiceAudioDataMode mode)
+{
+  SpiceMsgcRecordMode * msg =
+    SPICE_PACKET(SPICE_MSGC_RECORD_MODE, SpiceMsgcRecordMode, 0);
+
+  msg->time = purespice_getMMTime(channel->ps);
+  msg->mode = mode;
+
+  if (!SPICE_SEND_PACKET(channel, msg))
+  {
+    PS_LOG_ERROR("Failed to write SpiceMsgcRecordMode");
+    return false;
+  }
+
+  return true;
+}
+
 static PS_STATUS onMessage_recordStart(PSChannel * channel)
 {
+  PS * ps = channel->ps;
+  PSRecord * rec = ps->record;
   SpiceMsgRecordStart * msg = (SpiceMsgRecordStart *)channel->buffer;
 
   PSAudioFormat fmt = PS_AUDIO_FMT_INVALID;
   if (msg->format == SPICE_AUDIO_FMT_S16)
     fmt = PS_AUDIO_FMT_S16;
 
-  g_ps.config.record.start(msg->channels, msg->frequency, fmt);
+  closeEncoder(rec);
+  rec->frameSize = msg->channels * sizeof(int16_t);
+  rec->frequency = msg->frequency;
+  rec->batched   = 0;
+
+  if (fmt == PS_AUDIO_FMT_S16 && ps->config.record.opus && rec->serverOpus)
+  {
+    if (ps->config.record.opusPassthrough)
+    {
+      fmt      = PS_AUDIO_FMT_OPUS;
+      rec->opus = true;
+    }
+#if defined(USE_OPUS)
+    else
+      rec->opus = openEncoder(rec, msg->channels, msg->frequency);
+#endif
+
+    if (rec->opus && !sendMode(channel, SPICE_AUDIO_DATA_MODE_OPUS))
+      return PS_STATUS_ERROR;
+  }
+
+  STATS_CALLBACK(ps, PS_CHANNEL_RECORD,
+    ps->config.record.start(msg->channels, msg->frequency, fmt));
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_recordStop(PSChannel * channel)
 {
-  (void)channel;
+  PS * ps = channel->ps;
+  PSRecord * rec = ps->record;
+  // send anything still held back for batching
+  SPICE_LOCK(channel->lock);
+  rec->batched = 0;
+  SPICE_UNLOCK(channel->lock);
+  if (!channel_flush(channel))
+    return PS_STATUS_ERROR;
 
-  g_ps.config.record.stop();
+  closeEncoder(rec);
+  STATS_CALLBACK(ps, PS_CHANNEL_RECORD, ps->config.record.stop());
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_recordVolume(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgAudioVolume * msg = (SpiceMsgAudioVolume *)channel->buffer;
 
   uint16_t volume[msg->nchannels];
   memcpy(&volume, msg->volume, sizeof(volume));
 
-  g_ps.config.record.volume(msg->nchannels, volume);
+  STATS_CALLBACK(ps, PS_CHANNEL_RECORD,
+    ps->config.record.volume(msg->nchannels, volume));
   return PS_STATUS_OK;
 }
 
 static PS_STATUS onMessage_recordMute(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   SpiceMsgAudioMute * msg = (SpiceMsgAudioMute *)channel->buffer;
 
-  g_ps.config.record.mute(msg->mute);
+  STATS_CALLBACK(ps, PS_CHANNEL_RECORD, ps->config.record.mute(msg->mute));
   return PS_STATUS_OK;
 }
 
 PSHandlerFn channelRecord_onMessage(PSChannel * channel)
 {
+  PS * ps = channel->ps;
   channel->initDone = true;
   switch(channel->header.type)
   {
@@ -120,12 +312,12 @@ PSHandlerFn channelRecord_onMessage(PSChannel * channel)
       return onMessage_recordStop;
 
     case SPICE_MSG_RECORD_VOLUME:
-      if (!g_ps.config.record.volume)
+      if (!ps->config.record.volume)
         return PS_HANDLER_DISCARD;
       return onMessage_recordVolume;
 
     case SPICE_MSG_RECORD_MUTE:
-      if (!g_ps.config.record.mute)
+      if (!ps->config.record.mute)
         return PS_HANDLER_DISCARD;
       return onMessage_recordMute;
   }
@@ -133,28 +325,65 @@ PSHandlerFn channelRecord_onMessage(PSChannel * channel)
   return PS_HANDLER_ERROR;
 }
 
-bool purespice_writeAudio(void * data, size_t size, uint32_t time)
+typedef struct RecordHeader
 {
-  PSChannel * channel = &g_ps.channels[PS_CHANNEL_RECORD];
-  if (!channel->connected)
-    return false;
+  SpiceMiniDataHeader   header;
+  SpiceMsgcRecordPacket packet;
+}
+__attribute__((packed)) RecordHeader;
+
+static inline void setHeader(RecordHeader * h, struct iovec * iov,
+    const void * data, size_t size, uint32_t time)
+{
+  h->header.type = SPICE_MSGC_RECORD_DATA;
+  h->header.size = sizeof(h->packet) + size;
+  h->packet.time = time;
 
-  SpiceMsgcRecordPacket * msg =
-    SPICE_PACKET(SPICE_MSGC_RECORD_DATA, SpiceMsgcRecordPacket, size);
+  iov[0] = (struct iovec){ .iov_base = h           , .iov_len = sizeof(*h) };
+  iov[1] = (struct iovec){ .iov_base = (void *)data, .iov_len = size       };
+}
 
-  msg->time = time;
+/* sends `count` packets, described by header and payload iovec pairs, with a
+ * single write. When batching they are queued instead until batchLatency ms
+ * of audio is pending */
+static bool submitPackets(PSChannel * channel, const struct iovec * iov,
+    int count, unsigned int ms)
+{
+  PS * ps = channel->ps;
+  PSRecord * rec = ps->record;
+  if (!ps->config.record.batchLatency)
+  {
+    if (!channel_sendv(channel, iov, count * 2))
+    {
+      PS_LOG_ERROR("Failed to write SpiceMsgcRecordPacket");
+      return false;
+    }
+    return true;
+  }
+
+  // don't leave a partial message in the queue
+  size_t total = 0;
+  for(int i = 0; i < count * 2; ++i)
+    total += iov[i].iov_len;
 
   SPICE_LOCK(channel->lock);
-  if (!SPICE_SEND_PACKET_NL(channel, msg))
+  if (!channel_reserveNL(channel, total))
   {
     SPICE_UNLOCK(channel->lock);
     PS_LOG_ERROR("Failed to write SpiceMsgcRecordPacket");
     return false;
   }
-  const ssize_t wrote = send(channel->socket, data, size, 0);
+
+  for(int i = 0; i < count * 2; ++i)
+    channel_queueNL(channel, iov[i].iov_base, iov[i].iov_len);
+
+  rec->batched += ms;
+  const bool flush = rec->batched >= ps->config.record.batchLatency;
+  if (flush)
+    rec->batched = 0;
   SPICE_UNLOCK(channel->lock);
 
-  if ((size_t)wrote != size)
+  if (flush && !channel_flush(channel))
   {
     PS_LOG_ERROR("Failed to write the audio data");
     return false;
@@ -162,3 +391,124 @@ bool purespice_writeAudio(void * data, size_t size, uint32_t time)
 
   return true;
 }
+
+#if defined(USE_OPUS)
+// the most opus packets collected into a single write
+#define OPUS_BATCH (PS_SENDV_MAX / 2)
+
+static bool writeOpus(PSChannel * channel, const int16_t * samples,
+    int count, uint32_t time)
+{
+  PSRecord   * rec = channel->ps->record;
+  uint8_t      packets[OPUS_BATCH][OPUS_MAX_PACKET];
+  RecordHeader headers[OPUS_BATCH];
+  struct iovec iov    [OPUS_BATCH * 2];
+  int          numPackets = 0;
+
+  while(count > 0)
+  {
+    if (rec->pcmSamples == 0)
+      rec->pcmTime = time;
+
+    int take = rec->frameSamples - rec->pcmSamples;
+    if (take > count)
+      take = count;
+
+    memcpy(rec->pcm + rec->pcmSamples * rec->channels, samples,
+        take * rec->channels * sizeof(*samples));
+
+    rec->pcmSamples += take;
+    samples        += take * rec->channels;
+    count          -= take;
+    time           += take * 1000 / rec->frequency;
+
+    if (rec->pcmSamples < rec->frameSamples)
+      break;
+
+    rec->pcmSamples = 0;
+    const int size = opus_encode(rec->encoder, rec->pcm, rec->frameSamples,
+        packets[numPackets], OPUS_MAX_PACKET);
+    if (size < 0)
+    {
+      PS_LOG_ERROR("Failed to encode opus frame: %s", opus_strerror(size));
+      return false;
+    }
+
+    setHeader(&headers[numPackets], &iov[numPackets * 2],
+        packets[numPackets], size, rec->pcmTime);
+
+    if (++numPackets == OPUS_BATCH)
+    {
+      if (!submitPackets(channel, iov, numPackets, numPackets * 10))
+        return false;
+      numPackets = 0;
+    }
+  }
+
+  return !numPackets || submitPackets(channel, iov, numPackets,
+      numPackets * 10);
+}
+#endif
+
+bool purespice_writeAudio(PSSession * ps, void * data, size_t size,
+    uint32_t time)
+{
+  PSRecord * rec = ps->record;
+  PSChannel * channel = &ps->channels[PS_CHANNEL_RECORD];
+  if (!channel->connected)
+    return false;
+
+#if defined(USE_OPUS)
+  if (rec->encoder)
+    return writeOpus(channel, data,
+        size / (rec->channels * sizeof(int16_t)), time);
+#endif
+
+  // opus passthrough packets are assumed to be 10ms as spice uses
+  unsigned int ms = 10;
+  if (!rec->opus && rec->frameSize && rec->frequency)
+    ms = size / rec->frameSize * 1000 / rec->frequency;
+
+  RecordHeader header;
+  struct iovec iov[2];
+  setHeader(&header, iov, data, size, time);
+  return submitPackets(channel, iov, 1, ms);
+}
+
+void * purespice_borrowAudio(PSSession * ps, size_t size)
+{
+  PSRecord * rec = ps->record;
+  if (rec->borrowed)
+    return NULL;
+
+  if (size > rec->borrowSize)
+  {
+    void * buffer = realloc(rec->borrow, size);
+    if (!buffer)
+    {
+      PS_LOG_ERROR("Failed to allocate the record buffer");
+      return NULL;
+    }
+
+    rec->borrow     = buffer;
+    rec->borrowSize = size;
+  }
+
+  rec->borrowed = true;
+  return rec->borrow;
+}
+
+bool purespice_commitAudio(PSSession * ps, void * buffer, size_t size,
+    uint32_t time)
+{
+  PSRecord * rec = ps->record;
+  if (!rec->borrowed || buffer != rec->borrow || size > rec->borrowSize)
+  {
+    PS_LOG_ERROR("Invalid record buffer committed");
+    return false;
+  }
+
+  const bool ok = purespice_writeAudio(ps, buffer, size, time);
+  rec->borrowed = false;
+  return ok;
+}
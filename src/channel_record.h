@@ -19,6 +19,14 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-const SpiceLinkHeader * channelRecord_getConnectPacket(void);
+bool channelRecord_create (PS * ps);
+void channelRecord_destroy(PS * ps);
+
+const SpiceLinkHeader * channelRecord_getConnectPacket(PS * ps);
+
+void channelRecord_setCaps(PS * ps, const uint32_t * common, int numCommon,
+    const uint32_t * channel, int numChannel);
+PS_STATUS channelRecord_onConnect(PSChannel * channel);
+void channelRecord_deinit(PS * ps);
 
 PSHandlerFn channelRecord_onMessage(PSChannel * channel);
@@ -0,0 +1,252 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "convert.h"
+#include "scratch.h"
+#include "ps.h"
+#include "log.h"
+
+#include <string.h>
+
+static inline uint32_t expand5(uint32_t v)
+{
+  return (v << 3) | (v >> 2);
+}
+
+static void row_bgrx(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x, src += 4)
+  {
+    // the source rows are not guaranteed to be aligned
+    uint32_t p;
+    memcpy(&p, src, sizeof(p));
+    d[x] = p | 0xff000000;
+  }
+}
+
+static void row_bgra(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  memcpy(dst, src, width * sizeof(uint32_t));
+}
+
+static void row_bgr(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x, src += 3)
+    d[x] = src[0] | (src[1] << 8) | (src[2] << 16) | 0xff000000;
+}
+
+static void row_rgb555(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x, src += 2)
+  {
+    const uint32_t pix = src[0] | (src[1] << 8);
+    d[x] =
+       expand5( pix        & 0x1f)        |
+      (expand5((pix >> 5 ) & 0x1f) << 8 ) |
+      (expand5((pix >> 10) & 0x1f) << 16) |
+      0xff000000;
+  }
+}
+
+static void row_pal8(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = palette[src[x]];
+}
+
+static void row_pal4le(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = palette[(src[x >> 1] >> ((x & 1) * 4)) & 0xf];
+}
+
+static void row_pal4be(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = palette[(src[x >> 1] >> ((~x & 1) * 4)) & 0xf];
+}
+
+static void row_pal1le(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = palette[(src[x >> 3] >> (x & 7)) & 0x1];
+}
+
+static void row_pal1be(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = palette[(src[x >> 3] >> (7 - (x & 7))) & 0x1];
+}
+
+static void row_a8(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  uint32_t * d = (uint32_t *)dst;
+  for(unsigned int x = 0; x < width; ++x)
+    d[x] = (uint32_t)src[x] << 24;
+}
+
+static void swap_rb(uint8_t * data, unsigned int width)
+{
+  uint32_t * d = (uint32_t *)data;
+  for(unsigned int x = 0; x < width; ++x)
+  {
+    const uint32_t p = d[x];
+    d[x] = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+  }
+}
+
+static const ConvertKernels * getKernels(void)
+{
+  static ConvertKernels kernels;
+  static atomic_bool    init = false;
+  static atomic_flag    lock = ATOMIC_FLAG_INIT;
+
+  if (atomic_load_explicit(&init, memory_order_acquire))
+    return &kernels;
+
+  // sessions on other loops may be converting their first image too
+  SPICE_LOCK(lock);
+  if (!atomic_load_explicit(&init, memory_order_relaxed))
+  {
+    kernels = (ConvertKernels)
+    {
+      .bgrx   = row_bgrx,
+      .bgr    = row_bgr,
+      .rgb555 = row_rgb555,
+      .swapRB = swap_rb
+    };
+
+    convert_selectX86 (&kernels);
+    convert_selectNEON(&kernels);
+    atomic_store_explicit(&init, true, memory_order_release);
+  }
+  SPICE_UNLOCK(lock);
+
+  return &kernels;
+}
+
+bool convert_image(const PSDecodedImage * src, PSOutputFormat target,
+    PSDecodedImage * dst)
+{
+  const ConvertKernels * k = getKernels();
+
+  ConvertRowFn fn;
+  unsigned int bits;
+  unsigned int entries = 0;
+  switch(src->format)
+  {
+    case PS_BITMAP_FMT_1BIT_LE: fn = row_pal1le ; bits = 1 ; entries = 2  ; break;
+    case PS_BITMAP_FMT_1BIT_BE: fn = row_pal1be ; bits = 1 ; entries = 2  ; break;
+    case PS_BITMAP_FMT_4BIT_LE: fn = row_pal4le ; bits = 4 ; entries = 16 ; break;
+    case PS_BITMAP_FMT_4BIT_BE: fn = row_pal4be ; bits = 4 ; entries = 16 ; break;
+    case PS_BITMAP_FMT_8BIT   : fn = row_pal8   ; bits = 8 ; entries = 256; break;
+    case PS_BITMAP_FMT_16BIT  : fn = k->rgb555  ; bits = 16; break;
+    case PS_BITMAP_FMT_24BIT  : fn = k->bgr     ; bits = 24; break;
+    case PS_BITMAP_FMT_32BIT  : fn = k->bgrx    ; bits = 32; break;
+    case PS_BITMAP_FMT_RGBA   : fn = row_bgra   ; bits = 32; break;
+    case PS_BITMAP_FMT_8BIT_A : fn = row_a8     ; bits = 8 ; break;
+
+    default:
+      PS_LOG_ERROR("Unable to convert bitmap format %d", src->format);
+      return false;
+  }
+
+  if (((size_t)src->width * bits + 7) / 8 > src->stride)
+  {
+    PS_LOG_ERROR("Bitmap stride %u is too small for %u pixels",
+        src->stride, src->width);
+    return false;
+  }
+
+  /* the kernels index the palette directly, pad out short or missing
+   * palettes so that a bad index can never read out of bounds */
+  uint32_t palette[256];
+  if (entries)
+  {
+    const unsigned int n = src->palette ?
+      (src->paletteEntries < entries ? src->paletteEntries : entries) : 0;
+
+    for(unsigned int i = 0; i < n; ++i)
+      palette[i] = src->palette[i] | 0xff000000;
+
+    if (!n && entries == 2)
+    {
+      palette[0] = 0xff000000;
+      palette[1] = 0xffffffff;
+    }
+    else
+      for(unsigned int i = n; i < entries; ++i)
+        palette[i] = 0xff000000;
+  }
+
+  const size_t stride = (size_t)src->width * sizeof(uint32_t);
+  uint8_t * data = scratch_get(stride * src->height);
+  if (!data)
+  {
+    PS_LOG_ERROR("Failed to allocate %lu bytes for a converted bitmap",
+        (unsigned long)(stride * src->height));
+    return false;
+  }
+
+  for(unsigned int y = 0; y < src->height; ++y)
+  {
+    // bottom up images are flipped by reading the rows in reverse
+    const unsigned int sy = src->topDown ? y : src->height - 1 - y;
+    uint8_t * row = data + y * stride;
+
+    fn(src->data + (size_t)sy * src->stride, row, src->width, palette);
+    if (target == PS_OUTPUT_FMT_RGBA)
+      k->swapRB(row, src->width);
+  }
+
+  dst->format         = target == PS_OUTPUT_FMT_RGBA ?
+    PS_BITMAP_FMT_ABGR : PS_BITMAP_FMT_RGBA;
+  dst->topDown        = true;
+  dst->width          = src->width;
+  dst->height         = src->height;
+  dst->stride         = stride;
+  dst->data           = data;
+  dst->palette        = NULL;
+  dst->paletteEntries = 0;
+  dst->owned          = true;
+  return true;
+}
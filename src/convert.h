@@ -0,0 +1,55 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_CONVERT_
+#define _H_SPICE_CONVERT_
+
+#include "purespice.h"
+#include "decode.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* row kernels, each converts one row of `width` pixels to 32-bit B, G, R, A.
+ * The palette is only used by the paletted formats */
+typedef void (*ConvertRowFn)(const uint8_t * src, uint8_t * dst,
+    unsigned int width, const uint32_t * palette);
+
+// swaps the R and B channels of a row of 32-bit pixels in place
+typedef void (*ConvertSwapFn)(uint8_t * data, unsigned int width);
+
+typedef struct ConvertKernels
+{
+  ConvertRowFn  bgrx;
+  ConvertRowFn  bgr;
+  ConvertRowFn  rgb555;
+  ConvertSwapFn swapRB;
+}
+ConvertKernels;
+
+// the architecture specific kernels replace the scalar ones they improve on
+void convert_selectX86 (ConvertKernels * kernels);
+void convert_selectNEON(ConvertKernels * kernels);
+
+/* converts `src` into `target`, flipping bottom up images. The result is
+ * written to a scratch buffer and must be released with decode_release */
+bool convert_image(const PSDecodedImage * src, PSOutputFormat target,
+    PSDecodedImage * dst);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "convert.h"
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+#include <string.h>
+
+static void neon_bgrx(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  const uint32x4_t alpha = vdupq_n_u32(0xff000000);
+
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const uint32x4_t p = vreinterpretq_u32_u8(vld1q_u8(src + x * 4));
+    vst1q_u8(dst + x * 4, vreinterpretq_u8_u32(vorrq_u32(p, alpha)));
+  }
+
+  for(; x < width; ++x)
+  {
+    uint32_t p;
+    memcpy(&p, src + x * 4, sizeof(p));
+    p |= 0xff000000;
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+static void neon_bgr(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16)
+  {
+    const uint8x16x3_t p = vld3q_u8(src + x * 3);
+    const uint8x16x4_t o = { { p.val[0], p.val[1], p.val[2], vdupq_n_u8(0xff) } };
+    vst4q_u8(dst + x * 4, o);
+  }
+
+  for(; x < width; ++x)
+  {
+    const uint8_t * s = src + x * 3;
+    const uint32_t  p = s[0] | (s[1] << 8) | (s[2] << 16) | 0xff000000;
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+static inline uint8x8_t neon_expand5(uint16x8_t v)
+{
+  const uint16x8_t e = vorrq_u16(vshlq_n_u16(v, 3), vshrq_n_u16(v, 2));
+  return vmovn_u16(e);
+}
+
+static void neon_rgb555(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  const uint16x8_t mask = vdupq_n_u16(0x1f);
+
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const uint16x8_t p = vreinterpretq_u16_u8(vld1q_u8(src + x * 2));
+    const uint8x8x4_t o = { {
+      neon_expand5(vandq_u16(p, mask)),
+      neon_expand5(vandq_u16(vshrq_n_u16(p, 5 ), mask)),
+      neon_expand5(vandq_u16(vshrq_n_u16(p, 10), mask)),
+      vdup_n_u8(0xff)
+    } };
+    vst4_u8(dst + x * 4, o);
+  }
+
+  for(; x < width; ++x)
+  {
+    const uint32_t pix = src[x * 2] | (src[x * 2 + 1] << 8);
+    const uint32_t b = pix & 0x1f, g = (pix >> 5) & 0x1f, r = (pix >> 10) & 0x1f;
+    const uint32_t p =
+       ((b << 3) | (b >> 2))        |
+      (((g << 3) | (g >> 2)) << 8 ) |
+      (((r << 3) | (r >> 2)) << 16) |
+      0xff000000;
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+static void neon_swapRB(uint8_t * data, unsigned int width)
+{
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16)
+  {
+    uint8x16x4_t p = vld4q_u8(data + x * 4);
+    const uint8x16_t t = p.val[0];
+    p.val[0] = p.val[2];
+    p.val[2] = t;
+    vst4q_u8(data + x * 4, p);
+  }
+
+  for(; x < width; ++x)
+  {
+    uint8_t * p = data + x * 4;
+    const uint8_t t = p[0];
+    p[0] = p[2];
+    p[2] = t;
+  }
+}
+
+void convert_selectNEON(ConvertKernels * kernels)
+{
+  kernels->bgrx   = neon_bgrx;
+  kernels->bgr    = neon_bgr;
+  kernels->rgb555 = neon_rgb555;
+  kernels->swapRB = neon_swapRB;
+}
+
+#else
+
+void convert_selectNEON(ConvertKernels * kernels)
+{
+  (void)kernels;
+}
+
+#endif
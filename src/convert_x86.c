@@ -0,0 +1,263 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+/* every kernel finishes the tail of the row with a scalar loop, the source
+ * rows are not guaranteed to be aligned so only unaligned loads are used */
+
+static inline uint32_t expand5(uint32_t v)
+{
+  return (v << 3) | (v >> 2);
+}
+
+static inline uint32_t rgb555(const uint8_t * src)
+{
+  const uint32_t pix = src[0] | (src[1] << 8);
+  return
+     expand5( pix        & 0x1f)        |
+    (expand5((pix >> 5 ) & 0x1f) << 8 ) |
+    (expand5((pix >> 10) & 0x1f) << 16) |
+    0xff000000;
+}
+
+__attribute__((target("sse2")))
+static void sse2_bgrx(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 4));
+    _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(p, alpha));
+  }
+
+  for(; x < width; ++x)
+  {
+    uint32_t p;
+    memcpy(&p, src + x * 4, sizeof(p));
+    p |= 0xff000000;
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_expand5(__m128i v)
+{
+  return _mm_or_si128(_mm_slli_epi16(v, 3), _mm_srli_epi16(v, 2));
+}
+
+__attribute__((target("sse2")))
+static void sse2_rgb555(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+  const __m128i mask  = _mm_set1_epi16(0x1f);
+  const __m128i alpha = _mm_set1_epi16((short)0xff00);
+
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(src + x * 2));
+    const __m128i b = sse2_expand5(_mm_and_si128(p, mask));
+    const __m128i g = sse2_expand5(_mm_and_si128(_mm_srli_epi16(p, 5 ), mask));
+    const __m128i r = sse2_expand5(_mm_and_si128(_mm_srli_epi16(p, 10), mask));
+
+    // build B,G and R,A 16-bit pairs then interleave them into pixels
+    const __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+    const __m128i ra = _mm_or_si128(r, alpha);
+
+    _mm_storeu_si128((__m128i *)(dst + x * 4     ), _mm_unpacklo_epi16(bg, ra));
+    _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+  }
+
+  for(; x < width; ++x)
+  {
+    const uint32_t p = rgb555(src + x * 2);
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+__attribute__((target("sse2")))
+static void sse2_swapRB(uint8_t * data, unsigned int width)
+{
+  const __m128i ga = _mm_set1_epi32((int)0xff00ff00);
+  const __m128i lo = _mm_set1_epi32(0x000000ff);
+
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const __m128i p = _mm_loadu_si128((const __m128i *)(data + x * 4));
+    const __m128i r = _mm_and_si128(_mm_srli_epi32(p, 16), lo);
+    const __m128i b = _mm_slli_epi32(_mm_and_si128(p, lo), 16);
+    _mm_storeu_si128((__m128i *)(data + x * 4),
+        _mm_or_si128(_mm_and_si128(p, ga), _mm_or_si128(r, b)));
+  }
+
+  for(; x < width; ++x)
+  {
+    uint32_t p;
+    memcpy(&p, data + x * 4, sizeof(p));
+    p = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+    memcpy(data + x * 4, &p, sizeof(p));
+  }
+}
+
+__attribute__((target("avx2")))
+static void avx2_bgrx(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+    _mm256_storeu_si256((__m256i *)(dst + x * 4), _mm256_or_si256(p, alpha));
+  }
+
+  sse2_bgrx(src + x * 4, dst + x * 4, width - x, palette);
+}
+
+__attribute__((target("avx2")))
+static void avx2_bgr(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  (void)palette;
+
+  // spread 4 packed B,G,R pixels in each lane out to 4 bytes each
+  const __m256i shuffle = _mm256_setr_epi8(
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1,
+    0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+  const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+
+  /* each iteration reads 28 bytes to consume 24, stop while there is still
+   * enough of the row left to not read past the end of it */
+  unsigned int x = 0;
+  for(; x + 10 <= width; x += 8)
+  {
+    const uint8_t * s = src + x * 3;
+    const __m256i p = _mm256_inserti128_si256(
+        _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)s)),
+        _mm_loadu_si128((const __m128i *)(s + 12)), 1);
+
+    _mm256_storeu_si256((__m256i *)(dst + x * 4),
+        _mm256_or_si256(_mm256_shuffle_epi8(p, shuffle), alpha));
+  }
+
+  for(; x < width; ++x)
+  {
+    const uint8_t * s = src + x * 3;
+    const uint32_t  p = s[0] | (s[1] << 8) | (s[2] << 16) | 0xff000000;
+    memcpy(dst + x * 4, &p, sizeof(p));
+  }
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_expand5(__m256i v)
+{
+  return _mm256_or_si256(_mm256_slli_epi16(v, 3), _mm256_srli_epi16(v, 2));
+}
+
+__attribute__((target("avx2")))
+static void avx2_rgb555(const uint8_t * src, uint8_t * dst, unsigned int width,
+    const uint32_t * palette)
+{
+  const __m256i mask  = _mm256_set1_epi16(0x1f);
+  const __m256i alpha = _mm256_set1_epi16((short)0xff00);
+
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16)
+  {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(src + x * 2));
+    const __m256i b = avx2_expand5(_mm256_and_si256(p, mask));
+    const __m256i g = avx2_expand5(
+        _mm256_and_si256(_mm256_srli_epi16(p, 5 ), mask));
+    const __m256i r = avx2_expand5(
+        _mm256_and_si256(_mm256_srli_epi16(p, 10), mask));
+
+    const __m256i bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+    const __m256i ra = _mm256_or_si256(r, alpha);
+
+    // the unpacks work per lane, permute the halves back into pixel order
+    const __m256i lo = _mm256_unpacklo_epi16(bg, ra);
+    const __m256i hi = _mm256_unpackhi_epi16(bg, ra);
+    _mm256_storeu_si256((__m256i *)(dst + x * 4     ),
+        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dst + x * 4 + 32),
+        _mm256_permute2x128_si256(lo, hi, 0x31));
+  }
+
+  sse2_rgb555(src + x * 2, dst + x * 4, width - x, palette);
+}
+
+__attribute__((target("avx2")))
+static void avx2_swapRB(uint8_t * data, unsigned int width)
+{
+  const __m256i shuffle = _mm256_setr_epi8(
+    2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+    2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const __m256i p = _mm256_loadu_si256((const __m256i *)(data + x * 4));
+    _mm256_storeu_si256((__m256i *)(data + x * 4),
+        _mm256_shuffle_epi8(p, shuffle));
+  }
+
+  sse2_swapRB(data + x * 4, width - x);
+}
+
+void convert_selectX86(ConvertKernels * kernels)
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+  {
+    kernels->bgrx   = sse2_bgrx;
+    kernels->rgb555 = sse2_rgb555;
+    kernels->swapRB = sse2_swapRB;
+  }
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    kernels->bgrx   = avx2_bgrx;
+    kernels->bgr    = avx2_bgr;
+    kernels->rgb555 = avx2_rgb555;
+    kernels->swapRB = avx2_swapRB;
+  }
+}
+
+#else
+
+void convert_selectX86(ConvertKernels * kernels)
+{
+  (void)kernels;
+}
+
+#endif
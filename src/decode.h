@@ -0,0 +1,73 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_DECODE_
+#define _H_SPICE_DECODE_
+
+#include "purespice.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct PSDecodedImage
+{
+  PSBitmapFormat format;
+  bool           topDown;
+  unsigned int   width;
+  unsigned int   height;
+  unsigned int   stride;
+  uint8_t      * data;
+
+  // the palette for the 1, 4 and 8 bit formats as xRGB
+  const uint32_t * palette;
+  unsigned int     paletteEntries;
+
+  // false if the pixels belong to the decoder (ie, the GLZ window)
+  bool           owned;
+}
+PSDecodedImage;
+
+// the GLZ dictionary window, images may reference any earlier one still in it
+typedef struct GLZWindow GLZWindow;
+
+/* maxWidth and maxHeight are the size of the image's descriptor, which the
+ * draw is sized and clipped by. Compressed images that claim to be larger are
+ * rejected. LZ4 has no header of its own so it is decoded at that size */
+bool decode_lz4(const uint8_t * data, size_t size, unsigned int width,
+    unsigned int height, PSDecodedImage * out);
+bool decode_lz (const uint8_t * data, size_t size, unsigned int maxWidth,
+    unsigned int maxHeight, PSDecodedImage * out);
+bool decode_glz(GLZWindow * win, const uint8_t * data, size_t size,
+    unsigned int maxWidth, unsigned int maxHeight, PSDecodedImage * out);
+
+/* true if an image of the size given in its compressed header can be decoded
+ * to bpp bytes per pixel, logging why not otherwise */
+bool decode_checkSize(const char * name, uint32_t width, uint32_t height,
+    unsigned int bpp, unsigned int maxWidth, unsigned int maxHeight);
+
+void decode_release(PSDecodedImage * image);
+
+GLZWindow * decode_glzNew (void);
+void        decode_glzFree(GLZWindow * win);
+
+// drop every image held in the GLZ dictionary window
+void decode_glzReset(GLZWindow * win);
+
+#endif
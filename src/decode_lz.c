@@ -0,0 +1,655 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "decode.h"
+#include "scratch.h"
+#include "ps.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* decoders for the SPICE LZ and GLZ image formats. Both are a FastLZ style
+ * stream of literal runs and back references measured in pixels, GLZ adds
+ * references into previously decoded images held in a shared dictionary
+ * window. Every image is decoded to 32bpp BGRX/BGRA */
+
+#define LZ_MAGIC        0x20205a4c
+#define LZ_VERSION      0x00010001
+#define LZ_MAX_COPY     32
+#define LZ_MAX_DISTANCE 8191
+
+typedef enum
+{
+  LZ_IMAGE_TYPE_INVALID,
+  LZ_IMAGE_TYPE_PLT1_LE,
+  LZ_IMAGE_TYPE_PLT1_BE,
+  LZ_IMAGE_TYPE_PLT4_LE,
+  LZ_IMAGE_TYPE_PLT4_BE,
+  LZ_IMAGE_TYPE_PLT8,
+  LZ_IMAGE_TYPE_RGB16,
+  LZ_IMAGE_TYPE_RGB24,
+  LZ_IMAGE_TYPE_RGB32,
+  LZ_IMAGE_TYPE_RGBA,
+  LZ_IMAGE_TYPE_XXXA,
+  LZ_IMAGE_TYPE_A8
+}
+LZImageType;
+
+// the pixel encodings a single decode pass can read
+typedef enum
+{
+  LZ_PIXEL_RGB16,
+  LZ_PIXEL_RGB24,
+  LZ_PIXEL_ALPHA
+}
+LZPixel;
+
+typedef struct GLZImage
+{
+  uint64_t   id;
+  size_t     pixels;
+  uint32_t * data;
+}
+GLZImage;
+
+struct GLZWindow
+{
+  GLZImage   * images;
+  unsigned int count;
+  unsigned int size;
+};
+
+typedef struct LZReader
+{
+  const uint8_t * ip;
+  const uint8_t * end;
+}
+LZReader;
+
+static inline bool readU8(LZReader * r, uint8_t * value)
+{
+  if (r->ip == r->end)
+    return false;
+  *value = *r->ip++;
+  return true;
+}
+
+static inline bool readU32(LZReader * r, uint32_t * value)
+{
+  if (r->end - r->ip < 4)
+    return false;
+  *value =
+    ((uint32_t)r->ip[0] << 24) | ((uint32_t)r->ip[1] << 16) |
+    ((uint32_t)r->ip[2] << 8 ) |  (uint32_t)r->ip[3];
+  r->ip += 4;
+  return true;
+}
+
+static inline size_t compPixelSize(const LZPixel type)
+{
+  switch(type)
+  {
+    case LZ_PIXEL_RGB16: return 2;
+    case LZ_PIXEL_RGB24: return 3;
+    case LZ_PIXEL_ALPHA: return 1;
+  }
+  return 0;
+}
+
+static inline uint32_t expand5(uint32_t v)
+{
+  return (v << 3) | (v >> 2);
+}
+
+static inline void readLiterals(const uint8_t * ip, uint32_t * op, size_t n,
+    const LZPixel type)
+{
+  switch(type)
+  {
+    case LZ_PIXEL_RGB16:
+      for(size_t i = 0; i < n; ++i, ip += 2)
+      {
+        const uint32_t pix = (ip[0] << 8) | ip[1];
+        op[i] =
+           expand5( pix        & 0x1f)        |
+          (expand5((pix >> 5 ) & 0x1f) << 8 ) |
+          (expand5((pix >> 10) & 0x1f) << 16);
+      }
+      break;
+
+    case LZ_PIXEL_RGB24:
+      for(size_t i = 0; i < n; ++i, ip += 3)
+        op[i] = ip[0] | (ip[1] << 8) | (ip[2] << 16);
+      break;
+
+    case LZ_PIXEL_ALPHA:
+      for(size_t i = 0; i < n; ++i)
+        op[i] = (op[i] & 0x00ffffff) | ((uint32_t)ip[i] << 24);
+      break;
+  }
+}
+
+// copy a reference forwards, the regions overlap when the match is a run
+static inline void copyRef(uint32_t * op, const uint32_t * ref, size_t len,
+    const LZPixel type)
+{
+  if (type == LZ_PIXEL_ALPHA)
+  {
+    for(size_t i = 0; i < len; ++i)
+      op[i] = (op[i] & 0x00ffffff) | (ref[i] & 0xff000000);
+    return;
+  }
+
+  if (ref + len <= op || ref >= op + len)
+  {
+    memcpy(op, ref, len * sizeof(*op));
+    return;
+  }
+
+  for(size_t i = 0; i < len; ++i)
+    op[i] = ref[i];
+}
+
+static inline bool readLiteralRun(LZReader * r, uint32_t ** op,
+    uint32_t * const opEnd, uint8_t ctrl, const LZPixel type)
+{
+  const size_t n    = (size_t)ctrl + 1;
+  const size_t need = n * compPixelSize(type);
+  if (n > (size_t)(opEnd - *op) || need > (size_t)(r->end - r->ip))
+    return false;
+
+  readLiterals(r->ip, *op, n, type);
+  r->ip += need;
+  *op   += n;
+  return true;
+}
+
+static inline __attribute__((always_inline))
+bool lzDecode(LZReader * r, uint32_t * const out, size_t count,
+    const LZPixel type)
+{
+  uint32_t *       op    = out;
+  uint32_t * const opEnd = out + count;
+
+  while(op < opEnd)
+  {
+    uint8_t ctrl;
+    if (!readU8(r, &ctrl))
+      return false;
+
+    if (ctrl < LZ_MAX_COPY)
+    {
+      if (!readLiteralRun(r, &op, opEnd, ctrl, type))
+        return false;
+      continue;
+    }
+
+    size_t   len = (ctrl >> 5) - 1;
+    size_t   ofs = (ctrl & 0x1f) << 8;
+    uint8_t  code;
+
+    if (len == 7 - 1)
+      do
+      {
+        if (!readU8(r, &code))
+          return false;
+        len += code;
+      }
+      while(code == 255);
+
+    if (!readU8(r, &code))
+      return false;
+    ofs += code;
+
+    // far distances are escaped with the largest short distance
+    if (code == 255 && ofs - code == (31 << 8))
+    {
+      uint8_t hi, lo;
+      if (!readU8(r, &hi) || !readU8(r, &lo))
+        return false;
+      ofs = ((hi << 8) | lo) + LZ_MAX_DISTANCE;
+    }
+
+    // remove the encoder's bias from the length and distance
+    switch(type)
+    {
+      case LZ_PIXEL_ALPHA: len += 3; break;
+      case LZ_PIXEL_RGB16: len += 2; break;
+      case LZ_PIXEL_RGB24: len += 1; break;
+    }
+    ofs += 1;
+
+    if (ofs > (size_t)(op - out) || len > (size_t)(opEnd - op))
+      return false;
+
+    copyRef(op, op - ofs, len, type);
+    op += len;
+  }
+
+  return true;
+}
+
+bool decode_checkSize(const char * name, uint32_t width, uint32_t height,
+    unsigned int bpp, unsigned int maxWidth, unsigned int maxHeight)
+{
+  if (!width || !height)
+  {
+    PS_LOG_ERROR("%s image is empty", name);
+    return false;
+  }
+
+  if (width > maxWidth || height > maxHeight)
+  {
+    PS_LOG_ERROR("%s image of %ux%u is larger than its descriptor of %ux%u",
+        name, width, height, maxWidth, maxHeight);
+    return false;
+  }
+
+  // divided rather than multiplied so the size can't overflow
+  if (width > PS_DECODE_SIZE_MAX / bpp / height)
+  {
+    PS_LOG_ERROR("%s image of %ux%u is too large", name, width, height);
+    return false;
+  }
+
+  return true;
+}
+
+static bool allocImage(unsigned int width, unsigned int height,
+    PSDecodedImage * out)
+{
+  const size_t size = (size_t)width * height * sizeof(uint32_t);
+  out->data = scratch_get(size);
+  if (!out->data)
+  {
+    PS_LOG_ERROR("Failed to allocate %lu bytes for an image",
+        (unsigned long)size);
+    return false;
+  }
+
+  out->width  = width;
+  out->height = height;
+  out->stride = width * sizeof(uint32_t);
+  out->owned  = true;
+
+  out->palette        = NULL;
+  out->paletteEntries = 0;
+  return true;
+}
+
+bool decode_lz(const uint8_t * data, size_t size, unsigned int maxWidth,
+    unsigned int maxHeight, PSDecodedImage * out)
+{
+  LZReader r = { .ip = data, .end = data + size };
+
+  uint32_t magic, version, type, width, height, stride, topDown;
+  if (!readU32(&r, &magic  ) || !readU32(&r, &version) ||
+      !readU32(&r, &type   ) || !readU32(&r, &width  ) ||
+      !readU32(&r, &height ) || !readU32(&r, &stride ) ||
+      !readU32(&r, &topDown))
+  {
+    PS_LOG_ERROR("LZ image header is truncated");
+    return false;
+  }
+
+  if (magic != LZ_MAGIC || version != LZ_VERSION)
+  {
+    PS_LOG_ERROR("Invalid LZ image header");
+    return false;
+  }
+
+  LZPixel pixel;
+  switch(type)
+  {
+    case LZ_IMAGE_TYPE_RGB16: pixel = LZ_PIXEL_RGB16; break;
+    case LZ_IMAGE_TYPE_RGB24:
+    case LZ_IMAGE_TYPE_RGB32:
+    case LZ_IMAGE_TYPE_RGBA : pixel = LZ_PIXEL_RGB24; break;
+
+    default:
+      PS_LOG_ERROR("Unsupported LZ image type: %u", type);
+      return false;
+  }
+
+  if (!decode_checkSize("LZ", width, height, sizeof(uint32_t),
+        maxWidth, maxHeight) ||
+      !allocImage(width, height, out))
+    return false;
+
+  const size_t count = (size_t)width * height;
+  bool ok;
+  switch(pixel)
+  {
+    case LZ_PIXEL_RGB16:
+      ok = lzDecode(&r, (uint32_t *)out->data, count, LZ_PIXEL_RGB16);
+      break;
+
+    default:
+      ok = lzDecode(&r, (uint32_t *)out->data, count, LZ_PIXEL_RGB24);
+      break;
+  }
+
+  // the alpha channel follows the color data as a second stream
+  if (ok && type == LZ_IMAGE_TYPE_RGBA)
+    ok = lzDecode(&r, (uint32_t *)out->data, count, LZ_PIXEL_ALPHA);
+
+  if (!ok)
+  {
+    PS_LOG_ERROR("LZ image is corrupt");
+    decode_release(out);
+    return false;
+  }
+
+  out->format  = type == LZ_IMAGE_TYPE_RGBA ?
+    PS_BITMAP_FMT_RGBA : PS_BITMAP_FMT_32BIT;
+  out->topDown = topDown;
+  return true;
+}
+
+static const GLZImage * glzFind(GLZWindow * win, uint64_t id)
+{
+  // images are added in id order so the window is always sorted
+  unsigned int lo = 0, hi = win->count;
+  while(lo < hi)
+  {
+    const unsigned int mid = (lo + hi) / 2;
+    if (win->images[mid].id < id)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (lo < win->count && win->images[lo].id == id)
+    return &win->images[lo];
+
+  return NULL;
+}
+
+static bool glzAdd(GLZWindow * win, uint64_t id, uint32_t * data,
+    size_t pixels)
+{
+  if (win->count && win->images[win->count - 1].id >= id)
+  {
+    PS_LOG_ERROR("GLZ image %lu is out of order", (unsigned long)id);
+    return false;
+  }
+
+  if (win->count == win->size)
+  {
+    const unsigned int size = win->size ? win->size * 2 : 64;
+    GLZImage * images = realloc(win->images, size * sizeof(*images));
+    if (!images)
+    {
+      PS_LOG_ERROR("Failed to grow the GLZ window");
+      return false;
+    }
+
+    win->images = images;
+    win->size   = size;
+  }
+
+  win->images[win->count++] = (GLZImage)
+  {
+    .id     = id,
+    .pixels = pixels,
+    .data   = data
+  };
+  return true;
+}
+
+// release every image older then `id`, the server has dropped them too
+static void glzRelease(GLZWindow * win, uint64_t id)
+{
+  unsigned int n = 0;
+  while(n < win->count && win->images[n].id < id)
+    scratch_put(win->images[n++].data);
+
+  if (!n)
+    return;
+
+  win->count -= n;
+  memmove(win->images, win->images + n, win->count * sizeof(*win->images));
+}
+
+GLZWindow * decode_glzNew(void)
+{
+  GLZWindow * win = calloc(1, sizeof(*win));
+  if (!win)
+    PS_LOG_ERROR("Failed to allocate the GLZ window");
+
+  return win;
+}
+
+void decode_glzFree(GLZWindow * win)
+{
+  if (!win)
+    return;
+
+  decode_glzReset(win);
+  free(win);
+}
+
+void decode_glzReset(GLZWindow * win)
+{
+  glzRelease(win, UINT64_MAX);
+  free(win->images);
+  memset(win, 0, sizeof(*win));
+}
+
+static inline __attribute__((always_inline))
+bool glzDecode(GLZWindow * win, LZReader * r, uint64_t imageId,
+    uint32_t * const out, size_t count, const LZPixel type)
+{
+  uint32_t *       op    = out;
+  uint32_t * const opEnd = out + count;
+
+  while(op < opEnd)
+  {
+    uint8_t ctrl;
+    if (!readU8(r, &ctrl))
+      return false;
+
+    if (ctrl < LZ_MAX_COPY)
+    {
+      if (!readLiteralRun(r, &op, opEnd, ctrl, type))
+        return false;
+      continue;
+    }
+
+    size_t   len       = ctrl >> 5;
+    bool     pixelFlag = (ctrl >> 4) & 0x1;
+    size_t   pixelOfs  = ctrl & 0xf;
+    uint32_t imageDist;
+    uint8_t  code;
+
+    if (len == 7)
+      do
+      {
+        if (!readU8(r, &code))
+          return false;
+        len += code;
+      }
+      while(code == 255);
+
+    if (!readU8(r, &code))
+      return false;
+    pixelOfs += code << 4;
+
+    if (!readU8(r, &code))
+      return false;
+    const unsigned int imageFlag = (code >> 6) & 0x3;
+
+    if (!pixelFlag)
+    {
+      // short pixel offset, the image distance shares the byte
+      imageDist = code & 0x3f;
+      for(unsigned int i = 0; i < imageFlag; ++i)
+      {
+        if (!readU8(r, &code))
+          return false;
+        imageDist += code << (6 + 8 * i);
+      }
+    }
+    else
+    {
+      pixelFlag  = (code >> 5) & 0x1;
+      pixelOfs  += (code & 0x1f) << 12;
+      imageDist  = 0;
+      for(unsigned int i = 0; i < imageFlag; ++i)
+      {
+        if (!readU8(r, &code))
+          return false;
+        imageDist += code << (8 * i);
+      }
+
+      if (pixelFlag)
+      {
+        if (!readU8(r, &code))
+          return false;
+        pixelOfs += (size_t)code << 17;
+      }
+    }
+
+    // remove the encoder's bias from the length
+    switch(type)
+    {
+      case LZ_PIXEL_ALPHA: len += 2; break;
+      case LZ_PIXEL_RGB16: len += 1; break;
+      case LZ_PIXEL_RGB24: break;
+    }
+
+    if (len > (size_t)(opEnd - op))
+      return false;
+
+    const uint32_t * ref;
+    if (!imageDist)
+    {
+      // the distance within the same image is biased by one
+      pixelOfs += 1;
+      if (pixelOfs > (size_t)(op - out))
+        return false;
+      ref = op - pixelOfs;
+    }
+    else
+    {
+      const GLZImage * image = glzFind(win, imageId - imageDist);
+      if (!image)
+      {
+        PS_LOG_ERROR("GLZ image %lu references missing image %lu",
+            (unsigned long)imageId, (unsigned long)(imageId - imageDist));
+        return false;
+      }
+
+      if (pixelOfs > image->pixels || len > image->pixels - pixelOfs)
+        return false;
+
+      ref = image->data + pixelOfs;
+    }
+
+    copyRef(op, ref, len, type);
+    op += len;
+  }
+
+  return true;
+}
+
+bool decode_glz(GLZWindow * win, const uint8_t * data, size_t size,
+    unsigned int maxWidth, unsigned int maxHeight, PSDecodedImage * out)
+{
+  LZReader r = { .ip = data, .end = data + size };
+
+  uint32_t magic, version, width, height, stride, idHi, idLo, winHeadDist;
+  uint8_t  typeFlags;
+  if (!readU32(&r, &magic    ) || !readU32(&r, &version) ||
+      !readU8 (&r, &typeFlags) ||
+      !readU32(&r, &width    ) || !readU32(&r, &height ) ||
+      !readU32(&r, &stride   ) ||
+      !readU32(&r, &idHi     ) || !readU32(&r, &idLo   ) ||
+      !readU32(&r, &winHeadDist))
+  {
+    PS_LOG_ERROR("GLZ image header is truncated");
+    return false;
+  }
+
+  if (magic != LZ_MAGIC || version != LZ_VERSION)
+  {
+    PS_LOG_ERROR("Invalid GLZ image header");
+    return false;
+  }
+
+  const unsigned int type    = typeFlags & 0xf;
+  const bool         topDown = (typeFlags >> 4) & 0x1;
+  const uint64_t     id      = ((uint64_t)idHi << 32) | idLo;
+
+  if (type != LZ_IMAGE_TYPE_RGB16 && type != LZ_IMAGE_TYPE_RGB24 &&
+      type != LZ_IMAGE_TYPE_RGB32 && type != LZ_IMAGE_TYPE_RGBA)
+  {
+    PS_LOG_ERROR("Unsupported GLZ image type: %u", type);
+    return false;
+  }
+
+  if (!decode_checkSize("GLZ", width, height, sizeof(uint32_t),
+        maxWidth, maxHeight) ||
+      !allocImage(width, height, out))
+    return false;
+
+  uint32_t *   pixels = (uint32_t *)out->data;
+  const size_t count  = (size_t)width * height;
+
+  bool ok;
+  if (type == LZ_IMAGE_TYPE_RGB16)
+    ok = glzDecode(win, &r, id, pixels, count, LZ_PIXEL_RGB16);
+  else
+    ok = glzDecode(win, &r, id, pixels, count, LZ_PIXEL_RGB24);
+
+  if (ok && type == LZ_IMAGE_TYPE_RGBA)
+    ok = glzDecode(win, &r, id, pixels, count, LZ_PIXEL_ALPHA);
+
+  if (!ok)
+  {
+    PS_LOG_ERROR("GLZ image %lu is corrupt", (unsigned long)id);
+    decode_release(out);
+    return false;
+  }
+
+  // later images may reference this one, so it now belongs to the window
+  if (!glzAdd(win, id, pixels, count))
+  {
+    decode_release(out);
+    return false;
+  }
+
+  if (winHeadDist <= id)
+    glzRelease(win, id - winHeadDist);
+
+  out->format  = type == LZ_IMAGE_TYPE_RGBA ?
+    PS_BITMAP_FMT_RGBA : PS_BITMAP_FMT_32BIT;
+  out->topDown = topDown;
+  out->owned   = false;
+  return true;
+}
+
+void decode_release(PSDecodedImage * image)
+{
+  if (image->owned)
+    scratch_put(image->data);
+
+  image->data = NULL;
+}
@@ -0,0 +1,193 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "decode.h"
+#include "scratch.h"
+#include "ps.h"
+#include "log.h"
+
+#include <string.h>
+#include <spice/enums.h>
+
+/* decodes a single LZ4 block into `op`. The SPICE encoder uses the LZ4
+ * streaming API so matches may point back into the blocks that came before,
+ * which is fine as every block is decoded into one contiguous buffer */
+static uint8_t * lz4Block(const uint8_t * ip, const uint8_t * const ipEnd,
+    uint8_t * const base, uint8_t * op, uint8_t * const opEnd)
+{
+  while(ip < ipEnd)
+  {
+    const unsigned int token = *ip++;
+
+    size_t len = token >> 4;
+    if (len == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip == ipEnd)
+          return NULL;
+        b    = *ip++;
+        len += b;
+      }
+      while(b == 255);
+    }
+
+    if (len > (size_t)(ipEnd - ip) || len > (size_t)(opEnd - op))
+      return NULL;
+
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+
+    // the last sequence of a block only carries literals
+    if (ip == ipEnd)
+      break;
+
+    if (ipEnd - ip < 2)
+      return NULL;
+
+    const size_t offset = ip[0] | (ip[1] << 8);
+    ip += 2;
+
+    if (offset == 0 || offset > (size_t)(op - base))
+      return NULL;
+
+    len = token & 0xf;
+    if (len == 15)
+    {
+      uint8_t b;
+      do
+      {
+        if (ip == ipEnd)
+          return NULL;
+        b    = *ip++;
+        len += b;
+      }
+      while(b == 255);
+    }
+    len += 4;
+
+    if (len > (size_t)(opEnd - op))
+      return NULL;
+
+    /* overlapping matches repeat the last `offset` bytes, copy the pattern in
+     * doubling chunks so that each memcpy is free of overlap */
+    const uint8_t * ref = op - offset;
+    size_t dist = offset;
+    while(len > dist)
+    {
+      memcpy(op, ref, dist);
+      op   += dist;
+      len  -= dist;
+      dist *= 2;
+    }
+
+    memcpy(op, ref, len);
+    op += len;
+  }
+
+  return op;
+}
+
+bool decode_lz4(const uint8_t * data, size_t size, unsigned int width,
+    unsigned int height, PSDecodedImage * out)
+{
+  if (size < 2)
+  {
+    PS_LOG_ERROR("LZ4 image is truncated");
+    return false;
+  }
+
+  const uint8_t * ip    = data;
+  const uint8_t * ipEnd = data + size;
+
+  const bool topDown = *ip++;
+  const uint8_t fmt  = *ip++;
+
+  PSBitmapFormat format;
+  unsigned int   bpp;
+  switch(fmt)
+  {
+    case SPICE_BITMAP_FMT_16BIT: format = PS_BITMAP_FMT_16BIT; bpp = 2; break;
+    case SPICE_BITMAP_FMT_24BIT: format = PS_BITMAP_FMT_24BIT; bpp = 3; break;
+    case SPICE_BITMAP_FMT_32BIT: format = PS_BITMAP_FMT_32BIT; bpp = 4; break;
+    case SPICE_BITMAP_FMT_RGBA : format = PS_BITMAP_FMT_RGBA ; bpp = 4; break;
+
+    default:
+      PS_LOG_ERROR("Unsupported LZ4 bitmap format: %u", fmt);
+      return false;
+  }
+
+  if (!decode_checkSize("LZ4", width, height, bpp, width, height))
+    return false;
+
+  const size_t stride  = (size_t)width * bpp;
+  const size_t outSize = stride * height;
+
+  uint8_t * base = scratch_get(outSize);
+  if (!base)
+  {
+    PS_LOG_ERROR("Failed to allocate %lu bytes for an LZ4 image",
+        (unsigned long)outSize);
+    return false;
+  }
+
+  uint8_t * op    = base;
+  uint8_t * opEnd = base + outSize;
+
+  while(ip < ipEnd)
+  {
+    if (ipEnd - ip < 4)
+      goto err;
+
+    const size_t blockSize =
+      ((size_t)ip[0] << 24) | (ip[1] << 16) | (ip[2] << 8) | ip[3];
+    ip += 4;
+
+    if (blockSize > (size_t)(ipEnd - ip))
+      goto err;
+
+    op = lz4Block(ip, ip + blockSize, base, op, opEnd);
+    if (!op)
+      goto err;
+
+    ip += blockSize;
+  }
+
+  if (op != opEnd)
+    goto err;
+
+  out->format  = format;
+  out->topDown = topDown;
+  out->width   = width;
+  out->height  = height;
+  out->stride  = stride;
+  out->data    = base;
+  out->owned   = true;
+
+  out->palette        = NULL;
+  out->paletteEntries = 0;
+  return true;
+
+err:
+  PS_LOG_ERROR("LZ4 image is corrupt");
+  scratch_put(base);
+  return false;
+}
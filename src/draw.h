@@ -134,10 +134,10 @@ typedef struct SpiceImage
     SpiceBitmap         bitmap;
 //    SpiceQUICData       quic;
 //    SpiceSurface        surface;
-//    SpiceLZRGBData      lz_rgb;
+    SpiceLZRGBData      lz_rgb;
 //    SpiceLZPLTData      lz_plt;
 //    SpiceJPEGData       jpeg;
-//    SpiceLZ4Data        lz4;
+    SpiceLZ4Data        lz4;
 //    SpiceZlibGlzRGBData zlib_glz;
 //    SpiceJPEGAlphaData  jpeg_alpha;
   }
@@ -0,0 +1,243 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "io_thread.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+typedef struct PSIOThread PSIOThread;
+
+struct PSIOThread
+{
+  pthread_t       thread;
+  int             epollfd;
+
+  // wakes the thread to stop, identified by a NULL data pointer
+  int             wakefd;
+  atomic_bool     stop;
+
+  // held while the thread is processing events
+  pthread_mutex_t lock;
+
+  /* wakes the session's loop if the thread failed with `status`, or if one of
+   * its channels went away so the loop notices the session shutting down */
+  int             notifyfd;
+  PSPollSource    notify;
+  PSStatus        status;
+};
+
+static void * ioThread_main(void * opaque);
+
+bool ioThread_start(PS * ps)
+{
+  PSIOThread * io = calloc(1, sizeof(*io));
+  if (!io)
+  {
+    PS_LOG_ERROR("Failed to allocate the IO thread");
+    return false;
+  }
+
+  io->epollfd  = epoll_create1(EPOLL_CLOEXEC);
+  io->wakefd   = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  io->notifyfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (io->epollfd < 0 || io->wakefd < 0 || io->notifyfd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the IO thread fds");
+    goto err;
+  }
+
+  io->notify.type = PS_POLL_THREAD;
+  io->notify.ps   = ps;
+  io->status      = PS_STATUS_RUN;
+  atomic_store(&io->stop, false);
+  pthread_mutex_init(&io->lock, NULL);
+
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.ptr = NULL
+  };
+  epoll_ctl(io->epollfd, EPOLL_CTL_ADD, io->wakefd, &ev);
+
+  ev.data.ptr = &io->notify;
+  epoll_ctl(ps->epollfd, EPOLL_CTL_ADD, io->notifyfd, &ev);
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    if (ps->channels[i].threaded)
+      ps->channels[i].epollfd = io->epollfd;
+
+  ps->io = io;
+  if (pthread_create(&io->thread, NULL, ioThread_main, ps) != 0)
+  {
+    PS_LOG_ERROR("Failed to create the IO thread");
+    ps->io = NULL;
+    for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+      ps->channels[i].epollfd = ps->epollfd;
+
+    epoll_ctl(ps->epollfd, EPOLL_CTL_DEL, io->notifyfd, NULL);
+    pthread_mutex_destroy(&io->lock);
+    goto err;
+  }
+
+  return true;
+
+err:
+  if (io->notifyfd >= 0)
+    close(io->notifyfd);
+  if (io->wakefd >= 0)
+    close(io->wakefd);
+  if (io->epollfd >= 0)
+    close(io->epollfd);
+  free(io);
+  return false;
+}
+
+void ioThread_stop(PS * ps)
+{
+  PSIOThread * io = ps->io;
+  if (!io || atomic_exchange(&io->stop, true))
+    return;
+
+  const uint64_t value = 1;
+  if (write(io->wakefd, &value, sizeof(value)) != sizeof(value))
+    PS_LOG_ERROR("Failed to wake the IO thread");
+
+  pthread_join(io->thread, NULL);
+}
+
+void ioThread_free(PS * ps)
+{
+  PSIOThread * io = ps->io;
+  if (!io)
+    return;
+
+  ioThread_stop(ps);
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    ps->channels[i].epollfd = ps->epollfd;
+
+  epoll_ctl(ps->epollfd, EPOLL_CTL_DEL, io->notifyfd, NULL);
+  close(io->notifyfd);
+  close(io->wakefd);
+  close(io->epollfd);
+  pthread_mutex_destroy(&io->lock);
+  free(io);
+  ps->io = NULL;
+}
+
+void ioThread_lockChannel(PSChannel * channel)
+{
+  PSIOThread * io = channel->ps->io;
+  if (io && channel->threaded)
+    pthread_mutex_lock(&io->lock);
+}
+
+void ioThread_unlockChannel(PSChannel * channel)
+{
+  PSIOThread * io = channel->ps->io;
+  if (io && channel->threaded)
+    pthread_mutex_unlock(&io->lock);
+}
+
+PSStatus ioThread_status(PS * ps)
+{
+  PSIOThread * io = ps->io;
+
+  uint64_t value;
+  if (read(io->notifyfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    PS_LOG_ERROR("Failed to read the IO thread notification");
+
+  return io->status;
+}
+
+bool ioThread_isCurrent(PS * ps)
+{
+  return ps->io && pthread_equal(pthread_self(), ps->io->thread);
+}
+
+static void notifyLoop(PSIOThread * io)
+{
+  const uint64_t value = 1;
+  if (write(io->notifyfd, &value, sizeof(value)) != sizeof(value))
+    PS_LOG_ERROR("Failed to signal the session's loop");
+}
+
+static int connectedChannels(PS * ps)
+{
+  int count = 0;
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    if (ps->channels[i].threaded && ps->channels[i].connected)
+      ++count;
+  return count;
+}
+
+static void * ioThread_main(void * opaque)
+{
+  PS         * ps = opaque;
+  PSIOThread * io = ps->io;
+  struct epoll_event events[PS_LOOP_EVENTS];
+
+  while(!atomic_load(&io->stop))
+  {
+    int nfds = epoll_wait(io->epollfd, events, PS_LOOP_EVENTS, -1);
+    if (nfds < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      PS_LOG_ERROR("epoll_wait failed on the IO thread: %d", errno);
+      io->status = PS_STATUS_ERR_POLL;
+      break;
+    }
+
+    PSStatus status = PS_STATUS_RUN;
+    pthread_mutex_lock(&io->lock);
+    const int connected = connectedChannels(ps);
+    for(int i = 0; i < nfds && status == PS_STATUS_RUN; ++i)
+    {
+      PSPollSource * source = events[i].data.ptr;
+      if (source)
+        status = ps_dispatchEvent(source, events[i].events);
+    }
+    const bool lost = connectedChannels(ps) < connected;
+    pthread_mutex_unlock(&io->lock);
+
+    if (lost && status == PS_STATUS_RUN)
+      notifyLoop(io);
+
+    if (status != PS_STATUS_RUN)
+    {
+      io->status = status;
+      break;
+    }
+  }
+
+  // the channels are left as they are, the session's owner disconnects it
+  if (io->status != PS_STATUS_RUN)
+    notifyLoop(io);
+
+  return NULL;
+}
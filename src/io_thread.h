@@ -0,0 +1,54 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_IO_THREAD_
+#define _H_SPICE_IO_THREAD_
+
+#include "ps.h"
+
+#include <stdbool.h>
+
+/* in threaded mode the latency sensitive channels (those with
+ * PSChannel.threaded set) are polled and processed by a thread of their own
+ * so large display messages don't hold them up. A failure on the thread is
+ * reported to the session's loop which returns it from purespice_process */
+
+// creates the epoll set, moves the threaded channels onto it and starts the
+// thread
+bool ioThread_start(PS * ps);
+
+// stops and joins the thread, the epoll set stays valid until ioThread_free
+// so the channels can still be removed from it
+void ioThread_stop(PS * ps);
+void ioThread_free(PS * ps);
+
+/* serialises connecting and disconnecting a threaded channel with the thread
+ * processing it, these do nothing for the other channels or if the session
+ * is not threaded */
+void ioThread_lockChannel  (PSChannel * channel);
+void ioThread_unlockChannel(PSChannel * channel);
+
+// returns the status the thread failed with, or PS_STATUS_RUN if it is
+// fine, and clears the notification
+PSStatus ioThread_status(PS * ps);
+
+// true if called from the session's IO thread
+bool ioThread_isCurrent(PS * ps);
+
+#endif
@@ -17,14 +17,67 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
-#ifndef _H_I_LOG_
-#define _H_I_LOG_
-
+#define _GNU_SOURCE
 #include "log.h"
 #include "ps.h"
+#include "mpsc.h"
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/eventfd.h>
+
+// records waiting for the logging thread, a storm past this drops messages
+#define LOG_QUEUE_SIZE 256
+
+// room for the string arguments copied into a record
+#define LOG_TEXT_SIZE 256
+
+// the longest message the logging thread will format
+#define LOG_LINE_SIZE 1024
+
+typedef struct LogRecord
+{
+  const char * file;
+  const char * function;
+  const char * format;
+  unsigned int line;
+  unsigned int suppressed;
+  int          level;
+  unsigned int count;
+
+  // string arguments hold their offset into `text`
+  PSLogArg     args[PS_LOG_MAX_ARGS];
+  char         text[LOG_TEXT_SIZE];
+}
+LogRecord;
+
+static struct
+{
+  pthread_once_t     once;
+  struct MPSCQueue * queue;
+  pthread_t          thread;
+
+  // wakes the logging thread, only written if it has not already been asked
+  int                wakefd;
+  atomic_bool        wakePending;
+  atomic_bool        stop;
+
+  // records lost to a full queue, reported by the logging thread
+  atomic_uint        dropped;
+}
+l_log =
+{
+  .once   = PTHREAD_ONCE_INIT,
+  .wakefd = -1
+};
 
 static void log_stdout(const char * file, unsigned int line,
     const char * function, const char * format, ...)
@@ -54,16 +107,408 @@ static void log_stderr(const char * file, unsigned int line,
   fputc('\n', stderr);
 }
 
-void log_init(void)
+PSInit g_psInit =
+{
+  .log =
+  {
+    .info  = log_stdout,
+    .warn  = log_stdout,
+    .error = log_stderr
+  }
+};
+
+void log_init(const PSInit * init)
+{
+  if (init->log.info)
+    g_psInit.log.info  = init->log.info;
+
+  if (init->log.warn)
+    g_psInit.log.warn  = init->log.warn;
+
+  if (init->log.error)
+    g_psInit.log.error = init->log.error;
+
+  g_psInit.log.synchronous = init->log.synchronous;
+}
+
+static void append(char * out, size_t size, size_t * pos,
+    const char * format, ...) __attribute__((format (printf, 4, 5)));
+
+static void append(char * out, size_t size, size_t * pos,
+    const char * format, ...)
+{
+  if (*pos >= size - 1)
+    return;
+
+  va_list va;
+  va_start(va, format);
+  const int len = vsnprintf(out + *pos, size - *pos, format, va);
+  va_end(va);
+
+  if (len > 0)
+    *pos = *pos + len < size ? *pos + len : size - 1;
+}
+
+// the digits of a width or precision, or the value of a `*` argument
+static bool specNumber(const char ** f, char * spec, size_t * s,
+    const LogRecord * r, unsigned int * next, bool * omit)
+{
+  if (**f == '*')
+  {
+    ++*f;
+    if (*next >= r->count || r->args[*next].type != PS_LOG_ARG_INT)
+      return false;
+
+    const int value = (int)r->args[(*next)++].i;
+    if (value < 0 && omit)
+      *omit = true;
+    else
+      *s += snprintf(spec + *s, 16, "%d", value);
+    return true;
+  }
+
+  for(unsigned int i = 0; **f >= '0' && **f <= '9'; ++*f, ++i)
+    if (i < 8)
+      spec[(*s)++] = **f;
+  return true;
+}
+
+/* formats the record the way printf would have, each conversion is rebuilt
+ * with its width and precision resolved and widened to the argument as it
+ * was captured */
+static void formatRecord(const LogRecord * r, char * out, size_t size)
+{
+  const char * f    = r->format;
+  size_t       pos  = 0;
+  unsigned int next = 0;
+
+  while(*f && pos < size - 1)
+  {
+    if (*f != '%' || f[1] == '%')
+    {
+      if (*f == '%')
+        ++f;
+      out[pos++] = *f++;
+      continue;
+    }
+
+    char   spec[48];
+    size_t s = 0;
+    spec[s++] = *f++;
+
+    while(*f && strchr("-+ #0'", *f))
+    {
+      if (s < 8)
+        spec[s++] = *f;
+      ++f;
+    }
+
+    if (!specNumber(&f, spec, &s, r, &next, NULL))
+      goto bad;
+
+    if (*f == '.')
+    {
+      ++f;
+      bool   omit = false;
+      size_t dot  = s;
+      spec[s++] = '.';
+      if (!specNumber(&f, spec, &s, r, &next, &omit))
+        goto bad;
+
+      // a negative precision is taken as if it were omitted
+      if (omit)
+        s = dot;
+    }
+
+    char length[3] = { 0 };
+    for(unsigned int i = 0; *f && strchr("hljztLq", *f); ++f)
+      if (i < 2)
+        length[i++] = *f;
+
+    const char conv = *f;
+    if (!conv)
+      break;
+    ++f;
+
+    const PSLogArg * arg = next < r->count ? &r->args[next++] : NULL;
+    if (!arg)
+      goto bad;
+
+    switch(conv)
+    {
+      case 'd':
+      case 'i':
+      {
+        if (arg->type != PS_LOG_ARG_INT)
+          goto bad;
+
+        long long value;
+        if      (!strcmp(length, "hh")) value = (signed char)arg->i;
+        else if (!strcmp(length, "h" )) value = (short      )arg->i;
+        else if (!strcmp(length, "l" )) value = (long       )arg->i;
+        else if (!strcmp(length, "ll") ||
+                 !strcmp(length, "q" )) value = (long long  )arg->i;
+        else if (!strcmp(length, "j" )) value = (intmax_t   )arg->i;
+        else if (!strcmp(length, "z" ) ||
+                 !strcmp(length, "t" )) value = (ptrdiff_t  )arg->i;
+        else                            value = (int        )arg->i;
+
+        memcpy(spec + s, "lld", 4);
+        append(out, size, &pos, spec, value);
+        break;
+      }
+
+      case 'u':
+      case 'o':
+      case 'x':
+      case 'X':
+      {
+        if (arg->type != PS_LOG_ARG_INT)
+          goto bad;
+
+        unsigned long long value;
+        if      (!strcmp(length, "hh")) value = (unsigned char )arg->i;
+        else if (!strcmp(length, "h" )) value = (unsigned short)arg->i;
+        else if (!strcmp(length, "l" )) value = (unsigned long )arg->i;
+        else if (!strcmp(length, "ll") ||
+                 !strcmp(length, "q" ) ||
+                 !strcmp(length, "j" )) value = arg->i;
+        else if (!strcmp(length, "z" ) ||
+                 !strcmp(length, "t" )) value = (size_t        )arg->i;
+        else                            value = (unsigned int  )arg->i;
+
+        spec[s++] = 'l';
+        spec[s++] = 'l';
+        spec[s++] = conv;
+        spec[s  ] = '\0';
+        append(out, size, &pos, spec, value);
+        break;
+      }
+
+      case 'c':
+        if (arg->type != PS_LOG_ARG_INT)
+          goto bad;
+
+        memcpy(spec + s, "c", 2);
+        append(out, size, &pos, spec, (int)arg->i);
+        break;
+
+      case 's':
+        if (arg->type != PS_LOG_ARG_STRING)
+          goto bad;
+
+        memcpy(spec + s, "s", 2);
+        append(out, size, &pos, spec, r->text + arg->i);
+        break;
+
+      case 'p':
+        if (arg->type != PS_LOG_ARG_POINTER)
+          goto bad;
+
+        memcpy(spec + s, "p", 2);
+        append(out, size, &pos, spec, arg->p);
+        break;
+
+      case 'f': case 'F':
+      case 'e': case 'E':
+      case 'g': case 'G':
+      case 'a': case 'A':
+        if (arg->type != PS_LOG_ARG_DOUBLE)
+          goto bad;
+
+        spec[s++] = conv;
+        spec[s  ] = '\0';
+        append(out, size, &pos, spec, arg->d);
+        break;
+
+      case 'n':
+        break;
+
+      default:
+        goto bad;
+    }
+    continue;
+
+bad:
+    append(out, size, &pos, "(?)");
+  }
+
+  out[pos] = '\0';
+
+  if (r->suppressed)
+    append(out, size, &pos, " (%u similar messages suppressed)",
+        r->suppressed);
+}
+
+static void emitRecord(const LogRecord * r)
+{
+  char line[LOG_LINE_SIZE];
+  formatRecord(r, line, sizeof(line));
+
+  switch(r->level)
+  {
+    case PS_LOG_LEVEL_INFO:
+      g_psInit.log.info(r->file, r->line, r->function, "%s", line);
+      break;
+
+    case PS_LOG_LEVEL_WARN:
+      g_psInit.log.warn(r->file, r->line, r->function, "%s", line);
+      break;
+
+    default:
+      g_psInit.log.error(r->file, r->line, r->function, "%s", line);
+      break;
+  }
+}
+
+static void drainRecords(void)
+{
+  LogRecord r;
+  while(mpsc_pop(l_log.queue, &r))
+    emitRecord(&r);
+
+  const unsigned int dropped = atomic_exchange(&l_log.dropped, 0);
+  if (dropped)
+    g_psInit.log.warn(__FILE__, __LINE__, __FUNCTION__,
+        "%u log messages were dropped, the log queue was full", dropped);
+}
+
+static void * logThread_main(void * opaque)
+{
+  (void)opaque;
+  for(;;)
+  {
+    uint64_t value;
+    if (read(l_log.wakefd, &value, sizeof(value)) < 0)
+      continue;
+
+    // cleared before draining so a record pushed during it wakes us again
+    atomic_store(&l_log.wakePending, false);
+    drainRecords();
+
+    if (atomic_load(&l_log.stop))
+      break;
+  }
+
+  return NULL;
+}
+
+// flushes what is queued when the process exits
+static void logThread_stop(void)
+{
+  if (pthread_equal(pthread_self(), l_log.thread))
+    return;
+
+  atomic_store(&l_log.stop, true);
+
+  const uint64_t value = 1;
+  if (write(l_log.wakefd, &value, sizeof(value)) != sizeof(value))
+    return;
+
+  pthread_join(l_log.thread, NULL);
+}
+
+/* started by the first message, if any of this fails messages stay
+ * synchronous rather than being logged through what just failed */
+static void logThread_start(void)
 {
-  if (!g_ps.init.log.info)
-    g_ps.init.log.info  = log_stdout;
+  l_log.queue  = mpsc_new(sizeof(LogRecord), LOG_QUEUE_SIZE);
+  l_log.wakefd = eventfd(0, EFD_CLOEXEC);
+  if (!l_log.queue || l_log.wakefd < 0)
+    goto err;
+
+  if (pthread_create(&l_log.thread, NULL, logThread_main, NULL) != 0)
+    goto err;
+
+  atexit(logThread_stop);
+  return;
 
-  if (!g_ps.init.log.warn)
-    g_ps.init.log.warn  = log_stdout;
+err:
+  if (l_log.wakefd >= 0)
+    close(l_log.wakefd);
+  l_log.wakefd = -1;
 
-  if (!g_ps.init.log.error)
-    g_ps.init.log.error = log_stderr;
+  mpsc_free(l_log.queue);
+  l_log.queue = NULL;
 }
 
-#endif
+bool log_allow(PSLogSite * site)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  const uint64_t now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  uint64_t window = atomic_load_explicit(&site->windowMS,
+      memory_order_relaxed);
+  if (now - window >= PS_LOG_INTERVAL_MS &&
+      atomic_compare_exchange_strong_explicit(&site->windowMS, &window, now,
+        memory_order_relaxed, memory_order_relaxed))
+    atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+
+  if (atomic_fetch_add_explicit(&site->count, 1,
+        memory_order_relaxed) < PS_LOG_BURST)
+    return true;
+
+  atomic_fetch_add_explicit(&site->suppressed, 1, memory_order_relaxed);
+  return false;
+}
+
+void log_push(int level, PSLogSite * site, const char * file,
+    unsigned int line, const char * function, const char * format,
+    const PSLogArg * args)
+{
+  LogRecord r;
+  r.file       = file;
+  r.function   = function;
+  r.format     = format;
+  r.line       = line;
+  r.level      = level;
+  r.suppressed = atomic_exchange_explicit(&site->suppressed, 0,
+      memory_order_relaxed);
+
+  // the last byte is always a terminator for strings that did not fit
+  size_t used = 0;
+  r.text[LOG_TEXT_SIZE - 1] = '\0';
+
+  for(r.count = 0; r.count < PS_LOG_MAX_ARGS &&
+      args[r.count].type != PS_LOG_ARG_END; ++r.count)
+  {
+    r.args[r.count] = args[r.count];
+    if (args[r.count].type != PS_LOG_ARG_STRING)
+      continue;
+
+    const char * str = args[r.count].s ? args[r.count].s : "(null)";
+    const size_t len = strnlen(str, LOG_TEXT_SIZE - 1 - used);
+
+    memcpy(r.text + used, str, len);
+    r.text[used + len] = '\0';
+    r.args[r.count].i  = used;
+
+    used += len + 1;
+    if (used > LOG_TEXT_SIZE - 1)
+      used = LOG_TEXT_SIZE - 1;
+  }
+
+  if (!g_psInit.log.synchronous)
+  {
+    pthread_once(&l_log.once, logThread_start);
+    if (l_log.queue)
+    {
+      if (!mpsc_push(l_log.queue, &r))
+      {
+        atomic_fetch_add(&l_log.dropped, 1);
+        return;
+      }
+
+      if (!atomic_exchange(&l_log.wakePending, true))
+      {
+        const uint64_t value = 1;
+        if (write(l_log.wakefd, &value, sizeof(value)) != sizeof(value))
+          atomic_store(&l_log.wakePending, false);
+      }
+      return;
+    }
+  }
+
+  emitRecord(&r);
+}
@@ -22,13 +22,150 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "ps.h"
 
-#define _PS_LOG(func, fmt, ...) do { \
-  func(__FILE__, __LINE__, __FUNCTION__, fmt, ##__VA_ARGS__); \
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define PS_LOG_LEVEL_INFO  0
+#define PS_LOG_LEVEL_WARN  1
+#define PS_LOG_LEVEL_ERROR 2
+
+// messages below this level are not compiled in
+#ifndef PS_LOG_LEVEL
+#define PS_LOG_LEVEL PS_LOG_LEVEL_INFO
+#endif
+
+// the most arguments a message may take, more fail to compile
+#define PS_LOG_MAX_ARGS 16
+
+/* each call site lets a burst of messages through per interval, the rest are
+ * counted and the count is reported with the next message let through */
+#define PS_LOG_BURST       10
+#define PS_LOG_INTERVAL_MS 1000
+
+typedef enum PSLogArgType
+{
+  PS_LOG_ARG_END,
+  PS_LOG_ARG_INT,
+  PS_LOG_ARG_DOUBLE,
+  PS_LOG_ARG_STRING,
+  PS_LOG_ARG_POINTER
+}
+PSLogArgType;
+
+/* the arguments are captured as they are and formatted later by the logging
+ * thread, strings are copied as the caller's may not live that long */
+typedef struct PSLogArg
+{
+  PSLogArgType type;
+  union
+  {
+    unsigned long long i;
+    double             d;
+    const char       * s;
+    const void       * p;
+  };
+}
+PSLogArg;
+
+typedef struct PSLogSite
+{
+  _Atomic(uint64_t) windowMS;
+  atomic_uint       count;
+  atomic_uint       suppressed;
+}
+PSLogSite;
+
+static inline PSLogArg log_argInt(unsigned long long value)
+  { return (PSLogArg){ .type = PS_LOG_ARG_INT    , .i = value }; }
+static inline PSLogArg log_argDouble(double value)
+  { return (PSLogArg){ .type = PS_LOG_ARG_DOUBLE , .d = value }; }
+static inline PSLogArg log_argString(const char * value)
+  { return (PSLogArg){ .type = PS_LOG_ARG_STRING , .s = value }; }
+static inline PSLogArg log_argUString(const unsigned char * value)
+  { return (PSLogArg){ .type = PS_LOG_ARG_STRING , .s = (const char *)value }; }
+static inline PSLogArg log_argPointer(const void * value)
+  { return (PSLogArg){ .type = PS_LOG_ARG_POINTER, .p = value }; }
+
+// char pointers are always taken to be strings
+#define _PS_LOG_ARG(x) _Generic((x), \
+  char *               : log_argString , \
+  const char *         : log_argString , \
+  unsigned char *      : log_argUString, \
+  const unsigned char *: log_argUString, \
+  float                : log_argDouble , \
+  double               : log_argDouble , \
+  long double          : log_argDouble , \
+  _Bool                : log_argInt    , \
+  char                 : log_argInt    , \
+  signed char          : log_argInt    , \
+  unsigned char        : log_argInt    , \
+  short                : log_argInt    , \
+  unsigned short       : log_argInt    , \
+  int                  : log_argInt    , \
+  unsigned int         : log_argInt    , \
+  long                 : log_argInt    , \
+  unsigned long        : log_argInt    , \
+  long long            : log_argInt    , \
+  unsigned long long   : log_argInt    , \
+  default              : log_argPointer)((x)),
+
+#define _PS_LOG_ARGS_0()
+#define _PS_LOG_ARGS_1(x)       _PS_LOG_ARG(x)
+#define _PS_LOG_ARGS_2(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_1(__VA_ARGS__)
+#define _PS_LOG_ARGS_3(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_2(__VA_ARGS__)
+#define _PS_LOG_ARGS_4(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_3(__VA_ARGS__)
+#define _PS_LOG_ARGS_5(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_4(__VA_ARGS__)
+#define _PS_LOG_ARGS_6(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_5(__VA_ARGS__)
+#define _PS_LOG_ARGS_7(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_6(__VA_ARGS__)
+#define _PS_LOG_ARGS_8(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_7(__VA_ARGS__)
+#define _PS_LOG_ARGS_9(x, ...)  _PS_LOG_ARG(x) _PS_LOG_ARGS_8(__VA_ARGS__)
+#define _PS_LOG_ARGS_10(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_9(__VA_ARGS__)
+#define _PS_LOG_ARGS_11(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_10(__VA_ARGS__)
+#define _PS_LOG_ARGS_12(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_11(__VA_ARGS__)
+#define _PS_LOG_ARGS_13(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_12(__VA_ARGS__)
+#define _PS_LOG_ARGS_14(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_13(__VA_ARGS__)
+#define _PS_LOG_ARGS_15(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_14(__VA_ARGS__)
+#define _PS_LOG_ARGS_16(x, ...) _PS_LOG_ARG(x) _PS_LOG_ARGS_15(__VA_ARGS__)
+
+#define _PS_LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, \
+    _12, _13, _14, _15, _16, n, ...) n
+#define _PS_LOG_NARGS(...) _PS_LOG_NARGS_(0, ##__VA_ARGS__, \
+    16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+
+#define _PS_LOG_CAT_(a, b) a ## b
+#define _PS_LOG_CAT(a, b) _PS_LOG_CAT_(a, b)
+#define _PS_LOG_ARGS(...) \
+  _PS_LOG_CAT(_PS_LOG_ARGS_, _PS_LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+
+#define _PS_LOG(level, fmt, ...) do { \
+  static PSLogSite _site; \
+  if (0) \
+    log_check(fmt, ##__VA_ARGS__); \
+  if (log_allow(&_site)) \
+    log_push(level, &_site, __FILE__, __LINE__, __FUNCTION__, fmt, \
+        (const PSLogArg[]){ _PS_LOG_ARGS(__VA_ARGS__) \
+          { .type = PS_LOG_ARG_END } }); \
+} while(0);
+
+// stripped messages are still checked and still use their arguments
+#define _PS_LOG_STRIP(fmt, ...) do { \
+  if (0) \
+    log_check(fmt, ##__VA_ARGS__); \
 } while(0);
 
-#define PS_LOG_INFO(fmt, ...)  _PS_LOG(g_ps.init.log.info , fmt, ##__VA_ARGS__)
-#define PS_LOG_WARN(fmt, ...)  _PS_LOG(g_ps.init.log.warn , fmt, ##__VA_ARGS__)
-#define PS_LOG_ERROR(fmt, ...) _PS_LOG(g_ps.init.log.error, fmt, ##__VA_ARGS__)
+#if PS_LOG_LEVEL <= PS_LOG_LEVEL_INFO
+#define PS_LOG_INFO(fmt, ...)  _PS_LOG(PS_LOG_LEVEL_INFO , fmt, ##__VA_ARGS__)
+#else
+#define PS_LOG_INFO(fmt, ...)  _PS_LOG_STRIP(fmt, ##__VA_ARGS__)
+#endif
+
+#if PS_LOG_LEVEL <= PS_LOG_LEVEL_WARN
+#define PS_LOG_WARN(fmt, ...)  _PS_LOG(PS_LOG_LEVEL_WARN , fmt, ##__VA_ARGS__)
+#else
+#define PS_LOG_WARN(fmt, ...)  _PS_LOG_STRIP(fmt, ##__VA_ARGS__)
+#endif
+
+#define PS_LOG_ERROR(fmt, ...) _PS_LOG(PS_LOG_LEVEL_ERROR, fmt, ##__VA_ARGS__)
 
 #define PS_LOG_INFO_ONCE(fmt, ...) do { \
   static char first = 1; \
@@ -57,6 +194,21 @@ Place, Suite 330, Boston, MA 02111-1307 USA
   } \
 } while(0)
 
-void log_init(void);
+// the loggers are set up once for the process and shared by every session
+extern PSInit g_psInit;
+
+void log_init(const PSInit * init);
+
+static inline void log_check(const char * format, ...)
+  __attribute__((format (printf, 1, 2)));
+static inline void log_check(const char * format, ...)
+{
+  (void)format;
+}
+
+bool log_allow(PSLogSite * site);
+void log_push(int level, PSLogSite * site, const char * file,
+    unsigned int line, const char * function, const char * format,
+    const PSLogArg * args);
 
 #endif
@@ -45,6 +45,12 @@ typedef struct SpiceMsgMainInit
 }
 SpiceMsgMainInit;
 
+typedef struct SpiceMsgMainMultiMediaTime
+{
+  uint32_t time;
+}
+SpiceMsgMainMultiMediaTime;
+
 typedef struct SpiceChannelID
 {
   uint8_t type;
@@ -257,6 +263,123 @@ typedef struct SpiceMsgDisplayDrawCopy
 }
 SpiceMsgDisplayDrawCopy;
 
+typedef struct SpiceResourceID
+{
+  uint8_t  type;
+  uint64_t id;
+}
+SpiceResourceID;
+
+typedef struct SpiceMsgDisplayInvalList
+{
+  uint16_t        count;
+  SpiceResourceID resources[];
+}
+SpiceMsgDisplayInvalList;
+
+typedef struct SpiceMsgDisplayStreamCreate
+{
+  uint32_t  surface_id;
+  uint32_t  id;
+  uint8_t   flags;
+  uint8_t   codec_type;
+  uint64_t  stamp;
+  uint32_t  stream_width;
+  uint32_t  stream_height;
+  uint32_t  src_width;
+  uint32_t  src_height;
+  SpiceRect dest;
+  //SpiceClip clip;
+}
+SpiceMsgDisplayStreamCreate;
+
+typedef struct SpiceStreamDataHeader
+{
+  uint32_t id;
+  uint32_t multi_media_time;
+}
+SpiceStreamDataHeader;
+
+typedef struct SpiceMsgDisplayStreamData
+{
+  SpiceStreamDataHeader base;
+  uint32_t              data_size;
+  uint8_t               data[];
+}
+SpiceMsgDisplayStreamData;
+
+typedef struct SpiceMsgDisplayStreamDataSized
+{
+  SpiceStreamDataHeader base;
+  uint32_t              width;
+  uint32_t              height;
+  SpiceRect             dest;
+  uint32_t              data_size;
+  uint8_t               data[];
+}
+SpiceMsgDisplayStreamDataSized;
+
+typedef struct SpiceMsgDisplayStreamClip
+{
+  uint32_t id;
+  //SpiceClip clip;
+}
+SpiceMsgDisplayStreamClip;
+
+typedef struct SpiceMsgDisplayStreamDestroy
+{
+  uint32_t id;
+}
+SpiceMsgDisplayStreamDestroy;
+
+typedef struct SpiceMsgDisplayStreamActivateReport
+{
+  uint32_t stream_id;
+  uint32_t unique_id;
+  uint32_t max_window_size;
+  uint32_t timeout_ms;
+}
+SpiceMsgDisplayStreamActivateReport;
+
+typedef struct SpiceMsgcDisplayStreamReport
+{
+  uint32_t stream_id;
+  uint32_t unique_id;
+  uint32_t start_frame_mm_time;
+  uint32_t end_frame_mm_time;
+  uint32_t num_frames;
+  uint32_t num_drops;
+  int32_t  last_frame_delay;
+  uint32_t audio_delay;
+}
+SpiceMsgcDisplayStreamReport;
+
+typedef struct SpiceMsgDisplayInvalOne
+{
+  uint64_t id;
+}
+SpiceMsgDisplayInvalOne;
+
+// the dmabuf itself is passed with the byte that follows the message
+typedef struct SpiceMsgDisplayGlScanoutUnix
+{
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint32_t drm_fourcc_format;
+  uint32_t flags;
+}
+SpiceMsgDisplayGlScanoutUnix;
+
+typedef struct SpiceMsgDisplayGlDraw
+{
+  uint32_t x;
+  uint32_t y;
+  uint32_t w;
+  uint32_t h;
+}
+SpiceMsgDisplayGlDraw;
+
 typedef struct SpiceCursorHeader
 {
   uint64_t unique;
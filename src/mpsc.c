@@ -0,0 +1,133 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "mpsc.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* this is an implementation of Dmitry Vyukov's bounded MPMC queue, as there is
+ * only ever a single consumer the dequeue side does not need to be atomic */
+
+struct MPSCCell
+{
+  atomic_size_t seq;
+  uint8_t       data[];
+};
+
+struct MPSCQueue
+{
+  size_t    elementSize;
+  size_t    cellSize;
+  size_t    mask;
+  uint8_t * cells;
+
+  _Alignas(64) atomic_size_t enqueuePos;
+  _Alignas(64) size_t        dequeuePos;
+};
+
+static inline struct MPSCCell * getCell(struct MPSCQueue * queue, size_t pos)
+{
+  return (struct MPSCCell *)(queue->cells + (pos & queue->mask) *
+      queue->cellSize);
+}
+
+struct MPSCQueue * mpsc_new(size_t elementSize, unsigned int count)
+{
+  // the count must be a power of two
+  if (count < 2 || (count & (count - 1)))
+    return NULL;
+
+  struct MPSCQueue * queue = calloc(1, sizeof(*queue));
+  if (!queue)
+    return NULL;
+
+  queue->elementSize = elementSize;
+  queue->cellSize    = (sizeof(struct MPSCCell) + elementSize +
+      _Alignof(struct MPSCCell) - 1) & ~(_Alignof(struct MPSCCell) - 1);
+  queue->mask        = count - 1;
+  queue->cells       = malloc(queue->cellSize * count);
+  if (!queue->cells)
+  {
+    free(queue);
+    return NULL;
+  }
+
+  for(size_t i = 0; i < count; ++i)
+    atomic_init(&getCell(queue, i)->seq, i);
+
+  atomic_init(&queue->enqueuePos, 0);
+  queue->dequeuePos = 0;
+  return queue;
+}
+
+void mpsc_free(struct MPSCQueue * queue)
+{
+  if (!queue)
+    return;
+
+  free(queue->cells);
+  free(queue);
+}
+
+bool mpsc_push(struct MPSCQueue * queue, const void * data)
+{
+  struct MPSCCell * cell;
+  size_t pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+  for(;;)
+  {
+    cell = getCell(queue, pos);
+    const size_t   seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+    const intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+
+    if (dif == 0)
+    {
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueuePos, &pos,
+            pos + 1, memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if (dif < 0)
+      return false;
+    else
+      pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+  }
+
+  memcpy(cell->data, data, queue->elementSize);
+  atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+  return true;
+}
+
+bool mpsc_pop(struct MPSCQueue * queue, void * data)
+{
+  const size_t      pos  = queue->dequeuePos;
+  struct MPSCCell * cell = getCell(queue, pos);
+  const size_t      seq  = atomic_load_explicit(&cell->seq,
+      memory_order_acquire);
+
+  if ((intptr_t)seq - (intptr_t)(pos + 1) < 0)
+    return false;
+
+  memcpy(data, cell->data, queue->elementSize);
+  atomic_store_explicit(&cell->seq, pos + queue->mask + 1,
+      memory_order_release);
+  queue->dequeuePos = pos + 1;
+  return true;
+}
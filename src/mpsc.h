@@ -0,0 +1,36 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_MPSC_
+#define _H_SPICE_MPSC_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* bounded lock-free multi producer, single consumer queue of fixed size
+ * elements. Producers never block, if the queue is full the push fails. */
+
+struct MPSCQueue;
+
+struct MPSCQueue * mpsc_new(size_t elementSize, unsigned int count);
+void mpsc_free(struct MPSCQueue * queue);
+bool mpsc_push(struct MPSCQueue * queue, const void * data);
+bool mpsc_pop(struct MPSCQueue * queue, void * data);
+
+#endif
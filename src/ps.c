@@ -33,6 +33,16 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include "messages.h"
 #include "rsa.h"
 #include "queue.h"
+#include "decode.h"
+#include "scratch.h"
+#include "cache.h"
+#include "batch.h"
+#include "surface.h"
+#include "io_thread.h"
+#include "uring.h"
+#include "reconnect.h"
+#include "stats.h"
+#include "capture.h"
 
 #include <unistd.h>
 #include <stdio.h>
@@ -40,524 +50,1247 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <assert.h>
 #include <errno.h>
 
-#include <sys/ioctl.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include <spice/vd_agent.h>
 
-// globals
-PS g_ps =
+// the sessions of a loop are only touched by the thread processing it
+struct PSLoop
 {
-  .channels =
+  int   epollfd;
+  PS  * sessions;
+
+  /* makes the epoll set readable for work that has no fd of its own, such as
+   * a deferred channel disconnect, so loops polling it don't miss it */
+  int          wakefd;
+  PSPollSource wake;
+
+  // receives for the loop's channels if the io_uring backend is enabled
+  PSURing    * uring;
+  PSPollSource uringPoll;
+};
+
+// the session whose callbacks are being run by this thread
+static _Thread_local PS * l_current = NULL;
+
+// set by purespice_init, used by the loops created after it
+static bool l_ioUring = false;
+
+static const PSChannel l_channels[PS_CHANNEL_MAX] =
+{
+  // PS_CHANNEL_MAIN
   {
-    // PS_CHANNEL_MAIN
-    {
-      .spiceType        = SPICE_CHANNEL_MAIN,
-      .name             = "MAIN",
-      .getConnectPacket = channelMain_getConnectPacket,
-      .setCaps          = channelMain_setCaps,
-      .onMessage        = channelMain_onMessage
-    },
-    // PS_CHANNEL_INPUTS
-    {
-      .spiceType        = SPICE_CHANNEL_INPUTS,
-      .name             = "INPUTS",
-      .enable           = &g_ps.config.inputs.enable,
-      .autoConnect      = &g_ps.config.inputs.autoConnect,
-      .getConnectPacket = channelInputs_getConnectPacket,
-      .onMessage        = channelInputs_onMessage
-    },
-    // PS_CHANNEL_PLAYBACK
-    {
-      .spiceType        = SPICE_CHANNEL_PLAYBACK,
-      .name             = "PLAYBACK",
-      .enable           = &g_ps.config.playback.enable,
-      .autoConnect      = &g_ps.config.playback.autoConnect,
-      .getConnectPacket = channelPlayback_getConnectPacket,
-      .onMessage        = channelPlayback_onMessage
-    },
-    // PS_CHANNEL_RECORD
-    {
-      .spiceType        = SPICE_CHANNEL_RECORD,
-      .name             = "RECORD",
-      .enable           = &g_ps.config.record.enable,
-      .autoConnect      = &g_ps.config.record.autoConnect,
-      .getConnectPacket = channelRecord_getConnectPacket,
-      .onMessage        = channelRecord_onMessage,
-    },
-    // PS_CHANNEL_DISPLAY
-    {
-      .spiceType        = SPICE_CHANNEL_DISPLAY,
-      .name             = "DISPLAY",
-      .enable           = &g_ps.config.display.enable,
-      .autoConnect      = &g_ps.config.display.autoConnect,
-      .getConnectPacket = channelDisplay_getConnectPacket,
-      .onConnect        = channelDisplay_onConnect,
-      .onMessage        = channelDisplay_onMessage
-    },
-    // PS_CHANNEL_CURSOR
-    {
-      .spiceType        = SPICE_CHANNEL_CURSOR,
-      .name             = "CURSOR",
-      .enable           = &g_ps.config.cursor.enable,
-      .autoConnect      = &g_ps.config.cursor.autoConnect,
-      .getConnectPacket = channelCursor_getConnectPacket,
-      .onMessage        = channelCursor_onMessage
-    }
+    .spiceType        = SPICE_CHANNEL_MAIN,
+    .name             = "MAIN",
+    .getConnectPacket = channelMain_getConnectPacket,
+    .setCaps          = channelMain_setCaps,
+    .onMessage        = channelMain_onMessage
+  },
+  // PS_CHANNEL_INPUTS
+  {
+    .spiceType        = SPICE_CHANNEL_INPUTS,
+    .name             = "INPUTS",
+    .threaded         = true,
+    .getConnectPacket = channelInputs_getConnectPacket,
+    .onConnect        = channelInputs_onConnect,
+    .onMessage        = channelInputs_onMessage
+  },
+  // PS_CHANNEL_PLAYBACK
+  {
+    .spiceType        = SPICE_CHANNEL_PLAYBACK,
+    .name             = "PLAYBACK",
+    .threaded         = true,
+    .getConnectPacket = channelPlayback_getConnectPacket,
+    .onConnect        = channelPlayback_onConnect,
+    .onMessage        = channelPlayback_onMessage
+  },
+  // PS_CHANNEL_RECORD
+  {
+    .spiceType        = SPICE_CHANNEL_RECORD,
+    .name             = "RECORD",
+    .getConnectPacket = channelRecord_getConnectPacket,
+    .setCaps          = channelRecord_setCaps,
+    .onConnect        = channelRecord_onConnect,
+    .onMessage        = channelRecord_onMessage,
+  },
+  // PS_CHANNEL_DISPLAY
+  {
+    .spiceType        = SPICE_CHANNEL_DISPLAY,
+    .name             = "DISPLAY",
+    .getConnectPacket = channelDisplay_getConnectPacket,
+    .onConnect        = channelDisplay_onConnect,
+    .onMessage        = channelDisplay_onMessage
+  },
+  // PS_CHANNEL_CURSOR
+  {
+    .spiceType        = SPICE_CHANNEL_CURSOR,
+    .name             = "CURSOR",
+    .threaded         = true,
+    .getConnectPacket = channelCursor_getConnectPacket,
+    .onConnect        = channelCursor_onConnect,
+    .onMessage        = channelCursor_onMessage
   }
 };
 
 void purespice_init(const PSInit * init)
 {
-  if (init)
-    memcpy(&g_ps.init, init, sizeof(*init));
-  log_init();
-  g_ps.initialized = true;
+  if (!init)
+    return;
+
+  log_init(init);
+  l_ioUring = init->ioUring;
+}
+
+PSLoop * purespice_newLoop(void)
+{
+  PSLoop * loop = calloc(1, sizeof(*loop));
+  if (!loop)
+  {
+    PS_LOG_ERROR("Failed to allocate the loop");
+    return NULL;
+  }
+
+  loop->epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epollfd < 0)
+  {
+    PS_LOG_ERROR("epoll_create1 failed");
+    free(loop);
+    return NULL;
+  }
+
+  loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->wakefd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the loop eventfd");
+    close(loop->epollfd);
+    free(loop);
+    return NULL;
+  }
+
+  loop->wake.type = PS_POLL_WAKE;
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.ptr = &loop->wake
+  };
+  epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+
+  if (l_ioUring)
+  {
+    if ((loop->uring = uring_new()))
+    {
+      PS_LOG_INFO("Using io_uring for the channel sockets");
+      loop->uringPoll.type = PS_POLL_URING;
+      ev.data.ptr = &loop->uringPoll;
+      epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, uring_fd(loop->uring), &ev);
+    }
+    else
+      PS_LOG_INFO("Falling back to epoll for the channel sockets");
+  }
+
+  return loop;
+}
+
+void purespice_freeLoop(PSLoop * loop)
+{
+  if (!loop)
+    return;
+
+  if (loop->sessions)
+    PS_LOG_WARN("The loop was freed before its sessions were disconnected");
+
+  uring_free(loop->uring);
+  close(loop->wakefd);
+  close(loop->epollfd);
+  free(loop);
+}
+
+int purespice_getLoopFd(PSLoop * loop)
+{
+  return loop->epollfd;
+}
+
+static void loopWake(PSLoop * loop)
+{
+  const uint64_t value = 1;
+  if (write(loop->wakefd, &value, sizeof(value)) != sizeof(value))
+    PS_LOG_ERROR("Failed to wake the loop");
+}
+
+static void loopAdd(PS * ps)
+{
+  PSLoop * loop = ps->loop;
+  ps->loopPrev = NULL;
+  ps->loopNext = loop->sessions;
+  if (ps->loopNext)
+    ps->loopNext->loopPrev = ps;
+  loop->sessions = ps;
+  ps->inLoop     = true;
+}
+
+static void loopRemove(PS * ps)
+{
+  if (!ps->inLoop)
+    return;
+
+  PSLoop * loop = ps->loop;
+  if (ps->loopPrev)
+    ps->loopPrev->loopNext = ps->loopNext;
+  else
+    loop->sessions = ps->loopNext;
+
+  if (ps->loopNext)
+    ps->loopNext->loopPrev = ps->loopPrev;
+
+  ps->inLoop = false;
 }
 
-bool purespice_connect(const PSConfig * config)
+PSSession * purespice_newSession(PSLoop * loop)
 {
-  if (!g_ps.initialized)
+  PS * ps = calloc(1, sizeof(*ps));
+  if (!ps)
   {
-    log_init();
-    g_ps.initialized = true;
+    PS_LOG_ERROR("Failed to allocate the session");
+    return NULL;
   }
 
-  memcpy(&g_ps.config, config, sizeof(*config));
+  // balanced by purespice_freeSession, which the error path also calls
+  scratch_create();
 
-  g_ps.config.host = (const char *)strdup(config->host);
-  if (!g_ps.config.host)
+  if (!loop)
+  {
+    if (!(loop = purespice_newLoop()))
+      goto err;
+    ps->ownLoop = true;
+  }
+  ps->loop    = loop;
+  ps->epollfd = loop->epollfd;
+  ps->uring   = loop->uring;
+
+  memcpy(ps->channels, l_channels, sizeof(ps->channels));
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    PSChannel * channel = &ps->channels[i];
+    channel->ps        = ps;
+    channel->epollfd   = ps->epollfd;
+    channel->socket    = -1;
+    channel->uringSlot = -1;
+    channel->rxFd      = -1;
+    channel->poll.type = PS_POLL_CHANNEL;
+    channel->poll.ps   = ps;
+  }
+
+  ps->channels[PS_CHANNEL_INPUTS  ].enable      = &ps->config.inputs.enable;
+  ps->channels[PS_CHANNEL_INPUTS  ].autoConnect = &ps->config.inputs.autoConnect;
+  ps->channels[PS_CHANNEL_PLAYBACK].enable      = &ps->config.playback.enable;
+  ps->channels[PS_CHANNEL_PLAYBACK].autoConnect = &ps->config.playback.autoConnect;
+  ps->channels[PS_CHANNEL_RECORD  ].enable      = &ps->config.record.enable;
+  ps->channels[PS_CHANNEL_RECORD  ].autoConnect = &ps->config.record.autoConnect;
+  ps->channels[PS_CHANNEL_DISPLAY ].enable      = &ps->config.display.enable;
+  ps->channels[PS_CHANNEL_DISPLAY ].autoConnect = &ps->config.display.autoConnect;
+  ps->channels[PS_CHANNEL_CURSOR  ].enable      = &ps->config.cursor.enable;
+  ps->channels[PS_CHANNEL_CURSOR  ].autoConnect = &ps->config.cursor.autoConnect;
+
+  ps->inputs.eventfd    = -1;
+  ps->reconnect.timerfd = -1;
+  ps->inputs.poll.type = PS_POLL_INPUTS;
+  ps->inputs.poll.ps   = ps;
+
+  if (!agent_create(ps)           ||
+      !channelInputs_create(ps)   ||
+      !channelMain_create(ps)     ||
+      !channelDisplay_create(ps)  ||
+      !channelPlayback_create(ps) ||
+      !channelRecord_create(ps)   ||
+      !batch_create(ps)           ||
+      !surface_create(ps)         ||
+      !stats_create(ps)           ||
+      !(ps->glz = decode_glzNew()))
+    goto err;
+
+  return ps;
+
+err:
+  purespice_freeSession(ps);
+  return NULL;
+}
+
+void purespice_freeSession(PSSession * ps)
+{
+  if (!ps)
+    return;
+
+  if (ps->connected)
+    purespice_disconnect(ps);
+
+  decode_glzFree(ps->glz);
+  stats_destroy(ps);
+  surface_destroy(ps);
+  batch_destroy(ps);
+  channelRecord_destroy(ps);
+  channelPlayback_destroy(ps);
+  channelDisplay_destroy(ps);
+  channelMain_destroy(ps);
+  channelInputs_destroy(ps);
+  agent_destroy(ps);
+
+  if (ps->ownLoop)
+    purespice_freeLoop(ps->loop);
+
+  free(ps);
+  scratch_destroy();
+}
+
+PSSession * purespice_currentSession(void)
+{
+  return l_current;
+}
+
+PSLoop * purespice_getLoop(PSSession * ps)
+{
+  return ps->loop;
+}
+
+void * purespice_getOpaque(PSSession * ps)
+{
+  return ps->config.opaque;
+}
+
+bool purespice_connect(PSSession * ps, const PSConfig * config)
+{
+  if (ps->connected)
+  {
+    PS_LOG_ERROR("The session is already connected");
+    return false;
+  }
+
+  memcpy(&ps->config, config, sizeof(*config));
+
+  ps->config.host = (const char *)strdup(config->host);
+  if (!ps->config.host)
   {
     PS_LOG_ERROR("Failed to malloc");
     goto err_host;
   }
 
-  g_ps.config.password = (const char *)strdup(config->password);
-  if (!g_ps.config.password)
+  ps->config.password = (const char *)strdup(config->password);
+  if (!ps->config.password)
   {
     PS_LOG_ERROR("Failed to malloc");
     goto err_password;
   }
 
-  if (g_ps.config.clipboard.enable)
+  if (ps->config.clipboard.enable)
   {
-    if (!g_ps.config.clipboard.notice)
+    if (!ps->config.clipboard.notice)
     {
       PS_LOG_ERROR("clipboard->notice is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.clipboard.data)
+    if (ps->config.clipboard.dataStart)
+    {
+      if (!ps->config.clipboard.dataChunk)
+      {
+        PS_LOG_ERROR("clipboard->dataChunk is mandatory with dataStart");
+        goto err_config;
+      }
+
+      if (!ps->config.clipboard.dataEnd)
+      {
+        PS_LOG_ERROR("clipboard->dataEnd is mandatory with dataStart");
+        goto err_config;
+      }
+    }
+    else if (!ps->config.clipboard.data && !ps->config.clipboard.dataFd)
     {
       PS_LOG_ERROR("clipboard->data is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.clipboard.release)
+    if (!ps->config.clipboard.release)
     {
       PS_LOG_ERROR("clipboard->release is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.clipboard.request)
+    if (!ps->config.clipboard.request)
     {
       PS_LOG_ERROR("clipboard->request is mandatory");
       goto err_config;
     }
   }
 
-  if (g_ps.config.playback.enable)
+  if (ps->config.playback.enable)
   {
-    if (!g_ps.config.playback.start)
+    if (!ps->config.playback.start)
     {
       PS_LOG_ERROR("playback->start is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.playback.stop)
+    if (!ps->config.playback.stop)
     {
       PS_LOG_ERROR("playback->stop is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.playback.data)
+    if (!ps->config.playback.data &&
+        (!ps->config.playback.pull || ps->config.playback.opusPassthrough))
     {
       PS_LOG_ERROR("playback->data is mandatory");
       goto err_config;
     }
   }
 
-  if (g_ps.config.record.enable)
+  if (ps->config.record.enable)
   {
-    if (!g_ps.config.record.start)
+    if (!ps->config.record.start)
     {
       PS_LOG_ERROR("record->start is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.record.stop)
+    if (!ps->config.record.stop)
     {
       PS_LOG_ERROR("record->stop is mandatory");
       goto err_config;
     }
   }
 
-  if (g_ps.config.display.enable)
+  if (ps->config.display.enable)
   {
-    if (!g_ps.config.display.surfaceCreate)
+    // the surface store replaces the callbacks that draw to the surfaces
+    const bool store = ps->config.display.surfaceMapped;
+
+    if (!store && !ps->config.display.surfaceCreate)
     {
       PS_LOG_ERROR("display->surfaceCreate is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.display.surfaceDestroy)
+    if (!ps->config.display.surfaceDestroy)
     {
       PS_LOG_ERROR("display->surfaceDestroy is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.display.drawBitmap)
+    if (!store && !ps->config.display.frameComplete &&
+        !ps->config.display.drawBitmap)
     {
       PS_LOG_ERROR("display->drawBitmap is mandatory");
       goto err_config;
     }
 
-    if (!g_ps.config.display.drawFill)
+    if (!store && !ps->config.display.frameComplete &&
+        !ps->config.display.drawFills && !ps->config.display.drawFill)
     {
       PS_LOG_ERROR("display->drawFill is mandatory");
       goto err_config;
     }
+
+    if (store && !ps->config.display.surfaceDamage)
+    {
+      PS_LOG_ERROR("display->surfaceDamage is mandatory with surfaceMapped");
+      goto err_config;
+    }
+
+    if (ps->config.display.glScanout && !ps->config.display.glDraw)
+    {
+      PS_LOG_ERROR("display->glDraw is mandatory with glScanout");
+      goto err_config;
+    }
+
+    if (ps->config.display.streamCreate)
+    {
+      if (!ps->config.display.streamData)
+      {
+        PS_LOG_ERROR("display->streamData is mandatory with streamCreate");
+        goto err_config;
+      }
+
+      if (!ps->config.display.streamDestroy)
+      {
+        PS_LOG_ERROR("display->streamDestroy is mandatory with streamCreate");
+        goto err_config;
+      }
+    }
   }
 
-  memset(&g_ps.addr, 0, sizeof(g_ps.addr));
+  memset(&ps->addr, 0, sizeof(ps->addr));
 
-  if (g_ps.config.port == 0)
+  if (ps->config.port == 0)
   {
-    PS_LOG_INFO("Connecting to unix socket %s", g_ps.config.host);
+    PS_LOG_INFO("Connecting to unix socket %s", ps->config.host);
 
-    g_ps.family = AF_UNIX;
-    g_ps.addr.un.sun_family = g_ps.family;
-    strncpy(g_ps.addr.un.sun_path, g_ps.config.host,
-        sizeof(g_ps.addr.un.sun_path) - 1);
+    ps->family = AF_UNIX;
+    ps->addr.un.sun_family = ps->family;
+    strncpy(ps->addr.un.sun_path, ps->config.host,
+        sizeof(ps->addr.un.sun_path) - 1);
   }
   else
   {
     PS_LOG_INFO("Connecting to socket %s:%u",
-        g_ps.config.host, g_ps.config.port);
+        ps->config.host, ps->config.port);
 
-    g_ps.family = AF_INET;
-    inet_pton(g_ps.family, g_ps.config.host, &g_ps.addr.in.sin_addr);
-    g_ps.addr.in.sin_family = g_ps.family;
-    g_ps.addr.in.sin_port   = htons(g_ps.config.port);
+    ps->family = AF_INET;
+    inet_pton(ps->family, ps->config.host, &ps->addr.in.sin_addr);
+    ps->addr.in.sin_family = ps->family;
+    ps->addr.in.sin_port   = htons(ps->config.port);
   }
 
-  g_ps.epollfd = epoll_create1(0);
-  if (g_ps.epollfd < 0)
-  {
-    PS_LOG_ERROR("epoll_create1 failed");
+  if (ps->config.threaded && !ioThread_start(ps))
     goto err_config;
-  }
 
-  g_ps.channelID = 0;
-  if (channel_connect(&g_ps.channels[0]) != PS_STATUS_OK)
+  if (!channelInputs_init(ps))
+    goto err_inputs;
+
+  if (!agent_init(ps))
+    goto err_agent;
+
+  if (!reconnect_init(ps))
+    goto err_reconnect;
+
+  if (!stats_init(ps))
+    goto err_stats;
+
+  if (!capture_init(ps))
+    goto err_capture;
+
+  // the main channel links from the loop, failures are reported from there
+  ps->channelID = 0;
+  if (channel_connect(&ps->channels[0]) != PS_STATUS_OK)
   {
     PS_LOG_ERROR("channel connect failed");
     goto err_connect;
   }
 
-  PS_LOG_INFO("Connected");
-  g_ps.connected = true;
+  ps->connected = true;
+  loopAdd(ps);
   return true;
 
 err_connect:
-  close(g_ps.epollfd);
+  capture_deinit(ps);
+
+err_capture:
+  stats_deinit(ps);
+
+err_stats:
+  reconnect_deinit(ps);
+
+err_reconnect:
+  agent_deinit(ps);
+
+err_agent:
+  channelInputs_deinit(ps);
+
+err_inputs:
+  ioThread_free(ps);
 
 err_config:
-  free((char *)g_ps.config.host);
-  g_ps.config.host = NULL;
+  free((char *)ps->config.host);
+  ps->config.host = NULL;
 
 err_password:
-  free((char *)g_ps.config.password);
-  g_ps.config.password = NULL;
+  free((char *)ps->config.password);
+  ps->config.password = NULL;
 
 err_host:
   return false;
 }
 
-void purespice_disconnect(void)
+void purespice_disconnect(PSSession * ps)
 {
-  if (!g_ps.initialized)
-  {
-    log_init();
-    g_ps.initialized = true;
-  }
+  // a failure on the IO thread is reported to the session's owner instead
+  if (ioThread_isCurrent(ps))
+    return;
 
-  const bool wasConnected = g_ps.connected;
-  g_ps.connected = false;
+  const bool wasConnected = ps->connected;
+  ps->connected = false;
+  loopRemove(ps);
+  ioThread_stop(ps);
 
   for(int i = PS_CHANNEL_MAX - 1; i >= 0; --i)
-    channel_internal_disconnect(&g_ps.channels[i]);
+    channel_internal_disconnect(&ps->channels[i]);
+
+  channelInputs_deinit(ps);
+  agent_deinit(ps);
+  ioThread_free(ps);
+  reconnect_deinit(ps);
+  stats_deinit(ps);
+  capture_deinit(ps);
+
+  cache_free(ps->pixmapCache);
+  cache_free(ps->paletteCache);
+  ps->pixmapCache  = NULL;
+  ps->paletteCache = NULL;
+  channelDisplay_deinit(ps);
+  channelCursor_deinit(ps);
+  channelPlayback_deinit(ps);
+  channelRecord_deinit(ps);
+
+  decode_glzReset(ps->glz);
+  batch_free(ps);
+  surface_free(ps);
+
+  if (ps->config.host)
+  {
+    free((char *)ps->config.host);
+    ps->config.host = NULL;
+  }
 
-  close(g_ps.epollfd);
+  if (ps->config.password)
+  {
+    free((char *)ps->config.password);
+    ps->config.password = NULL;
+  }
+  channel_freeTicket(ps);
 
-  if (g_ps.motionBuffer)
+  if (ps->guestName)
   {
-    free(g_ps.motionBuffer);
-    g_ps.motionBuffer = NULL;
+    free(ps->guestName);
+    ps->guestName = NULL;
   }
 
-  if (g_ps.config.host)
+  if (wasConnected)
+    PS_LOG_INFO("Disconnected");
+}
+
+static PSStatus channel_dispatch(PSChannel * channel, uint8_t * data)
+{
+  channel->buffer     = data;
+  channel->headerRead = false;
+
+  // process the data
+  const uint64_t  start  = stats_start(channel->ps);
+  const PS_STATUS status = channel->handlerFn(channel);
+  stats_handler(channel, start);
+
+  switch(status)
   {
-    free((char *)g_ps.config.host);
-    g_ps.config.host = NULL;
+    case PS_STATUS_OK:
+    case PS_STATUS_HANDLED:
+      break;
+
+    case PS_STATUS_NODATA:
+      channel_internal_disconnect(channel);
+      break;
+
+    default:
+      PS_LOG_ERROR("%s: Handler reported read error", channel->name);
+      return PS_STATUS_ERR_READ;
   }
 
-  if (g_ps.config.password)
+  return PS_STATUS_RUN;
+}
+
+static void releaseLarge(PSChannel * channel)
+{
+  scratch_put(channel->largeBuffer);
+  channel->largeBuffer = NULL;
+  channel->largeSize   = 0;
+  channel->largeIdle   = 0;
+}
+
+/* parses the messages in buffer[*start, end), advancing start past those that
+ * were handled and leaving it at the start of any partial message */
+static PSStatus parseBuffer(PSChannel * channel, uint8_t * buffer,
+    unsigned int * start, const unsigned int end)
+{
+  while(channel->connected)
   {
-    free((char *)g_ps.config.password);
-    g_ps.config.password = NULL;
+    unsigned int avail = end - *start;
+
+    // drop any data that is still being discarded from the last message
+    if (channel->discardSize)
+    {
+      const unsigned int discard = channel->discardSize > avail ?
+        avail : channel->discardSize;
+
+      channel->discardSize -= discard;
+      *start               += discard;
+      avail                -= discard;
+
+      if (channel->discardSize)
+        break;
+    }
+
+    if (avail < sizeof(SpiceMiniDataHeader))
+      break;
+
+    uint8_t * ptr = buffer + *start;
+    if (!channel->headerRead)
+    {
+      memcpy(&channel->header, ptr, sizeof(channel->header));
+      channel->headerRead  = true;
+      channel->trailerSize = 0;
+      stats_message(channel);
+
+      // ack that we got the message
+      if (!channel_ack(channel))
+      {
+        PS_LOG_ERROR("%s: Failed to send message ack", channel->name);
+        return PS_STATUS_ERR_ACK;
+      }
+
+      if (channel->header.type < SPICE_MSG_BASE_LAST)
+        channel->handlerFn = channel_onMessage(channel);
+      else
+        channel->handlerFn = channel->onMessage(channel);
+
+      if (channel->handlerFn == PS_HANDLER_ERROR)
+      {
+        PS_LOG_ERROR("%s: invalid message: %d",
+            channel->name, channel->header.type);
+        return PS_STATUS_ERR_READ;
+      }
+
+      if (channel->handlerFn == PS_HANDLER_DISCARD)
+      {
+        stats_add(&channel->stats->bytesDiscarded, channel->header.size);
+        channel->headerRead   = false;
+        channel->discardSize  = channel->header.size + channel->trailerSize;
+        *start               += sizeof(SpiceMiniDataHeader);
+        continue;
+      }
+
+      // if the message can never fit in the ring, move it into a dedicated
+      // buffer and read the remainder of it directly into there
+      if (channel->header.size + channel->trailerSize >
+          PS_RX_RING_SIZE - sizeof(SpiceMiniDataHeader))
+      {
+        // only the small messages that pass an fd are followed by anything
+        if (channel->trailerSize)
+        {
+          PS_LOG_ERROR("%s: message %d is too large", channel->name,
+              channel->header.type);
+          return PS_STATUS_ERR_READ;
+        }
+
+        if (channel->largeSize < channel->header.size)
+        {
+          scratch_put(channel->largeBuffer);
+          channel->largeBuffer = scratch_get(channel->header.size);
+          if (!channel->largeBuffer)
+          {
+            channel->largeSize = 0;
+            PS_LOG_ERROR("out of memory");
+            return PS_STATUS_ERR_READ;
+          }
+          channel->largeSize = scratch_size(channel->largeBuffer);
+        }
+
+        // decay the high water mark so a one off huge message is let go
+        channel->largeHigh -= channel->largeHigh / 8;
+        if (channel->largeHigh < channel->header.size)
+          channel->largeHigh = channel->header.size;
+        channel->largeIdle = 0;
+
+        const unsigned int copy = avail - sizeof(SpiceMiniDataHeader);
+        memcpy(channel->largeBuffer, ptr + sizeof(SpiceMiniDataHeader), copy);
+        channel->largeRead    = copy;
+        channel->largePending = true;
+        *start                = end;
+        break;
+      }
+    }
+
+    // wait for the rest of the message
+    const unsigned int size = sizeof(SpiceMiniDataHeader) +
+      channel->header.size + channel->trailerSize;
+    if (avail < size)
+      break;
+
+    *start += size;
+
+    PSStatus status;
+    if ((status = channel_dispatch(channel,
+            ptr + sizeof(SpiceMiniDataHeader))) != PS_STATUS_RUN)
+      return status;
+
+    // don't pin the large buffer if large messages have stopped arriving
+    if (channel->largeBuffer &&
+        ++channel->largeIdle >= PS_LARGE_IDLE_MESSAGES)
+      releaseLarge(channel);
   }
 
-  if (g_ps.guestName)
+  return PS_STATUS_RUN;
+}
+
+static inline PSStatus channel_parseRing(PSChannel * channel)
+{
+  return parseBuffer(channel, channel->rxRing, &channel->rxStart,
+      channel->rxEnd);
+}
+
+// move any partial message to the start of the ring
+static void compactRing(PSChannel * channel)
+{
+  if (channel->rxStart == channel->rxEnd)
+    channel->rxStart = channel->rxEnd = 0;
+  else if (channel->rxStart > 0)
   {
-    free(g_ps.guestName);
-    g_ps.guestName = NULL;
+    channel->rxEnd -= channel->rxStart;
+    memmove(channel->rxRing, channel->rxRing + channel->rxStart,
+        channel->rxEnd);
+    channel->rxStart = 0;
   }
+}
 
-  agent_disconnect();
+static PSStatus completeLarge(PSChannel * channel)
+{
+  channel->largePending = false;
+  const PSStatus status = channel_dispatch(channel, channel->largeBuffer);
 
-  if (wasConnected)
-    PS_LOG_INFO("Disconnected");
+  /* give the buffer up if the consumer leased it, or if it is far larger
+   * than the messages that have been arriving recently */
+  if (channel->largeBuffer &&
+      (scratch_isShared(channel->largeBuffer) ||
+       channel->largeSize / 2 > channel->largeHigh))
+    releaseLarge(channel);
+
+  return status;
 }
 
-PSStatus purespice_process(int timeout)
+// drops a channel whose connection was lost, it is reconnected if it can be
+static PSStatus channelLost(PSChannel * channel)
 {
-  static struct epoll_event events[PS_CHANNEL_MAX];
+  channel_internal_disconnect(channel);
+  reconnect_lost(channel);
+  return PS_STATUS_RUN;
+}
 
-  // check for pending disconnects
-  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
-    if (g_ps.channels[i].initDone && g_ps.channels[i].doDisconnect)
-      channel_internal_disconnect(&g_ps.channels[i]);
+static PSStatus readFailed(PSChannel * channel, int error)
+{
+  PS_LOG_ERROR("%s: Failed to read from the socket: %d",
+      channel->name, error);
 
-  int nfds = epoll_wait(g_ps.epollfd, events, PS_CHANNEL_MAX, timeout);
-  if (nfds == 0 || (nfds < 0 && errno == EINTR))
+  // a network error only costs the session the channel if it comes back
+  if (reconnect_isTransient(error) && reconnect_lost(channel))
+  {
+    channel_internal_disconnect(channel);
     return PS_STATUS_RUN;
+  }
 
-  if (nfds < 0)
+  return PS_STATUS_ERR_READ;
+}
+
+static PSStatus channel_process(PSChannel * channel)
+{
+  uint8_t * dst;
+  size_t    size;
+
+  if (channel->largePending)
+  {
+    dst  = channel->largeBuffer + channel->largeRead;
+    size = channel->header.size - channel->largeRead;
+  }
+  else
   {
-    if (!g_ps.connected)
+    compactRing(channel);
+    dst  = channel->rxRing + channel->rxEnd;
+    size = PS_RX_RING_SIZE - channel->rxEnd;
+  }
+
+  // don't block on an event that went stale while the IO thread waited for
+  // a channel to be reconnected
+  ssize_t len = channel_recv(channel, dst, size);
+  if (len == 0)
+    return channelLost(channel);
+
+  if (len < 0)
+  {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+      return PS_STATUS_RUN;
+
+    return readFailed(channel, errno);
+  }
+
+  stats_add(&channel->stats->bytesIn, len);
+  capture_data(channel, dst, len);
+  if (channel->largePending)
+  {
+    channel->largeRead += len;
+    if (channel->largeRead < channel->header.size)
+      return PS_STATUS_RUN;
+
+    return completeLarge(channel);
+  }
+
+  channel->rxEnd += len;
+  return channel_parseRing(channel);
+}
+
+/* feeds data the io_uring received for the channel through the parser. Whole
+ * messages are handled in place, only a trailing partial message is copied
+ * into the ring to be completed by the next receive */
+static PSStatus channel_receive(PSChannel * channel, uint8_t * data,
+    unsigned int len)
+{
+  PSStatus status;
+  while(len && channel->connected)
+  {
+    if (channel->largePending)
     {
-      PS_LOG_INFO("Shutdown");
-      return PS_STATUS_SHUTDOWN;
+      unsigned int copy = channel->header.size - channel->largeRead;
+      if (copy > len)
+        copy = len;
+
+      memcpy(channel->largeBuffer + channel->largeRead, data, copy);
+      channel->largeRead += copy;
+      data               += copy;
+      len                -= copy;
+
+      if (channel->largeRead < channel->header.size)
+        return PS_STATUS_RUN;
+
+      if ((status = completeLarge(channel)) != PS_STATUS_RUN)
+        return status;
+      continue;
     }
 
-    PS_LOG_ERROR("epoll_err returned %d", nfds);
-    return PS_STATUS_ERR_POLL;
+    if (channel->rxStart == channel->rxEnd)
+    {
+      unsigned int start = 0;
+      if ((status = parseBuffer(channel, data, &start, len)) != PS_STATUS_RUN)
+        return status;
+
+      if (!channel->connected || channel->largePending)
+        return PS_STATUS_RUN;
+
+      channel->rxStart = 0;
+      channel->rxEnd   = len - start;
+      memcpy(channel->rxRing, data + start, channel->rxEnd);
+      return PS_STATUS_RUN;
+    }
+
+    // complete the partial message in the ring
+    compactRing(channel);
+    unsigned int copy = PS_RX_RING_SIZE - channel->rxEnd;
+    if (copy > len)
+      copy = len;
+
+    memcpy(channel->rxRing + channel->rxEnd, data, copy);
+    channel->rxEnd += copy;
+    data           += copy;
+    len            -= copy;
+
+    if ((status = channel_parseRing(channel)) != PS_STATUS_RUN)
+      return status;
   }
 
-  // process each channel one message at a time to avoid stalling a channel
+  return PS_STATUS_RUN;
+}
+
+static PSStatus uringReceive(PSChannel * channel, uint8_t * data,
+    ssize_t len)
+{
+  PS * ps = channel->ps;
+  if (!ps->connected || !channel->connected)
+    return PS_STATUS_RUN;
+
+  if (len == 0)
+    return channelLost(channel);
+
+  if (len < 0)
+    return readFailed(channel, (int)-len);
 
-  int done = 0;
-  while(done < nfds)
+  stats_add(&channel->stats->bytesIn, len);
+  capture_data(channel, data, len);
+  l_current = ps;
+  PSStatus status = channel_receive(channel, data, len);
+  if (status == PS_STATUS_RUN && !channel_flushDeferred(channel))
+    status = PS_STATUS_ERR_WRITE;
+  l_current = NULL;
+  return status;
+}
+
+// starts a channel whose link has completed
+static PSStatus channelLinked(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  PS_STATUS status;
+
+  // the IO thread must not see the channel until it has been set up
+  ioThread_lockChannel(channel);
+  if ((status = channel_linked(channel)) == PS_STATUS_OK)
   {
-    for(int i = 0; i < nfds; ++i)
+    if (channel == &ps->channels[PS_CHANNEL_MAIN])
     {
-      if (!events[i].data.ptr)
-        continue;
+      PS_LOG_INFO("Connected");
+    }
+    else
+      PS_LOG_INFO("%s channel connected", channel->name);
 
-      PSChannel * channel = (PSChannel *)events[i].data.ptr;
+    reconnect_linked(channel);
+    if (channel->onConnect)
+      status = channel->onConnect(channel);
+  }
+  ioThread_unlockChannel(channel);
 
-      int dataAvailable;
-      ioctl(channel->socket, FIONREAD, &dataAvailable);
+  if (status != PS_STATUS_OK)
+  {
+    PS_LOG_ERROR("Failed to connect to the %s channel", channel->name);
+    purespice_disconnect(ps);
+    return PS_STATUS_ERR_CONNECT;
+  }
 
-      // check if the socket has been disconnected
-      if (!dataAvailable)
-        goto done_disconnect;
+  channelMain_checkReady(ps);
+  return PS_STATUS_RUN;
+}
 
-      // if we don't have a header yet, read it
-      if (channel->headerRead < sizeof(SpiceMiniDataHeader))
+static PSStatus linkEvent(PSChannel * channel)
+{
+  switch(channel_link(channel))
+  {
+    case PS_STATUS_HANDLED:
+      return PS_STATUS_RUN;
+
+    case PS_STATUS_OK:
+      return channelLinked(channel);
+
+    case PS_STATUS_NODATA:
+      if (reconnect_lost(channel))
       {
-        int       size = sizeof(SpiceMiniDataHeader)   - channel->headerRead;
-        uint8_t * dst  = ((uint8_t *)&channel->header) + channel->headerRead;
+        channel_internal_disconnect(channel);
+        channelMain_checkReady(channel->ps);
+        return PS_STATUS_RUN;
+      }
+      // fall through
 
-        if (size > dataAvailable)
-          size = dataAvailable;
+    default:
+      PS_LOG_ERROR("Failed to connect to the %s channel", channel->name);
+      purespice_disconnect(channel->ps);
+      return PS_STATUS_ERR_CONNECT;
+  }
+}
 
-        ssize_t len = read(channel->socket, dst, size);
-        if (len == 0)
-          goto done_disconnect;
+static PSStatus dispatchEvent(PSPollSource * source, uint32_t events)
+{
+  PS * ps = source->ps;
+  switch(source->type)
+  {
+    case PS_POLL_INPUTS:
+      if (!channelInputs_processQueue(ps))
+        return PS_STATUS_ERR_WRITE;
+      return PS_STATUS_RUN;
 
-        if (len < 0)
-        {
-          PS_LOG_ERROR("%s: Failed to read from the socket: %ld",
-              channel->name, len);
-          return PS_STATUS_ERR_READ;
-        }
+    case PS_POLL_AGENT:
+      if (!agent_processQueue(ps))
+        return PS_STATUS_ERR_WRITE;
+      return PS_STATUS_RUN;
 
-        // check if we have a complete header
-        channel->headerRead += len;
-        if (channel->headerRead < sizeof(SpiceMiniDataHeader))
-          continue;
+    case PS_POLL_THREAD:
+      return ioThread_status(ps);
 
-        // ack that we got the message
-        if (!channel_ack(channel))
-        {
-          PS_LOG_ERROR("%s: Failed to send message ack", channel->name);
-          return PS_STATUS_ERR_ACK;
-        }
+    case PS_POLL_RECONNECT:
+      return reconnect_process(ps);
 
-        dataAvailable -= len;
-        channel->bufferRead = 0;
-        if (channel->header.type < SPICE_MSG_BASE_LAST)
-          channel->handlerFn = channel_onMessage(channel);
-        else
-          channel->handlerFn = channel->onMessage(channel);
+    case PS_POLL_STATS:
+      return stats_report(ps);
 
-        if (channel->handlerFn == PS_HANDLER_ERROR)
-        {
-          PS_LOG_ERROR("%s: invalid message: %d",
-              channel->name, channel->header.type);
-          return PS_STATUS_ERR_READ;
-        }
+    // only seen by the loop itself
+    case PS_POLL_WAKE:
+    case PS_POLL_URING:
+      return PS_STATUS_RUN;
 
-        if (channel->handlerFn == PS_HANDLER_DISCARD)
-        {
-          channel->discarding  = true;
-          channel->discardSize = channel->header.size;
-        }
-        else
-        {
-          // ensure we have a large enough buffer to read the entire message
-          if (channel->bufferSize < channel->header.size)
-          {
-            free(channel->buffer);
-            channel->buffer = malloc(channel->header.size);
-            if (!channel->buffer)
-            {
-              PS_LOG_ERROR("out of memory");
-              return PS_STATUS_ERR_READ;
-            }
-            channel->bufferSize = channel->header.size;
-          }
-        }
-      }
+    case PS_POLL_CHANNEL:
+      break;
+  }
 
-      // check if we are discarding data
-      if (channel->discarding)
-      {
-        while(channel->discardSize && dataAvailable)
-        {
-          char temp[8192];
-          unsigned int discard =
-            channel->discardSize > (unsigned int)dataAvailable ?
-            (unsigned int)dataAvailable : channel->discardSize;
-          if (discard > sizeof(temp))
-            discard = sizeof(temp);
-
-          ssize_t len = read(channel->socket, temp, discard);
-          if (len == 0)
-            goto done_disconnect;
-
-          if (len < 0)
-          {
-            PS_LOG_ERROR("%s: Failed to discard from the socket: %ld",
-                channel->name, len);
-            return PS_STATUS_ERR_READ;
-          }
+  PSChannel * channel = (PSChannel *)
+    ((uint8_t *)source - offsetof(PSChannel, poll));
 
-          dataAvailable        -= len;
-          channel->discardSize -= len;
-        }
+  if (channel->link != PS_LINK_NONE)
+    return linkEvent(channel);
 
-        if (!channel->discardSize)
-        {
-          channel->discarding = false;
-          channel->headerRead = 0;
-        }
-      }
-      else
-      {
-        // read the payload into the buffer
-        int size = channel->header.size - channel->bufferRead;
-        if (size)
-        {
-          if (size > dataAvailable)
-            size = dataAvailable;
-          ssize_t len = read(channel->socket,
-              channel->buffer + channel->bufferRead, size);
+  if (!channel->connected)
+    return PS_STATUS_RUN;
 
-          if (len == 0)
-            goto done_disconnect;
+  if (events & EPOLLOUT)
+  {
+    if (!channel_flush(channel))
+      return PS_STATUS_ERR_WRITE;
 
-          if (len < 0)
-          {
-            PS_LOG_ERROR("%s: Failed to read the message payload: %ld",
-                channel->name, len);
-            return PS_STATUS_ERR_READ;
-          }
+    // the agent stops sending while the main channel is backed up
+    if (channel == &ps->channels[PS_CHANNEL_MAIN] && !channel->txWaiting)
+      agent_wake(ps);
+  }
 
-          dataAvailable       -= len;
-          channel->bufferRead += len;
-        }
+  // the io_uring does the receiving, hangups and errors appear there as well
+  if (!(events & ~EPOLLOUT) || channel->uringSlot >= 0)
+    return PS_STATUS_RUN;
 
-        // if we have the full payload call the channel handler to process it
-        if (channel->bufferRead == channel->header.size)
-        {
-          channel->headerRead = 0;
+  // the acks and pongs for what was received go out together
+  const PSStatus status = channel_process(channel);
+  if (status == PS_STATUS_RUN && !channel_flushDeferred(channel))
+    return PS_STATUS_ERR_WRITE;
 
-          // process the data
-          switch(channel->handlerFn(channel))
-          {
-            case PS_STATUS_OK:
-            case PS_STATUS_HANDLED:
-              break;
+  return status;
+}
 
-            case PS_STATUS_NODATA:
-              goto done_disconnect;
+PSStatus ps_dispatchEvent(PSPollSource * source, uint32_t events)
+{
+  l_current = source->ps;
+  const PSStatus status = dispatchEvent(source, events);
+  l_current = NULL;
+  return status;
+}
 
-            default:
-              PS_LOG_ERROR("%s: Handler reported read error", channel->name);
-              return PS_STATUS_ERR_READ;
-          }
-        }
-      }
+// returns true if every channel of the session has gone away
+static bool endPass(PS * ps)
+{
+  // in batched and store mode everything drawn during this pass is one frame
+  l_current = ps;
+  batch_flush(ps);
+  if (surface_enabled(ps))
+    surface_flush(ps);
+  l_current = NULL;
+
+  // channels lost during the pass, possibly on the IO thread
+  reconnect_schedule(ps);
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    PSChannel * channel = &ps->channels[i];
+    ioThread_lockChannel(channel);
+    const bool connected = channel->connected ||
+      channel->link != PS_LINK_NONE;
+    ioThread_unlockChannel(channel);
+
+    if (connected)
+      return false;
+  }
+
+  ps->sessionID = 0;
+
+  for(int i = PS_CHANNEL_MAX - 1; i >= 0; --i)
+  {
+    PSChannel * channel = &ps->channels[i];
+    if (channel->socket >= 0)
+    {
+      close(channel->socket);
+      channel->socket = -1;
+    }
+  }
+
+  PS_LOG_INFO("Shutdown");
+  return true;
+}
+
+PSStatus purespice_processLoop(PSLoop * loop, int timeout,
+    PSSession ** session)
+{
+  struct epoll_event events[PS_LOOP_EVENTS];
+
+  // check for pending disconnects
+  for(PS * ps = loop->sessions; ps; ps = ps->loopNext)
+    for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    {
+      PSChannel * channel = &ps->channels[i];
+      ioThread_lockChannel(channel);
+      if (channel->initDone && channel->doDisconnect)
+        channel_internal_disconnect(channel);
+      ioThread_unlockChannel(channel);
+    }
+
+  int nfds = epoll_wait(loop->epollfd, events, PS_LOOP_EVENTS, timeout);
+  if (nfds == 0 || (nfds < 0 && errno == EINTR))
+    return PS_STATUS_RUN;
 
-      // if there is no more data, we are finished processing this channel
-      if (dataAvailable == 0)
+  if (nfds < 0)
+  {
+    PS_LOG_ERROR("epoll_err returned %d", nfds);
+    return PS_STATUS_ERR_POLL;
+  }
+
+  /* each channel gets a single read per wakeup to avoid stalling the others,
+   * every complete message that arrived with it is processed. A session that
+   * fails stops the pass so the caller can deal with it, anything left over
+   * is reported again by the next epoll_wait */
+  for(int i = 0; i < nfds; ++i)
+  {
+    PSPollSource * source = events[i].data.ptr;
+    if (source->type == PS_POLL_WAKE)
+    {
+      // the pending disconnects were handled above
+      uint64_t value;
+      if (read(loop->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+        PS_LOG_ERROR("Failed to read the loop eventfd");
+      continue;
+    }
+
+    if (source->type == PS_POLL_URING)
+    {
+      PSChannel * failed = NULL;
+      const PSStatus status = uring_process(loop->uring, uringReceive,
+          &failed);
+
+      if (status != PS_STATUS_RUN)
       {
-        ++done;
-        events[i].data.ptr = NULL;
+        if (session)
+          *session = failed->ps;
+        return status;
       }
+      continue;
+    }
 
+    PS * ps = source->ps;
+    if (!ps->connected)
       continue;
 
-done_disconnect:
-      ++done;
-      events[i].data.ptr = NULL;
-      channel_internal_disconnect(channel);
+    const PSStatus status = ps_dispatchEvent(source, events[i].events);
+
+    if (status != PS_STATUS_RUN)
+    {
+      if (session)
+        *session = ps;
+      return status;
     }
   }
 
-  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
-    if (g_ps.channels[i].connected)
-      return PS_STATUS_RUN;
+  PS * ps = loop->sessions;
+  while(ps)
+  {
+    PS * next = ps->loopNext;
+    if (endPass(ps))
+    {
+      // report the session once, it stays out of the loop until reconnected
+      loopRemove(ps);
+      if (session)
+        *session = ps;
+      return PS_STATUS_SHUTDOWN;
+    }
+    ps = next;
+  }
 
-  g_ps.sessionID = 0;
+  return PS_STATUS_RUN;
+}
 
-  for(int i = PS_CHANNEL_MAX - 1; i >= 0; --i)
-    close(g_ps.channels[i].socket);
+PSStatus purespice_dispatch(PSLoop * loop, PSSession ** session)
+{
+  return purespice_processLoop(loop, 0, session);
+}
 
-  PS_LOG_INFO("Shutdown");
-  return PS_STATUS_SHUTDOWN;
+PSStatus purespice_process(PSSession * ps, int timeout)
+{
+  if (!ps->inLoop)
+  {
+    PS_LOG_INFO("Shutdown");
+    return PS_STATUS_SHUTDOWN;
+  }
+
+  return purespice_processLoop(ps->loop, timeout, NULL);
 }
 
-bool purespice_getServerInfo(PSServerInfo * info)
+bool purespice_getServerInfo(PSSession * ps, PSServerInfo * info)
 {
-  if (!g_ps.guestName)
+  if (!ps->guestName)
     return false;
 
-  memcpy(info->uuid, g_ps.guestUUID, sizeof(g_ps.guestUUID));
-  info->name = strdup(g_ps.guestName);
+  memcpy(info->uuid, ps->guestUUID, sizeof(ps->guestUUID));
+  info->name = strdup(ps->guestName);
 
   return true;
 }
@@ -571,6 +1304,15 @@ void purespice_freeServerInfo(PSServerInfo * info)
     free(info->name);
 }
 
+bool purespice_getStats(PSSession * ps, PSStats * stats)
+{
+  if (!ps->connected)
+    return false;
+
+  stats_get(ps, stats);
+  return true;
+}
+
 static uint8_t channelTypeToSpiceType(PSChannelType channel)
 {
   switch(channel)
@@ -601,31 +1343,31 @@ static uint8_t channelTypeToSpiceType(PSChannelType channel)
   __builtin_unreachable();
 }
 
-static PSChannel * getChannel(PSChannelType channel)
+static PSChannel * getChannel(PS * ps, PSChannelType channel)
 {
   const uint8_t spiceType = channelTypeToSpiceType(channel);
   if (spiceType == 255)
     return NULL;
 
   for(int i = 0; i < PS_CHANNEL_MAX; ++i)
-    if (g_ps.channels[i].spiceType == spiceType)
-      return &g_ps.channels[i];
+    if (ps->channels[i].spiceType == spiceType)
+      return &ps->channels[i];
 
   __builtin_unreachable();
 }
 
-bool purespice_hasChannel(PSChannelType channel)
+bool purespice_hasChannel(PSSession * ps, PSChannelType channel)
 {
-  PSChannel * ch = getChannel(channel);
+  PSChannel * ch = getChannel(ps, channel);
   if (!ch)
     return false;
 
   return ch->available;
 }
 
-bool purespice_channelConnected(PSChannelType channel)
+bool purespice_channelConnected(PSSession * ps, PSChannelType channel)
 {
-  PSChannel * ch = getChannel(channel);
+  PSChannel * ch = getChannel(ps, channel);
   if (!ch)
     return false;
   return ch->connected;
@@ -633,18 +1375,11 @@ bool purespice_channelConnected(PSChannelType channel)
 
 PS_STATUS ps_connectChannel(PSChannel * ch)
 {
+  // the link completes from the loop, see channelLinked
   PS_STATUS status;
   if ((status = channel_connect(ch)) != PS_STATUS_OK)
   {
-    purespice_disconnect();
-    PS_LOG_ERROR("Failed to connect to the %s channel", ch->name);
-    return status;
-  }
-
-  PS_LOG_INFO("%s channel connected", ch->name);
-  if (ch->onConnect && (status = ch->onConnect(ch)) != PS_STATUS_OK)
-  {
-    purespice_disconnect();
+    purespice_disconnect(ch->ps);
     PS_LOG_ERROR("Failed to connect to the %s channel", ch->name);
     return status;
   }
@@ -652,9 +1387,9 @@ PS_STATUS ps_connectChannel(PSChannel * ch)
   return PS_STATUS_OK;
 }
 
-bool purespice_connectChannel(PSChannelType channel)
+bool purespice_connectChannel(PSSession * ps, PSChannelType channel)
 {
-  PSChannel * ch = getChannel(channel);
+  PSChannel * ch = getChannel(ps, channel);
   if (!ch)
     return false;
 
@@ -664,15 +1399,16 @@ bool purespice_connectChannel(PSChannelType channel)
     return false;
   }
 
-  if (ch->connected)
+  if (ch->connected || ch->link != PS_LINK_NONE)
     return true;
 
+  reconnect_cancel(ch);
   return ps_connectChannel(ch) == PS_STATUS_OK;
 }
 
-bool purespice_disconnectChannel(PSChannelType channel)
+bool purespice_disconnectChannel(PSSession * ps, PSChannelType channel)
 {
-  PSChannel * ch = getChannel(channel);
+  PSChannel * ch = getChannel(ps, channel);
   if (!ch)
     return false;
 
@@ -682,9 +1418,20 @@ bool purespice_disconnectChannel(PSChannelType channel)
     return false;
   }
 
+  reconnect_cancel(ch);
+
+  // links are only run by the loop so one can be dropped straight away
+  if (ch->link != PS_LINK_NONE)
+  {
+    channel_internal_disconnect(ch);
+    channelMain_checkReady(ps);
+    return true;
+  }
+
   if (!ch->connected)
     return true;
 
   channel_disconnect(ch);
+  loopWake(ps->loop);
   return true;
 }
@@ -24,6 +24,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include "locking.h"
 #include "messages.h"
+#include "rsa.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -33,9 +34,10 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 #include <arpa/inet.h>
 #include <spice/protocol.h>
 
-// we don't really need flow control because we are all local
-// instead do what the spice-gtk library does and provide the largest
-// possible number
+// agent data is handed to the application as soon as it is received so
+// there is nothing to throttle, do what the spice-gtk library does and
+// provide the largest possible number. Tokens are never returned as that
+// would overflow the server's count
 #define SPICE_AGENT_TOKENS_MAX ~0
 
 #define _SPICE_RAW_PACKET(htype, dataSize, extraData, _alloc) \
@@ -82,21 +84,120 @@ Place, Suite 330, Boston, MA 02111-1307 USA
   SpiceMiniDataHeader * header = (SpiceMiniDataHeader *)(((uint8_t *)packet) - \
       sizeof(SpiceMiniDataHeader)); \
   ssize_t *sz = (ssize_t *)(((uint8_t *)header) - sizeof(ssize_t)); \
-  SPICE_LOCK((channel)->lock); \
-  const ssize_t wrote = send((channel)->socket, header, *sz, 0); \
-  SPICE_UNLOCK((channel)->lock); \
-  wrote == *sz; \
+  channel_send((channel), header, *sz); \
 })
 
+// queues the packet to be flushed once the channel's current receive is done
+#define SPICE_QUEUE_PACKET(channel, packet) \
+({ \
+  SpiceMiniDataHeader * header = (SpiceMiniDataHeader *)(((uint8_t *)packet) - \
+      sizeof(SpiceMiniDataHeader)); \
+  ssize_t *sz = (ssize_t *)(((uint8_t *)header) - sizeof(ssize_t)); \
+  channel_queue((channel), header, *sz); \
+})
+
+// queues the packet without taking the channel lock or flushing, the caller
+// must hold the lock and call channel_flush once it has been released
 #define SPICE_SEND_PACKET_NL(channel, packet) \
 ({ \
   SpiceMiniDataHeader * header = (SpiceMiniDataHeader *)(((uint8_t *)packet) - \
       sizeof(SpiceMiniDataHeader)); \
   ssize_t *sz = (ssize_t *)(((uint8_t *)header) - sizeof(ssize_t)); \
-  const ssize_t wrote = send((channel)->socket, header, *sz, 0); \
-  wrote == *sz; \
+  channel_queueNL((channel), header, *sz); \
 })
 
+// the largest SpiceLinkReply accepted from the server
+#define PS_LINK_REPLY_MAX 200
+
+// size of the per channel receive ring, messages larger then this that can not
+// fit into the ring are read into a dedicated buffer instead
+#define PS_RX_RING_SIZE (256 * 1024)
+
+// upper limit of unsent data a channel may queue before sends start to fail,
+// this only happens if the server has stopped reading from the socket
+#define PS_TX_QUEUE_MAX (4 * 1024 * 1024)
+
+// size of the GLZ dictionary window requested from the server in pixels
+#define PS_GLZ_WINDOW_SIZE (16 * 1024 * 1024)
+
+// default size of the pixmap cache in bytes
+#define PS_PIXMAP_CACHE_DEFAULT (64 * 1024 * 1024)
+
+// size of the palette cache in bytes
+#define PS_PALETTE_CACHE_SIZE (1024 * 1024)
+
+// the highest stream id the display channel will track, spice uses 50
+#define PS_MAX_STREAMS 64
+
+// number of input events that can be pending before new events are dropped
+#define PS_INPUT_QUEUE_SIZE 1024
+
+// number of unacknowledged motion messages before motion is coalesced, this
+// allows one ack bunch to be in flight while the next is being sent
+#define PS_MOTION_INFLIGHT_MAX (SPICE_INPUT_MOTION_ACK_BUNCH * 2)
+
+// number of damage rectangles kept per surface in batched mode before the
+// closest ones are merged together
+#define PS_DAMAGE_RECTS_MAX 16
+
+// size of the cursor cache in bytes, including the converted images
+#define PS_CURSOR_CACHE_SIZE (4 * 1024 * 1024)
+
+// size of the playback ring in bytes, about 2.7 seconds of 48kHz stereo
+#define PS_PLAYBACK_RING_SIZE (512 * 1024)
+
+// the most iovecs channel_sendv accepts in a single call
+#define PS_SENDV_MAX 32
+
+/* delay before a lost channel is reconnected in milliseconds, doubled for each
+ * attempt that fails. A channel that stayed up for the longest delay starts
+ * over with the shortest */
+#define PS_RECONNECT_DELAY_MIN 50
+#define PS_RECONNECT_DELAY_MAX 5000
+
+// number of attempts made to reconnect a channel before giving up on it
+#define PS_RECONNECT_ATTEMPTS 10
+
+// the surface ids the display channel keeps over a reconnect, larger ids are
+// passed on untracked
+#define PS_MAX_SURFACES 1024
+
+// the default amount of audio the playback ring keeps buffered in ms
+#define PS_PLAYBACK_LATENCY_DEFAULT 20
+
+// agent data up to this size is copied into the queue node instead of being
+// referenced
+#define PS_AGENT_INLINE_SIZE 64
+
+// the number of free agent queue nodes kept for reuse
+#define PS_AGENT_POOL_SIZE 64
+
+// the most agent data packets sent per wakeup before the other channels get
+// a turn
+#define PS_AGENT_DRAIN_MAX 8
+
+// the number of idle buffers the scratch pool keeps per size class, enough
+// for a receive ring per channel, and the most idle memory it keeps in total
+#define PS_SCRATCH_IDLE_PER_CLASS 8
+#define PS_SCRATCH_IDLE_MAX (32 * 1024 * 1024)
+
+// the largest image the decoders will produce, 8192x8192 at 32bpp
+#define PS_DECODE_SIZE_MAX (256 * 1024 * 1024)
+
+/* a channel releases its large message buffer if it is more than twice the
+ * decaying high water mark of recent large messages, or if no large message
+ * has arrived in this many messages */
+#define PS_LARGE_IDLE_MESSAGES 1024
+
+// the most epoll events handled per wakeup of a loop
+#define PS_LOOP_EVENTS 64
+
+/* the io_uring backend's queue depth, and the receive buffers a loop shares
+ * between its channels (the count must be a power of two) */
+#define PS_URING_ENTRIES 64
+#define PS_URING_BUFFERS 64
+#define PS_URING_BUFFER_SIZE (16 * 1024)
+
 // currently (2020) these defines are not yet availble for most distros, so we
 // just define them ourselfs for now
 #define _SPICE_MOUSE_BUTTON_SIDE        6
@@ -113,9 +214,42 @@ typedef enum
 }
 PS_STATUS;
 
-typedef struct PS        PS;
+typedef struct PSSession PS;
 typedef struct PSChannel PSChannel;
 
+typedef enum
+{
+  PS_POLL_CHANNEL,
+  PS_POLL_INPUTS,
+  PS_POLL_AGENT,
+  PS_POLL_THREAD,
+  PS_POLL_WAKE,
+  PS_POLL_URING,
+  PS_POLL_RECONNECT,
+  PS_POLL_STATS
+}
+PSPollType;
+
+/* every fd in a loop's epoll set points at one of these, `ps` is NULL for the
+ * loop's own wakeup and io_uring */
+typedef struct PSPollSource
+{
+  PSPollType type;
+  PS       * ps;
+}
+PSPollSource;
+
+// the steps of a channel's non-blocking link handshake
+typedef enum
+{
+  PS_LINK_NONE,
+  PS_LINK_CONNECT,
+  PS_LINK_HEADER,
+  PS_LINK_REPLY,
+  PS_LINK_RESULT
+}
+PSLinkState;
+
 typedef PS_STATUS (*PSHandlerFn)(PSChannel * channel);
 #define PS_HANDLER_DISCARD (PSHandlerFn)( 0)
 #define PS_HANDLER_ERROR   (PSHandlerFn)(-1)
@@ -123,6 +257,8 @@ typedef PS_STATUS (*PSHandlerFn)(PSChannel * channel);
 // internal structures
 struct PSChannel
 {
+  PS         * ps;
+  PSPollSource poll;
   uint8_t      spiceType;
   const char * name;
   bool         available;
@@ -130,16 +266,74 @@ struct PSChannel
   bool       * autoConnect;
 
   SpiceMiniDataHeader header;
-  unsigned int headerRead;
+  bool         headerRead;
   PSHandlerFn  handlerFn;
   uint8_t    * buffer;
-  unsigned int bufferSize;
-  unsigned int bufferRead;
-  bool         discarding;
   unsigned int discardSize;
 
-  const SpiceLinkHeader * (*getConnectPacket)(void);
-  void (*setCaps)(
+  // the bytes the server sends after the current message, see passFds
+  unsigned int trailerSize;
+
+  // receive ring, filled with one recv per wakeup
+  uint8_t    * rxRing;
+  unsigned int rxStart;
+  unsigned int rxEnd;
+
+  // dedicated buffer for messages that are too large for the ring
+  uint8_t    * largeBuffer;
+  unsigned int largeSize;
+  unsigned int largeRead;
+  bool         largePending;
+  unsigned int largeHigh;
+  unsigned int largeIdle;
+
+  // outbound queue, protected by lock and flushed by channel_flush
+  uint8_t    * txBuffer;
+  size_t       txSize;
+  size_t       txStart;
+  size_t       txEnd;
+  bool         txWaiting;
+
+  // data was queued by channel_queue, only touched by the receiving thread
+  bool         txDeferred;
+
+  // runs on the session's IO thread in threaded mode
+  bool threaded;
+
+  // the epoll set the channel's socket is polled by
+  int  epollfd;
+
+  // the io_uring slot receiving for the channel, or -1 if it uses epoll
+  int  uringSlot;
+
+  /* the server passes fds with SCM_RIGHTS, each with a byte of its own after
+   * the message it belongs to. The channel then receives with recvmsg rather
+   * than through the io_uring, rxFd is the last fd received or -1 */
+  bool passFds;
+  int  rxFd;
+
+  // the link message being read while the channel is linking
+  PSLinkState  link;
+  uint8_t      linkBuffer[PS_LINK_REPLY_MAX];
+  unsigned int linkSize;
+  unsigned int linkRead;
+
+  // the cached ticket was sent with the link message instead of after it
+  bool         linkPipelined;
+
+  /* set where the connection was lost if the channel is to be reconnected,
+   * the loop then schedules the attempt for reconnectAt (in ms, 0 if none) */
+  bool         dropped;
+  uint64_t     reconnectAt;
+  unsigned int reconnectDelay;
+  unsigned int reconnectTries;
+  uint64_t     linkedAt;
+
+  // the channel's counters in the session's statistics
+  struct PSChannelCounters * stats;
+
+  const SpiceLinkHeader * (*getConnectPacket)(PS * ps);
+  void (*setCaps)(PS * ps,
       const uint32_t * common , int numCommon,
       const uint32_t * channel, int numChannel);
   PS_STATUS   (*onConnect)(PSChannel * channel);
@@ -157,18 +351,27 @@ struct PSChannel
 
 struct PSCursorImage
 {
-  struct PSCursorImage * next;
   bool                   cached;
+  bool                   current;
   SpiceCursorHeader      header;
+
+  /* the image converted to 32-bit ARGB for the color types, points at the
+   * buffer for alpha cursors and is NULL for mono cursors */
+  const uint8_t        * rgba;
   uint8_t                buffer[];
 };
 
-struct PS
+struct PSSession
 {
-  bool     initialized;
-  PSInit   init;
   PSConfig config;
 
+  // the loop the session's fds are polled by
+  struct PSLoop * loop;
+  bool            ownLoop;
+  bool            inLoop;
+  PS            * loopNext;
+  PS            * loopPrev;
+
   short        family;
   union
   {
@@ -187,21 +390,62 @@ struct PS
   bool   connected;
   int    epollfd;
   PSChannel channels[PS_CHANNEL_MAX];
+
+  /* the password encrypted with the server's public key. keyReused is set
+   * once a second link presented the same key, only then is the ticket sent
+   * ahead of the link reply */
+  struct
+  {
+    bool       valid;
+    bool       keyReused;
+    uint8_t    pubKey[SPICE_TICKET_PUBKEY_BYTES];
+    PSPassword pass;
+  }
+  ticket;
   bool   channelsReady;
 
+  // fires when the next lost channel is due to be reconnected, -1 if the
+  // session does not reconnect by itself
+  struct
+  {
+    int          timerfd;
+    PSPollSource poll;
+  }
+  reconnect;
+
   struct
   {
     uint32_t modifiers;
   }
   kb;
 
+  // offset from the monotonic clock to the server's multimedia clock
+  _Atomic(int64_t) mmTimeOffset;
+
+  struct Cache * pixmapCache;
+  struct Cache * paletteCache;
+
   struct
   {
-    atomic_flag lock;
+    struct MPSCQueue * queue;
+    int                eventfd;
+    PSPollSource       poll;
+    atomic_bool        wakePending;
+  }
+  inputs;
+
+  struct
+  {
+    // only accessed from the thread that drains the input queue
     uint32_t buttonState;
 
     atomic_int sentCount;
-    int rpos, wpos;
+
+    // motion held back while coalescing
+    bool     motionPending;
+    int32_t  motionX, motionY;
+    bool     positionPending;
+    uint32_t positionX, positionY;
   }
   mouse;
 
@@ -210,20 +454,38 @@ struct PS
     uint16_t                x, y;
     uint16_t                trailLen, trailFreq;
     bool                    visible;
-    struct PSCursorImage  * cache;
-    struct PSCursorImage ** cacheLast;
+    struct Cache          * cache;
     struct PSCursorImage  * current;
   }
   cursor;
 
-  uint8_t * motionBuffer;
-  size_t    motionBufferSize;
+  // state private to the modules, created with the session
+  struct PSAgent       * agent;
+  struct ChannelMain   * main;
+  struct PSDisplay     * display;
+  struct PSPlayback    * playback;
+  struct PSRecord      * record;
+  struct PSBatch       * batch;
+  struct PSSurfaces    * surfaces;
+  struct GLZWindow     * glz;
+  struct PSStatsState  * stats;
+
+  // the file the received data is recorded to, NULL if not capturing
+  struct PSCapture     * capture;
+
+  // the IO thread of a threaded session, only while it is connected
+  struct PSIOThread    * io;
+
+  // the io_uring of the session's loop if the backend is enabled
+  struct PSURing       * uring;
 };
 
-extern PS g_ps;
-
 PS_STATUS ps_connectChannel(PSChannel * ch);
 
+/* handles an event from a loop or the IO thread, the callbacks it runs see
+ * the source's session as purespice_currentSession */
+PSStatus ps_dispatchEvent(PSPollSource * source, uint32_t events);
+
 PS_STATUS purespice_onCommonRead(PSChannel * channel,
     SpiceMiniDataHeader * header, int * dataAvailable);
 
@@ -0,0 +1,176 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "raster.h"
+#include "ps.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+static inline uint32_t load32(const uint8_t * src)
+{
+  uint32_t p;
+  memcpy(&p, src, sizeof(p));
+  return p;
+}
+
+static inline uint32_t applyOp(uint32_t d, uint32_t s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return d | s;
+    case RASTER_OP_AND: return d & s;
+    case RASTER_OP_XOR: return d ^ s;
+  }
+  return d;
+}
+
+static void scalar_fill(uint32_t * dst, unsigned int width, uint32_t color)
+{
+  for(unsigned int x = 0; x < width; ++x)
+    dst[x] = color;
+}
+
+static void scalar_fillOp(uint32_t * dst, unsigned int width, uint32_t color,
+    RasterOp op)
+{
+  for(unsigned int x = 0; x < width; ++x)
+    dst[x] = applyOp(dst[x], color, op);
+}
+
+static void scalar_copyOp(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op)
+{
+  for(unsigned int x = 0; x < width; ++x, src += 4)
+    dst[x] = applyOp(dst[x], load32(src), op);
+}
+
+const RasterKernels * raster_getKernels(void)
+{
+  static RasterKernels kernels;
+  static atomic_bool   init = false;
+  static atomic_flag   lock = ATOMIC_FLAG_INIT;
+
+  if (atomic_load_explicit(&init, memory_order_acquire))
+    return &kernels;
+
+  // sessions on other loops may be drawing their first surface too
+  SPICE_LOCK(lock);
+  if (!atomic_load_explicit(&init, memory_order_relaxed))
+  {
+    kernels = (RasterKernels)
+    {
+      .fill   = scalar_fill,
+      .fillOp = scalar_fillOp,
+      .copyOp = scalar_copyOp
+    };
+
+    raster_selectX86 (&kernels);
+    raster_selectNEON(&kernels);
+    atomic_store_explicit(&init, true, memory_order_release);
+  }
+  SPICE_UNLOCK(lock);
+
+  return &kernels;
+}
+
+void raster_rop(uint32_t * dst, const uint8_t * src, uint32_t color,
+    unsigned int width, uint16_t ropd)
+{
+  const RasterKernels * k = raster_getKernels();
+
+  // the source is inverted for a copy and the brush for a fill
+  bool invSrc = ropd & (src ? SPICE_ROPD_INVERS_SRC : SPICE_ROPD_INVERS_BRUSH);
+  const bool invDst = ropd & SPICE_ROPD_INVERS_DEST;
+  const bool invRes = ropd & SPICE_ROPD_INVERS_RES;
+  const uint16_t op = ropd & (SPICE_ROPD_OP_PUT | SPICE_ROPD_OP_OR |
+      SPICE_ROPD_OP_AND | SPICE_ROPD_OP_XOR | SPICE_ROPD_OP_BLACKNESS |
+      SPICE_ROPD_OP_WHITENESS | SPICE_ROPD_OP_INVERS);
+
+  if (!src && invSrc)
+  {
+    color  = ~color;
+    invSrc = false;
+  }
+
+  // the results that do not depend on the source or destination are fills
+  if (op == SPICE_ROPD_OP_BLACKNESS || op == SPICE_ROPD_OP_WHITENESS)
+  {
+    const bool white = (op == SPICE_ROPD_OP_WHITENESS) != invRes;
+    k->fill(dst, width, white ? 0xffffffff : 0);
+    return;
+  }
+
+  if (!src && op == SPICE_ROPD_OP_PUT && !invDst)
+  {
+    k->fill(dst, width, invRes ? ~color : color);
+    return;
+  }
+
+  if (!invSrc && !invDst && !invRes)
+  {
+    RasterOp rop;
+    switch(op)
+    {
+      case SPICE_ROPD_OP_PUT:
+        memcpy(dst, src, width * sizeof(uint32_t));
+        return;
+
+      case SPICE_ROPD_OP_OR : rop = RASTER_OP_OR ; break;
+      case SPICE_ROPD_OP_AND: rop = RASTER_OP_AND; break;
+      case SPICE_ROPD_OP_XOR: rop = RASTER_OP_XOR; break;
+      default:
+        goto generic;
+    }
+
+    if (src)
+      k->copyOp(dst, src, width, rop);
+    else
+      k->fillOp(dst, width, color, rop);
+    return;
+  }
+
+generic:
+  for(unsigned int x = 0; x < width; ++x)
+  {
+    uint32_t s = src ? load32(src + x * 4) : color;
+    uint32_t d = dst[x];
+    uint32_t r = d;
+
+    if (invSrc)
+      s = ~s;
+    if (invDst)
+      d = ~d;
+
+    switch(op)
+    {
+      case SPICE_ROPD_OP_PUT   : r = s    ; break;
+      case SPICE_ROPD_OP_OR    : r = s | d; break;
+      case SPICE_ROPD_OP_AND   : r = s & d; break;
+      case SPICE_ROPD_OP_XOR   : r = s ^ d; break;
+      case SPICE_ROPD_OP_INVERS: r = ~d   ; break;
+
+      // no operation leaves the destination as it was
+      default:
+        continue;
+    }
+
+    dst[x] = invRes ? ~r : r;
+  }
+}
@@ -0,0 +1,69 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_RASTER_
+#define _H_SPICE_RASTER_
+
+#include <stdint.h>
+
+typedef enum RasterOp
+{
+  RASTER_OP_OR,
+  RASTER_OP_AND,
+  RASTER_OP_XOR
+}
+RasterOp;
+
+/* row kernels over 32-bit pixels, the destination is always a surface row and
+ * is aligned to the pixel, the source rows are not. Plain copies are left to
+ * memcpy which is already vectorised */
+
+// sets `width` pixels to `color`
+typedef void (*RasterFillFn)(uint32_t * dst, unsigned int width,
+    uint32_t color);
+
+// combines `width` pixels with `color`
+typedef void (*RasterFillOpFn)(uint32_t * dst, unsigned int width,
+    uint32_t color, RasterOp op);
+
+// combines `width` pixels with those of `src`
+typedef void (*RasterCopyOpFn)(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op);
+
+typedef struct RasterKernels
+{
+  RasterFillFn   fill;
+  RasterFillOpFn fillOp;
+  RasterCopyOpFn copyOp;
+}
+RasterKernels;
+
+// the architecture specific kernels replace the scalar ones they improve on
+void raster_selectX86 (RasterKernels * kernels);
+void raster_selectNEON(RasterKernels * kernels);
+
+const RasterKernels * raster_getKernels(void);
+
+/* applies a SPICE rop descriptor to a row, `src` may be NULL to combine the
+ * pixels with `color` instead. Descriptors that map to a plain put or one of
+ * the RasterOps use the kernels, the rest are done pixel by pixel */
+void raster_rop(uint32_t * dst, const uint8_t * src, uint32_t color,
+    unsigned int width, uint16_t ropd);
+
+#endif
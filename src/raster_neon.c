@@ -0,0 +1,114 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "raster.h"
+
+#if defined(__ARM_NEON)
+
+#include <arm_neon.h>
+#include <string.h>
+
+static inline uint32_t applyOp(uint32_t d, uint32_t s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return d | s;
+    case RASTER_OP_AND: return d & s;
+    case RASTER_OP_XOR: return d ^ s;
+  }
+  return d;
+}
+
+static inline uint32x4_t neon_op(uint32x4_t d, uint32x4_t s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return vorrq_u32(d, s);
+    case RASTER_OP_AND: return vandq_u32(d, s);
+    case RASTER_OP_XOR: return veorq_u32(d, s);
+  }
+  return d;
+}
+
+static void neon_fill(uint32_t * dst, unsigned int width, uint32_t color)
+{
+  const uint32x4_t c = vdupq_n_u32(color);
+
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16)
+  {
+    vst1q_u32(dst + x     , c);
+    vst1q_u32(dst + x + 4 , c);
+    vst1q_u32(dst + x + 8 , c);
+    vst1q_u32(dst + x + 12, c);
+  }
+
+  for(; x + 4 <= width; x += 4)
+    vst1q_u32(dst + x, c);
+
+  for(; x < width; ++x)
+    dst[x] = color;
+}
+
+static void neon_fillOp(uint32_t * dst, unsigned int width, uint32_t color,
+    RasterOp op)
+{
+  const uint32x4_t c = vdupq_n_u32(color);
+
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+    vst1q_u32(dst + x, neon_op(vld1q_u32(dst + x), c, op));
+
+  for(; x < width; ++x)
+    dst[x] = applyOp(dst[x], color, op);
+}
+
+static void neon_copyOp(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op)
+{
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const uint32x4_t s = vreinterpretq_u32_u8(vld1q_u8(src + x * 4));
+    vst1q_u32(dst + x, neon_op(vld1q_u32(dst + x), s, op));
+  }
+
+  for(; x < width; ++x)
+  {
+    uint32_t s;
+    memcpy(&s, src + x * 4, sizeof(s));
+    dst[x] = applyOp(dst[x], s, op);
+  }
+}
+
+void raster_selectNEON(RasterKernels * kernels)
+{
+  kernels->fill   = neon_fill;
+  kernels->fillOp = neon_fillOp;
+  kernels->copyOp = neon_copyOp;
+}
+
+#else
+
+void raster_selectNEON(RasterKernels * kernels)
+{
+  (void)kernels;
+}
+
+#endif
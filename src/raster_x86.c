@@ -0,0 +1,206 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "raster.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <immintrin.h>
+#include <string.h>
+
+/* every kernel finishes the tail of the row with a scalar loop, only
+ * unaligned loads and stores are used as a rect can start on any pixel */
+
+static inline uint32_t applyOp(uint32_t d, uint32_t s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return d | s;
+    case RASTER_OP_AND: return d & s;
+    case RASTER_OP_XOR: return d ^ s;
+  }
+  return d;
+}
+
+static inline void scalarOp(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op)
+{
+  for(unsigned int x = 0; x < width; ++x, src += 4)
+  {
+    uint32_t s;
+    memcpy(&s, src, sizeof(s));
+    dst[x] = applyOp(dst[x], s, op);
+  }
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_op(__m128i d, __m128i s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return _mm_or_si128 (d, s);
+    case RASTER_OP_AND: return _mm_and_si128(d, s);
+    case RASTER_OP_XOR: return _mm_xor_si128(d, s);
+  }
+  return d;
+}
+
+__attribute__((target("sse2")))
+static void sse2_fill(uint32_t * dst, unsigned int width, uint32_t color)
+{
+  const __m128i c = _mm_set1_epi32((int)color);
+
+  unsigned int x = 0;
+  for(; x + 16 <= width; x += 16)
+  {
+    _mm_storeu_si128((__m128i *)(dst + x     ), c);
+    _mm_storeu_si128((__m128i *)(dst + x + 4 ), c);
+    _mm_storeu_si128((__m128i *)(dst + x + 8 ), c);
+    _mm_storeu_si128((__m128i *)(dst + x + 12), c);
+  }
+
+  for(; x + 4 <= width; x += 4)
+    _mm_storeu_si128((__m128i *)(dst + x), c);
+
+  for(; x < width; ++x)
+    dst[x] = color;
+}
+
+__attribute__((target("sse2")))
+static void sse2_fillOp(uint32_t * dst, unsigned int width, uint32_t color,
+    RasterOp op)
+{
+  const __m128i c = _mm_set1_epi32((int)color);
+
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+    _mm_storeu_si128((__m128i *)(dst + x), sse2_op(d, c, op));
+  }
+
+  for(; x < width; ++x)
+    dst[x] = applyOp(dst[x], color, op);
+}
+
+__attribute__((target("sse2")))
+static void sse2_copyOp(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op)
+{
+  unsigned int x = 0;
+  for(; x + 4 <= width; x += 4)
+  {
+    const __m128i d = _mm_loadu_si128((const __m128i *)(dst + x));
+    const __m128i s = _mm_loadu_si128((const __m128i *)(src + x * 4));
+    _mm_storeu_si128((__m128i *)(dst + x), sse2_op(d, s, op));
+  }
+
+  scalarOp(dst + x, src + x * 4, width - x, op);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_op(__m256i d, __m256i s, RasterOp op)
+{
+  switch(op)
+  {
+    case RASTER_OP_OR : return _mm256_or_si256 (d, s);
+    case RASTER_OP_AND: return _mm256_and_si256(d, s);
+    case RASTER_OP_XOR: return _mm256_xor_si256(d, s);
+  }
+  return d;
+}
+
+__attribute__((target("avx2")))
+static void avx2_fill(uint32_t * dst, unsigned int width, uint32_t color)
+{
+  const __m256i c = _mm256_set1_epi32((int)color);
+
+  unsigned int x = 0;
+  for(; x + 32 <= width; x += 32)
+  {
+    _mm256_storeu_si256((__m256i *)(dst + x     ), c);
+    _mm256_storeu_si256((__m256i *)(dst + x + 8 ), c);
+    _mm256_storeu_si256((__m256i *)(dst + x + 16), c);
+    _mm256_storeu_si256((__m256i *)(dst + x + 24), c);
+  }
+
+  for(; x + 8 <= width; x += 8)
+    _mm256_storeu_si256((__m256i *)(dst + x), c);
+
+  sse2_fill(dst + x, width - x, color);
+}
+
+__attribute__((target("avx2")))
+static void avx2_fillOp(uint32_t * dst, unsigned int width, uint32_t color,
+    RasterOp op)
+{
+  const __m256i c = _mm256_set1_epi32((int)color);
+
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const __m256i d = _mm256_loadu_si256((const __m256i *)(dst + x));
+    _mm256_storeu_si256((__m256i *)(dst + x), avx2_op(d, c, op));
+  }
+
+  sse2_fillOp(dst + x, width - x, color, op);
+}
+
+__attribute__((target("avx2")))
+static void avx2_copyOp(uint32_t * dst, const uint8_t * src,
+    unsigned int width, RasterOp op)
+{
+  unsigned int x = 0;
+  for(; x + 8 <= width; x += 8)
+  {
+    const __m256i d = _mm256_loadu_si256((const __m256i *)(dst + x));
+    const __m256i s = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+    _mm256_storeu_si256((__m256i *)(dst + x), avx2_op(d, s, op));
+  }
+
+  sse2_copyOp(dst + x, src + x * 4, width - x, op);
+}
+
+void raster_selectX86(RasterKernels * kernels)
+{
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("sse2"))
+  {
+    kernels->fill   = sse2_fill;
+    kernels->fillOp = sse2_fillOp;
+    kernels->copyOp = sse2_copyOp;
+  }
+
+  if (__builtin_cpu_supports("avx2"))
+  {
+    kernels->fill   = avx2_fill;
+    kernels->fillOp = avx2_fillOp;
+    kernels->copyOp = avx2_copyOp;
+  }
+}
+
+#else
+
+void raster_selectX86(RasterKernels * kernels)
+{
+  (void)kernels;
+}
+
+#endif
@@ -0,0 +1,236 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "reconnect.h"
+#include "log.h"
+#include "channel.h"
+#include "io_thread.h"
+
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+bool reconnect_init(PS * ps)
+{
+  ps->reconnect.timerfd = -1;
+  if (!ps->config.reconnect.automatic)
+    return true;
+
+  ps->reconnect.timerfd = timerfd_create(CLOCK_MONOTONIC,
+      TFD_NONBLOCK | TFD_CLOEXEC);
+  if (ps->reconnect.timerfd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the reconnect timer");
+    return false;
+  }
+
+  ps->reconnect.poll.type = PS_POLL_RECONNECT;
+  ps->reconnect.poll.ps   = ps;
+
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.ptr = &ps->reconnect.poll
+  };
+  epoll_ctl(ps->epollfd, EPOLL_CTL_ADD, ps->reconnect.timerfd, &ev);
+  return true;
+}
+
+void reconnect_deinit(PS * ps)
+{
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    reconnect_cancel(&ps->channels[i]);
+
+  if (ps->reconnect.timerfd < 0)
+    return;
+
+  close(ps->reconnect.timerfd);
+  ps->reconnect.timerfd = -1;
+}
+
+bool reconnect_isTransient(int error)
+{
+  switch(error)
+  {
+    case ECONNREFUSED:
+    case ECONNRESET:
+    case ECONNABORTED:
+    case EPIPE:
+    case ETIMEDOUT:
+    case EHOSTUNREACH:
+    case ENETUNREACH:
+    case ENETDOWN:
+    case ENETRESET:
+      return true;
+
+    default:
+      return false;
+  }
+}
+
+bool reconnect_lost(PSChannel * channel)
+{
+  PS * ps = channel->ps;
+  if (ps->reconnect.timerfd < 0 ||
+      channel == &ps->channels[PS_CHANNEL_MAIN] ||
+      !ps->channels[PS_CHANNEL_MAIN].connected)
+    return false;
+
+  channel->dropped = true;
+  return true;
+}
+
+// arms the timer for the earliest pending attempt, or disarms it
+static void armTimer(PS * ps, uint64_t now)
+{
+  uint64_t next = 0;
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    const uint64_t at = ps->channels[i].reconnectAt;
+    if (at && (!next || at < next))
+      next = at;
+  }
+
+  struct itimerspec spec = { 0 };
+  if (next)
+  {
+    // a zero it_value disarms the timer, so one that is due fires in 1ns
+    const uint64_t delay = next > now ? next - now : 0;
+    spec.it_value.tv_sec  = delay / 1000;
+    spec.it_value.tv_nsec = (delay % 1000) * 1000000 + (delay ? 0 : 1);
+  }
+
+  if (timerfd_settime(ps->reconnect.timerfd, 0, &spec, NULL) < 0)
+    PS_LOG_ERROR("Failed to arm the reconnect timer");
+}
+
+void reconnect_schedule(PS * ps)
+{
+  if (ps->reconnect.timerfd < 0)
+    return;
+
+  const bool     mainUp  = ps->channels[PS_CHANNEL_MAIN].connected;
+  const uint64_t now     = get_timestamp();
+  bool           changed = false;
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    PSChannel * channel = &ps->channels[i];
+
+    ioThread_lockChannel(channel);
+    const bool dropped = channel->dropped;
+    channel->dropped = false;
+    ioThread_unlockChannel(channel);
+
+    // there is nothing to come back to once the main channel has gone
+    if (!mainUp)
+    {
+      if (channel->reconnectAt)
+      {
+        channel->reconnectAt = 0;
+        changed = true;
+      }
+      continue;
+    }
+
+    if (!dropped)
+      continue;
+
+    if (channel->linkedAt && now - channel->linkedAt >= PS_RECONNECT_DELAY_MAX)
+    {
+      channel->reconnectDelay = 0;
+      channel->reconnectTries = 0;
+    }
+    channel->linkedAt = 0;
+
+    if (++channel->reconnectTries > PS_RECONNECT_ATTEMPTS)
+    {
+      PS_LOG_ERROR("%s: Giving up on reconnecting after %d attempts",
+          channel->name, PS_RECONNECT_ATTEMPTS);
+      channel->reconnectDelay = 0;
+      channel->reconnectTries = 0;
+      continue;
+    }
+
+    if (!channel->reconnectDelay)
+      channel->reconnectDelay = PS_RECONNECT_DELAY_MIN;
+    else if ((channel->reconnectDelay *= 2) > PS_RECONNECT_DELAY_MAX)
+      channel->reconnectDelay = PS_RECONNECT_DELAY_MAX;
+
+    channel->reconnectAt = now + channel->reconnectDelay;
+    changed = true;
+
+    PS_LOG_INFO("%s channel lost, reconnecting in %u ms", channel->name,
+        channel->reconnectDelay);
+  }
+
+  if (changed)
+    armTimer(ps, now);
+}
+
+PSStatus reconnect_process(PS * ps)
+{
+  uint64_t expirations;
+  if (read(ps->reconnect.timerfd, &expirations, sizeof(expirations)) < 0 &&
+      errno != EAGAIN)
+    PS_LOG_ERROR("Failed to read the reconnect timer");
+
+  const bool     mainUp = ps->channels[PS_CHANNEL_MAIN].connected;
+  const uint64_t now    = get_timestamp();
+
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    PSChannel * channel = &ps->channels[i];
+    if (!channel->reconnectAt || channel->reconnectAt > now)
+      continue;
+
+    channel->reconnectAt = 0;
+    if (!mainUp || channel->connected || channel->link != PS_LINK_NONE)
+      continue;
+
+    // a failure here is retried like one during the link
+    PS_LOG_INFO("Reconnecting the %s channel", channel->name);
+    if (channel_connect(channel) != PS_STATUS_OK)
+      reconnect_lost(channel);
+  }
+
+  // pick up the attempts that failed straight away
+  reconnect_schedule(ps);
+  armTimer(ps, now);
+  return PS_STATUS_RUN;
+}
+
+void reconnect_cancel(PSChannel * channel)
+{
+  ioThread_lockChannel(channel);
+  channel->dropped = false;
+  ioThread_unlockChannel(channel);
+
+  channel->reconnectAt    = 0;
+  channel->reconnectDelay = 0;
+  channel->reconnectTries = 0;
+  channel->linkedAt       = 0;
+}
+
+void reconnect_linked(PSChannel * channel)
+{
+  channel->linkedAt = get_timestamp();
+}
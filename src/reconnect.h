@@ -0,0 +1,57 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_RECONNECT_
+#define _H_SPICE_RECONNECT_
+
+#include "ps.h"
+
+#include <stdbool.h>
+
+/* with PSConfig.reconnect.automatic set a channel other than main whose
+ * connection is lost is linked again by the session's loop, waiting longer
+ * after each attempt that fails. The main channel can't be reconnected as the
+ * server ends the session with it */
+
+// creates the timer if the session reconnects by itself
+bool reconnect_init  (PS * ps);
+void reconnect_deinit(PS * ps);
+
+// true for the socket errors a reconnect might recover from
+bool reconnect_isTransient(int error);
+
+/* called where the channel's connection was lost, returns true if it will be
+ * reconnected. Only flags the channel so it may be called from the IO thread,
+ * the loop picks it up with reconnect_schedule */
+bool reconnect_lost(PSChannel * channel);
+
+// schedules the attempts for the channels flagged since the last call
+void reconnect_schedule(PS * ps);
+
+// starts the attempts that are due when the timer fires
+PSStatus reconnect_process(PS * ps);
+
+// forgets any pending attempt, for when the channel is connected or
+// disconnected on request
+void reconnect_cancel(PSChannel * channel);
+
+// records when the channel was linked so the backoff can start over
+void reconnect_linked(PSChannel * channel);
+
+#endif
@@ -17,6 +17,9 @@ this program; if not, write to the Free Software Foundation, Inc., 59 Temple
 Place, Suite 330, Boston, MA 02111-1307 USA
 */
 
+#ifndef _H_SPICE_RSA_
+#define _H_SPICE_RSA_
+
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -30,3 +33,5 @@ PSPassword;
 bool rsa_encryptPassword(uint8_t * pub_key, const char * password,
     PSPassword * result);
 void rsa_freePassword(PSPassword * pass);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "scratch.h"
+#include "purespice.h"
+#include "ps.h"
+#include "locking.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+
+// the smallest class holds 4KiB, every class after is double the last
+#define SCRATCH_CLASS_SHIFT 12
+#define SCRATCH_CLASSES     19
+
+typedef struct ScratchBuffer
+{
+  struct ScratchBuffer * next;
+  int                    class;
+  bool                   leasable;
+  atomic_uint            refs;
+  size_t                 size;
+
+  // keep the data aligned for the SIMD conversion kernels
+  _Alignas(64) uint8_t   data[];
+}
+ScratchBuffer;
+
+static struct
+{
+  atomic_flag     lock;
+
+  // the sessions using the pool, the last to go frees the idle buffers
+  unsigned int    sessions;
+
+  // leasable buffers in use sorted by address, searched by scratch_ref
+  ScratchBuffer ** used;
+  unsigned int     usedCount;
+  unsigned int     usedSize;
+
+  // idle buffers by size class
+  ScratchBuffer * idle[SCRATCH_CLASSES];
+  unsigned int    idleCount[SCRATCH_CLASSES];
+  size_t          idleBytes;
+}
+l_pool = { .lock = ATOMIC_FLAG_INIT };
+
+static inline ScratchBuffer * toBuffer(const void * data)
+{
+  return (ScratchBuffer *)((uint8_t *)data - offsetof(ScratchBuffer, data));
+}
+
+static int sizeClass(size_t size)
+{
+  int class = 0;
+  while(((size_t)1 << (class + SCRATCH_CLASS_SHIFT)) < size)
+    if (++class == SCRATCH_CLASSES)
+      return -1;
+
+  return class;
+}
+
+/* the index of the first used buffer that does not start below `ptr`, call
+ * with the lock held */
+static unsigned int findUsedNL(const void * ptr)
+{
+  unsigned int lo = 0, hi = l_pool.usedCount;
+  while(lo < hi)
+  {
+    const unsigned int mid = (lo + hi) / 2;
+    if ((const void *)l_pool.used[mid]->data < ptr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+// call with the lock held
+static bool addUsedNL(ScratchBuffer * buf)
+{
+  if (l_pool.usedCount == l_pool.usedSize)
+  {
+    const unsigned int size = l_pool.usedSize ? l_pool.usedSize * 2 : 64;
+    ScratchBuffer ** used = realloc(l_pool.used, size * sizeof(*used));
+    if (!used)
+      return false;
+
+    l_pool.used     = used;
+    l_pool.usedSize = size;
+  }
+
+  const unsigned int i = findUsedNL(buf->data);
+  memmove(l_pool.used + i + 1, l_pool.used + i,
+      (l_pool.usedCount - i) * sizeof(*l_pool.used));
+  l_pool.used[i] = buf;
+  ++l_pool.usedCount;
+  return true;
+}
+
+// call with the lock held
+static void removeUsedNL(ScratchBuffer * buf)
+{
+  const unsigned int i = findUsedNL(buf->data);
+  if (i == l_pool.usedCount || l_pool.used[i] != buf)
+    return;
+
+  --l_pool.usedCount;
+  memmove(l_pool.used + i, l_pool.used + i + 1,
+      (l_pool.usedCount - i) * sizeof(*l_pool.used));
+}
+
+static void * allocBuffer(size_t size, bool leasable)
+{
+  const int class = sizeClass(size);
+  ScratchBuffer * buf = NULL;
+
+  SPICE_LOCK(l_pool.lock);
+  if (class >= 0 && (buf = l_pool.idle[class]))
+  {
+    l_pool.idle[class] = buf->next;
+    --l_pool.idleCount[class];
+    l_pool.idleBytes -= buf->size;
+  }
+  SPICE_UNLOCK(l_pool.lock);
+
+  if (!buf)
+  {
+    // sizes beyond the largest class are allocated exactly and never pooled
+    const size_t bufSize = class >= 0 ?
+      (size_t)1 << (class + SCRATCH_CLASS_SHIFT) : size;
+
+    buf = aligned_alloc(_Alignof(ScratchBuffer),
+        (sizeof(*buf) + bufSize + _Alignof(ScratchBuffer) - 1) &
+        ~(_Alignof(ScratchBuffer) - 1));
+    if (!buf)
+      return NULL;
+
+    buf->class = class;
+    buf->size  = bufSize;
+  }
+
+  buf->leasable = leasable;
+  buf->next     = NULL;
+  atomic_store(&buf->refs, 1);
+
+  // only leasable buffers are indexed, scratch_ref never returns the others
+  if (leasable)
+  {
+    SPICE_LOCK(l_pool.lock);
+    const bool added = addUsedNL(buf);
+    SPICE_UNLOCK(l_pool.lock);
+
+    if (!added)
+    {
+      free(buf);
+      return NULL;
+    }
+  }
+
+  return buf->data;
+}
+
+void * scratch_get(size_t size)
+{
+  return allocBuffer(size, true);
+}
+
+void * scratch_getPrivate(size_t size)
+{
+  return allocBuffer(size, false);
+}
+
+void scratch_put(void * buffer)
+{
+  if (!buffer)
+    return;
+
+  ScratchBuffer * buf = toBuffer(buffer);
+  if (atomic_fetch_sub(&buf->refs, 1) != 1)
+    return;
+
+  SPICE_LOCK(l_pool.lock);
+  if (buf->leasable)
+    removeUsedNL(buf);
+
+  /* keep a few idle buffers per class for reuse, but drop one off large
+   * buffers rather than letting them pin memory forever */
+  const int class = buf->class;
+  if (class >= 0 &&
+      l_pool.idleCount[class] < PS_SCRATCH_IDLE_PER_CLASS &&
+      l_pool.idleBytes + buf->size <= PS_SCRATCH_IDLE_MAX)
+  {
+    buf->next = l_pool.idle[class];
+    l_pool.idle[class] = buf;
+    ++l_pool.idleCount[class];
+    l_pool.idleBytes += buf->size;
+    buf = NULL;
+  }
+  SPICE_UNLOCK(l_pool.lock);
+
+  free(buf);
+}
+
+size_t scratch_size(const void * buffer)
+{
+  return toBuffer(buffer)->size;
+}
+
+bool scratch_isShared(const void * buffer)
+{
+  return atomic_load(&toBuffer(buffer)->refs) > 1;
+}
+
+void * scratch_ref(const void * ptr)
+{
+  const uint8_t * p = ptr;
+  void * ret = NULL;
+
+  /* the buffers do not overlap, so the only one that can hold `ptr` is the
+   * last that starts at or below it */
+  SPICE_LOCK(l_pool.lock);
+  unsigned int i = findUsedNL(p);
+  if (i < l_pool.usedCount && l_pool.used[i]->data == p)
+    ++i;
+
+  if (i > 0)
+  {
+    ScratchBuffer * buf = l_pool.used[i - 1];
+    if (p < buf->data + buf->size)
+    {
+      atomic_fetch_add(&buf->refs, 1);
+      ret = buf->data;
+    }
+  }
+  SPICE_UNLOCK(l_pool.lock);
+
+  return ret;
+}
+
+void scratch_create(void)
+{
+  SPICE_LOCK(l_pool.lock);
+  ++l_pool.sessions;
+  SPICE_UNLOCK(l_pool.lock);
+}
+
+void scratch_destroy(void)
+{
+  SPICE_LOCK(l_pool.lock);
+  if (--l_pool.sessions)
+  {
+    SPICE_UNLOCK(l_pool.lock);
+    return;
+  }
+
+  for(int i = 0; i < SCRATCH_CLASSES; ++i)
+  {
+    ScratchBuffer * buf = l_pool.idle[i];
+    while(buf)
+    {
+      ScratchBuffer * next = buf->next;
+      free(buf);
+      buf = next;
+    }
+
+    l_pool.idle     [i] = NULL;
+    l_pool.idleCount[i] = 0;
+  }
+  l_pool.idleBytes = 0;
+
+  // buffers the application still holds keep the index alive until put
+  if (!l_pool.usedCount)
+  {
+    free(l_pool.used);
+    l_pool.used     = NULL;
+    l_pool.usedSize = 0;
+  }
+  SPICE_UNLOCK(l_pool.lock);
+}
+
+void * purespice_leaseBuffer(const void ** data, size_t size)
+{
+  void * lease = scratch_ref(*data);
+  if (lease)
+  {
+    // the data must not run past the end of the buffer holding it
+    if ((const uint8_t *)*data + size <= (uint8_t *)lease + scratch_size(lease))
+      return lease;
+
+    scratch_put(lease);
+  }
+
+  // the data is not in a buffer that can be leased, copy it into one
+  if (!(lease = scratch_get(size)))
+    return NULL;
+
+  memcpy(lease, *data, size);
+  *data = lease;
+  return lease;
+}
+
+void purespice_releaseBuffer(void * lease)
+{
+  scratch_put(lease);
+}
@@ -0,0 +1,52 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_SCRATCH_
+#define _H_SPICE_SCRATCH_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* a size class pool of reusable, reference counted buffers shared by the
+ * image decoders and the channel receive paths so that a steady stream of
+ * messages and images does not hit the allocator for every draw */
+
+void * scratch_get(size_t size);
+void scratch_put(void * buffer);
+
+// as scratch_get but the buffer is never leased by scratch_ref
+void * scratch_getPrivate(size_t size);
+
+// the usable size of a buffer returned by scratch_get
+size_t scratch_size(const void * buffer);
+
+// true if something other than the owner holds a reference to the buffer
+bool scratch_isShared(const void * buffer);
+
+/* takes a reference on the leasable buffer that contains `ptr`, returning the
+ * start of that buffer to pass to scratch_put, or NULL if there is none */
+void * scratch_ref(const void * ptr);
+
+/* the pool is shared by all sessions, each calls scratch_create when it is
+ * made and scratch_destroy when it is freed. The last scratch_destroy frees
+ * the idle buffers, buffers still in use are freed when put */
+void scratch_create(void);
+void scratch_destroy(void);
+
+#endif
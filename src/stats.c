@@ -0,0 +1,318 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "stats.h"
+#include "log.h"
+#include "agent.h"
+#include "channel.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+typedef struct PSStatsState PSStatsState;
+
+struct PSStatsState
+{
+  PSChannelCounters channels[PS_CHANNEL_MAX];
+
+  // fires every PSConfig.stats.intervalMS if there is a report callback
+  int               timerfd;
+  PSPollSource      poll;
+
+  // filled for the report callback, too large for the stack
+  PSStats           report;
+
+  struct
+  {
+    // when the oldest input not matched to an update was queued, 0 if none
+    _Atomic(uint64_t)        inputCursorNS;
+    _Atomic(uint64_t)        inputDisplayNS;
+
+    PSStatsHistogramCounters inputToCursor;
+    PSStatsHistogramCounters inputToDisplay;
+    PSStatsHistogramCounters streamDelay;
+    _Atomic(uint64_t)        streamLate;
+  }
+  latency;
+};
+
+bool stats_create(PS * ps)
+{
+  ps->stats = calloc(1, sizeof(*ps->stats));
+  if (!ps->stats)
+  {
+    PS_LOG_ERROR("Failed to allocate the statistics");
+    return false;
+  }
+
+  ps->stats->timerfd = -1;
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+    ps->channels[i].stats = &ps->stats->channels[i];
+
+  return true;
+}
+
+void stats_destroy(PS * ps)
+{
+  free(ps->stats);
+  ps->stats = NULL;
+}
+
+bool stats_init(PS * ps)
+{
+  PSStatsState * s = ps->stats;
+  memset(s->channels, 0, sizeof(s->channels));
+  memset(&s->latency, 0, sizeof(s->latency));
+
+  if (!ps->config.stats.report)
+    return true;
+
+  if (!ps->config.stats.intervalMS)
+  {
+    PS_LOG_ERROR("stats->intervalMS is mandatory with stats->report");
+    return false;
+  }
+
+  s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (s->timerfd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the statistics timer");
+    return false;
+  }
+
+  const unsigned int ms = ps->config.stats.intervalMS;
+  const struct itimerspec spec =
+  {
+    .it_interval = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 },
+    .it_value    = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000 }
+  };
+  timerfd_settime(s->timerfd, 0, &spec, NULL);
+
+  s->poll.type = PS_POLL_STATS;
+  s->poll.ps   = ps;
+
+  struct epoll_event ev =
+  {
+    .events   = EPOLLIN,
+    .data.ptr = &s->poll
+  };
+  epoll_ctl(ps->epollfd, EPOLL_CTL_ADD, s->timerfd, &ev);
+  return true;
+}
+
+void stats_deinit(PS * ps)
+{
+  PSStatsState * s = ps->stats;
+  if (s->timerfd < 0)
+    return;
+
+  close(s->timerfd);
+  s->timerfd = -1;
+}
+
+PSStatus stats_report(PS * ps)
+{
+  PSStatsState * s = ps->stats;
+
+  uint64_t expirations;
+  if (read(s->timerfd, &expirations, sizeof(expirations)) < 0)
+  {
+    if (errno != EAGAIN)
+      PS_LOG_ERROR("Failed to read the statistics timer");
+    return PS_STATUS_RUN;
+  }
+
+  stats_get(ps, &s->report);
+  ps->config.stats.report(&s->report);
+  return PS_STATUS_RUN;
+}
+
+static inline uint64_t load(_Atomic(uint64_t) * counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static inline uint32_t load32(_Atomic(uint32_t) * counter)
+{
+  return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void getHistogram(PSStatsHistogramCounters * src,
+    PSStatsHistogram * dst)
+{
+  dst->count   = load(&src->count  );
+  dst->totalNS = load(&src->totalNS);
+  dst->maxNS   = load(&src->maxNS  );
+  for(int i = 0; i < PS_STATS_BUCKETS; ++i)
+    dst->buckets[i] = load(&src->buckets[i]);
+}
+
+void stats_get(PS * ps, PSStats * stats)
+{
+  for(int i = 0; i < PS_CHANNEL_MAX; ++i)
+  {
+    PSChannelCounters * src = &ps->stats->channels[i];
+    PSChannelStats    * dst = &stats->channels[i];
+
+    dst->connected      = ps->channels[i].connected;
+    dst->bytesIn        = load(&src->bytesIn);
+    dst->bytesOut       = load(&src->bytesOut);
+    dst->writes         = load(&src->writes);
+    dst->messages       = load(&src->messages);
+    dst->bytesDiscarded = load(&src->bytesDiscarded);
+    dst->messageMax     = load32(&src->messageMax);
+    dst->txQueueMax     = load(&src->txQueueMax);
+    dst->acks           = load(&src->acks);
+    dst->pings          = load(&src->pings);
+
+    // sampled here rather than per ping as it costs a system call
+    if (!channel_getRTT(&ps->channels[i], &dst->rttUS, &dst->rttVarUS))
+      dst->rttUS = dst->rttVarUS = 0;
+
+    for(int t = 0; t < PS_STATS_MESSAGE_TYPES; ++t)
+    {
+      dst->messagesByType [t] = load(&src->messagesByType [t]);
+      dst->handlerNSByType[t] = load(&src->handlerNSByType[t]);
+    }
+
+    getHistogram(&src->handlers , &dst->handlers );
+    getHistogram(&src->callbacks, &dst->callbacks);
+  }
+
+  agent_getQueue(ps, &stats->agentQueued, &stats->agentTokens);
+
+  getHistogram(&ps->stats->latency.inputToCursor , &stats->inputToCursor );
+  getHistogram(&ps->stats->latency.inputToDisplay, &stats->inputToDisplay);
+  getHistogram(&ps->stats->latency.streamDelay   , &stats->streamDelay   );
+  stats->streamLate = load(&ps->stats->latency.streamLate);
+}
+
+static void addHistogram(PSStatsHistogramCounters * h, uint64_t ns)
+{
+  // bucket n holds [2^(n-1), 2^n) microseconds, bucket 0 under 1us
+  const uint64_t us     = ns / 1000;
+  unsigned int   bucket = us ? 64 - __builtin_clzll(us) : 0;
+  if (bucket >= PS_STATS_BUCKETS)
+    bucket = PS_STATS_BUCKETS - 1;
+
+  stats_add(&h->count          , 1 );
+  stats_add(&h->totalNS        , ns);
+  stats_add(&h->buckets[bucket], 1 );
+  stats_max(&h->maxNS          , ns);
+}
+
+void stats_handler(PSChannel * channel, uint64_t start)
+{
+  if (!start)
+    return;
+
+  const uint64_t ns = stats_start(channel->ps) - start;
+  const unsigned int type = channel->header.type < PS_STATS_MESSAGE_TYPES ?
+    channel->header.type : 0;
+
+  stats_add(&channel->stats->handlerNSByType[type], ns);
+  addHistogram(&channel->stats->handlers, ns);
+}
+
+void stats_callback(PS * ps, PSChannelType channel, uint64_t start)
+{
+  if (!start)
+    return;
+
+  addHistogram(&ps->stats->channels[channel].callbacks,
+      stats_start(ps) - start);
+}
+
+void stats_recordInput(PS * ps, bool mouse)
+{
+  PSStatsState * s   = ps->stats;
+  const uint64_t now = stats_now();
+
+  uint64_t none = 0;
+  atomic_compare_exchange_strong_explicit(&s->latency.inputDisplayNS, &none,
+      now, memory_order_relaxed, memory_order_relaxed);
+
+  // only the mouse moves the cursor
+  none = 0;
+  if (mouse)
+    atomic_compare_exchange_strong_explicit(&s->latency.inputCursorNS, &none,
+        now, memory_order_relaxed, memory_order_relaxed);
+}
+
+void stats_recordUpdate(PS * ps, bool cursor)
+{
+  PSStatsState * s = ps->stats;
+  _Atomic(uint64_t) * pending = cursor ?
+    &s->latency.inputCursorNS : &s->latency.inputDisplayNS;
+
+  // most updates follow no input, don't read the clock for those
+  if (!atomic_load_explicit(pending, memory_order_relaxed))
+    return;
+
+  const uint64_t input = atomic_exchange_explicit(pending, 0,
+      memory_order_relaxed);
+  if (!input)
+    return;
+
+  addHistogram(cursor ? &s->latency.inputToCursor : &s->latency.inputToDisplay,
+      stats_now() - input);
+}
+
+void stats_recordStream(PS * ps, uint32_t mmTime)
+{
+  PSStatsState * s = ps->stats;
+
+  // both clocks are in milliseconds and wrap
+  const int32_t delay = (int32_t)(mmTime - purespice_getMMTime(ps));
+  if (delay < 0)
+    stats_add(&s->latency.streamLate, 1);
+  else
+    addHistogram(&s->latency.streamDelay, delay * 1000000ULL);
+}
+
+uint64_t purespice_statsPercentile(const PSStatsHistogram * histogram,
+    unsigned int percent)
+{
+  if (!histogram->count)
+    return 0;
+
+  if (percent > 100)
+    percent = 100;
+
+  // the rank of the sample wanted, the bucket is never tighter than the max
+  uint64_t rank = (histogram->count * percent + 99) / 100;
+  if (!rank)
+    rank = 1;
+
+  const uint64_t maxUS = (histogram->maxNS + 999) / 1000;
+  uint64_t seen = 0;
+  for(int i = 0; i < PS_STATS_BUCKETS - 1; ++i)
+  {
+    seen += histogram->buckets[i];
+    if (seen >= rank)
+      return (1ULL << i) < maxUS ? (1ULL << i) : maxUS;
+  }
+
+  return maxUS;
+}
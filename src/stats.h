@@ -0,0 +1,170 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_STATS_
+#define _H_SPICE_STATS_
+
+#include "ps.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+/* the counters are only written by the thread processing the channel, or with
+ * the channel's lock held for the send side, and read by purespice_getStats
+ * from any thread, so relaxed atomics are enough */
+
+typedef struct PSStatsHistogramCounters
+{
+  _Atomic(uint64_t) count;
+  _Atomic(uint64_t) totalNS;
+  _Atomic(uint64_t) maxNS;
+  _Atomic(uint64_t) buckets[PS_STATS_BUCKETS];
+}
+PSStatsHistogramCounters;
+
+typedef struct PSChannelCounters
+{
+  _Atomic(uint64_t) bytesIn;
+  _Atomic(uint64_t) bytesOut;
+  _Atomic(uint64_t) writes;
+  _Atomic(uint64_t) messages;
+  _Atomic(uint64_t) messagesByType[PS_STATS_MESSAGE_TYPES];
+  _Atomic(uint64_t) bytesDiscarded;
+  _Atomic(uint32_t) messageMax;
+  _Atomic(uint64_t) txQueueMax;
+  _Atomic(uint64_t) acks;
+  _Atomic(uint64_t) pings;
+
+  _Atomic(uint64_t)        handlerNSByType[PS_STATS_MESSAGE_TYPES];
+  PSStatsHistogramCounters handlers;
+  PSStatsHistogramCounters callbacks;
+}
+PSChannelCounters;
+
+bool stats_create (PS * ps);
+void stats_destroy(PS * ps);
+
+// clears the counters and starts the report timer if there is a report
+bool stats_init  (PS * ps);
+void stats_deinit(PS * ps);
+
+// called when the report timer fires
+PSStatus stats_report(PS * ps);
+
+void stats_get(PS * ps, PSStats * stats);
+
+static inline void stats_add(_Atomic(uint64_t) * counter, uint64_t value)
+{
+  atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void stats_max(_Atomic(uint64_t) * counter, uint64_t value)
+{
+  if (value > atomic_load_explicit(counter, memory_order_relaxed))
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline void stats_max32(_Atomic(uint32_t) * counter, uint32_t value)
+{
+  if (value > atomic_load_explicit(counter, memory_order_relaxed))
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+
+// counts a received message, before it is handled or discarded
+static inline void stats_message(PSChannel * channel)
+{
+  PSChannelCounters * c = channel->stats;
+  const unsigned int type = channel->header.type < PS_STATS_MESSAGE_TYPES ?
+    channel->header.type : 0;
+
+  stats_add  (&c->messages            , 1);
+  stats_add  (&c->messagesByType[type], 1);
+  stats_max32(&c->messageMax, channel->header.size);
+}
+
+static inline uint64_t stats_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// returns the time to pass to stats_handler and stats_callback, or 0 if the
+// session isn't timing
+static inline uint64_t stats_start(PS * ps)
+{
+  if (!ps->config.stats.timing)
+    return 0;
+
+  return stats_now();
+}
+
+// records the time taken to handle the channel's current message
+void stats_handler(PSChannel * channel, uint64_t start);
+
+// records the time taken by a callback made for the channel
+void stats_callback(PS * ps, PSChannelType channel, uint64_t start);
+
+/* the input to display latency probe, an input starts the clock for the
+ * next cursor and display update unless an earlier one already has */
+void stats_recordInput (PS * ps, bool mouse);
+void stats_recordUpdate(PS * ps, bool cursor);
+void stats_recordStream(PS * ps, uint32_t mmTime);
+
+// called for each input event queued for the server
+static inline void stats_input(PS * ps, bool mouse)
+{
+  if (ps->config.stats.latency)
+    stats_recordInput(ps, mouse);
+}
+
+// called before the cursor state is passed to the callback
+static inline void stats_cursorUpdate(PS * ps)
+{
+  if (ps->config.stats.latency)
+    stats_recordUpdate(ps, true);
+}
+
+// called before a draw, a batched frame or a video frame is passed on
+static inline void stats_displayUpdate(PS * ps)
+{
+  if (ps->config.stats.latency)
+    stats_recordUpdate(ps, false);
+}
+
+// called with the presentation time of each video frame
+static inline void stats_streamFrame(PS * ps, uint32_t mmTime)
+{
+  if (ps->config.stats.latency)
+    stats_recordStream(ps, mmTime);
+}
+
+// times a callback to the user made for `channel`
+#define STATS_CALLBACK(ps, channel, ...) \
+do \
+{ \
+  const uint64_t _cbStart = stats_start(ps); \
+  __VA_ARGS__; \
+  stats_callback((ps), (channel), _cbStart); \
+} \
+while(0)
+
+#endif
@@ -0,0 +1,438 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#define _GNU_SOURCE
+#include "surface.h"
+#include "raster.h"
+#include "log.h"
+#include "stats.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+// the surface rows are padded to this so they can be imported as they are
+#define SURFACE_STRIDE_ALIGN 256
+
+typedef struct StoreSurface
+{
+  bool            mapped;
+
+  // waiting in the flush queue
+  bool            queued;
+
+  PSSurfaceFormat format;
+  unsigned int    width, height;
+  unsigned int    stride;
+  int             fd;
+  size_t          size;
+  uint8_t       * pixels;
+
+  unsigned int    tilesX, tilesY;
+  uint64_t      * dirty;
+}
+StoreSurface;
+
+typedef struct PSSurfaces PSSurfaces;
+
+struct PSSurfaces
+{
+  // PS_MAX_SURFACES of them, allocated with the first
+  StoreSurface * surfaces;
+
+  // the surfaces drawn to since the last flush
+  unsigned int   queue[PS_MAX_SURFACES];
+  unsigned int   numQueued;
+};
+
+bool surface_create(PS * ps)
+{
+  ps->surfaces = calloc(1, sizeof(*ps->surfaces));
+  if (!ps->surfaces)
+  {
+    PS_LOG_ERROR("Failed to allocate the surface store");
+    return false;
+  }
+
+  return true;
+}
+
+void surface_destroy(PS * ps)
+{
+  if (!ps->surfaces)
+    return;
+
+  surface_free(ps);
+  free(ps->surfaces->surfaces);
+  free(ps->surfaces);
+  ps->surfaces = NULL;
+}
+
+static StoreSurface * getSurface(PS * ps, unsigned int surfaceId)
+{
+  PSSurfaces * store = ps->surfaces;
+  if (surfaceId >= PS_MAX_SURFACES || !store->surfaces ||
+      !store->surfaces[surfaceId].mapped)
+    return NULL;
+
+  return &store->surfaces[surfaceId];
+}
+
+bool surface_isMapped(PS * ps, unsigned int surfaceId)
+{
+  return getSurface(ps, surfaceId) != NULL;
+}
+
+static unsigned int formatBits(PSSurfaceFormat format)
+{
+  switch(format)
+  {
+    case PS_SURFACE_FMT_1_A    : return 1;
+    case PS_SURFACE_FMT_8_A    : return 8;
+    case PS_SURFACE_FMT_16_555 :
+    case PS_SURFACE_FMT_16_565 : return 16;
+    case PS_SURFACE_FMT_32_xRGB:
+    case PS_SURFACE_FMT_32_ARGB: return 32;
+  }
+  return 0;
+}
+
+bool surface_new(PS * ps, unsigned int surfaceId, PSSurfaceFormat format,
+    unsigned int width, unsigned int height)
+{
+  PSSurfaces * store = ps->surfaces;
+  if (surfaceId >= PS_MAX_SURFACES)
+  {
+    PS_LOG_ERROR("Surface id %u is too large for the surface store",
+        surfaceId);
+    return false;
+  }
+
+  if (!store->surfaces)
+  {
+    store->surfaces = calloc(PS_MAX_SURFACES, sizeof(*store->surfaces));
+    if (!store->surfaces)
+    {
+      PS_LOG_ERROR("Failed to allocate the surface store");
+      return false;
+    }
+  }
+
+  StoreSurface * s = &store->surfaces[surfaceId];
+  const unsigned int bits = formatBits(format);
+  const size_t rowBytes = ((size_t)width * bits + 7) / 8;
+
+  s->format = format;
+  s->width  = width;
+  s->height = height;
+  s->stride = (rowBytes + SURFACE_STRIDE_ALIGN - 1) &
+    ~(size_t)(SURFACE_STRIDE_ALIGN - 1);
+  s->size   = (size_t)s->stride * height;
+  s->tilesX = (width  + PS_SURFACE_TILE_SIZE - 1) / PS_SURFACE_TILE_SIZE;
+  s->tilesY = (height + PS_SURFACE_TILE_SIZE - 1) / PS_SURFACE_TILE_SIZE;
+  s->queued = false;
+
+  const size_t words = ((size_t)s->tilesX * s->tilesY + 63) / 64;
+  s->dirty = calloc(words ? words : 1, sizeof(*s->dirty));
+  if (!s->dirty)
+  {
+    PS_LOG_ERROR("Failed to allocate the dirty bitmap");
+    return false;
+  }
+
+  s->fd = memfd_create("purespice-surface", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (s->fd < 0)
+  {
+    PS_LOG_ERROR("Failed to create the surface memfd: %d", errno);
+    goto err_dirty;
+  }
+
+  // sealed so that a mapping of the app's can never fault past the end
+  if (ftruncate(s->fd, s->size ? s->size : 1) < 0 ||
+      fcntl(s->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0)
+  {
+    PS_LOG_ERROR("Failed to size the surface memfd: %d", errno);
+    goto err_fd;
+  }
+
+  s->pixels = mmap(NULL, s->size ? s->size : 1, PROT_READ | PROT_WRITE,
+      MAP_SHARED, s->fd, 0);
+  if (s->pixels == MAP_FAILED)
+  {
+    PS_LOG_ERROR("Failed to map the surface memfd: %d", errno);
+    goto err_fd;
+  }
+
+  s->mapped = true;
+
+  const PSSurfaceBuffer buffer =
+  {
+    .format = format,
+    .width  = width,
+    .height = height,
+    .stride = s->stride,
+    .fd     = s->fd,
+    .size   = s->size,
+    .pixels = s->pixels
+  };
+
+  STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+    ps->config.display.surfaceMapped(surfaceId, &buffer));
+  return true;
+
+err_fd:
+  close(s->fd);
+err_dirty:
+  free(s->dirty);
+  s->dirty = NULL;
+  return false;
+}
+
+void surface_release(PS * ps, unsigned int surfaceId)
+{
+  StoreSurface * s = getSurface(ps, surfaceId);
+  if (!s)
+    return;
+
+  munmap(s->pixels, s->size ? s->size : 1);
+  close(s->fd);
+  free(s->dirty);
+
+  if (s->queued)
+  {
+    PSSurfaces * store = ps->surfaces;
+    for(unsigned int i = 0; i < store->numQueued; ++i)
+      if (store->queue[i] == surfaceId)
+      {
+        store->queue[i] = store->queue[--store->numQueued];
+        break;
+      }
+  }
+
+  memset(s, 0, sizeof(*s));
+}
+
+static inline bool rectIntersect(SpiceRect * a, const SpiceRect * b)
+{
+  if (b->left   > a->left  ) a->left   = b->left;
+  if (b->top    > a->top   ) a->top    = b->top;
+  if (b->right  < a->right ) a->right  = b->right;
+  if (b->bottom < a->bottom) a->bottom = b->bottom;
+  return a->left < a->right && a->top < a->bottom;
+}
+
+static void setBits(uint64_t * bitmap, size_t first, size_t last)
+{
+  for(size_t word = first / 64; word <= last / 64; ++word)
+  {
+    const size_t lo = word * 64 > first ? 0  : first % 64;
+    const size_t hi = word * 64 + 63 < last ? 63 : last % 64;
+    bitmap[word] |= (~0ULL >> (63 - hi)) & (~0ULL << lo);
+  }
+}
+
+static void markDirty(PS * ps, unsigned int surfaceId, StoreSurface * s,
+    const SpiceRect * rect)
+{
+  const unsigned int tx0 =  rect->left       / PS_SURFACE_TILE_SIZE;
+  const unsigned int tx1 = (rect->right  - 1) / PS_SURFACE_TILE_SIZE;
+  const unsigned int ty0 =  rect->top        / PS_SURFACE_TILE_SIZE;
+  const unsigned int ty1 = (rect->bottom - 1) / PS_SURFACE_TILE_SIZE;
+
+  for(unsigned int ty = ty0; ty <= ty1; ++ty)
+    setBits(s->dirty, (size_t)ty * s->tilesX + tx0,
+        (size_t)ty * s->tilesX + tx1);
+
+  if (!s->queued)
+  {
+    s->queued = true;
+    ps->surfaces->queue[ps->surfaces->numQueued++] = surfaceId;
+  }
+}
+
+/* finds the surface to draw to and clips `box` to it, returns NULL if there
+ * is nothing to draw */
+static StoreSurface * drawTarget(PS * ps, unsigned int surfaceId,
+    SpiceRect * box)
+{
+  StoreSurface * s = getSurface(ps, surfaceId);
+  if (!s)
+  {
+    PS_LOG_WARN("Draw to surface %u which does not exist", surfaceId);
+    return NULL;
+  }
+
+  if (formatBits(s->format) != 32)
+  {
+    PS_LOG_WARN_ONCE("The surface store only draws to 32-bit surfaces");
+    return NULL;
+  }
+
+  const SpiceRect bounds =
+  {
+    .top    = 0,
+    .left   = 0,
+    .bottom = s->height,
+    .right  = s->width
+  };
+
+  return rectIntersect(box, &bounds) ? s : NULL;
+}
+
+void surface_fill(PS * ps, unsigned int surfaceId, const SpiceRect * box,
+    const SpiceRect * clip, unsigned int numClip, uint32_t color,
+    uint16_t ropd)
+{
+  SpiceRect target = *box;
+  StoreSurface * s = drawTarget(ps, surfaceId, &target);
+  if (!s)
+    return;
+
+  for(unsigned int i = 0; i < (numClip ? numClip : 1); ++i)
+  {
+    SpiceRect r = target;
+    if (numClip && !rectIntersect(&r, &clip[i]))
+      continue;
+
+    const unsigned int width = r.right - r.left;
+    for(int y = r.top; y < r.bottom; ++y)
+      raster_rop((uint32_t *)(s->pixels + (size_t)y * s->stride) + r.left,
+          NULL, color, width, ropd);
+
+    markDirty(ps, surfaceId, s, &r);
+  }
+}
+
+void surface_copy(PS * ps, unsigned int surfaceId, const SpiceRect * box,
+    const SpiceRect * clip, unsigned int numClip, const SpiceRect * srcArea,
+    const PSDecodedImage * image, uint16_t ropd)
+{
+  if (srcArea->right  - srcArea->left != box->right  - box->left ||
+      srcArea->bottom - srcArea->top  != box->bottom - box->top)
+    PS_LOG_WARN_ONCE("Scaled copies are drawn unscaled");
+
+  if ((size_t)image->width * 4 > image->stride)
+  {
+    PS_LOG_ERROR("Bitmap stride %u is too small for %u pixels",
+        image->stride, image->width);
+    return;
+  }
+
+  // the part of the box the image covers, in surface coordinates
+  const int dx = box->left - srcArea->left;
+  const int dy = box->top  - srcArea->top;
+  const SpiceRect covered =
+  {
+    .top    = dy,
+    .left   = dx,
+    .bottom = dy + (int)image->height,
+    .right  = dx + (int)image->width
+  };
+
+  SpiceRect target = *box;
+  StoreSurface * s = drawTarget(ps, surfaceId, &target);
+  if (!s || !rectIntersect(&target, &covered))
+    return;
+
+  // copies straight from the server leave the alpha of xRGB sources unset
+  const bool setAlpha = image->format == PS_BITMAP_FMT_32BIT &&
+    s->format == PS_SURFACE_FMT_32_ARGB;
+  const RasterKernels * k = raster_getKernels();
+
+  for(unsigned int i = 0; i < (numClip ? numClip : 1); ++i)
+  {
+    SpiceRect r = target;
+    if (numClip && !rectIntersect(&r, &clip[i]))
+      continue;
+
+    const unsigned int width = r.right - r.left;
+    for(int y = r.top; y < r.bottom; ++y)
+    {
+      const unsigned int sy  = y - dy;
+      const unsigned int row = image->topDown ? sy : image->height - 1 - sy;
+      uint32_t * dst = (uint32_t *)(s->pixels + (size_t)y * s->stride) +
+        r.left;
+
+      raster_rop(dst, image->data + (size_t)row * image->stride +
+          (size_t)(r.left - dx) * 4, 0, width, ropd);
+
+      if (setAlpha)
+        k->fillOp(dst, width, 0xff000000, RASTER_OP_OR);
+    }
+
+    markDirty(ps, surfaceId, s, &r);
+  }
+}
+
+void surface_flush(PS * ps)
+{
+  PSSurfaces * store = ps->surfaces;
+  if (!store->numQueued)
+    return;
+
+  stats_displayUpdate(ps);
+  for(unsigned int i = 0; i < store->numQueued; ++i)
+  {
+    const unsigned int surfaceId = store->queue[i];
+    StoreSurface * s = getSurface(ps, surfaceId);
+
+    const size_t words = ((size_t)s->tilesX * s->tilesY + 63) / 64;
+    unsigned int count = 0;
+    for(size_t w = 0; w < words; ++w)
+      count += __builtin_popcountll(s->dirty[w]);
+
+    const PSSurfaceDirty dirty =
+    {
+      .tilesX = s->tilesX,
+      .tilesY = s->tilesY,
+      .bitmap = s->dirty,
+      .count  = count
+    };
+
+    STATS_CALLBACK(ps, PS_CHANNEL_DISPLAY,
+      ps->config.display.surfaceDamage(surfaceId, &dirty));
+
+    memset(s->dirty, 0, words * sizeof(*s->dirty));
+    s->queued = false;
+  }
+
+  store->numQueued = 0;
+}
+
+void surface_free(PS * ps)
+{
+  PSSurfaces * store = ps->surfaces;
+  if (!store->surfaces)
+    return;
+
+  for(unsigned int i = 0; i < PS_MAX_SURFACES; ++i)
+  {
+    if (!store->surfaces[i].mapped)
+      continue;
+
+    ps->config.display.surfaceDestroy(i);
+    surface_release(ps, i);
+  }
+
+  store->numQueued = 0;
+}
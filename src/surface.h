@@ -0,0 +1,67 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_SURFACE_
+#define _H_SPICE_SURFACE_
+
+#include "purespice.h"
+#include "ps.h"
+#include "decode.h"
+#include "draw.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* the surface store for PSConfig.display.surfaceMapped, the surfaces are kept
+ * in memfds and drawn to here with the damage tracked in tiles */
+
+bool surface_create (PS * ps);
+void surface_destroy(PS * ps);
+
+static inline bool surface_enabled(PS * ps)
+{
+  return ps->config.display.surfaceMapped != NULL;
+}
+
+// maps a new surface and passes it to surfaceMapped
+bool surface_new(PS * ps, unsigned int surfaceId, PSSurfaceFormat format,
+    unsigned int width, unsigned int height);
+
+bool surface_isMapped(PS * ps, unsigned int surfaceId);
+
+// unmaps a surface, surfaceDestroy must already have been called for it
+void surface_release(PS * ps, unsigned int surfaceId);
+
+/* draw to the part of `box` inside the clip rects, or all of it if there are
+ * none. Copies take a 32-bit image and draw from `srcArea` unscaled */
+void surface_fill(PS * ps, unsigned int surfaceId, const SpiceRect * box,
+    const SpiceRect * clip, unsigned int numClip, uint32_t color,
+    uint16_t ropd);
+
+void surface_copy(PS * ps, unsigned int surfaceId, const SpiceRect * box,
+    const SpiceRect * clip, unsigned int numClip, const SpiceRect * srcArea,
+    const PSDecodedImage * image, uint16_t ropd);
+
+// passes the tiles drawn to since the last call to surfaceDamage
+void surface_flush(PS * ps);
+
+// destroys and unmaps every surface left
+void surface_free(PS * ps);
+
+#endif
@@ -0,0 +1,508 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#include "uring.h"
+#include "log.h"
+
+#if defined(USE_IO_URING)
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// the provided buffer group every receive selects from
+#define BUFFER_GROUP 0
+
+// the user_data of requests whose completions are of no interest
+#define TAG_IGNORE 0
+
+/* the user_data of a receive identifies the slot of the channel and the
+ * generation of that slot, so completions that arrive after the channel was
+ * disarmed are recognised as stale */
+typedef struct
+{
+  PSChannel * channel;
+  uint32_t    gen;
+}
+PSURingSlot;
+
+struct PSURing
+{
+  int fd;
+
+  // the submission and completion queues share a single mapping
+  void                * rings;
+  size_t                ringsSize;
+  struct io_uring_sqe * sqes;
+  size_t                sqesSize;
+
+  unsigned            * sqHead;
+  unsigned            * sqTail;
+  unsigned            * sqFlags;
+  unsigned            * sqArray;
+  unsigned              sqMask;
+
+  unsigned            * cqHead;
+  unsigned            * cqTail;
+  struct io_uring_cqe * cqes;
+  unsigned              cqMask;
+
+  // the buffers the kernel receives into, handed back once processed
+  struct io_uring_buf_ring * bufRing;
+  uint8_t                  * buffers;
+  uint16_t                   bufTail;
+
+  PSURingSlot * slots;
+  unsigned int  slotCount;
+};
+
+static inline unsigned loadAcquire(const unsigned * ptr)
+{
+  return atomic_load_explicit((_Atomic unsigned *)ptr, memory_order_acquire);
+}
+
+static inline void storeRelease(unsigned * ptr, unsigned value)
+{
+  atomic_store_explicit((_Atomic unsigned *)ptr, value, memory_order_release);
+}
+
+static int sysEnter(int fd, unsigned submit, unsigned minComplete,
+    unsigned flags)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, minComplete, flags,
+      NULL, 0);
+}
+
+static struct io_uring_sqe * getSqe(PSURing * ring)
+{
+  const unsigned tail = *ring->sqTail;
+  if (tail - loadAcquire(ring->sqHead) > ring->sqMask)
+    return NULL;
+
+  struct io_uring_sqe * sqe = &ring->sqes[tail & ring->sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+// queues the sqe returned by getSqe and submits everything queued
+static bool submit(PSURing * ring)
+{
+  const unsigned tail = *ring->sqTail;
+  ring->sqArray[tail & ring->sqMask] = tail & ring->sqMask;
+  storeRelease(ring->sqTail, tail + 1);
+
+  int ret;
+  do
+    ret = sysEnter(ring->fd, tail + 1 - loadAcquire(ring->sqHead), 0, 0);
+  while(ret < 0 && errno == EINTR);
+
+  if (ret < 0)
+  {
+    PS_LOG_ERROR("io_uring_enter failed: %d", errno);
+    return false;
+  }
+
+  return true;
+}
+
+static bool submitRecv(PSURing * ring, int socket, uint64_t tag)
+{
+  struct io_uring_sqe * sqe = getSqe(ring);
+  if (!sqe)
+  {
+    PS_LOG_ERROR("The io_uring submission queue is full");
+    return false;
+  }
+
+  sqe->opcode    = IORING_OP_RECV;
+  sqe->fd        = socket;
+  sqe->ioprio    = IORING_RECV_MULTISHOT;
+  sqe->flags     = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = BUFFER_GROUP;
+  sqe->user_data = tag;
+  return submit(ring);
+}
+
+static void recycleBuffer(PSURing * ring, unsigned bid)
+{
+  struct io_uring_buf * buf =
+    &ring->bufRing->bufs[ring->bufTail & (PS_URING_BUFFERS - 1)];
+
+  buf->addr = (uintptr_t)(ring->buffers + (size_t)bid * PS_URING_BUFFER_SIZE);
+  buf->len  = PS_URING_BUFFER_SIZE;
+  buf->bid  = bid;
+
+  atomic_store_explicit((_Atomic uint16_t *)&ring->bufRing->tail,
+      ++ring->bufTail, memory_order_release);
+}
+
+static inline uint8_t * getBuffer(PSURing * ring, unsigned bid)
+{
+  return ring->buffers + (size_t)bid * PS_URING_BUFFER_SIZE;
+}
+
+/* multishot receives need a newer kernel than the provided buffer rings do,
+ * and an unsupported flag only shows up in the completion, so try one on a
+ * socket pair */
+static bool probeMultishot(PSURing * ring)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+    return false;
+
+  bool supported = false;
+  bool more      = true;
+  if (!submitRecv(ring, fds[0], TAG_IGNORE))
+    goto out;
+
+  // closing the peer after the first byte ends the receive
+  const uint8_t byte = 0;
+  if (write(fds[1], &byte, 1) != 1)
+    goto out;
+  shutdown(fds[1], SHUT_RDWR);
+
+  do
+  {
+    if (sysEnter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR)
+      break;
+
+    unsigned head = *ring->cqHead;
+    const unsigned tail = loadAcquire(ring->cqTail);
+    for(; head != tail; ++head)
+    {
+      const struct io_uring_cqe * cqe = &ring->cqes[head & ring->cqMask];
+      if (cqe->res == 1)
+        supported = true;
+
+      if (cqe->flags & IORING_CQE_F_BUFFER)
+        recycleBuffer(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+
+      more = cqe->flags & IORING_CQE_F_MORE;
+    }
+    storeRelease(ring->cqHead, head);
+  }
+  while(more);
+
+out:
+  close(fds[0]);
+  close(fds[1]);
+  return supported;
+}
+
+PSURing * uring_new(void)
+{
+  PSURing * ring = calloc(1, sizeof(*ring));
+  if (!ring)
+  {
+    PS_LOG_ERROR("Failed to allocate the io_uring");
+    return NULL;
+  }
+
+  struct io_uring_params params = { .flags = IORING_SETUP_CLAMP };
+  ring->fd = syscall(__NR_io_uring_setup, PS_URING_ENTRIES, &params);
+  if (ring->fd < 0)
+  {
+    PS_LOG_INFO("io_uring is not available: %d", errno);
+    free(ring);
+    return NULL;
+  }
+
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP))
+  {
+    PS_LOG_INFO("The kernel's io_uring is too old");
+    goto err;
+  }
+
+  const size_t sqSize = params.sq_off.array +
+    params.sq_entries * sizeof(unsigned);
+  const size_t cqSize = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+
+  ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+  ring->rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->rings == MAP_FAILED)
+  {
+    ring->rings = NULL;
+    PS_LOG_ERROR("Failed to map the io_uring queues");
+    goto err;
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    ring->sqes = NULL;
+    PS_LOG_ERROR("Failed to map the io_uring submission entries");
+    goto err;
+  }
+
+  uint8_t * rings = ring->rings;
+  ring->sqHead  = (unsigned *)(rings + params.sq_off.head);
+  ring->sqTail  = (unsigned *)(rings + params.sq_off.tail);
+  ring->sqFlags = (unsigned *)(rings + params.sq_off.flags);
+  ring->sqArray = (unsigned *)(rings + params.sq_off.array);
+  ring->sqMask  = *(unsigned *)(rings + params.sq_off.ring_mask);
+  ring->cqHead  = (unsigned *)(rings + params.cq_off.head);
+  ring->cqTail  = (unsigned *)(rings + params.cq_off.tail);
+  ring->cqes    = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+  ring->cqMask  = *(unsigned *)(rings + params.cq_off.ring_mask);
+
+  const long   pageSize    = sysconf(_SC_PAGESIZE);
+  const size_t bufRingSize = (PS_URING_BUFFERS * sizeof(struct io_uring_buf) +
+    pageSize - 1) & ~(pageSize - 1);
+
+  ring->bufRing = aligned_alloc(pageSize, bufRingSize);
+  ring->buffers = aligned_alloc(64,
+      (size_t)PS_URING_BUFFERS * PS_URING_BUFFER_SIZE);
+  if (!ring->bufRing || !ring->buffers)
+  {
+    PS_LOG_ERROR("Failed to allocate the io_uring buffers");
+    goto err;
+  }
+  memset(ring->bufRing, 0, bufRingSize);
+
+  struct io_uring_buf_reg reg =
+  {
+    .ring_addr    = (uintptr_t)ring->bufRing,
+    .ring_entries = PS_URING_BUFFERS,
+    .bgid         = BUFFER_GROUP
+  };
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+        &reg, 1) < 0)
+  {
+    PS_LOG_INFO("The kernel does not support io_uring buffer rings: %d",
+        errno);
+    free(ring->bufRing);
+    ring->bufRing = NULL;
+    goto err;
+  }
+
+  for(unsigned i = 0; i < PS_URING_BUFFERS; ++i)
+    recycleBuffer(ring, i);
+
+  if (!probeMultishot(ring))
+  {
+    PS_LOG_INFO("The kernel does not support io_uring multishot receives");
+    goto err;
+  }
+
+  return ring;
+
+err:
+  uring_free(ring);
+  return NULL;
+}
+
+void uring_free(PSURing * ring)
+{
+  if (!ring)
+    return;
+
+  // stop the kernel selecting buffers before they are freed
+  if (ring->bufRing)
+  {
+    struct io_uring_buf_reg reg = { .bgid = BUFFER_GROUP };
+    syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_PBUF_RING,
+        &reg, 1);
+  }
+
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqesSize);
+  if (ring->rings)
+    munmap(ring->rings, ring->ringsSize);
+  close(ring->fd);
+
+  free(ring->bufRing);
+  free(ring->buffers);
+  free(ring->slots);
+  free(ring);
+}
+
+int uring_fd(PSURing * ring)
+{
+  return ring->fd;
+}
+
+static inline uint64_t slotTag(PSURing * ring, unsigned int slot)
+{
+  return ((uint64_t)ring->slots[slot].gen << 32) | (slot + 1);
+}
+
+static PSChannel * lookupTag(PSURing * ring, uint64_t tag)
+{
+  const unsigned int slot = (uint32_t)tag - 1;
+  if (tag == TAG_IGNORE || slot >= ring->slotCount ||
+      ring->slots[slot].gen != (uint32_t)(tag >> 32))
+    return NULL;
+
+  return ring->slots[slot].channel;
+}
+
+bool uring_arm(PSURing * ring, PSChannel * channel)
+{
+  unsigned int slot = 0;
+  while(slot < ring->slotCount && ring->slots[slot].channel)
+    ++slot;
+
+  if (slot == ring->slotCount)
+  {
+    PSURingSlot * slots = realloc(ring->slots,
+        (ring->slotCount + PS_CHANNEL_MAX) * sizeof(*slots));
+    if (!slots)
+    {
+      PS_LOG_ERROR("out of memory");
+      return false;
+    }
+
+    memset(slots + ring->slotCount, 0, PS_CHANNEL_MAX * sizeof(*slots));
+    ring->slots      = slots;
+    ring->slotCount += PS_CHANNEL_MAX;
+  }
+
+  if (!submitRecv(ring, channel->socket, slotTag(ring, slot)))
+    return false;
+
+  ring->slots[slot].channel = channel;
+  channel->uringSlot        = slot;
+  return true;
+}
+
+void uring_disarm(PSURing * ring, PSChannel * channel)
+{
+  if (channel->uringSlot < 0)
+    return;
+
+  const unsigned int slot = channel->uringSlot;
+  struct io_uring_sqe * sqe = getSqe(ring);
+  if (sqe)
+  {
+    sqe->opcode    = IORING_OP_ASYNC_CANCEL;
+    sqe->addr      = slotTag(ring, slot);
+    sqe->user_data = TAG_IGNORE;
+    submit(ring);
+  }
+  else
+    PS_LOG_ERROR("%s: Failed to cancel the receive", channel->name);
+
+  ring->slots[slot].channel = NULL;
+  ++ring->slots[slot].gen;
+  channel->uringSlot = -1;
+}
+
+PSStatus uring_process(PSURing * ring, PSURingRecvFn fn, PSChannel ** failed)
+{
+  PSStatus status = PS_STATUS_RUN;
+  unsigned head = *ring->cqHead;
+  const unsigned tail = loadAcquire(ring->cqTail);
+
+  while(head != tail && status == PS_STATUS_RUN)
+  {
+    const struct io_uring_cqe cqe = ring->cqes[head & ring->cqMask];
+    storeRelease(ring->cqHead, ++head);
+
+    PSChannel * channel = lookupTag(ring, cqe.user_data);
+    if (channel)
+    {
+      // running out of buffers only ends the receive, it is restarted below
+      if (cqe.res > 0)
+        status = fn(channel,
+            getBuffer(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT), cqe.res);
+      else if (cqe.res != -ENOBUFS)
+        status = fn(channel, NULL, cqe.res);
+    }
+
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+      recycleBuffer(ring, cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+
+    if (status != PS_STATUS_RUN)
+    {
+      *failed = channel;
+      break;
+    }
+
+    // restart the receive if it ended but the channel is still reading
+    if (channel && !(cqe.flags & IORING_CQE_F_MORE) &&
+        (cqe.res > 0 || cqe.res == -ENOBUFS) &&
+        lookupTag(ring, cqe.user_data) == channel &&
+        !submitRecv(ring, channel->socket, cqe.user_data))
+    {
+      *failed = channel;
+      status  = PS_STATUS_ERR_READ;
+    }
+  }
+
+  // completions that did not fit in the queue are only moved in on entry
+  if (loadAcquire(ring->sqFlags) & IORING_SQ_CQ_OVERFLOW)
+    sysEnter(ring->fd, 0, 0, IORING_ENTER_GETEVENTS);
+
+  return status;
+}
+
+#else
+
+PSURing * uring_new(void)
+{
+  PS_LOG_INFO("Built without io_uring support");
+  return NULL;
+}
+
+void uring_free(PSURing * ring)
+{
+  (void)ring;
+}
+
+int uring_fd(PSURing * ring)
+{
+  (void)ring;
+  return -1;
+}
+
+bool uring_arm(PSURing * ring, PSChannel * channel)
+{
+  (void)ring;
+  (void)channel;
+  return false;
+}
+
+void uring_disarm(PSURing * ring, PSChannel * channel)
+{
+  (void)ring;
+  (void)channel;
+}
+
+PSStatus uring_process(PSURing * ring, PSURingRecvFn fn, PSChannel ** failed)
+{
+  (void)ring;
+  (void)fn;
+  (void)failed;
+  return PS_STATUS_RUN;
+}
+
+#endif
@@ -0,0 +1,59 @@
+/*
+PureSpice - A pure C implementation of the SPICE client protocol
+Copyright (C) 2017-2022 Geoffrey McRae <geoff@hostfission.com>
+https://github.com/gnif/PureSpice
+
+This program is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free Software
+Foundation; either version 2 of the License, or (at your option) any later
+version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+PARTICULAR PURPOSE. See the GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License along with
+this program; if not, write to the Free Software Foundation, Inc., 59 Temple
+Place, Suite 330, Boston, MA 02111-1307 USA
+*/
+
+#ifndef _H_SPICE_URING_
+#define _H_SPICE_URING_
+
+#include "ps.h"
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/* an optional io_uring receive backend for the channels polled by a loop.
+ * Each socket gets a multishot receive that fills buffers from a ring shared
+ * by the loop, so a wakeup costs a single epoll_wait however many channels
+ * have data, and whole messages are parsed straight out of those buffers.
+ * The ring's fd sits in the loop's epoll set. Sends still go out directly */
+
+typedef struct PSURing PSURing;
+
+/* called for each completed receive, `len` is 0 when the peer has closed the
+ * connection or a negative errno on failure. The data is only valid for the
+ * duration of the call */
+typedef PSStatus (*PSURingRecvFn)(PSChannel * channel, uint8_t * data,
+    ssize_t len);
+
+// returns NULL if io_uring was not built in or the kernel does not support it
+PSURing * uring_new(void);
+void      uring_free(PSURing * ring);
+int       uring_fd(PSURing * ring);
+
+/* starts receiving on the channel's socket, the channel must only be
+ * connected and disconnected by the thread processing the ring */
+bool uring_arm(PSURing * ring, PSChannel * channel);
+
+// stops receiving, completions still queued for the channel are dropped
+void uring_disarm(PSURing * ring, PSChannel * channel);
+
+/* handles the completed receives, stopping at the first for which `fn` does
+ * not return PS_STATUS_RUN and storing its channel in `failed`. Anything left
+ * is handled by the next call */
+PSStatus uring_process(PSURing * ring, PSURingRecvFn fn, PSChannel ** failed);
+
+#endif
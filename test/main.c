@@ -25,6 +25,7 @@ Place, Suite 330, Boston, MA 02111-1307 USA
 
 #include <purespice.h>
 
+PSSession * session;
 bool       connectionReady = false;
 bool       record = false;
 int        recordChannels;
@@ -345,19 +346,26 @@ int main(int argc, char * argv[])
     }
   };
 
-  if (!purespice_connect(&config))
+  session = purespice_newSession(NULL);
+  if (!session)
   {
-    printf("spice connect failed\n");
     retval = -1;
     goto err_exit;
   }
 
+  if (!purespice_connect(session, &config))
+  {
+    printf("spice connect failed\n");
+    retval = -1;
+    goto err_session;
+  }
+
   /* wait for purespice to be ready */
   while(!connectionReady)
-    if (purespice_process(1) != PS_STATUS_RUN)
+    if (purespice_process(session, 1) != PS_STATUS_RUN)
     {
       retval = -1;
-      goto err_exit;
+      goto err_session;
     }
 
   /* Create the parent window */
@@ -390,11 +398,12 @@ int main(int argc, char * argv[])
     switch(event.type)
     {
       case ADL_EVENT_NONE:
-        if (purespice_process(1) != PS_STATUS_RUN)
+        if (purespice_process(session, 1) != PS_STATUS_RUN)
           goto err_shutdown;
 
         if (record)
-          purespice_writeAudio((uint8_t*)recordAudio, recordAudioSize, 0);
+          purespice_writeAudio(session, (uint8_t*)recordAudio,
+              recordAudioSize, 0);
         continue;
 
       case ADL_EVENT_CLOSE:
@@ -402,15 +411,15 @@ int main(int argc, char * argv[])
         goto exit;
 
       case ADL_EVENT_KEY_DOWN:
-        if (purespice_channelConnected(PS_CHANNEL_DISPLAY))
+        if (purespice_channelConnected(session, PS_CHANNEL_DISPLAY))
         {
           printf("Disconnect display\n");
-          purespice_disconnectChannel(PS_CHANNEL_DISPLAY);
+          purespice_disconnectChannel(session, PS_CHANNEL_DISPLAY);
         }
         else
         {
           printf("Connect display\n");
-          purespice_connectChannel(PS_CHANNEL_DISPLAY);
+          purespice_connectChannel(session, PS_CHANNEL_DISPLAY);
         }
         break;
 
@@ -424,7 +433,7 @@ int main(int argc, char * argv[])
         break;
 
       case ADL_EVENT_MOUSE_MOVE:
-        purespice_mouseMotion(event.u.mouse.relX, event.u.mouse.relY);
+        purespice_mouseMotion(session, event.u.mouse.relX, event.u.mouse.relY);
         break;
 
       default:
@@ -433,10 +442,12 @@ int main(int argc, char * argv[])
   }
 
 exit:
-  purespice_disconnect();
+  purespice_disconnect(session);
 
 err_shutdown:
   adlShutdown();
+err_session:
+  purespice_freeSession(session);
 err_exit:
   return retval;
 }